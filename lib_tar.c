@@ -1,4 +1,5 @@
 #include "lib_tar.h"
+#include "tar_internal.h"
 #include <string.h>
 #include <stdio.h>
 
@@ -6,7 +7,7 @@
  * Helper used to determine whether a header block is entirely made of
  * NUL bytes which marks the end of a tar archive.
  */
-static int is_empty_block(const tar_header_t *hdr) {
+int is_empty_block(const tar_header_t *hdr) {
     const unsigned char *bytes = (const unsigned char *) hdr;
     for (size_t i = 0; i < sizeof(tar_header_t); i++) {
         if (bytes[i] != 0) {
@@ -19,20 +20,151 @@ static int is_empty_block(const tar_header_t *hdr) {
 /**
  * Builds the full path of an entry from a tar header.  The resulting string
  * is written into `out` which must be large enough to hold any tar path
- * (256 bytes is sufficient for the ustar format).
+ * (256 bytes is sufficient for the ustar format).  Only ustar headers have a
+ * prefix field, GNU headers store times at its place.
  */
-static void header_path(char *out, const tar_header_t *hdr) {
-    if (hdr->prefix[0] != '\0') {
+void header_path(char *out, const tar_header_t *hdr) {
+    if (hdr->prefix[0] != '\0' && memcmp(hdr->magic, TMAGIC, TMAGLEN) == 0) {
         snprintf(out, 256, "%s/%s", hdr->prefix, hdr->name);
     } else {
         snprintf(out, 256, "%s", hdr->name);
     }
 }
 
+/**
+ * Checks the checksum of a header, whatever its format.
+ *
+ * @return non-zero if the checksum field matches the header bytes.
+ */
+int header_checksum_ok(const tar_header_t *hdr) {
+    unsigned int expected = TAR_INT(hdr->chksum);
+
+    unsigned char tmp[sizeof(*hdr)];
+    memcpy(tmp, hdr, sizeof(*hdr));
+    memset(tmp + offsetof(tar_header_t, chksum), ' ', 8);
+
+    unsigned int sum = 0;
+    for (size_t i = 0; i < sizeof(*hdr); i++) {
+        sum += tmp[i];
+    }
+    return sum == expected;
+}
+
+/**
+ * Validates a single non-null header the way check_archive() does.
+ *
+ * @return zero if the header is valid, or the negative check_archive() error
+ *         code describing the first problem found.
+ */
+int check_header(const tar_header_t *hdr) {
+    if (strncmp(hdr->magic, TMAGIC, TMAGLEN) != 0 || hdr->magic[TMAGLEN - 1] != '\0') {
+        return -1;
+    }
+
+    if (strncmp(hdr->version, TVERSION, TVERSLEN) != 0) {
+        return -2;
+    }
+
+    if (!header_checksum_ok(hdr)) {
+        return -3;
+    }
+    return 0;
+}
+
+/**
+ * Writes `value` into a numeric header field as zero-padded octal digits
+ * followed by a NUL byte.
+ *
+ * @return zero on success, -1 if the value does not fit in the field.
+ */
+int header_set_octal(char *field, size_t field_len, unsigned long value) {
+    char tmp[32];
+    int n = snprintf(tmp, sizeof(tmp), "%0*lo", (int) field_len - 1, value);
+    if (n < 0 || (size_t) n > field_len - 1) {
+        return -1;
+    }
+    memcpy(field, tmp, field_len);
+    return 0;
+}
+
+/**
+ * Recomputes the checksum of a header so that it passes check_header(): the
+ * sum of all header bytes with the checksum field taken as spaces, stored as
+ * six octal digits, a NUL and a space.
+ */
+void header_update_checksum(tar_header_t *hdr) {
+    memset(hdr->chksum, ' ', sizeof(hdr->chksum));
+
+    const unsigned char *bytes = (const unsigned char *) hdr;
+    unsigned int sum = 0;
+    for (size_t i = 0; i < sizeof(*hdr); i++) {
+        sum += bytes[i];
+    }
+
+    snprintf(hdr->chksum, sizeof(hdr->chksum), "%06o", sum);
+    hdr->chksum[7] = ' ';
+}
+
+/**
+ * Stores a path in the name and prefix fields of a header, splitting it on a
+ * slash when it does not fit in the name field alone.  The checksum is not
+ * updated.
+ *
+ * @param hdr The header to modify.
+ * @param path The new path of the entry.
+ *
+ * @return zero on success,
+ *         -1 if the path cannot be represented in a ustar header.
+ */
+int tar_header_set_path(tar_header_t *hdr, const char *path) {
+    size_t len = strlen(path);
+    size_t split = 0;
+
+    if (len > sizeof(hdr->name)) {
+        /* the last slash leaving at most 100 bytes for the name */
+        for (size_t i = len - sizeof(hdr->name) - 1; i < len && i <= sizeof(hdr->prefix); i++) {
+            if (path[i] == '/' && i > 0) {
+                split = i;
+                break;
+            }
+        }
+        if (split == 0) {
+            return -1;
+        }
+    }
+
+    memset(hdr->name, 0, sizeof(hdr->name));
+    memset(hdr->prefix, 0, sizeof(hdr->prefix));
+    if (split == 0) {
+        memcpy(hdr->name, path, len);
+    } else {
+        memcpy(hdr->prefix, path, split);
+        memcpy(hdr->name, path + split + 1, len - split - 1);
+    }
+    return 0;
+}
+
+/**
+ * Tells whether a header is the entry at `path`, a directory matching with
+ * or without its trailing slash.
+ */
+int header_matches(const tar_header_t *hdr, const char *path) {
+    char name[256];
+    header_path(name, hdr);
+    if (strcmp(name, path) == 0) {
+        return 1;
+    }
+    /* allow searching directories without their trailing slash */
+    size_t len = strlen(name);
+    return hdr->typeflag == DIRTYPE && len > 0 && name[len - 1] == '/' &&
+           strncmp(name, path, len - 1) == 0 && path[len - 1] == '\0';
+}
+
 /**
  * Searches for an entry inside the archive.  If found and `header` or
  * `data_offset` are non-NULL, they are populated with the entry header and the
- * offset of the entry data within the file respectively.
+ * offset of the entry data within the file respectively.  When a path occurs
+ * several times, as in archives appended to, the last occurrence wins.
  */
 static int find_header(int tar_fd, const char *path, tar_header_t *header,
                        off_t *data_offset) {
@@ -42,39 +174,21 @@ static int find_header(int tar_fd, const char *path, tar_header_t *header,
         return 0;
     }
 
+    int found = 0;
     while (read(tar_fd, &hdr, sizeof(hdr)) == sizeof(hdr)) {
         if (is_empty_block(&hdr)) {
             break;
         }
 
-        char name[256];
-        header_path(name, &hdr);
-
-        int match = 0;
-        if (hdr.typeflag == DIRTYPE) {
-            /* allow searching with or without a trailing slash */
-            size_t len = strlen(name);
-            if (strcmp(name, path) == 0) {
-                match = 1;
-            } else if (len > 0 && name[len - 1] == '/' &&
-                       strncmp(name, path, len - 1) == 0 && path[len - 1] == '\0') {
-                match = 1;
-            }
-        } else {
-            if (strcmp(name, path) == 0) {
-                match = 1;
-            }
-        }
-
         off_t data_off = lseek(tar_fd, 0, SEEK_CUR);
-        if (match) {
+        if (header_matches(&hdr, path)) {
             if (header) {
                 *header = hdr;
             }
             if (data_offset) {
                 *data_offset = data_off;
             }
-            return 1;
+            found = 1;
         }
 
         size_t size = TAR_INT(hdr.size);
@@ -84,7 +198,7 @@ static int find_header(int tar_fd, const char *path, tar_header_t *header,
         }
     }
 
-    return 0;
+    return found;
 }
 
 /**
@@ -158,32 +272,15 @@ int check_archive(int tar_fd) {
             break;
         }
 
-        if (strncmp(hdr.magic, TMAGIC, TMAGLEN) != 0 || hdr.magic[TMAGLEN - 1] != '\0') {
-            return -1;
-        }
-
-        if (strncmp(hdr.version, TVERSION, TVERSLEN) != 0) {
-            return -2;
-        }
-
-        unsigned int expected = TAR_INT(hdr.chksum);
-
-        unsigned char tmp[sizeof(hdr)];
-        memcpy(tmp, &hdr, sizeof(hdr));
-        memset(tmp + offsetof(tar_header_t, chksum), ' ', 8);
-
-        unsigned int sum = 0;
-        for (size_t i = 0; i < sizeof(hdr); i++) {
-            sum += tmp[i];
-        }
-
-        if (sum != expected) {
-            return -3;
+        int err = check_header(&hdr);
+        if (err != 0) {
+            return err;
         }
 
+        /* a size too large for a file offset would seek backwards */
         size_t size = TAR_INT(hdr.size);
-        off_t jump = ((size + 511) / 512) * 512;
-        if (lseek(tar_fd, jump, SEEK_CUR) == (off_t) -1) {
+        off_t jump = TAR_PADDED(size);
+        if (jump < 0 || lseek(tar_fd, jump, SEEK_CUR) == (off_t) -1) {
             return -3;
         }
 
@@ -257,6 +354,55 @@ int is_symlink(int tar_fd, char *path) {
 }
 
 
+/*
+ * Paths already listed by list(), as an open-addressing hash set of their
+ * positions in `entries` plus one, so that a path seen again is found with a
+ * single lookup whatever the number of paths listed.
+ */
+struct listed_set {
+    size_t *slots;
+    size_t nslots;
+};
+
+static int listed_grow(struct listed_set *set, char **entries, size_t count) {
+    size_t nslots = set->nslots ? set->nslots * 2 : 64;
+    size_t *slots = calloc(nslots, sizeof(size_t));
+    if (!slots) {
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        size_t s = tar_hash(0, entries[i], strlen(entries[i])) & (nslots - 1);
+        while (slots[s] != 0) {
+            s = (s + 1) & (nslots - 1);
+        }
+        slots[s] = i + 1;
+    }
+    free(set->slots);
+    set->slots = slots;
+    set->nslots = nslots;
+    return 0;
+}
+
+/**
+ * Records that `name` is listed next, at entries[count], unless it already is.
+ *
+ * @return zero if the path was added, 1 if it is already listed, -1 if the set could not grow.
+ */
+static int listed_add(struct listed_set *set, char **entries, size_t count, const char *name) {
+    if ((count + 1) * 2 > set->nslots && listed_grow(set, entries, count) != 0) {
+        return -1;
+    }
+    size_t s = tar_hash(0, name, strlen(name)) & (set->nslots - 1);
+    while (set->slots[s] != 0) {
+        if (strcmp(entries[set->slots[s] - 1], name) == 0) {
+            return 1;
+        }
+        s = (s + 1) & (set->nslots - 1);
+    }
+    set->slots[s] = count + 1;
+    return 0;
+}
+
 /**
  * Lists the entries at a given path in the archive.
  * list() does not recurse into the directories listed at the given path.
@@ -308,6 +454,7 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries) {
     }
 
     size_t count = 0;
+    struct listed_set listed = { NULL, 0 };
     while (read(tar_fd, &hdr, sizeof(hdr)) == sizeof(hdr)) {
         if (is_empty_block(&hdr)) {
             break;
@@ -323,10 +470,15 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries) {
             const char *rest = name + base_len;
             const char *slash = strchr(rest, '/');
             if (!slash || slash[1] == '\0') {
-                if (count < capacity) {
+                /* later occurrences of a path replace it rather than being listed again */
+                int seen = count < capacity ? listed_add(&listed, entries, count, name) : 1;
+                for (size_t i = 0; seen < 0 && i < count; i++) {
+                    /* without memory for the set, fall back to comparing with every listed path */
+                    seen = strcmp(entries[i], name) == 0 ? 1 : -1;
+                }
+                if (seen <= 0) {
                     strcpy(entries[count], name);
                     count++;
-
                 }
             }
         }
@@ -336,6 +488,7 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries) {
             break;
         }
     }
+    free(listed.slots);
 
     *no_entries = count;
     return 1;
@@ -5,6 +5,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <sys/types.h>
 
 typedef struct posix_header
 {                              /* byte offset */
@@ -148,4 +149,767 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries);
  */
 ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len);
 
+/**
+ * Result of the validation of one archive by check_archives().
+ */
+typedef struct check_result {
+    const char *path;             /* archive path, as passed by the caller */
+    size_t index;                 /* position of the archive in the input list */
+    int ret;                      /* check_archive() return value, -4 if the archive could not be opened */
+    int err;                      /* errno value explaining a -4 result */
+} check_result_t;
+
+/* Callback receiving the results of check_archives(), never called concurrently */
+typedef void (*check_cb)(const check_result_t *result, void *arg);
+
+/**
+ * Checks whether many archives are valid, in parallel.
+ *
+ * Archives are opened and validated by a pool of worker threads so that
+ * several disk requests are in flight at once.  Each archive is validated with
+ * the same rules as check_archive() and its result is streamed to `cb` as soon
+ * as it is known, in completion order.
+ *
+ * @param paths The paths of the archives to validate.
+ * @param count The number of entries in `paths`.
+ * @param threads The number of archives validated concurrently, zero or negative selects a default.
+ * @param cb A callback invoked once per archive as soon as its result is known, may be NULL.
+ * @param arg An opaque pointer passed to `cb`.
+ *
+ * @return zero if every archive is valid,
+ *         a positive value representing the number of archives that are invalid or could not be opened,
+ *         -1 if the worker threads could not be started.
+ */
+int check_archives(char **paths, size_t count, int threads, check_cb cb, void *arg);
+
+/**
+ * An entry of an archive index.
+ */
+typedef struct tar_entry {
+    char path[256];               /* full path, prefix included */
+    char linkname[101];           /* NUL-terminated linkname field */
+    char typeflag;
+    size_t size;                  /* size of the entry data in bytes */
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    time_t mtime;
+    off_t header_offset;          /* offset of the entry header in the archive */
+    off_t data_offset;            /* offset of the first byte of the entry data */
+} tar_entry_t;
+
+/**
+ * An in-memory index of every entry of an archive, in archive order.
+ */
+typedef struct tar_index {
+    tar_entry_t *entries;
+    size_t count;
+    size_t capacity;
+    off_t end_offset;             /* offset of the end-of-archive marker */
+    off_t archive_size;           /* identity of the indexed archive: size, modification time and inode */
+    time_t archive_mtime;
+    long archive_mtime_nsec;
+    ino_t archive_ino;
+    uint32_t *slots;              /* open-addressing path table, entry number + 1 or zero */
+    size_t nslots;
+    struct tar_index **nested;    /* index of the archive stored in each entry, if recorded, may be NULL */
+    struct tar_columns *columns;  /* entry metadata stored column by column, for tar_index_filter() */
+    struct tar_dirs *dirs;        /* statistics of every directory, for tar_index_du() */
+    struct tar_history *history;  /* every occurrence of each path, for tar_index_history() */
+    char **dumpdirs;              /* contents of each GNU incremental directory entry, may be NULL */
+} tar_index_t;
+
+/**
+ * Builds an in-memory index of every entry of an archive in a single pass.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file, its offset is not used nor modified.
+ * @param index The index to fill, released with tar_index_free().
+ *
+ * @return the number of entries indexed,
+ *         -1 if the index could not be allocated.
+ */
+ssize_t tar_index_build(int tar_fd, tar_index_t *index);
+
+/**
+ * Releases the memory held by an index built with tar_index_build().
+ */
+void tar_index_free(tar_index_t *index);
+
+/**
+ * Looks up an entry of the index by path.
+ *
+ * @param index An index built with tar_index_build().
+ * @param path A path to an entry in the archive, directories may be given with or without their trailing slash.
+ *
+ * @return the entry at the given path, its last occurrence if the path occurs several times,
+ *         NULL if no such entry exists.
+ */
+const tar_entry_t *tar_index_find(const tar_index_t *index, const char *path);
+
+/**
+ * Tells whether an index, typically loaded from a sidecar file, still
+ * describes an archive.
+ *
+ * @return zero if the archive changed since the index was built,
+ *         any other value otherwise.
+ */
+int tar_index_is_current(const tar_index_t *index, int tar_fd);
+
+/**
+ * Serializes an index, typically into a sidecar file next to the archive.
+ * The indexes of nested archives recorded with the index are saved with it.
+ *
+ * @param index An index built with tar_index_build() or loaded with tar_index_load().
+ * @param fd A file descriptor the index is written to, at its current offset.
+ *
+ * @return zero on success,
+ *         -1 if the index could not be written.
+ */
+int tar_index_save(const tar_index_t *index, int fd);
+
+/**
+ * Loads an index saved with tar_index_save().
+ *
+ * @param fd A file descriptor positioned at the start of a saved index, which is read until its end.
+ * @param index The index to fill, released with tar_index_free().
+ *
+ * @return the number of entries loaded,
+ *         -1 if the index could not be read or is malformed.
+ */
+ssize_t tar_index_load(int fd, tar_index_t *index);
+
+/**
+ * An entry of an archive embedded into a program by tar_embed.
+ */
+typedef struct tar_embedded_entry {
+    const char *path;
+    const char *linkname;
+    char typeflag;
+    size_t size;
+    size_t data_offset;           /* offset of the entry data within the embedded bytes */
+} tar_embedded_entry_t;
+
+/**
+ * An archive embedded into a program by tar_embed, together with its
+ * perfect-hash index.  Everything is constant data generated at build time.
+ */
+typedef struct tar_embedded {
+    const uint8_t *data;          /* the archive bytes */
+    size_t data_len;
+    const tar_embedded_entry_t *entries;
+    size_t count;
+    const uint32_t *disp;         /* hash seed of each bucket */
+    size_t nbuckets;
+    const uint32_t *slots;        /* entry number + 1 of each slot, zero when empty */
+    size_t nslots;
+} tar_embedded_t;
+
+/**
+ * Looks up an entry of an embedded archive through its precomputed perfect
+ * hash: a single probe, no scan and no allocation.
+ *
+ * @param emb An embedded archive emitted by tar_embed.
+ * @param path A path to an entry in the archive, directories may be given with or without their trailing slash.
+ *
+ * @return the entry at the given path, NULL if no such entry exists.
+ */
+const tar_embedded_entry_t *embedded_find(const tar_embedded_t *emb, const char *path);
+
+/**
+ * Gives a zero-copy view of a file of an embedded archive.
+ *
+ * @param emb An embedded archive emitted by tar_embed.
+ * @param path A path to an entry in the archive.  If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param data Set to the first byte of the file contents, which live in the read-only data of the program.
+ * @param size Set to the size of the file in bytes.
+ *
+ * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         zero otherwise.
+ */
+int embedded_view(const tar_embedded_t *emb, const char *path, const uint8_t **data, size_t *size);
+
+/**
+ * Creates a member-level delta between two versions of an archive.
+ *
+ * Members of the new archive whose header and data are identical to those of
+ * the member at the same path in the old archive are recorded as references
+ * to the old archive, all other bytes are carried by the delta.
+ *
+ * @param old_fd A file descriptor pointing to the old version of a valid tar archive file.
+ * @param new_fd A file descriptor pointing to the new version of a valid tar archive file.
+ * @param delta_fd A file descriptor the delta is written to, at its current offset.
+ *
+ * @return a zero or positive value on success, representing the number of members carried in the delta,
+ *         -1 if the archives could not be read or the delta could not be written.
+ */
+ssize_t tar_delta_create(int old_fd, int new_fd, int delta_fd);
+
+/**
+ * Rebuilds the new version of an archive from the old version and a delta
+ * created by tar_delta_create().  Unchanged members are copied from the old
+ * archive inside the kernel when possible.  The result is then validated with
+ * check_archive().
+ *
+ * @param old_fd A file descriptor pointing to the old version of the archive.
+ * @param delta_fd A file descriptor pointing to the start of the delta.
+ * @param out_fd A file descriptor opened for reading and writing the new archive is written to.
+ *
+ * @return a zero or positive value on success, representing the number of non-null headers of the new archive,
+ *         -1 if the delta is malformed or an I/O error occurred,
+ *         -2 if the rebuilt archive does not pass check_archive().
+ */
+ssize_t tar_delta_apply(int old_fd, int delta_fd, int out_fd);
+
+/**
+ * Stores a path in the name and prefix fields of a header, splitting it on a
+ * slash when it does not fit in the name field alone.  The checksum is not
+ * updated.
+ *
+ * @param hdr The header to modify.
+ * @param path The new path of the entry.
+ *
+ * @return zero on success,
+ *         -1 if the path cannot be represented in a ustar header.
+ */
+int tar_header_set_path(tar_header_t *hdr, const char *path);
+
+/* Values returned by a transform_cb */
+#define TAR_KEEP 0              /* write the entry, with its possibly modified header */
+#define TAR_DROP 1              /* leave the entry out of the output */
+
+/**
+ * Callback deciding the fate of an entry in tar_transform().  It may modify
+ * any header field but the size, and returns TAR_KEEP, TAR_DROP or a negative
+ * value to abort the transform.
+ */
+typedef int (*transform_cb)(tar_header_t *hdr, void *arg);
+
+/**
+ * Common rewriting rules, applied by passing tar_rules_apply() and a pointer
+ * to the rules to tar_transform().
+ */
+typedef struct tar_rules {
+    const char *const *drop;      /* NULL-terminated list of path prefixes to drop, may be NULL */
+    const char *rename_from;      /* path prefix replaced by rename_to, NULL to keep paths */
+    const char *rename_to;
+    long uid;                     /* new owner user id, negative to keep */
+    long gid;                     /* new owner group id, negative to keep */
+    long mode;                    /* new permission bits, negative to keep */
+    const char *uname;            /* new owner user name, NULL to keep */
+    const char *gname;            /* new owner group name, NULL to keep */
+} tar_rules_t;
+
+/**
+ * A transform callback applying a tar_rules_t, passed as `arg`.
+ *
+ * @return TAR_DROP if the entry matches one of the dropped prefixes,
+ *         TAR_KEEP if the entry is kept, possibly rewritten,
+ *         -1 if the renamed path or a new numeric value does not fit in the header.
+ */
+int tar_rules_apply(tar_header_t *hdr, void *arg);
+
+/**
+ * Copies an archive while rewriting its entries.
+ *
+ * The input is read sequentially, so it may be a pipe or a socket.  Every
+ * header is handed to `cb` which may rewrite or drop the entry; the checksum
+ * of modified headers is recomputed so the output passes check_archive().
+ * Member data is never modified and passes through with copy_file_range() or
+ * splice() when the descriptors allow it.
+ *
+ * @param in_fd A file descriptor pointing to the start of a valid tar archive.
+ * @param out_fd A file descriptor the transformed archive is written to, at its current offset.
+ * @param cb A callback deciding the fate of each entry, NULL copies every entry unchanged.
+ * @param arg An opaque pointer passed to `cb`.
+ *
+ * @return a zero or positive value on success, representing the number of entries written,
+ *         -1 if the input could not be read, is not a valid archive or ends without its
+ *            end-of-archive marker, or if the output could not be written,
+ *         -2 if the callback returned an error for some entry.
+ */
+ssize_t tar_transform(int in_fd, int out_fd, transform_cb cb, void *arg);
+
+/**
+ * A destination of tar_route().
+ */
+typedef struct tar_route {
+    const char *pattern;          /* path prefix, or glob if it contains '*', '?' or '[', NULL matches every entry */
+    int fd;                       /* file descriptor the selected entries are written to */
+    int raw;                      /* nonzero writes the contents of the single selected file instead of a sub-archive */
+} tar_route_t;
+
+/**
+ * Splits an archive into several outputs in a single pass.
+ *
+ * Each entry goes to the first route whose pattern matches its path, entries
+ * matching no route are left out.  Routes receive a valid sub-archive, or in
+ * raw mode the contents of the one file they select, like `tar -xO`: raw
+ * output has no framing, so a raw route matching a second file fails the
+ * call, the first file having already been written.  The input is read
+ * sequentially and member data is moved with copy_file_range() or splice()
+ * when possible, so memory use does not depend on the member sizes.
+ *
+ * @param in_fd A file descriptor pointing to the start of a valid tar archive, it may be a pipe or a socket.
+ * @param routes The routes, tried in order for each entry.
+ * @param count The number of entries in `routes`.
+ *
+ * @return a zero or positive value on success, representing the number of entries routed,
+ *         -1 if the input could not be read or ends without its end-of-archive marker,
+ *            or if an output could not be written,
+ *         -2 if a raw route selected more than one file.
+ */
+ssize_t tar_route(int in_fd, const tar_route_t *routes, size_t count);
+
+/**
+ * Checks whether the archive is valid, like check_archive(), persisting its
+ * progress so that an interrupted check resumes where it stopped.
+ *
+ * Every few thousand headers the offset reached and the offsets of the last
+ * few headers are saved to `checkpoint`, a small record of fixed size.  A
+ * later call finding a checkpoint re-reads those headers and, if the archive
+ * is unchanged, carries on from there.
+ *
+ * @param tar_fd A file descriptor pointing to a file supposed to contain a tar archive.
+ * @param checkpoint The path of the checkpoint file, removed once the check completes.
+ *
+ * @return the check_archive() return value,
+ *         -4 if the checkpoint could not be written.
+ */
+int check_archive_resumable(int tar_fd, const char *checkpoint);
+
+/**
+ * Extracts every entry of an archive into a directory.
+ *
+ * Files, directories, symlinks and hard links are extracted, other entry
+ * types are skipped.  With a checkpoint file, progress is persisted like in
+ * check_archive_resumable() once the extracted outputs are synced, and an
+ * interrupted extraction resumes after the last checkpointed entry.
+ *
+ * Paths are resolved under `dest_dir` without following symbolic links, so
+ * neither an entry below a symlink extracted earlier nor a hard link naming
+ * a file outside of the destination can reach out of it.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file.
+ * @param dest_dir The directory the entries are extracted into, it must exist.
+ * @param checkpoint The path of a checkpoint file, removed once the extraction completes, NULL disables checkpoints.
+ *
+ * @return a zero or positive value on success, representing the number of entries extracted,
+ *         -1 if the archive contains an invalid header,
+ *         -2 if an entry could not be written,
+ *         -3 if an entry or the target of a hard link lies outside of `dest_dir`,
+ *         -4 if the checkpoint could not be written.
+ */
+ssize_t tar_extract(int tar_fd, const char *dest_dir, const char *checkpoint);
+
+/* Flags of tar_open_opts_t */
+#define TAR_OPEN_PROFILE 0x1    /* record the byte ranges read shortly after opening */
+#define TAR_OPEN_PRELOAD 0x2    /* read ahead the byte ranges recorded by a previous open */
+#define TAR_OPEN_DECOMPRESS 0x4 /* tar_read() returns the decompressed contents of ".gz" members */
+#define TAR_OPEN_VERIFY 0x8     /* verify the member data read against CRC32C checksums */
+#define TAR_OPEN_SAVE_INDEX 0x10 /* save the indexes built by the handle for the next open */
+
+/**
+ * Options of tar_open(), zero-initialize unused fields.
+ */
+typedef struct tar_open_opts {
+    int flags;                    /* TAR_OPEN_* flags */
+    unsigned profile_seconds;     /* length of the TAR_OPEN_PROFILE window, zero selects 30 seconds */
+    const char *cache_dir;        /* directory caching decompressed members of compressed archives, NULL disables it */
+    size_t cache_budget;          /* size limit of the cache directory in bytes, zero selects 1 GiB */
+} tar_open_opts_t;
+
+/* An archive opened with tar_open() */
+typedef struct tar_archive tar_archive_t;
+
+/**
+ * Opens an archive and indexes it.
+ *
+ * The index is loaded from the sidecar file "<path>.idx" when it is still
+ * current, and otherwise built; with TAR_OPEN_SAVE_INDEX, it is then saved
+ * there, as are the other indexes the handle builds, so that opening the
+ * archive for reading alone writes nothing next to it.  A sidecar is current
+ * when the size, modification time, to the nanosecond, and inode of the
+ * archive are those recorded in it.  With TAR_OPEN_PROFILE, the
+ * byte ranges read during the first seconds are saved as the hot set of the
+ * archive in "<path>.hot"; with TAR_OPEN_PRELOAD, the hot set saved by a
+ * previous open is read ahead asynchronously in archive order.
+ *
+ * Gzip-compressed archives are decompressed once when opened, recording
+ * access points from which any member can later be decompressed.  The access
+ * points are saved in "<path>.gzi" with the index, so that later opens do not
+ * decompress the archive again.  With a
+ * cache directory, members read more than once are stored decompressed
+ * there, shared between processes and bounded by a least-recently-used byte
+ * budget, and are then read directly from their cache file, once its
+ * checksum has been verified by the handle.  Archives
+ * written by tar_compress() with a frame table are not decompressed when
+ * their index is saved in "<path>.idx": the table gives the access points.
+ *
+ * Bzip2-compressed archives are decompressed once as well, their blocks in
+ * parallel, and members are later read by decompressing only the blocks
+ * holding them.  The block table is saved in "<path>.bzi" with the index.
+ *
+ * With TAR_OPEN_DECOMPRESS, tar_read() serves the decompressed contents of
+ * the gzip-compressed ".gz" members of an uncompressed archive, offsets and
+ * sizes then being those of the decompressed data.  The access points of
+ * such a member are built on its first read and kept by the handle, so that
+ * reading anywhere in it only decompresses from the closest access point.
+ *
+ * With TAR_OPEN_VERIFY, the data of every regular file is checksummed with
+ * CRC32C, 64 KiB at a time, when the archive is first opened, and with
+ * TAR_OPEN_SAVE_INDEX the checksums are saved in "<path>.crc".  tar_read(), tar_read_version() and
+ * tar_read_lines() then verify every 64 KiB chunk they read from, and fail
+ * with -3 on a mismatch.  The contents of ".gz" members read decompressed
+ * with TAR_OPEN_DECOMPRESS are not verified at all: they are inflated from
+ * access points, which never checks the gzip trailer.  The checksums are computed again
+ * whenever the size, modification time or inode of the archive changes, so
+ * they only catch corruption that leaves these untouched.
+ *
+ * @param path The path of a valid tar archive file.
+ * @param opts Options of the handle, NULL selects the defaults.
+ *
+ * @return a handle on the archive, released with tar_close(),
+ *         NULL if the archive could not be opened or indexed.
+ */
+tar_archive_t *tar_open(const char *path, const tar_open_opts_t *opts);
+
+/**
+ * Closes an archive opened with tar_open(), saving the hot set recorded so
+ * far if the recording window is still open.  An archive stays open until
+ * the nested archives opened from it are closed too.
+ */
+void tar_close(tar_archive_t *ar);
+
+/**
+ * Gives access to the index of an archive opened with tar_open().
+ */
+const tar_index_t *tar_archive_index(const tar_archive_t *ar);
+
+/**
+ * Reads a file at a given path in an archive opened with tar_open().  The
+ * file is found through the index and read with a positional read, so the
+ * handle can be shared between threads.
+ *
+ * @param ar An archive opened with tar_open().
+ * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param dest A destination buffer to read the given file into.
+ * @param len An in-out argument.
+ *            The caller set it to the size of dest.
+ *            The callee set it to the number of bytes written to dest.
+ *
+ * @return the read_file() return value,
+ *         -3 if the data read does not match its checksum, with TAR_OPEN_VERIFY.
+ */
+ssize_t tar_read(tar_archive_t *ar, const char *path, size_t offset, uint8_t *dest, size_t *len);
+
+/**
+ * Reads a range of lines of a text file in an archive opened with tar_open().
+ *
+ * The first query on a file builds its line index, recording the offset of
+ * every 1024th line, which is saved in the "<path>.lines" sidecar when the
+ * archive is closed.  A query then costs one lookup and a scan of at most
+ * 1024 lines, wherever the lines are in the file.
+ *
+ * @param ar An archive opened with tar_open().
+ * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param first_line The number of the first line to read, the first line of the file being line 1.
+ * @param count The number of lines to read.
+ * @param dest A destination buffer to read the lines into, newlines included.
+ * @param len An in-out argument.
+ *            The caller set it to the size of dest.
+ *            The callee set it to the number of bytes written to dest.
+ *
+ * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the first line is outside the file,
+ *         zero if the requested lines were read in their entirety into the destination buffer,
+ *         -3 if the lines read do not match their checksum, with TAR_OPEN_VERIFY,
+ *         a positive value if the lines were partially read, representing the remaining bytes left to be read to
+ *         reach the end of the last requested line.
+ */
+ssize_t tar_read_lines(tar_archive_t *ar, const char *path, size_t first_line, size_t count,
+                       uint8_t *dest, size_t *len);
+
+/**
+ * Opens an archive stored as a member of another archive.
+ *
+ * The nested archive is read in place, as a byte range of the outer archive,
+ * and every handle function works on it.  Its index is recorded in the index
+ * of the outer archive, and saved with it in the outer sidecar, so that it is
+ * not rebuilt on the next open.  So are the indexes of archives nested in it,
+ * at any depth, once it is closed.  The outer archive stays open until then,
+ * even if tar_close() is called on it first.
+ *
+ * @param outer An uncompressed archive opened with tar_open() or tar_open_member().
+ * @param path A path to an entry of `outer` holding an uncompressed tar archive.  If the entry is a symlink, it is
+ *             resolved to its linked-to entry.
+ *
+ * @return a handle on the nested archive, released with tar_close(),
+ *         NULL if the entry does not exist or does not hold an uncompressed tar archive.
+ */
+tar_archive_t *tar_open_member(tar_archive_t *outer, const char *path);
+
+/**
+ * Lists the entries at a given path in an archive opened with tar_open(),
+ * with the semantics of list().
+ *
+ * @param ar An archive opened with tar_open().
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
+ * @param no_entries An in-out argument.
+ *                   The caller set it to the number of entries in `entries`.
+ *                   The callee set it to the number of entries listed.
+ *
+ * @return zero if no directory at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int tar_list(tar_archive_t *ar, const char *path, char **entries, size_t *no_entries);
+
+/**
+ * Opens a GNU multi-volume archive as a single archive.
+ *
+ * Members cut at the end of a volume and continued in the next one are
+ * indexed once, and tar_read() and tar_read_lines() read them across volume
+ * boundaries straight from the volumes, nothing being copied aside.  The
+ * header and data offsets of an entry are relative to the volume holding its
+ * header.  The handle has no sidecar files.
+ *
+ * @param fds The file descriptors of the volumes, in order.  They are duplicated and left open.
+ * @param count The number of volumes.
+ *
+ * @return a handle on the archive, released with tar_close(),
+ *         NULL if the volumes do not form a complete multi-volume archive.
+ */
+tar_archive_t *tar_open_volumes(const int *fds, size_t count);
+
+/**
+ * Entry metadata columns that tar_index_filter() can test.
+ */
+typedef enum {
+    TAR_COL_TYPE,                 /* typeflag */
+    TAR_COL_SIZE,
+    TAR_COL_MTIME,
+    TAR_COL_UID,
+    TAR_COL_GID,
+    TAR_COL_MODE,
+    TAR_COL_PATH,                 /* path id: the number of the first entry with the same path */
+} tar_column_t;
+
+typedef enum {
+    TAR_EQ,
+    TAR_NE,
+    TAR_LT,
+    TAR_LE,
+    TAR_GT,
+    TAR_GE,
+    TAR_BITS,                     /* every bit of the value is set */
+} tar_op_t;
+
+/**
+ * A test of one column of an entry against a value, `column op value`.
+ */
+typedef struct {
+    tar_column_t column;
+    tar_op_t op;
+    long value;
+} tar_predicate_t;
+
+/**
+ * Finds the entries of an index matching every predicate of a list.
+ *
+ * The predicates are evaluated over the metadata columns of the index, a
+ * block of entries at a time, without going through the entries themselves.
+ *
+ * @param index An index built with tar_index_build().
+ * @param preds The predicates, all of which must hold.
+ * @param npreds The number of predicates, zero matching every entry.
+ * @param ids A destination array receiving the numbers of the matching entries, in archive order.
+ * @param max_ids The number of entries of `ids`.
+ *
+ * @return the number of matching entries, which may exceed `max_ids`,
+ *         -1 if a predicate is invalid.
+ */
+ssize_t tar_index_filter(const tar_index_t *index, const tar_predicate_t *preds, size_t npreds,
+                         uint32_t *ids, size_t max_ids);
+
+/**
+ * Aggregate statistics of a directory and everything below it.  Paths
+ * occurring several times in the archive are counted once.
+ */
+typedef struct {
+    char path[257];               /* with its trailing slash, empty for the root of the archive */
+    uint64_t size;                /* total size of the entries below the directory */
+    uint64_t files;               /* regular files and hard links */
+    uint64_t dirs;                /* directories, whether or not they have an entry of their own */
+    uint64_t symlinks;
+    time_t max_mtime;             /* latest modification time of the directory and its entries */
+} tar_dir_stats_t;
+
+/**
+ * Gives the aggregate statistics of a directory of an index.
+ *
+ * The statistics of every directory are computed when the index is built,
+ * and saved with it, so that the query is a single lookup.
+ *
+ * @param index An index built with tar_index_build().
+ * @param path A path to a directory, with or without its trailing slash, NULL or empty for the whole archive.
+ *
+ * @return the statistics of the directory, NULL if no directory exists at the given path.
+ */
+const tar_dir_stats_t *tar_index_du(const tar_index_t *index, const char *path);
+
+/**
+ * Finds the largest directories of an index, the root excepted.
+ *
+ * @param index An index built with tar_index_build().
+ * @param n The number of directories wanted.
+ * @param out A destination array of `n` items receiving the directories, largest first.
+ *
+ * @return the number of directories written to `out`.
+ */
+size_t tar_index_top_dirs(const tar_index_t *index, size_t n, const tar_dir_stats_t **out);
+
+/**
+ * Finds the largest files of an index.
+ *
+ * @param index An index built with tar_index_build().
+ * @param n The number of files wanted.
+ * @param ids A destination array of `n` items receiving the entry numbers of the files, largest first.
+ *
+ * @return the number of entry numbers written to `ids`.
+ */
+size_t tar_index_top_files(const tar_index_t *index, size_t n, uint32_t *ids);
+
+/**
+ * Gives every occurrence of a path in an index, in archive order.
+ *
+ * Archives appended to may hold several versions of a path, the last one
+ * being the current one.  The versions of every path are grouped when the
+ * index is built, so that any of them is reached in constant time.
+ *
+ * @param index An index built with tar_index_build().
+ * @param path A path to an entry in the archive, directories may be given with or without their trailing slash.
+ * @param versions Set to the numbers of the entries at the given path, the oldest first and the one
+ *                 tar_index_find() returns last.  The array belongs to the index.
+ *
+ * @return the number of occurrences of the path, zero if no entry exists at the given path.
+ */
+size_t tar_index_history(const tar_index_t *index, const char *path, const uint32_t **versions);
+
+/**
+ * Reads a given version of a file in an archive opened with tar_open().
+ *
+ * @param ar An archive opened with tar_open().
+ * @param path A path to an entry in the archive to read from.  If the version is a symlink, it is resolved to the
+ *             current version of its linked-to entry.
+ * @param version The version to read, zero being the oldest occurrence of the path, as in tar_index_history().
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param dest A destination buffer to read the given file into.
+ * @param len An in-out argument.
+ *            The caller set it to the size of dest.
+ *            The callee set it to the number of bytes written to dest.
+ *
+ * @return the read_file() return value, -1 as well if the version does not exist,
+ *         -3 if the data read does not match its checksum, with TAR_OPEN_VERIFY.
+ */
+ssize_t tar_read_version(tar_archive_t *ar, const char *path, size_t version, size_t offset,
+                         uint8_t *dest, size_t *len);
+
+/**
+ * A member to extract when restoring from a chain of archives.
+ */
+typedef struct {
+    size_t archive;               /* position of the archive in the chain */
+    const tar_entry_t *entry;     /* member holding the live version, in the index of that archive */
+} tar_restore_t;
+
+/**
+ * Plans the restore of a path from a chain of GNU incremental archives.
+ *
+ * The dumpdir entries of the archives, which list the contents of every
+ * directory at dump time, are recorded in their indexes.  The most recent
+ * dumpdir of a directory tells which of its files are live and which dump
+ * holds each of them, so that a restore reads only the members it needs.
+ * Archives that are not incremental dumps are taken as full dumps.
+ *
+ * @param chain The indexes of the archives of the chain, the level 0 dump first.
+ * @param n The number of archives of the chain.
+ * @param path A path to a file or a directory, a directory being restored with its whole subtree.
+ * @param plan A destination array receiving a member for each path to restore, directories before their contents.
+ * @param max The number of items of `plan`.
+ *
+ * @return the number of members to restore, which may exceed `max`,
+ *         zero if the path does not exist once the whole chain is restored.
+ */
+size_t tar_plan_restore(const tar_index_t *const *chain, size_t n, const char *path,
+                        tar_restore_t *plan, size_t max);
+
+
+/* Flags of tar_compress_opts_t */
+#define TAR_COMPRESS_FRAME_TABLE 0x1 /* end the output with a table of its gzip members */
+
+/**
+ * Options of tar_compress(), zero-initialize unused fields.
+ */
+typedef struct tar_compress_opts {
+    int flags;                    /* TAR_COMPRESS_* flags */
+    int level;                    /* compression level from 1 to 9, zero selects zlib's default */
+    int threads;                  /* compressing threads, zero selects one per online processor */
+    size_t chunk_size;            /* uncompressed bytes per gzip member, zero selects 4 MiB */
+} tar_compress_opts_t;
+
+/**
+ * Compresses an archive into gzip members compressed in parallel.
+ *
+ * The archive is cut into chunks of about `chunk_size` bytes, at entry
+ * boundaries unless an entry does not fit in a chunk, and each chunk is
+ * compressed as an independent gzip member by a pool of threads.  The members
+ * are written in order, so the output is a regular gzip file.  With
+ * TAR_COMPRESS_FRAME_TABLE, it ends with a table of the members, hidden in
+ * empty gzip members, from which tar_open() finds access points without
+ * decompressing the archive.
+ *
+ * @param in_fd A file descriptor pointing to the start of a valid tar archive, it may be a pipe or a socket.
+ * @param out_fd A file descriptor the compressed archive is written to, at its current offset.
+ * @param opts Options of the compression, NULL selects the defaults.
+ *
+ * @return a zero or positive value on success, representing the number of entries written,
+ *         -1 if the input could not be read, ends before its end-of-archive marker, or the output could not be
+ *         written.
+ */
+ssize_t tar_compress(int in_fd, int out_fd, const tar_compress_opts_t *opts);
+
+
+/* Formats of tar_export() */
+typedef enum {
+    TAR_EXPORT_JSONL,             /* one JSON object per line */
+    TAR_EXPORT_CSV,               /* a header line, then one line per entry */
+    TAR_EXPORT_BINARY,            /* fixed-size little-endian records followed by the path and linkname */
+} tar_export_format_t;
+
+/* Flags of tar_export() */
+#define TAR_EXPORT_DIGEST 0x1   /* add the CRC-32 of the data of regular files, which is then read */
+
+/**
+ * Writes a manifest of every entry of an archive: path, type, size, mode,
+ * owner, modification time, linkname and header offset, in archive order.
+ *
+ * The headers are read in a single pass through a large buffer, the data of
+ * the entries being skipped unless it is digested, and the records are
+ * formatted by hand into a large output buffer, so that exporting an entry
+ * costs no allocation and no system call of its own.  The layout of the
+ * binary format is described in tar_export.c.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a tar archive, it may be a pipe or a socket.
+ * @param out_fd A file descriptor the manifest is written to, at its current offset.
+ * @param format The format of the manifest.
+ * @param flags TAR_EXPORT_* flags.
+ *
+ * @return a zero or positive value on success, representing the number of entries exported,
+ *         -1 if the input could not be read or ends before its end-of-archive marker,
+ *            or if the output could not be written,
+ *         -2 if the archive contains a header with an invalid checksum value.
+ */
+ssize_t tar_export(int tar_fd, int out_fd, tar_export_format_t format, int flags);
+
 #endif
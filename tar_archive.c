@@ -0,0 +1,952 @@
+#include "lib_tar.h"
+#include "tar_internal.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+/* Length of the access recording window when none is given */
+#define DEFAULT_PROFILE_SECONDS 30
+
+/* Distance between the access points of compressed archives */
+#define GZ_SPAN (1024 * 1024)
+
+/* Distance between the access points of compressed members */
+#define GZ_MEMBER_SPAN (256 * 1024)
+
+/* Members of compressed archives are cached from their second read on */
+#define CACHE_MIN_READS 2
+#define DEFAULT_CACHE_BUDGET ((size_t) 1024 * 1024 * 1024)
+
+/* Decompressed bytes copied at a time into the cache */
+#define CACHE_FILL_CHUNK (4 * 1024 * 1024)
+
+/*
+ * Member cache file layout, numbers being 64-bit little-endian:
+ *
+ *   "TARMEM01" archive identity (see put_identity()) size checksum
+ *   size bytes: the decompressed member
+ *
+ * The checksum is the CRC32C of the member, computed as it is written and
+ * checked the first time each handle opens the file, so that a cache file
+ * left by a rewritten archive, or damaged, is never served.
+ */
+#define MEMBER_MAGIC "TARMEM01"
+#define MEMBER_MAGLEN 8
+#define MEMBER_HEADER (MEMBER_MAGLEN + IDENTITY_LEN + 16)
+
+/*
+ * Hot-set profile layout, numbers being 64-bit little-endian:
+ *
+ *   "TARHOT02" archive identity (see put_identity()) count
+ *   count times: archive offset, length     (sorted by offset, disjoint)
+ */
+#define HOT_MAGIC "TARHOT02"
+#define HOT_MAGLEN 8
+
+/**
+ * Builds the path of a sidecar file of the archive, e.g. "a.tar.idx".
+ */
+void sidecar_path(char *out, size_t out_len, const tar_archive_t *ar, const char *suffix) {
+    snprintf(out, out_len, "%s.%s", ar->path, suffix);
+}
+
+/**
+ * Replaces a sidecar file atomically with the data produced by `save`.
+ */
+int sidecar_save(const tar_archive_t *ar, const char *suffix,
+                        int (*save)(const tar_archive_t *ar, int fd)) {
+    char path[4096], tmp[sizeof(path) + 8];
+    if (!ar->path) {
+        /* nested archives have no file of their own */
+        return -1;
+    }
+    sidecar_path(path, sizeof(path), ar, suffix);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+    int ret = save(ar, fd);
+    close(fd);
+    if (ret == 0) {
+        ret = rename(tmp, path);
+    }
+    if (ret != 0) {
+        unlink(tmp);
+    }
+    return ret;
+}
+
+static int save_index(const tar_archive_t *ar, int fd) {
+    return tar_index_save(&ar->index, fd);
+}
+
+/**
+ * Loads the sidecar index of the archive if it is still current.
+ *
+ * @return zero if the index was loaded, -1 if it must be built.
+ */
+static int load_saved_index(tar_archive_t *ar) {
+    char path[4096];
+    sidecar_path(path, sizeof(path), ar, "idx");
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t ret = tar_index_load(fd, &ar->index);
+    close(fd);
+    if (ret >= 0 && tar_index_is_current(&ar->index, ar->fd)) {
+        return 0;
+    }
+    if (ret >= 0) {
+        tar_index_free(&ar->index);
+    }
+    return -1;
+}
+
+static int save_gz_index(const tar_archive_t *ar, int fd) {
+    uint8_t id[IDENTITY_LEN];
+    put_identity(id, &ar->index);
+    return gz_index_save(ar->gz, fd, id);
+}
+
+/**
+ * Indexes a gzip-compressed archive: the archive is decompressed once, its
+ * headers being indexed on the fly while the access points are recorded.
+ * Offsets in the index are offsets in the decompressed archive.  The access
+ * points are saved with the index, so that the next open decompresses
+ * nothing; archives ending with a frame table have them in the table.
+ */
+static int load_gz_index(tar_archive_t *ar) {
+    struct stat st;
+    if (fstat(ar->fd, &st) == -1) {
+        return -1;
+    }
+
+    gz_index_t *frames = gz_index_load_frames(ar->fd, st.st_size);
+    if (load_saved_index(ar) == 0) {
+        if (frames) {
+            ar->gz = frames;
+            return 0;
+        }
+        char path[4096];
+        sidecar_path(path, sizeof(path), ar, "gzi");
+        int fd = open(path, O_RDONLY);
+        if (fd != -1) {
+            uint8_t id[IDENTITY_LEN];
+            put_identity(id, &ar->index);
+            ar->gz = gz_index_load(fd, id);
+            close(fd);
+        }
+        if (ar->gz) {
+            return 0;
+        }
+        tar_index_free(&ar->index);
+    }
+    int framed = frames != NULL;
+    gz_index_free(frames);
+
+    struct index_scan scan = { .index = &ar->index };
+    if (index_set_identity(&ar->index, ar->fd) != 0) {
+        return -1;
+    }
+    ar->gz = gz_index_build(ar->fd, 0, st.st_size, GZ_SPAN, index_scan_feed, &scan);
+    if (!ar->gz || index_scan_finish(&scan) != 0) {
+        tar_index_free(&ar->index);
+        return -1;
+    }
+    /* best effort, the archive may live in a read-only directory */
+    if (ar->save_index && sidecar_save(ar, "idx", save_index) == 0 && !framed) {
+        sidecar_save(ar, "gzi", save_gz_index);
+    }
+    return 0;
+}
+
+static int save_bz_index(const tar_archive_t *ar, int fd) {
+    uint8_t id[IDENTITY_LEN];
+    put_identity(id, &ar->index);
+    return bz_index_save(ar->bz, fd, id);
+}
+
+/**
+ * Indexes a bzip2-compressed archive: its blocks are decompressed in
+ * parallel, and the headers indexed as the blocks are handed over in order.
+ * Unlike access points, the block table is small, and is saved with the index
+ * so that the archive is not decompressed again on the next open.
+ */
+static int load_bz_index(tar_archive_t *ar) {
+    struct stat st;
+    if (fstat(ar->fd, &st) == -1) {
+        return -1;
+    }
+
+    if (load_saved_index(ar) == 0) {
+        char path[4096];
+        sidecar_path(path, sizeof(path), ar, "bzi");
+        int fd = open(path, O_RDONLY);
+        if (fd != -1) {
+            uint8_t id[IDENTITY_LEN];
+            put_identity(id, &ar->index);
+            ar->bz = bz_index_load(fd, id);
+            close(fd);
+        }
+        if (ar->bz) {
+            return 0;
+        }
+        tar_index_free(&ar->index);
+    }
+
+    struct index_scan scan = { .index = &ar->index };
+    if (index_set_identity(&ar->index, ar->fd) != 0) {
+        return -1;
+    }
+    ar->bz = bz_index_build(ar->fd, st.st_size, index_scan_feed, &scan);
+    if (!ar->bz || index_scan_finish(&scan) != 0) {
+        bz_index_free(ar->bz);
+        ar->bz = NULL;
+        tar_index_free(&ar->index);
+        return -1;
+    }
+    /* best effort, the archive may live in a read-only directory */
+    if (ar->save_index && sidecar_save(ar, "idx", save_index) == 0) {
+        sidecar_save(ar, "bzi", save_bz_index);
+    }
+    return 0;
+}
+
+/**
+ * Loads the sidecar index of the archive when it is still current, or builds
+ * the index and saves it for the next open.
+ */
+static int load_index(tar_archive_t *ar) {
+    uint8_t magic[4];
+    ssize_t n = pread(ar->fd, magic, sizeof(magic), 0);
+    if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+        return load_gz_index(ar);
+    }
+    if (n == 4 && memcmp(magic, "BZh", 3) == 0 && magic[3] >= '1' && magic[3] <= '9') {
+        return load_bz_index(ar);
+    }
+
+    if (load_saved_index(ar) == 0) {
+        return 0;
+    }
+    if (tar_index_build(ar->fd, &ar->index) < 0) {
+        return -1;
+    }
+    if (ar->save_index) {
+        /* best effort, the archive may live in a read-only directory */
+        sidecar_save(ar, "idx", save_index);
+    }
+    return 0;
+}
+
+static int cmp_range(const void *a, const void *b) {
+    const struct hot_range *x = a, *y = b;
+    return x->off < y->off ? -1 : x->off > y->off;
+}
+
+/**
+ * Sorts the recorded ranges and merges the overlapping or adjacent ones.
+ */
+static void merge_ranges(tar_archive_t *ar) {
+    if (ar->nranges == 0) {
+        return;
+    }
+    qsort(ar->ranges, ar->nranges, sizeof(struct hot_range), cmp_range);
+
+    size_t out = 0;
+    for (size_t i = 1; i < ar->nranges; i++) {
+        struct hot_range *last = &ar->ranges[out];
+        const struct hot_range *r = &ar->ranges[i];
+        if (r->off <= last->off + (off_t) last->len) {
+            off_t end = r->off + r->len;
+            if (end > last->off + (off_t) last->len) {
+                last->len = end - last->off;
+            }
+        } else {
+            ar->ranges[++out] = *r;
+        }
+    }
+    ar->nranges = out + 1;
+}
+
+static int save_profile(const tar_archive_t *ar, int fd) {
+    uint8_t hdr[HOT_MAGLEN + IDENTITY_LEN + 8];
+    memcpy(hdr, HOT_MAGIC, HOT_MAGLEN);
+    put_identity(hdr + HOT_MAGLEN, &ar->index);
+    put_u64(hdr + HOT_MAGLEN + IDENTITY_LEN, ar->nranges);
+    if (write_all(fd, hdr, sizeof(hdr)) != 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < ar->nranges; i++) {
+        uint8_t rec[16];
+        put_u64(rec, ar->ranges[i].off);
+        put_u64(rec + 8, ar->ranges[i].len);
+        if (write_all(fd, rec, sizeof(rec)) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Ends the recording window and persists the hot set.  Called with the
+ * profile lock held.
+ */
+static void finish_profile(tar_archive_t *ar) {
+    __atomic_store_n(&ar->profiling, 0, __ATOMIC_RELAXED);
+    merge_ranges(ar);
+    sidecar_save(ar, "hot", save_profile);
+    free(ar->ranges);
+    ar->ranges = NULL;
+    ar->nranges = ar->ranges_cap = 0;
+}
+
+/**
+ * Records a read of the archive bytes [off, off + len) while profiling.
+ */
+static void record_access(tar_archive_t *ar, off_t off, size_t len) {
+    pthread_mutex_lock(&ar->lock);
+    if (__atomic_load_n(&ar->profiling, __ATOMIC_RELAXED)) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec - ar->opened.tv_sec >= ar->profile_seconds) {
+            finish_profile(ar);
+        } else {
+            if (ar->nranges == ar->ranges_cap) {
+                size_t cap = ar->ranges_cap ? ar->ranges_cap * 2 : 64;
+                struct hot_range *ranges = realloc(ar->ranges, cap * sizeof(struct hot_range));
+                if (ranges) {
+                    ar->ranges = ranges;
+                    ar->ranges_cap = cap;
+                }
+            }
+            if (ar->nranges < ar->ranges_cap) {
+                ar->ranges[ar->nranges].off = off;
+                ar->ranges[ar->nranges].len = len;
+                ar->nranges++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&ar->lock);
+}
+
+/**
+ * Asks the kernel to read ahead the hot set recorded by a previous open, in
+ * archive order.  The advice is asynchronous, tar_open() does not wait.
+ */
+static void preload_profile(tar_archive_t *ar) {
+    char path[4096];
+    sidecar_path(path, sizeof(path), ar, "hot");
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return;
+    }
+
+    uint8_t hdr[HOT_MAGLEN + IDENTITY_LEN + 8];
+    if (read_exact(fd, hdr, sizeof(hdr)) == 0 && memcmp(hdr, HOT_MAGIC, HOT_MAGLEN) == 0 &&
+        identity_matches(hdr + HOT_MAGLEN, &ar->index)) {
+        uint64_t count = get_u64(hdr + HOT_MAGLEN + IDENTITY_LEN);
+        uint8_t rec[16];
+        for (uint64_t i = 0; i < count && read_exact(fd, rec, sizeof(rec)) == 0; i++) {
+            posix_fadvise(ar->fd, get_u64(rec), get_u64(rec + 8), POSIX_FADV_WILLNEED);
+        }
+    }
+    close(fd);
+}
+
+/**
+ * Opens an archive and indexes it.
+ *
+ * @param path The path of a valid tar archive file.
+ * @param opts Options of the handle, NULL selects the defaults.
+ *
+ * @return a handle on the archive, released with tar_close(),
+ *         NULL if the archive could not be opened or indexed.
+ */
+tar_archive_t *tar_open(const char *path, const tar_open_opts_t *opts) {
+    tar_archive_t *ar = calloc(1, sizeof(*ar));
+    if (!ar) {
+        return NULL;
+    }
+    ar->refs = 1;
+    ar->fd = open(path, O_RDONLY);
+    ar->path = strdup(path);
+    ar->save_index = opts && (opts->flags & TAR_OPEN_SAVE_INDEX);
+    if (ar->fd == -1 || !ar->path || load_index(ar) != 0) {
+        if (ar->fd != -1) {
+            close(ar->fd);
+        }
+        free(ar->path);
+        free(ar);
+        return NULL;
+    }
+    pthread_mutex_init(&ar->lock, NULL);
+
+    struct stat st;
+    if ((ar->gz || ar->bz) && opts && opts->cache_dir && fstat(ar->fd, &st) == 0) {
+        /* the identity of the sidecars, and the device the inode belongs to */
+        uint8_t id[IDENTITY_LEN + 8];
+        put_identity(id, &ar->index);
+        put_u64(id + IDENTITY_LEN, st.st_dev);
+        ar->identity = (uint64_t) tar_hash(0, (const char *) id, sizeof(id)) << 32 |
+                       tar_hash(1, (const char *) id, sizeof(id));
+        ar->cache_dir = strdup(opts->cache_dir);
+        ar->cache_budget = opts->cache_budget ? opts->cache_budget : DEFAULT_CACHE_BUDGET;
+        ar->cache_used = CACHE_USAGE_UNKNOWN;
+        size_t n = ar->index.count ? ar->index.count : 1;
+        ar->reads = calloc(n, sizeof(uint32_t));
+        ar->cache_checked = calloc(n, 1);
+        if (!ar->cache_dir || !ar->reads || !ar->cache_checked) {
+            free(ar->cache_dir);
+            free(ar->reads);
+            free(ar->cache_checked);
+            ar->cache_dir = NULL;
+            ar->reads = NULL;
+            ar->cache_checked = NULL;
+        }
+    }
+
+    int flags = opts ? opts->flags : 0;
+    ar->decompress = (flags & TAR_OPEN_DECOMPRESS) != 0;
+    if (ar->gz || ar->bz) {
+        /* hot sets are byte ranges of the file, meaningless once decompressed */
+        flags &= ~(TAR_OPEN_PROFILE | TAR_OPEN_PRELOAD);
+    }
+    if (flags & TAR_OPEN_PRELOAD) {
+        preload_profile(ar);
+    }
+    if (flags & TAR_OPEN_PROFILE) {
+        ar->profile_seconds = opts->profile_seconds ? opts->profile_seconds : DEFAULT_PROFILE_SECONDS;
+        clock_gettime(CLOCK_MONOTONIC, &ar->opened);
+        ar->profiling = 1;
+    }
+    if ((flags & TAR_OPEN_VERIFY) && crc_open(ar) != 0) {
+        tar_close(ar);
+        return NULL;
+    }
+    return ar;
+}
+
+/**
+ * Records the index of a nested archive, and the indexes nested in it since
+ * it was opened, in the index of its outer archive.
+ */
+static void record_nested(tar_archive_t *ar) {
+    tar_archive_t *outer = ar->outer;
+    tar_index_t *copy = malloc(sizeof(*copy));
+    pthread_mutex_lock(&outer->lock);
+    if (copy && index_copy(copy, &ar->index) == 0) {
+        if (index_set_nested(&outer->index, ar->outer_entry, copy) == 0) {
+            outer->index_dirty = 1;
+            copy = NULL;
+        } else {
+            tar_index_free(copy);
+        }
+    }
+    pthread_mutex_unlock(&outer->lock);
+    free(copy);
+}
+
+/**
+ * Closes an archive opened with tar_open(), saving the hot set recorded so
+ * far if the recording window is still open.  An archive stays open until
+ * the nested archives opened from it are closed too.
+ */
+void tar_close(tar_archive_t *ar) {
+    if (!ar || __atomic_sub_fetch(&ar->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+    if (__atomic_load_n(&ar->profiling, __ATOMIC_RELAXED)) {
+        finish_profile(ar);
+    }
+    close_lines(ar);
+    if (ar->index_dirty && ar->outer) {
+        /* nested archives have no sidecar, the outer one saves their indexes */
+        record_nested(ar);
+    } else if (ar->index_dirty && ar->save_index) {
+        sidecar_save(ar, "idx", save_index);
+    }
+    if (ar->members_gz) {
+        for (size_t i = 0; i < ar->index.count; i++) {
+            gz_index_free(ar->members_gz[i]);
+        }
+        free(ar->members_gz);
+        free(ar->members_tried);
+    }
+    pthread_mutex_destroy(&ar->lock);
+    gz_index_free(ar->gz);
+    bz_index_free(ar->bz);
+    crc_table_free(ar->crcs);
+    free(ar->cache_dir);
+    free(ar->reads);
+    free(ar->cache_checked);
+    close_volumes(ar);
+    tar_index_free(&ar->index);
+    close(ar->fd);
+    free(ar->path);
+    tar_close(ar->outer);
+    free(ar);
+}
+
+/**
+ * Gives access to the index of an archive opened with tar_open().
+ */
+const tar_index_t *tar_archive_index(const tar_archive_t *ar) {
+    return &ar->index;
+}
+
+/**
+ * Looks up an entry by path, following symlinks like read_file() does.
+ */
+const tar_entry_t *resolve_entry(const tar_archive_t *ar, const char *path) {
+    const tar_entry_t *entry = tar_index_find(&ar->index, path);
+    for (int depth = 0; entry && entry->typeflag == SYMTYPE && depth < 16; depth++) {
+        entry = tar_index_find(&ar->index, entry->linkname);
+    }
+    if (entry && entry->typeflag == SYMTYPE) {
+        return NULL;
+    }
+    return entry;
+}
+
+/**
+ * Builds the cache key of a member of the archive: archive identity, path
+ * hash and a digest of the member header.  The contents are checked against
+ * the checksum stored in the cache file, see cache_check().
+ */
+static void cache_key(char *out, size_t out_len, const tar_archive_t *ar, const tar_entry_t *entry) {
+    size_t len = strlen(entry->path);
+    uint64_t digest[4] = { entry->size, entry->mtime, entry->mode, entry->data_offset };
+    snprintf(out, out_len, "%016llx-%08x%08x-%08x",
+             (unsigned long long) ar->identity,
+             tar_hash(0, entry->path, len), tar_hash(1, entry->path, len),
+             tar_hash(0, (const char *) digest, sizeof(digest)));
+}
+
+struct cache_fill {
+    const tar_archive_t *ar;
+    const tar_entry_t *entry;
+};
+
+/**
+ * Reads the decompressed data of a compressed archive.
+ */
+static ssize_t read_decompressed(const tar_archive_t *ar, uint8_t *dest, size_t len, off_t offset) {
+    if (ar->bz) {
+        return bz_index_read(ar->bz, ar->fd, dest, len, offset);
+    }
+    return gz_index_read(ar->gz, ar->fd, dest, len, offset);
+}
+
+/**
+ * Writes the header of a member cache file, see MEMBER_MAGIC.
+ */
+static int put_member_header(int fd, const tar_archive_t *ar, const tar_entry_t *entry, uint32_t crc) {
+    uint8_t hdr[MEMBER_HEADER];
+    memcpy(hdr, MEMBER_MAGIC, MEMBER_MAGLEN);
+    put_identity(hdr + MEMBER_MAGLEN, &ar->index);
+    put_u64(hdr + MEMBER_MAGLEN + IDENTITY_LEN, entry->size);
+    put_u64(hdr + MEMBER_MAGLEN + IDENTITY_LEN + 8, crc);
+    return pwrite(fd, hdr, sizeof(hdr), 0) == sizeof(hdr) ? 0 : -1;
+}
+
+/**
+ * Writes the decompressed contents of a member to a cache file, after a
+ * header recording their checksum.
+ */
+static int fill_member(int fd, void *arg) {
+    const struct cache_fill *f = arg;
+    uint8_t *buf = malloc(CACHE_FILL_CHUNK);
+    if (!buf || lseek(fd, MEMBER_HEADER, SEEK_SET) != MEMBER_HEADER) {
+        free(buf);
+        return -1;
+    }
+
+    int ret = 0;
+    uint32_t crc = 0;
+    for (size_t done = 0; done < f->entry->size && ret == 0;) {
+        size_t chunk = f->entry->size - done < CACHE_FILL_CHUNK ? f->entry->size - done : CACHE_FILL_CHUNK;
+        ssize_t r = read_decompressed(f->ar, buf, chunk, f->entry->data_offset + done);
+        if (r != (ssize_t) chunk || write_all(fd, buf, chunk) != 0) {
+            ret = -1;
+        }
+        crc = crc32c(crc, buf, chunk);
+        done += chunk;
+    }
+    free(buf);
+    return ret == 0 ? put_member_header(fd, f->ar, f->entry, crc) : -1;
+}
+
+/**
+ * Tells whether a member cache file holds the member of this archive, its
+ * contents being checksummed the first time the handle opens it.
+ */
+static int cache_check(tar_archive_t *ar, const tar_entry_t *entry, int fd) {
+    uint8_t hdr[MEMBER_HEADER];
+    if (pread(fd, hdr, sizeof(hdr), 0) != sizeof(hdr) || memcmp(hdr, MEMBER_MAGIC, MEMBER_MAGLEN) != 0 ||
+        !identity_matches(hdr + MEMBER_MAGLEN, &ar->index) ||
+        get_u64(hdr + MEMBER_MAGLEN + IDENTITY_LEN) != entry->size) {
+        return 0;
+    }
+    size_t i = entry - ar->index.entries;
+    if (__atomic_load_n(&ar->cache_checked[i], __ATOMIC_ACQUIRE)) {
+        return 1;
+    }
+
+    uint8_t *buf = malloc(CACHE_FILL_CHUNK);
+    if (!buf) {
+        return 0;
+    }
+    uint32_t crc = 0;
+    size_t done = 0;
+    while (done < entry->size) {
+        size_t chunk = entry->size - done < CACHE_FILL_CHUNK ? entry->size - done : CACHE_FILL_CHUNK;
+        if (pread(fd, buf, chunk, MEMBER_HEADER + done) != (ssize_t) chunk) {
+            break;
+        }
+        crc = crc32c(crc, buf, chunk);
+        done += chunk;
+    }
+    free(buf);
+    if (done != entry->size || crc != get_u64(hdr + MEMBER_MAGLEN + IDENTITY_LEN + 8)) {
+        return 0;
+    }
+    __atomic_store_n(&ar->cache_checked[i], 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/**
+ * Reads member data of a compressed archive, from the member cache when it
+ * holds the member, by decompressing from the closest access point otherwise.
+ * Members read repeatedly are added to the cache.
+ */
+static ssize_t read_compressed(tar_archive_t *ar, const tar_entry_t *entry, uint8_t *dest, size_t len, size_t offset) {
+    if (ar->cache_dir) {
+        char key[64];
+        cache_key(key, sizeof(key), ar, entry);
+
+        int fd = cache_open(ar->cache_dir, key);
+        if (fd != -1 && !cache_check(ar, entry, fd)) {
+            /* replaced below once the member is read again */
+            close(fd);
+            fd = -1;
+        }
+        if (fd == -1) {
+            size_t i = entry - ar->index.entries;
+            if (__atomic_add_fetch(&ar->reads[i], 1, __ATOMIC_RELAXED) >= CACHE_MIN_READS) {
+                struct cache_fill f = { ar, entry };
+                if (cache_store(ar->cache_dir, key, ar->cache_budget, &ar->cache_used, fill_member, &f) == 0) {
+                    fd = cache_open(ar->cache_dir, key);
+                }
+                if (fd != -1 && !cache_check(ar, entry, fd)) {
+                    close(fd);
+                    fd = -1;
+                }
+            }
+        }
+        if (fd != -1) {
+            ssize_t r = pread(fd, dest, len, MEMBER_HEADER + offset);
+            close(fd);
+            return r;
+        }
+    }
+    return read_decompressed(ar, dest, len, entry->data_offset + offset);
+}
+
+/**
+ * Reads `len` bytes of the data of an entry from `offset`, whatever the
+ * storage of the archive, without verifying it.
+ *
+ * @return the number of bytes read, -1 on error.
+ */
+ssize_t read_entry_stored(tar_archive_t *ar, const tar_entry_t *entry, uint8_t *dest, size_t len, size_t offset) {
+    if (ar->gz || ar->bz) {
+        return read_compressed(ar, entry, dest, len, offset);
+    }
+    if (ar->volumes) {
+        return volume_read(ar, entry, dest, len, offset);
+    }
+    return pread(ar->fd, dest, len, ar->base + entry->data_offset + offset);
+}
+
+/**
+ * Reads `len` bytes of the data of an entry from `offset`, verifying it
+ * against its checksums when the handle has them.
+ *
+ * @return the number of bytes read, -1 on error, READ_CORRUPT if the data does not match its checksum.
+ */
+ssize_t read_entry_data(tar_archive_t *ar, const tar_entry_t *entry, uint8_t *dest, size_t len, size_t offset) {
+    if (ar->crcs) {
+        return crc_read(ar, entry, dest, len, offset);
+    }
+    return read_entry_stored(ar, entry, dest, len, offset);
+}
+
+/**
+ * Returns the access points of a gzip-compressed member of an uncompressed
+ * archive, building them on first use, or NULL if the member is not a ".gz"
+ * file holding valid gzip data.
+ */
+static const gz_index_t *member_gz(tar_archive_t *ar, const tar_entry_t *entry) {
+    size_t i = entry - ar->index.entries;
+    size_t len = strlen(entry->path);
+    if (ar->gz || ar->bz || ar->volumes || len < 3 || strcmp(entry->path + len - 3, ".gz") != 0) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&ar->lock);
+    if (!ar->members_gz) {
+        ar->members_gz = calloc(ar->index.count, sizeof(gz_index_t *));
+        ar->members_tried = calloc(ar->index.count, 1);
+        if (!ar->members_gz || !ar->members_tried) {
+            free(ar->members_gz);
+            free(ar->members_tried);
+            ar->members_gz = NULL;
+            ar->members_tried = NULL;
+        }
+    }
+    int tried = !ar->members_gz || ar->members_tried[i];
+    gz_index_t *gz = ar->members_gz ? ar->members_gz[i] : NULL;
+    pthread_mutex_unlock(&ar->lock);
+    if (tried) {
+        return gz;
+    }
+
+    /* decompressing the member takes long, other reads go on meanwhile */
+    uint8_t magic[2];
+    gz_index_t *built = NULL;
+    if (entry->size > sizeof(magic) &&
+        pread(ar->fd, magic, sizeof(magic), ar->base + entry->data_offset) == sizeof(magic) &&
+        magic[0] == 0x1f && magic[1] == 0x8b) {
+        built = gz_index_build(ar->fd, ar->base + entry->data_offset, entry->size, GZ_MEMBER_SPAN, NULL, NULL);
+    }
+
+    /* a concurrent read may have probed the member first, its access points are kept */
+    pthread_mutex_lock(&ar->lock);
+    if (!ar->members_tried[i]) {
+        ar->members_tried[i] = 1;
+        ar->members_gz[i] = built;
+        built = NULL;
+    }
+    gz = ar->members_gz[i];
+    pthread_mutex_unlock(&ar->lock);
+    gz_index_free(built);
+    return gz;
+}
+
+/**
+ * Reads the data of a file entry of the archive, with the read_file()
+ * return values.
+ */
+static ssize_t read_member(tar_archive_t *ar, const tar_entry_t *entry, size_t offset, uint8_t *dest, size_t *len) {
+    if (!entry || !(entry->typeflag == REGTYPE || entry->typeflag == AREGTYPE)) {
+        return -1;
+    }
+
+    const gz_index_t *gz = ar->decompress ? member_gz(ar, entry) : NULL;
+    size_t size = gz ? (size_t) gz_index_size(gz) : entry->size;
+    if (offset > size) {
+        return -2;
+    }
+
+    size_t to_read = size - offset;
+    if (to_read > *len) {
+        to_read = *len;
+    }
+
+    ssize_t r = gz ? gz_index_read(gz, ar->fd, dest, to_read, offset)
+                   : read_entry_data(ar, entry, dest, to_read, offset);
+    if (r < 0) {
+        return !gz && r == READ_CORRUPT ? -3 : -1;
+    }
+    /* reading nothing would have callers looping on the same offset forever */
+    if (r == 0 && to_read > 0) {
+        return -1;
+    }
+    *len = (size_t) r;
+
+    /* the window may close concurrently, record_access() checks again under the lock */
+    if (r > 0 && !gz && __atomic_load_n(&ar->profiling, __ATOMIC_RELAXED)) {
+        record_access(ar, ar->base + entry->data_offset + offset, r);
+    }
+
+    if (offset + (size_t) r < size) {
+        return size - offset - (size_t) r;
+    }
+    return 0;
+}
+
+/**
+ * Reads a file at a given path in an archive opened with tar_open().  The
+ * file is found through the index and read with a positional read, so the
+ * handle can be shared between threads.
+ *
+ * @param ar An archive opened with tar_open().
+ * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param dest A destination buffer to read the given file into.
+ * @param len An in-out argument.
+ *            The caller set it to the size of dest.
+ *            The callee set it to the number of bytes written to dest.
+ *
+ * @return the read_file() return value,
+ *         -3 if the data read does not match its checksum, with TAR_OPEN_VERIFY.
+ */
+ssize_t tar_read(tar_archive_t *ar, const char *path, size_t offset, uint8_t *dest, size_t *len) {
+    return read_member(ar, resolve_entry(ar, path), offset, dest, len);
+}
+
+/**
+ * Reads a given version of a file in an archive opened with tar_open().
+ *
+ * @param ar An archive opened with tar_open().
+ * @param path A path to an entry in the archive to read from.  If the version is a symlink, it is resolved to the
+ *             current version of its linked-to entry.
+ * @param version The version to read, zero being the oldest occurrence of the path, as in tar_index_history().
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param dest A destination buffer to read the given file into.
+ * @param len An in-out argument.
+ *            The caller set it to the size of dest.
+ *            The callee set it to the number of bytes written to dest.
+ *
+ * @return the read_file() return value, -1 as well if the version does not exist,
+ *         -3 if the data read does not match its checksum, with TAR_OPEN_VERIFY.
+ */
+ssize_t tar_read_version(tar_archive_t *ar, const char *path, size_t version, size_t offset,
+                         uint8_t *dest, size_t *len) {
+    const uint32_t *versions;
+    if (version >= tar_index_history(&ar->index, path, &versions)) {
+        return -1;
+    }
+    const tar_entry_t *entry = &ar->index.entries[versions[version]];
+    if (entry->typeflag == SYMTYPE) {
+        entry = resolve_entry(ar, entry->linkname);
+    }
+    return read_member(ar, entry, offset, dest, len);
+}
+
+/**
+ * Opens an archive stored as a member of another archive.
+ *
+ * @param outer An uncompressed archive opened with tar_open() or tar_open_member().
+ * @param path A path to an entry of `outer` holding an uncompressed tar archive.  If the entry is a symlink, it is
+ *             resolved to its linked-to entry.
+ *
+ * @return a handle on the nested archive, released with tar_close(),
+ *         NULL if the entry does not exist or does not hold an uncompressed tar archive.
+ */
+tar_archive_t *tar_open_member(tar_archive_t *outer, const char *path) {
+    const tar_entry_t *entry = resolve_entry(outer, path);
+    if (outer->gz || outer->bz || outer->volumes || !entry || !(entry->typeflag == REGTYPE || entry->typeflag == AREGTYPE)) {
+        return NULL;
+    }
+
+    tar_header_t hdr;
+    off_t base = outer->base + entry->data_offset;
+    if (entry->size < sizeof(hdr) || pread(outer->fd, &hdr, sizeof(hdr), base) != sizeof(hdr) ||
+        check_header(&hdr) != 0) {
+        return NULL;
+    }
+
+    tar_archive_t *ar = calloc(1, sizeof(*ar));
+    if (!ar) {
+        return NULL;
+    }
+    ar->refs = 1;
+    ar->fd = dup(outer->fd);
+    ar->base = base;
+
+    /* the index of the nested archive is kept in the outer index and its sidecar */
+    size_t i = entry - outer->index.entries;
+    int ok = ar->fd != -1;
+    pthread_mutex_lock(&outer->lock);
+    if (ok && outer->index.nested && outer->index.nested[i]) {
+        ok = index_copy(&ar->index, outer->index.nested[i]) == 0;
+    } else if (ok) {
+        ar->index.archive_size = entry->size;
+        ar->index.archive_mtime = entry->mtime;
+        ok = index_build_range(ar->fd, base, entry->size, &ar->index) >= 0;
+
+        tar_index_t *cached = malloc(sizeof(*cached));
+        if (ok && cached && index_copy(cached, &ar->index) == 0 &&
+            index_set_nested(&outer->index, i, cached) == 0) {
+            outer->index_dirty = 1;
+        } else if (cached) {
+            tar_index_free(cached);
+            free(cached);
+        }
+    }
+    pthread_mutex_unlock(&outer->lock);
+
+    if (!ok) {
+        if (ar->fd != -1) {
+            close(ar->fd);
+        }
+        free(ar);
+        return NULL;
+    }
+    pthread_mutex_init(&ar->lock, NULL);
+    ar->outer = outer;
+    ar->outer_entry = i;
+    __atomic_add_fetch(&outer->refs, 1, __ATOMIC_RELAXED);
+    return ar;
+}
+
+/**
+ * Lists the entries at a given path in an archive opened with tar_open(),
+ * with the semantics of list().
+ *
+ * @param ar An archive opened with tar_open().
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
+ * @param no_entries An in-out argument.
+ *                   The caller set it to the number of entries in `entries`.
+ *                   The callee set it to the number of entries listed.
+ *
+ * @return zero if no directory at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int tar_list(tar_archive_t *ar, const char *path, char **entries, size_t *no_entries) {
+    size_t capacity = *no_entries;
+    *no_entries = 0;
+
+    char base[257];
+    if (path && path[0] != '\0') {
+        const tar_entry_t *dir = resolve_entry(ar, path);
+        if (!dir || dir->typeflag != DIRTYPE) {
+            return 0;
+        }
+        strcpy(base, dir->path);
+        size_t len = strlen(base);
+        if (len > 0 && base[len - 1] != '/') {
+            base[len] = '/';
+            base[len + 1] = '\0';
+        }
+    } else {
+        base[0] = '\0';
+    }
+    size_t base_len = strlen(base);
+
+    size_t count = 0;
+    for (size_t i = 0; i < ar->index.count && count < capacity; i++) {
+        const char *name = ar->index.entries[i].path;
+        if (!index_is_latest(&ar->index, i) || strncmp(name, base, base_len) != 0 || strcmp(name, base) == 0) {
+            continue;
+        }
+        const char *slash = strchr(name + base_len, '/');
+        if (!slash || slash[1] == '\0') {
+            strcpy(entries[count++], name);
+        }
+    }
+
+    *no_entries = count;
+    return 1;
+}
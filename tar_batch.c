@@ -0,0 +1,162 @@
+#include "lib_tar.h"
+#include "tar_internal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+
+/* Number of headers fetched per pread() when headers are packed together */
+#define BATCH_READ_BLOCKS 16
+
+/**
+ * State shared by the workers of a check_archives() run.
+ */
+struct batch {
+    char **paths;
+    size_t count;
+    size_t next;            /* next archive to hand out */
+    int failed;             /* number of archives that were not valid */
+    check_cb cb;
+    void *arg;
+    pthread_mutex_t lock;   /* protects next, failed and the callback */
+};
+
+/**
+ * Validates an archive with positional reads only, so the file offset of
+ * `tar_fd` is left untouched.  The semantics and return values are those of
+ * check_archive().
+ *
+ * Consecutive headers of small members are fetched with a single pread() so
+ * that an archive of small files does not cost one syscall per header.
+ */
+static int check_archive_pread(int tar_fd) {
+    tar_header_t blocks[BATCH_READ_BLOCKS];
+    off_t buf_off = 0;
+    size_t buf_blocks = 0;
+    off_t off = 0;
+    int count = 0;
+
+    for (;;) {
+        if (off < buf_off || off >= buf_off + (off_t) buf_blocks * 512) {
+            ssize_t r = pread(tar_fd, blocks, sizeof(blocks), off);
+            if (r < (ssize_t) sizeof(tar_header_t)) {
+                break;
+            }
+            buf_off = off;
+            buf_blocks = (size_t) r / 512;
+        }
+
+        const tar_header_t *hdr = &blocks[(off - buf_off) / 512];
+        if (is_empty_block(hdr)) {
+            break;
+        }
+
+        int err = check_header(hdr);
+        if (err != 0) {
+            return err;
+        }
+
+        /* fail where the lseek() of check_archive() would */
+        size_t size = TAR_INT(hdr->size);
+        off_t jump = TAR_PADDED(size);
+        if (jump < 0 || off > INT64_MAX - 512 - jump) {
+            return -3;
+        }
+        off += 512 + jump;
+        count++;
+    }
+
+    return count;
+}
+
+/**
+ * Worker body: repeatedly claims the next archive of the batch, opens and
+ * validates it, then reports the result through the user callback.
+ */
+static void *batch_worker(void *p) {
+    struct batch *b = p;
+
+    for (;;) {
+        pthread_mutex_lock(&b->lock);
+        size_t i = b->next++;
+        pthread_mutex_unlock(&b->lock);
+        if (i >= b->count) {
+            break;
+        }
+
+        check_result_t res = { .path = b->paths[i], .index = i, .ret = -4, .err = 0 };
+        int fd = open(b->paths[i], O_RDONLY);
+        if (fd == -1) {
+            res.err = errno;
+        } else {
+            /* queue the whole file now so the device works while we parse */
+            posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+            res.ret = check_archive_pread(fd);
+            close(fd);
+        }
+
+        pthread_mutex_lock(&b->lock);
+        if (res.ret < 0) {
+            b->failed++;
+        }
+        if (b->cb) {
+            b->cb(&res, b->arg);
+        }
+        pthread_mutex_unlock(&b->lock);
+    }
+
+    return NULL;
+}
+
+/**
+ * Checks whether many archives are valid, in parallel.
+ *
+ * @param paths The paths of the archives to validate.
+ * @param count The number of entries in `paths`.
+ * @param threads The number of archives validated concurrently, zero or negative selects a default.
+ * @param cb A callback invoked once per archive as soon as its result is known, may be NULL.
+ * @param arg An opaque pointer passed to `cb`.
+ *
+ * @return zero if every archive is valid,
+ *         a positive value representing the number of archives that are invalid or could not be opened,
+ *         -1 if the worker threads could not be started.
+ */
+int check_archives(char **paths, size_t count, int threads, check_cb cb, void *arg) {
+    if (threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        /* oversubscribe: workers spend most of their time waiting on I/O */
+        threads = cpus > 0 ? (int) cpus * 4 : 4;
+    }
+    if ((size_t) threads > count) {
+        threads = count > 0 ? (int) count : 1;
+    }
+
+    struct batch b = { .paths = paths, .count = count, .next = 0, .failed = 0, .cb = cb, .arg = arg };
+    pthread_mutex_init(&b.lock, NULL);
+
+    pthread_t *tids = malloc(sizeof(pthread_t) * threads);
+    if (!tids) {
+        pthread_mutex_destroy(&b.lock);
+        return -1;
+    }
+
+    int started = 0;
+    for (; started < threads; started++) {
+        if (pthread_create(&tids[started], NULL, batch_worker, &b) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        free(tids);
+        pthread_mutex_destroy(&b.lock);
+        return -1;
+    }
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    free(tids);
+    pthread_mutex_destroy(&b.lock);
+    return b.failed;
+}
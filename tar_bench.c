@@ -0,0 +1,1863 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+
+#include "lib_tar.h"
+#include "tar_internal.h"
+
+/**
+ * Benchmarks of the library.
+ *
+ * Usage: tar_bench [options] kernels [archive.tar...]
+ *        tar_bench [options] compare [archive.tar...]
+ *        tar_bench [options] threads [-t max_threads] [archive.tar]
+ *
+ * Options:
+ *   --save file.json       save the results as a baseline
+ *   --baseline file.json   compare the results with a saved baseline
+ *   --threshold percent    slowdown failing the comparison, 5 by default
+ *
+ * The kernels suite times the building blocks run on every header, and
+ * candidate replacements for them, over the headers of the given archives or
+ * over a synthetic corpus mixing short paths, prefixed long paths and
+ * directories.  Each kernel is warmed up, then timed over several runs of
+ * many passes over the corpus, and reported in time-stamp counter cycles per
+ * header (nanoseconds where no such counter exists), with its speedup over
+ * the library implementation.
+ *
+ * Candidates live in this file and may be inlined into their timing loop,
+ * while the library kernels are called across translation units: a candidate
+ * must win clearly before it replaces a library kernel.  The library and the
+ * benchmark are compiled with the same flags, so that measuring optimized
+ * code takes rebuilding everything, e.g. "make clean all CFLAGS='-O2 -g'".
+ *
+ * The compare suite runs the same workloads through lib_tar, GNU tar and
+ * libarchive's bsdtar, those installed, over generated archives or the given
+ * ones: validating, listing every entry, looking up a random set of paths,
+ * extracting one member and extracting everything.  Every workload runs in a
+ * child process, lib_tar's through "tar_bench exec", and is reported with its
+ * median wall and CPU times, and with its system calls and peak resident
+ * set, taken in a separate traced run.
+ *
+ * The threads suite sweeps 1 to max_threads threads, twice the online
+ * processors by default, over stat-heavy, read-heavy and list-heavy mixes of
+ * tar_archive_index() lookups, tar_read() and tar_list() calls.  The threads
+ * share one handle, then open a handle each, with its own descriptor and
+ * index.  Every configuration reports its throughput, the latency
+ * percentiles of its operations and the worst 99th percentile of a thread,
+ * and the voluntary context switches per thousand operations, which count
+ * the waits on locks and I/O.  Each configuration is warmed up by a discarded
+ * run, then run several times and reported by its run of median throughput,
+ * with the spread of the throughput over the runs.  Configurations of no more
+ * threads than processors whose throughput grows less than 80% as fast as
+ * their threads are flagged, the efficiency of more threads than processors
+ * telling nothing about scaling.
+ *
+ * The kernels and compare suites record the samples of every benchmark:
+ * ticks per header of each run, and wall milliseconds of each run of lib_tar
+ * and the other tools.  A baseline saves them in JSON, tagged with the
+ * machine, the compiler and the git revision.  Comparing with a baseline
+ * reports, for each benchmark found in both, the change of its mean with the
+ * 95% confidence interval of the change, from Welch's t-test.  A change is
+ * significant when its interval excludes zero, and the exit status is 3 when
+ * some benchmark is significantly slower than the threshold allows.  The
+ * threads suite is not recorded.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TICK_UNIT "cycles"
+static uint64_t ticks(void) {
+    return __rdtsc();
+}
+#else
+#define TICK_UNIT "ns"
+static uint64_t ticks(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+/* Headers of the synthetic corpus, and at most read from archives */
+#define SYNTHETIC_HEADERS 4096
+#define MAX_HEADERS 65536
+
+/* Passes over the corpus before timing, then timed runs of about RUN_SECONDS */
+#define WARMUP_PASSES 20
+#define RUNS 21
+#define RUN_SECONDS 0.01
+
+/* Keeps the compiler from dropping the work of the kernels */
+static volatile uint64_t sink;
+
+struct corpus {
+    tar_header_t *headers;
+    size_t count;
+    const char *target;           /* path looked up by the matching kernels */
+    size_t target_len;
+};
+
+struct kernel {
+    const char *name;             /* kernel measured, shared by its implementations */
+    const char *impl;             /* "library" for the implementation in use */
+    uint64_t (*pass)(const struct corpus *c);
+};
+
+struct result {
+    const struct kernel *kernel;
+    double samples[RUNS];         /* ticks per header of each run, sorted */
+};
+
+/* A benchmark of the current invocation, lower samples being better */
+struct record {
+    char name[192];
+    const char *unit;
+    double *samples;
+    size_t count;
+};
+
+static struct record *records;
+static size_t nrecords;
+static size_t records_cap;
+
+/**
+ * Records the samples of a benchmark for --save and --baseline.
+ */
+static void record(const char *name, const char *unit, const double *samples, size_t count) {
+    if (nrecords == records_cap) {
+        size_t cap = records_cap ? records_cap * 2 : 64;
+        struct record *grown = realloc(records, cap * sizeof(*grown));
+        if (!grown) {
+            return;
+        }
+        records = grown;
+        records_cap = cap;
+    }
+    struct record *r = &records[nrecords];
+    r->samples = malloc(count * sizeof(double));
+    if (!r->samples) {
+        return;
+    }
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->unit = unit;
+    memcpy(r->samples, samples, count * sizeof(double));
+    r->count = count;
+    nrecords++;
+}
+
+static double seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Times the runs of a kernel, calibrating the passes per run on the warmup.
+ */
+static void measure(const struct kernel *k, const struct corpus *c, struct result *r) {
+    double start = seconds();
+    for (int i = 0; i < WARMUP_PASSES; i++) {
+        sink += k->pass(c);
+    }
+    double per_pass = (seconds() - start) / WARMUP_PASSES;
+    size_t passes = per_pass > 0 ? RUN_SECONDS / per_pass : 1;
+    if (passes == 0) {
+        passes = 1;
+    }
+
+    r->kernel = k;
+    for (int run = 0; run < RUNS; run++) {
+        uint64_t t0 = ticks();
+        for (size_t i = 0; i < passes; i++) {
+            sink += k->pass(c);
+        }
+        r->samples[run] = (double) (ticks() - t0) / (passes * c->count);
+    }
+    qsort(r->samples, RUNS, sizeof(double), cmp_double);
+}
+
+/* --- Candidate kernels --------------------------------------------------- */
+
+/**
+ * is_empty_block() over 64-bit words, the first word alone deciding for
+ * almost every real header.
+ */
+static int empty_words(const tar_header_t *hdr) {
+    const unsigned char *bytes = (const unsigned char *) hdr;
+    uint64_t acc;
+    memcpy(&acc, bytes, 8);
+    if (acc != 0) {
+        return 0;
+    }
+    for (size_t i = 8; i < sizeof(*hdr); i += 8) {
+        uint64_t w;
+        memcpy(&w, bytes + i, 8);
+        acc |= w;
+    }
+    return acc == 0;
+}
+
+/**
+ * header_checksum_ok() summing the header in place, the checksum field being
+ * replaced by spaces arithmetically instead of in a copy.
+ */
+static int checksum_in_place(const tar_header_t *hdr) {
+    const unsigned char *bytes = (const unsigned char *) hdr;
+    unsigned int sum = 8 * ' ';
+    for (size_t i = 0; i < sizeof(*hdr); i++) {
+        sum += bytes[i];
+    }
+    for (size_t i = 0; i < sizeof(hdr->chksum); i++) {
+        sum -= (unsigned char) hdr->chksum[i];
+    }
+    return sum == (unsigned int) TAR_INT(hdr->chksum);
+}
+
+/**
+ * TAR_INT() without strtol(): leading spaces, then octal digits up to the
+ * end of the field.
+ */
+static uint64_t parse_octal(const char *field, size_t len) {
+    size_t i = 0;
+    while (i < len && field[i] == ' ') {
+        i++;
+    }
+    uint64_t v = 0;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) {
+        v = v << 3 | (field[i] - '0');
+    }
+    return v;
+}
+
+/**
+ * header_path() with bounded copies instead of snprintf().
+ */
+static void path_copy(char *out, const tar_header_t *hdr) {
+    size_t n = 0;
+    if (hdr->prefix[0] != '\0' && memcmp(hdr->magic, TMAGIC, TMAGLEN) == 0) {
+        n = strnlen(hdr->prefix, sizeof(hdr->prefix));
+        memcpy(out, hdr->prefix, n);
+        out[n++] = '/';
+    }
+    size_t len = strnlen(hdr->name, sizeof(hdr->name));
+    memcpy(out + n, hdr->name, len);
+    out[n + len] = '\0';
+}
+
+/**
+ * The matching of find_header(), header_matches(), against the prefix and
+ * name fields without building the path, most headers being rejected on
+ * their first bytes.
+ */
+static int match_fields(const tar_header_t *hdr, const char *path, size_t len) {
+    if (hdr->prefix[0] != '\0' && memcmp(hdr->magic, TMAGIC, TMAGLEN) == 0) {
+        size_t n = strnlen(hdr->prefix, sizeof(hdr->prefix));
+        if (len <= n || path[n] != '/' || memcmp(path, hdr->prefix, n) != 0) {
+            return 0;
+        }
+        path += n + 1;
+        len -= n + 1;
+    }
+    size_t n = strnlen(hdr->name, sizeof(hdr->name));
+    if (n == len && memcmp(hdr->name, path, n) == 0) {
+        return 1;
+    }
+    return hdr->typeflag == DIRTYPE && n == len + 1 && hdr->name[len] == '/' && memcmp(hdr->name, path, len) == 0;
+}
+
+/* --- Passes over the corpus ---------------------------------------------- */
+
+static uint64_t pass_empty_library(const struct corpus *c) {
+    uint64_t n = 0;
+    for (size_t i = 0; i < c->count; i++) {
+        n += is_empty_block(&c->headers[i]);
+    }
+    return n;
+}
+
+static uint64_t pass_empty_words(const struct corpus *c) {
+    uint64_t n = 0;
+    for (size_t i = 0; i < c->count; i++) {
+        n += empty_words(&c->headers[i]);
+    }
+    return n;
+}
+
+static uint64_t pass_checksum_library(const struct corpus *c) {
+    uint64_t n = 0;
+    for (size_t i = 0; i < c->count; i++) {
+        n += header_checksum_ok(&c->headers[i]);
+    }
+    return n;
+}
+
+static uint64_t pass_checksum_in_place(const struct corpus *c) {
+    uint64_t n = 0;
+    for (size_t i = 0; i < c->count; i++) {
+        n += checksum_in_place(&c->headers[i]);
+    }
+    return n;
+}
+
+static uint64_t pass_octal_library(const struct corpus *c) {
+    uint64_t n = 0;
+    for (size_t i = 0; i < c->count; i++) {
+        n += TAR_INT(c->headers[i].size);
+    }
+    return n;
+}
+
+static uint64_t pass_octal_loop(const struct corpus *c) {
+    uint64_t n = 0;
+    for (size_t i = 0; i < c->count; i++) {
+        n += parse_octal(c->headers[i].size, sizeof(c->headers[i].size));
+    }
+    return n;
+}
+
+static uint64_t pass_path_library(const struct corpus *c) {
+    uint64_t n = 0;
+    char path[257];
+    for (size_t i = 0; i < c->count; i++) {
+        header_path(path, &c->headers[i]);
+        n += (unsigned char) path[0];
+    }
+    return n;
+}
+
+static uint64_t pass_path_copy(const struct corpus *c) {
+    uint64_t n = 0;
+    char path[257];
+    for (size_t i = 0; i < c->count; i++) {
+        path_copy(path, &c->headers[i]);
+        n += (unsigned char) path[0];
+    }
+    return n;
+}
+
+static uint64_t pass_match_library(const struct corpus *c) {
+    uint64_t n = 0;
+    for (size_t i = 0; i < c->count; i++) {
+        n += header_matches(&c->headers[i], c->target);
+    }
+    return n;
+}
+
+static uint64_t pass_match_fields(const struct corpus *c) {
+    uint64_t n = 0;
+    for (size_t i = 0; i < c->count; i++) {
+        n += match_fields(&c->headers[i], c->target, c->target_len);
+    }
+    return n;
+}
+
+static const struct kernel kernels[] = {
+    { "is_empty_block", "library", pass_empty_library },
+    { "is_empty_block", "words", pass_empty_words },
+    { "checksum", "library", pass_checksum_library },
+    { "checksum", "in-place", pass_checksum_in_place },
+    { "TAR_INT", "library", pass_octal_library },
+    { "TAR_INT", "loop", pass_octal_loop },
+    { "header_path", "library", pass_path_library },
+    { "header_path", "memcpy", pass_path_copy },
+    { "find_header match", "library", pass_match_library },
+    { "find_header match", "fields", pass_match_fields },
+};
+
+/* --- Corpora -------------------------------------------------------------- */
+
+/**
+ * Appends the headers of an archive to the corpus, end-of-archive blocks
+ * included, as they are all seen by a scan.
+ */
+static int load_headers(struct corpus *c, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror(path);
+        return -1;
+    }
+
+    tar_header_t hdr;
+    off_t off = 0;
+    int empty = 0;
+    while (c->count < MAX_HEADERS && empty < 2 && pread(fd, &hdr, sizeof(hdr), off) == sizeof(hdr)) {
+        c->headers[c->count++] = hdr;
+        empty = is_empty_block(&hdr) ? empty + 1 : 0;
+        off += sizeof(hdr) + (empty ? 0 : TAR_PADDED((size_t) TAR_INT(hdr.size)));
+    }
+    close(fd);
+    return 0;
+}
+
+/**
+ * Fills the corpus with typical headers: mostly files with short paths, some
+ * long paths split into prefix and name, some directories, and the two
+ * end-of-archive blocks.
+ */
+static void synthesize_headers(struct corpus *c) {
+    uint32_t seed = 12345;
+    for (size_t i = 0; i < SYNTHETIC_HEADERS - 2; i++) {
+        seed = seed * 1103515245 + 12345;
+        unsigned kind = (seed >> 16) % 10;
+
+        tar_header_t *hdr = &c->headers[c->count++];
+        memset(hdr, 0, sizeof(*hdr));
+        char path[256];
+        if (kind < 7) {
+            snprintf(path, sizeof(path), "src/module%zu/file%zu.c", i % 37, i);
+        } else if (kind < 9) {
+            snprintf(path, sizeof(path),
+                     "vendor/github.com/some-organization/some-project/internal/generated/protocol/"
+                     "version%zu/messages/definitions/file_with_a_rather_long_name_%zu.pb.go", i % 5, i);
+        } else {
+            snprintf(path, sizeof(path), "src/module%zu/dir%zu/", i % 37, i);
+        }
+        tar_header_set_path(hdr, path);
+        hdr->typeflag = kind < 9 ? REGTYPE : DIRTYPE;
+        snprintf(hdr->mode, sizeof(hdr->mode), "%07o", kind < 9 ? 0644 : 0755);
+        snprintf(hdr->uid, sizeof(hdr->uid), "%07o", 1000);
+        snprintf(hdr->gid, sizeof(hdr->gid), "%07o", 1000);
+        snprintf(hdr->size, sizeof(hdr->size), "%011o", kind < 9 ? (seed >> 8) % (1 << 20) : 0);
+        snprintf(hdr->mtime, sizeof(hdr->mtime), "%011o", 1700000000 + (unsigned) i);
+        memcpy(hdr->magic, TMAGIC, TMAGLEN);
+        memcpy(hdr->version, TVERSION, TVERSLEN);
+        strcpy(hdr->uname, "user");
+        strcpy(hdr->gname, "user");
+        header_update_checksum(hdr);
+    }
+    memset(&c->headers[c->count], 0, 2 * sizeof(tar_header_t));
+    c->count += 2;
+}
+
+static int run_kernels(int argc, char **argv) {
+    struct corpus c = { malloc(MAX_HEADERS * sizeof(tar_header_t)), 0, NULL, 0 };
+    if (!c.headers) {
+        return 1;
+    }
+    for (int i = 0; i < argc; i++) {
+        if (load_headers(&c, argv[i]) != 0) {
+            return 1;
+        }
+    }
+    if (argc == 0) {
+        synthesize_headers(&c);
+    }
+    if (c.count == 0) {
+        fprintf(stderr, "no headers to measure\n");
+        return 1;
+    }
+
+    /* a scan compares every header, the target being found or not */
+    static char target[257];
+    header_path(target, &c.headers[c.count / 2]);
+    c.target = target;
+    c.target_len = strlen(target);
+
+    size_t nkernels = sizeof(kernels) / sizeof(kernels[0]);
+    struct result results[nkernels];
+    for (size_t k = 0; k < nkernels; k++) {
+        measure(&kernels[k], &c, &results[k]);
+        char name[128];
+        snprintf(name, sizeof(name), "kernels/%s/%s", kernels[k].name, kernels[k].impl);
+        record(name, TICK_UNIT "/header", results[k].samples, RUNS);
+    }
+
+    printf("%zu headers, %d runs, %s per header\n\n", c.count, RUNS, TICK_UNIT);
+    printf("%-18s %-9s %10s %10s %10s %9s\n", "kernel", "impl", "min", "median", "max", "speedup");
+    double library = 0;
+    for (size_t k = 0; k < nkernels; k++) {
+        const struct result *r = &results[k];
+        double median = r->samples[RUNS / 2];
+        int first = k == 0 || strcmp(kernels[k - 1].name, r->kernel->name) != 0;
+        if (strcmp(r->kernel->impl, "library") == 0) {
+            library = median;
+        }
+        printf("%-18s %-9s %10.2f %10.2f %10.2f %8.2fx\n", first ? r->kernel->name : "", r->kernel->impl,
+               r->samples[0], median, r->samples[RUNS - 1], median > 0 ? library / median : 0);
+    }
+    free(c.headers);
+    return 0;
+}
+
+/* --- Comparison with other implementations ----------------------------- */
+
+/* Timed runs of each workload, the median being reported */
+#define COMPARE_RUNS 5
+
+/* Paths looked up by the stat workload */
+#define STAT_PATHS 32
+
+/* Generated archives: many small files, and a few large ones */
+#define SMALL_FILES 4000
+#define SMALL_SIZE 2048
+#define LARGE_FILES 8
+#define LARGE_SIZE (8 * 1024 * 1024)
+
+enum workload { VALIDATE, LIST, STAT, EXTRACT_ONE, EXTRACT_ALL, NWORKLOADS };
+
+static const char *const workload_names[NWORKLOADS] = {
+    "validate", "list", "stat", "extract-one", "extract-all",
+};
+
+struct tool {
+    const char *name;
+    const char *path;             /* executable, NULL for lib_tar itself */
+};
+
+struct usage {
+    double walls[COMPARE_RUNS];   /* milliseconds, of every run */
+    double wall;                  /* seconds */
+    double cpu;                   /* user and system seconds */
+    long max_rss;                 /* KiB, -1 when the command could not be traced */
+    long syscalls;                /* -1 when the command could not be traced */
+};
+
+/**
+ * Writes a ustar archive of `files` files of `size` bytes spread over
+ * directories, each directory preceding its files.
+ */
+static int generate_archive(const char *path, size_t files, size_t size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    uint8_t *data = malloc(TAR_PADDED(size) + 1);
+    if (fd == -1 || !data) {
+        free(data);
+        return -1;
+    }
+    uint32_t seed = 42;
+    for (size_t i = 0; i < TAR_PADDED(size); i++) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = i < size ? 'a' + (seed >> 16) % 26 : 0;
+    }
+
+    size_t per_dir = files > 100 ? 100 : files;
+    int ret = 0;
+    for (size_t i = 0; i < files && ret == 0; i++) {
+        char name[256];
+        int dir = i % per_dir == 0;
+        for (int k = dir ? 0 : 1; k < 2 && ret == 0; k++) {
+            tar_header_t hdr;
+            memset(&hdr, 0, sizeof(hdr));
+            if (k == 0) {
+                snprintf(name, sizeof(name), "data/dir%04zu/", i / per_dir);
+            } else {
+                snprintf(name, sizeof(name), "data/dir%04zu/file%06zu.txt", i / per_dir, i);
+            }
+            tar_header_set_path(&hdr, name);
+            hdr.typeflag = k == 0 ? DIRTYPE : REGTYPE;
+            snprintf(hdr.mode, sizeof(hdr.mode), "%07o", k == 0 ? 0755 : 0644);
+            snprintf(hdr.uid, sizeof(hdr.uid), "%07o", 1000);
+            snprintf(hdr.gid, sizeof(hdr.gid), "%07o", 1000);
+            snprintf(hdr.size, sizeof(hdr.size), "%011zo", k == 0 ? 0 : size);
+            snprintf(hdr.mtime, sizeof(hdr.mtime), "%011o", 1700000000);
+            memcpy(hdr.magic, TMAGIC, TMAGLEN);
+            memcpy(hdr.version, TVERSION, TVERSLEN);
+            header_update_checksum(&hdr);
+            ret = write_all(fd, &hdr, sizeof(hdr));
+            if (ret == 0 && k == 1) {
+                ret = write_all(fd, data, TAR_PADDED(size));
+            }
+        }
+    }
+    static const uint8_t end[1024];
+    if (ret == 0) {
+        ret = write_all(fd, end, sizeof(end));
+    }
+    free(data);
+    close(fd);
+    return ret;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    return remove(path);
+}
+
+/**
+ * Removes a directory and everything below it.
+ */
+static void remove_tree(const char *path) {
+    nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/**
+ * Runs one workload through lib_tar, as "tar_bench exec" does.
+ */
+static int exec_workload(int argc, char **argv) {
+    if (argc < 2) {
+        return 2;
+    }
+    const char *op = argv[0];
+    int fd = open(argv[1], O_RDONLY);
+    if (fd == -1) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    if (strcmp(op, "validate") == 0) {
+        return check_archive(fd) < 0;
+    }
+    if (strcmp(op, "extract-all") == 0) {
+        return argc < 3 || tar_extract(fd, argv[2], NULL) < 0;
+    }
+
+    tar_index_t index;
+    if (tar_index_build(fd, &index) < 0) {
+        return 1;
+    }
+    int ret = 0;
+    if (strcmp(op, "list") == 0) {
+        /* listed like the other tools do, so that they all pay for the output */
+        for (size_t i = 0; i < index.count; i++) {
+            printf("%s\n", index.entries[i].path);
+        }
+    } else if (strcmp(op, "stat") == 0) {
+        for (int i = 2; i < argc; i++) {
+            const tar_entry_t *entry = tar_index_find(&index, argv[i]);
+            if (entry) {
+                printf("%s %zu\n", entry->path, (size_t) entry->size);
+            }
+        }
+    } else if (strcmp(op, "extract-one") == 0 && argc == 4) {
+        const tar_entry_t *entry = tar_index_find(&index, argv[3]);
+        char out[4096];
+        snprintf(out, sizeof(out), "%s/%s", argv[2], strrchr(argv[3], '/') ? strrchr(argv[3], '/') + 1 : argv[3]);
+        int out_fd = entry ? open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+        off_t in_off = entry ? (off_t) entry->data_offset : 0;
+        ret = out_fd == -1 || copy_range(fd, &in_off, out_fd, entry->size) != 0;
+        if (out_fd != -1) {
+            close(out_fd);
+        }
+    } else {
+        ret = 2;
+    }
+    tar_index_free(&index);
+    fflush(stdout);
+    return ret;
+}
+
+/**
+ * Sends the output of a child to /dev/null, as only its cost is of interest,
+ * failures being told by the exit status.
+ */
+static void quiet_output(void) {
+    int null = open("/dev/null", O_WRONLY);
+    if (null != -1) {
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        close(null);
+    }
+}
+
+/**
+ * Runs a command to completion, measuring its resource usage.
+ *
+ * @return the exit status of the command, -1 if it could not be run.
+ */
+static int run_command(char *const argv[], struct usage *u) {
+    double start = seconds();
+    pid_t pid = fork();
+    if (pid == -1) {
+        return -1;
+    }
+    if (pid == 0) {
+        quiet_output();
+        execv(argv[0], argv);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) == -1) {
+        return -1;
+    }
+    u->wall = seconds() - start;
+    u->cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/**
+ * Reads the peak resident set of a process, in KiB.
+ */
+static long peak_rss(pid_t pid) {
+    char path[64], line[256];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int) pid);
+    FILE *f = fopen(path, "r");
+    long kib = 0;
+    while (f && fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmHWM: %ld", &kib) == 1) {
+            break;
+        }
+    }
+    if (f) {
+        fclose(f);
+    }
+    return kib;
+}
+
+/**
+ * Traces a command and its children, counting their system calls and reading
+ * their peak resident set as they exit.  Unlike the rusage of a child, this
+ * peak does not include the memory of the benchmark before execve().
+ *
+ * @return zero on success, -1 if the command could not be traced.
+ */
+static int trace_command(char *const argv[], long *syscalls, long *max_rss) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        return -1;
+    }
+    if (pid == 0) {
+        quiet_output();
+        if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) == -1) {
+            _exit(127);
+        }
+        raise(SIGSTOP);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) == -1 || !WIFSTOPPED(status)) {
+        return -1;
+    }
+    ptrace(PTRACE_SETOPTIONS, pid, NULL, PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK |
+                                            PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXIT | PTRACE_O_EXITKILL);
+    ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+    /* every system call stops its process twice, on entry and on exit */
+    long stops = 0;
+    int live = 1;
+    *max_rss = 0;
+    while (live > 0) {
+        pid_t p = waitpid(-1, &status, __WALL);
+        if (p == -1) {
+            return -1;
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            live--;
+            continue;
+        }
+        int sig = WSTOPSIG(status);
+        int event = status >> 16;
+        if (sig == (SIGTRAP | 0x80)) {
+            stops++;
+            sig = 0;
+        } else if (event == PTRACE_EVENT_FORK || event == PTRACE_EVENT_VFORK || event == PTRACE_EVENT_CLONE) {
+            live++;
+            sig = 0;
+        } else if (event == PTRACE_EVENT_EXIT) {
+            long rss = peak_rss(p);
+            *max_rss = rss > *max_rss ? rss : *max_rss;
+            sig = 0;
+        } else if (sig == SIGTRAP || sig == SIGSTOP) {
+            /* the stop after execve() and the first stop of new children */
+            sig = 0;
+        }
+        ptrace(PTRACE_SYSCALL, p, NULL, sig);
+    }
+    *syscalls = (stops + 1) / 2;
+    return 0;
+}
+
+/**
+ * Builds the command line of a workload for a tool.
+ *
+ * @return the number of arguments, zero if the tool has no such workload.
+ */
+static int workload_command(const struct tool *tool, enum workload w, const char *archive, const char *dir,
+                            char **paths, size_t npaths, char **argv) {
+    int n = 0;
+    if (!tool->path) {
+        argv[n++] = "/proc/self/exe";
+        argv[n++] = "exec";
+        argv[n++] = (char *) workload_names[w];
+        argv[n++] = (char *) archive;
+        if (w == EXTRACT_ONE || w == EXTRACT_ALL) {
+            argv[n++] = (char *) dir;
+        }
+    } else {
+        /* the other tools validate by reading every header, as they list */
+        static char *const flags[NWORKLOADS] = { "-tf", "-tvf", "-tvf", "-xf", "-xf" };
+        argv[n++] = (char *) tool->path;
+        argv[n++] = flags[w];
+        argv[n++] = (char *) archive;
+        if (w == EXTRACT_ONE || w == EXTRACT_ALL) {
+            argv[n++] = "-C";
+            argv[n++] = (char *) dir;
+        }
+    }
+    if (w == STAT) {
+        for (size_t i = 0; i < npaths; i++) {
+            argv[n++] = paths[i];
+        }
+    } else if (w == EXTRACT_ONE) {
+        argv[n++] = paths[0];
+    }
+    argv[n] = NULL;
+    return n;
+}
+
+static int cmp_usage_wall(const void *a, const void *b) {
+    return cmp_double(&((const struct usage *) a)->wall, &((const struct usage *) b)->wall);
+}
+
+/**
+ * Measures a workload of a tool, extracting into a fresh directory every run.
+ *
+ * @return zero on success, -1 if the workload failed.
+ */
+static int measure_workload(const struct tool *tool, enum workload w, const char *archive, const char *tmp,
+                            char **paths, size_t npaths, struct usage *result) {
+    char dir[4096];
+    snprintf(dir, sizeof(dir), "%s/out", tmp);
+    char *argv[STAT_PATHS + 8];
+    workload_command(tool, w, archive, dir, paths, npaths, argv);
+
+    struct usage runs[COMPARE_RUNS];
+    for (int r = 0; r < COMPARE_RUNS; r++) {
+        mkdir(dir, 0755);
+        int status = run_command(argv, &runs[r]);
+        remove_tree(dir);
+        if (status != 0) {
+            return -1;
+        }
+    }
+    qsort(runs, COMPARE_RUNS, sizeof(runs[0]), cmp_usage_wall);
+    *result = runs[COMPARE_RUNS / 2];
+    for (int r = 0; r < COMPARE_RUNS; r++) {
+        result->walls[r] = runs[r].wall * 1e3;
+    }
+
+    double cpu[COMPARE_RUNS];
+    for (int r = 0; r < COMPARE_RUNS; r++) {
+        cpu[r] = runs[r].cpu;
+    }
+    qsort(cpu, COMPARE_RUNS, sizeof(double), cmp_double);
+    result->cpu = cpu[COMPARE_RUNS / 2];
+
+    mkdir(dir, 0755);
+    if (trace_command(argv, &result->syscalls, &result->max_rss) != 0) {
+        result->syscalls = -1;
+        result->max_rss = -1;
+    }
+    remove_tree(dir);
+    return 0;
+}
+
+/**
+ * Picks the paths of the stat and extract-one workloads, distinct regular
+ * files spread over the archive, the first being extracted.
+ */
+static size_t pick_paths(const char *archive, char **paths) {
+    int fd = open(archive, O_RDONLY);
+    tar_index_t index;
+    if (fd == -1 || tar_index_build(fd, &index) < 0) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return 0;
+    }
+    close(fd);
+
+    size_t files = 0;
+    for (size_t i = 0; i < index.count; i++) {
+        files += index.entries[i].typeflag == REGTYPE || index.entries[i].typeflag == AREGTYPE;
+    }
+    size_t n = 0;
+    uint32_t seed = 7;
+    for (size_t tries = 0; n < STAT_PATHS && files > 0 && tries < 16 * STAT_PATHS; tries++) {
+        seed = seed * 1103515245 + 12345;
+        const tar_entry_t *entry = &index.entries[(seed >> 8) % index.count];
+        size_t k = 0;
+        while (k < n && strcmp(paths[k], entry->path) != 0) {
+            k++;
+        }
+        if (k == n && (entry->typeflag == REGTYPE || entry->typeflag == AREGTYPE)) {
+            paths[n++] = strdup(entry->path);
+        }
+    }
+    tar_index_free(&index);
+    return n;
+}
+
+static void print_usage_row(const char *workload, const char *tool, const struct usage *u) {
+    char syscalls[32] = "-", rss[32] = "-";
+    if (u->syscalls >= 0) {
+        snprintf(syscalls, sizeof(syscalls), "%ld", u->syscalls);
+        snprintf(rss, sizeof(rss), "%ld", u->max_rss);
+    }
+    printf("%-12s %-8s %10.2f %10.2f %10s %10s\n", workload, tool, u->wall * 1e3, u->cpu * 1e3, syscalls, rss);
+}
+
+static int run_compare(int argc, char **argv) {
+    static const struct tool candidates[] = {
+        { "lib_tar", NULL },
+        { "gnu tar", "/usr/bin/tar" },
+        { "gnu tar", "/bin/tar" },
+        { "bsdtar", "/usr/bin/bsdtar" },
+        { "bsdtar", "/usr/local/bin/bsdtar" },
+    };
+    struct tool tools[3];
+    size_t ntools = 0;
+    for (size_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]); i++) {
+        int known = ntools > 0 && strcmp(tools[ntools - 1].name, candidates[i].name) == 0;
+        if (!known && (!candidates[i].path || access(candidates[i].path, X_OK) == 0)) {
+            tools[ntools++] = candidates[i];
+        }
+    }
+
+    char tmp[] = "/tmp/tar_bench.XXXXXX";
+    if (!mkdtemp(tmp)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    char generated[2][4096];
+    char *archives[argc > 0 ? argc : 2];
+    int narchives = argc;
+    if (argc == 0) {
+        snprintf(generated[0], sizeof(generated[0]), "%s/small.tar", tmp);
+        snprintf(generated[1], sizeof(generated[1]), "%s/large.tar", tmp);
+        if (generate_archive(generated[0], SMALL_FILES, SMALL_SIZE) != 0 ||
+            generate_archive(generated[1], LARGE_FILES, LARGE_SIZE) != 0) {
+            fprintf(stderr, "cannot generate the archives in %s\n", tmp);
+            remove_tree(tmp);
+            return 1;
+        }
+        archives[0] = generated[0];
+        archives[1] = generated[1];
+        narchives = 2;
+    } else {
+        memcpy(archives, argv, argc * sizeof(char *));
+    }
+
+    printf("tools:");
+    for (size_t t = 0; t < ntools; t++) {
+        printf(" %s%s", tools[t].name, t + 1 < ntools ? "," : "");
+    }
+    printf(" (%d runs, medians)\n", COMPARE_RUNS);
+    if (strcmp(tools[ntools - 1].name, "bsdtar") != 0) {
+        printf("bsdtar is not installed, skipped\n");
+    }
+
+    int failed = 0;
+    for (int a = 0; a < narchives; a++) {
+        char *paths[STAT_PATHS];
+        size_t npaths = pick_paths(archives[a], paths);
+        struct stat st;
+        if (npaths == 0 || stat(archives[a], &st) == -1) {
+            fprintf(stderr, "%s: not a tar archive with regular files\n", archives[a]);
+            failed = 1;
+            continue;
+        }
+
+        printf("\n%s (%.1f MiB)\n", archives[a], st.st_size / 1048576.0);
+        printf("%-12s %-8s %10s %10s %10s %10s\n", "workload", "tool", "wall ms", "cpu ms", "syscalls", "rss KiB");
+        for (int w = 0; w < NWORKLOADS; w++) {
+            for (size_t t = 0; t < ntools; t++) {
+                struct usage u = { 0 };
+                const char *name = t == 0 ? workload_names[w] : "";
+                if (measure_workload(&tools[t], w, archives[a], tmp, paths, npaths, &u) != 0) {
+                    printf("%-12s %-8s %10s\n", name, tools[t].name, "failed");
+                    failed = 1;
+                } else {
+                    print_usage_row(name, tools[t].name, &u);
+                    char label[160];
+                    const char *base = strrchr(archives[a], '/');
+                    snprintf(label, sizeof(label), "compare/%s/%s/%s", base ? base + 1 : archives[a],
+                             workload_names[w], tools[t].name);
+                    record(label, "ms", u.walls, COMPARE_RUNS);
+                }
+            }
+        }
+        for (size_t i = 0; i < npaths; i++) {
+            free(paths[i]);
+        }
+    }
+    remove_tree(tmp);
+    return failed;
+}
+
+/* --- Thread scalability -------------------------------------------------- */
+
+/* Length of each run of a configuration */
+#define THREADS_SECONDS 0.3
+
+/* Timed runs of each configuration, after one warmup run */
+#define THREADS_RUNS 5
+
+/* Operations whose latency is recorded, per thread */
+#define MAX_LATENCIES (1 << 20)
+
+/* Bytes read by the read operation, and entries listed at most */
+#define READ_SIZE (64 * 1024)
+#define LIST_ENTRIES 256
+
+/* Efficiency below which a configuration is flagged */
+#define SUBLINEAR 0.8
+
+#define SCALE_FILES 2000
+#define SCALE_SIZE (16 * 1024)
+
+/* Operation mixes, in percent of stat, read and list operations */
+struct mix {
+    const char *name;
+    unsigned stat;
+    unsigned read;
+};
+
+static const struct mix mixes[] = {
+    { "stat", 90, 9 },
+    { "read", 10, 85 },
+    { "list", 10, 10 },
+};
+
+struct scale_shared {
+    const char *archive;
+    tar_archive_t *shared;        /* handle of every thread, NULL when each opens its own */
+    const struct mix *mix;
+    char **files;
+    size_t nfiles;
+    char **dirs;
+    size_t ndirs;
+    pthread_barrier_t start;
+    int stop;
+};
+
+struct scale_thread {
+    struct scale_shared *s;
+    pthread_t tid;
+    unsigned id;
+    size_t ops;
+    double *latencies;            /* seconds, of the first MAX_LATENCIES operations */
+    long vcsw;                    /* voluntary context switches */
+    int failed;
+};
+
+static void *scale_worker(void *arg) {
+    struct scale_thread *t = arg;
+    struct scale_shared *s = t->s;
+    tar_open_opts_t opts = { .flags = TAR_OPEN_SAVE_INDEX };
+    tar_archive_t *ar = s->shared ? s->shared : tar_open(s->archive, &opts);
+    uint8_t *buf = malloc(READ_SIZE);
+    char (*names)[257] = malloc(LIST_ENTRIES * sizeof(*names));
+    char *entries[LIST_ENTRIES];
+    for (size_t i = 0; names && i < LIST_ENTRIES; i++) {
+        entries[i] = names[i];
+    }
+    t->failed = !ar || !buf || !names;
+    pthread_barrier_wait(&s->start);
+
+    struct rusage before, after;
+    getrusage(RUSAGE_THREAD, &before);
+    uint64_t state = 0x9e3779b97f4a7c15ULL * (t->id + 1);
+    while (!t->failed && !__atomic_load_n(&s->stop, __ATOMIC_RELAXED)) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        unsigned pick = state % 100;
+
+        double t0 = seconds();
+        if (pick < s->mix->stat) {
+            const char *path = s->files[(state >> 8) % s->nfiles];
+            t->failed = tar_index_find(tar_archive_index(ar), path) == NULL;
+        } else if (pick < s->mix->stat + s->mix->read) {
+            const char *path = s->files[(state >> 8) % s->nfiles];
+            size_t len = READ_SIZE;
+            t->failed = tar_read(ar, path, 0, buf, &len) < 0;
+        } else {
+            size_t n = LIST_ENTRIES;
+            t->failed = tar_list(ar, s->dirs[(state >> 8) % s->ndirs], entries, &n) == 0;
+        }
+        if (t->ops < MAX_LATENCIES) {
+            t->latencies[t->ops] = seconds() - t0;
+        }
+        t->ops++;
+    }
+    getrusage(RUSAGE_THREAD, &after);
+    t->vcsw = after.ru_nvcsw - before.ru_nvcsw;
+
+    if (!s->shared) {
+        tar_close(ar);
+    }
+    free(buf);
+    free(names);
+    return NULL;
+}
+
+static double percentile(const double *sorted, size_t n, double p) {
+    return n ? sorted[(size_t) (p * (n - 1))] : 0;
+}
+
+struct scale_result {
+    double ops_per_sec;
+    double p50, p99, p999;        /* seconds, over the operations of every thread */
+    double worst_p99;             /* seconds, the highest 99th percentile of a thread */
+    double vcsw_per_kop;
+};
+
+/**
+ * Runs one configuration of the sweep.
+ *
+ * @return zero on success, -1 if the threads could not run or an operation failed.
+ */
+static int scale_run(struct scale_shared *s, unsigned nthreads, struct scale_result *r) {
+    struct scale_thread *threads = calloc(nthreads, sizeof(*threads));
+    if (!threads) {
+        return -1;
+    }
+    pthread_barrier_init(&s->start, NULL, nthreads + 1);
+    s->stop = 0;
+
+    int ok = 1;
+    unsigned started = 0;
+    for (; started < nthreads; started++) {
+        struct scale_thread *t = &threads[started];
+        t->s = s;
+        t->id = started;
+        t->latencies = malloc(MAX_LATENCIES * sizeof(double));
+        if (!t->latencies || pthread_create(&t->tid, NULL, scale_worker, t) != 0) {
+            free(t->latencies);
+            ok = 0;
+            break;
+        }
+    }
+    if (!ok) {
+        /* the barrier cannot be passed anymore, the started threads are stuck */
+        fprintf(stderr, "cannot start %u threads\n", nthreads);
+        exit(1);
+    }
+
+    pthread_barrier_wait(&s->start);
+    double start = seconds();
+    struct timespec length = { 0, THREADS_SECONDS * 1e9 };
+    nanosleep(&length, NULL);
+    __atomic_store_n(&s->stop, 1, __ATOMIC_RELAXED);
+
+    size_t ops = 0, recorded = 0;
+    long vcsw = 0;
+    for (unsigned i = 0; i < nthreads; i++) {
+        pthread_join(threads[i].tid, NULL);
+    }
+    double elapsed = seconds() - start;
+    r->worst_p99 = 0;
+    for (unsigned i = 0; i < nthreads; i++) {
+        struct scale_thread *t = &threads[i];
+        size_t n = t->ops < MAX_LATENCIES ? t->ops : MAX_LATENCIES;
+        qsort(t->latencies, n, sizeof(double), cmp_double);
+        double p99 = percentile(t->latencies, n, 0.99);
+        r->worst_p99 = p99 > r->worst_p99 ? p99 : r->worst_p99;
+        ops += t->ops;
+        recorded += n;
+        vcsw += t->vcsw;
+        ok &= !t->failed;
+    }
+
+    double *all = malloc((recorded ? recorded : 1) * sizeof(double));
+    if (all) {
+        size_t pos = 0;
+        for (unsigned i = 0; i < nthreads; i++) {
+            size_t n = threads[i].ops < MAX_LATENCIES ? threads[i].ops : MAX_LATENCIES;
+            memcpy(all + pos, threads[i].latencies, n * sizeof(double));
+            pos += n;
+        }
+        qsort(all, recorded, sizeof(double), cmp_double);
+        r->p50 = percentile(all, recorded, 0.5);
+        r->p99 = percentile(all, recorded, 0.99);
+        r->p999 = percentile(all, recorded, 0.999);
+        free(all);
+    }
+    r->ops_per_sec = ops / elapsed;
+    r->vcsw_per_kop = ops ? 1000.0 * vcsw / ops : 0;
+
+    for (unsigned i = 0; i < nthreads; i++) {
+        free(threads[i].latencies);
+    }
+    free(threads);
+    pthread_barrier_destroy(&s->start);
+    return ok && all ? 0 : -1;
+}
+
+static int cmp_throughput(const void *a, const void *b) {
+    const struct scale_result *x = a, *y = b;
+    return x->ops_per_sec < y->ops_per_sec ? -1 : x->ops_per_sec > y->ops_per_sec;
+}
+
+/**
+ * Runs one configuration of the sweep after a warmup run, and keeps the run
+ * of median throughput.
+ *
+ * @param spread Set to the range of the throughput over the runs, relative to the median.
+ *
+ * @return zero on success, -1 if some run failed.
+ */
+static int scale_measure(struct scale_shared *s, unsigned nthreads, struct scale_result *r, double *spread) {
+    struct scale_result runs[THREADS_RUNS];
+    if (scale_run(s, nthreads, &runs[0]) != 0) {
+        return -1;
+    }
+    for (int k = 0; k < THREADS_RUNS; k++) {
+        if (scale_run(s, nthreads, &runs[k]) != 0) {
+            return -1;
+        }
+    }
+    qsort(runs, THREADS_RUNS, sizeof(runs[0]), cmp_throughput);
+    *r = runs[THREADS_RUNS / 2];
+    *spread = r->ops_per_sec > 0 ? (runs[THREADS_RUNS - 1].ops_per_sec - runs[0].ops_per_sec) / r->ops_per_sec : 0;
+    return 0;
+}
+
+static int run_threads(int argc, char **argv) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpus = cpus > 0 ? cpus : 1;
+    unsigned max_threads = 2 * cpus < 4 ? 4 : 2 * cpus;
+    if (argc >= 2 && strcmp(argv[0], "-t") == 0) {
+        max_threads = atoi(argv[1]);
+        argc -= 2;
+        argv += 2;
+    }
+    if (max_threads == 0 || argc > 1) {
+        fprintf(stderr, "Usage: tar_bench threads [-t max_threads] [archive.tar]\n");
+        return 2;
+    }
+
+    char tmp[] = "/tmp/tar_bench.XXXXXX";
+    if (!mkdtemp(tmp)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    char generated[4096];
+    snprintf(generated, sizeof(generated), "%s/scale.tar", tmp);
+    struct scale_shared s = { .archive = argc ? argv[0] : generated };
+    if (!argc && generate_archive(generated, SCALE_FILES, SCALE_SIZE) != 0) {
+        fprintf(stderr, "cannot generate the archive in %s\n", tmp);
+        remove_tree(tmp);
+        return 1;
+    }
+
+    /* the index is saved, so that the threads opening the archive load it */
+    tar_open_opts_t opts = { .flags = TAR_OPEN_SAVE_INDEX };
+    tar_archive_t *ar = tar_open(s.archive, &opts);
+    if (!ar) {
+        fprintf(stderr, "%s: cannot open archive\n", s.archive);
+        remove_tree(tmp);
+        return 1;
+    }
+    const tar_index_t *index = tar_archive_index(ar);
+    s.files = malloc(index->count * sizeof(char *));
+    s.dirs = malloc(index->count * sizeof(char *));
+    for (size_t i = 0; s.files && s.dirs && i < index->count; i++) {
+        const tar_entry_t *entry = &index->entries[i];
+        if (entry->typeflag == REGTYPE || entry->typeflag == AREGTYPE) {
+            s.files[s.nfiles++] = (char *) entry->path;
+        } else if (entry->typeflag == DIRTYPE) {
+            s.dirs[s.ndirs++] = (char *) entry->path;
+        }
+    }
+    if (s.nfiles == 0 || s.ndirs == 0) {
+        fprintf(stderr, "%s: the archive needs regular files and directories\n", s.archive);
+        tar_close(ar);
+        remove_tree(tmp);
+        return 1;
+    }
+
+    printf("%s: %zu files, %zu directories, %ld processors online, 1 + %d runs of %.1f s per configuration\n",
+           s.archive, s.nfiles, s.ndirs, cpus, THREADS_RUNS, THREADS_SECONDS);
+    printf("%-5s %-7s %7s %11s %7s %7s %9s %9s %9s %10s %9s\n", "mix", "handle", "threads", "ops/s", "spread",
+           "eff", "p50 us", "p99 us", "p99.9 us", "worst p99", "vcsw/kop");
+
+    int failed = 0;
+    for (size_t m = 0; m < sizeof(mixes) / sizeof(mixes[0]); m++) {
+        s.mix = &mixes[m];
+        for (int per_thread = 0; per_thread < 2; per_thread++) {
+            s.shared = per_thread ? NULL : ar;
+            double single = 0;
+            for (unsigned n = 1; n <= max_threads; n++) {
+                struct scale_result r = { 0 };
+                double spread;
+                if (scale_measure(&s, n, &r, &spread) != 0) {
+                    printf("%-5s %-7s %7u %11s\n", s.mix->name, per_thread ? "own" : "shared", n, "failed");
+                    failed = 1;
+                    break;
+                }
+                if (n == 1) {
+                    single = r.ops_per_sec;
+                }
+                /* threads beyond the processors cannot add throughput, their efficiency is no verdict */
+                char eff[16] = "-";
+                const char *verdict = "";
+                if (n <= (unsigned) cpus && single > 0) {
+                    double e = r.ops_per_sec / single / n;
+                    snprintf(eff, sizeof(eff), "%.2f", e);
+                    verdict = e < SUBLINEAR ? "  sublinear" : "";
+                }
+                printf("%-5s %-7s %7u %11.0f %6.0f%% %7s %9.2f %9.2f %9.2f %10.2f %9.2f%s\n",
+                       n == 1 ? s.mix->name : "", n == 1 ? (per_thread ? "own" : "shared") : "", n,
+                       r.ops_per_sec, spread * 100, eff, r.p50 * 1e6, r.p99 * 1e6, r.p999 * 1e6,
+                       r.worst_p99 * 1e6, r.vcsw_per_kop, verdict);
+            }
+        }
+    }
+
+    free(s.files);
+    free(s.dirs);
+    tar_close(ar);
+    remove_tree(tmp);
+    return failed;
+}
+
+/* --- Baselines ------------------------------------------------------------ */
+
+/* Exit status of a comparison finding a regression */
+#define EXIT_REGRESSION 3
+
+#define DEFAULT_THRESHOLD 5.0
+
+/**
+ * Runs a shell command and keeps the first line of its output.
+ */
+static void command_line(const char *cmd, char *out, size_t len) {
+    out[0] = '\0';
+    FILE *f = popen(cmd, "r");
+    if (!f) {
+        return;
+    }
+    if (fgets(out, len, f)) {
+        out[strcspn(out, "\n")] = '\0';
+    }
+    pclose(f);
+}
+
+#ifndef SOURCE_DIR
+#define SOURCE_DIR "."
+#endif
+
+/**
+ * Describes the revision of the sources the benchmark was built from,
+ * "-dirty" marking local changes.
+ */
+static void git_revision(char *out, size_t len) {
+    char dirty[8];
+    command_line("git -C '" SOURCE_DIR "' rev-parse --short HEAD 2>/dev/null", out, len);
+    command_line("git -C '" SOURCE_DIR "' status --porcelain --untracked-files=no 2>/dev/null", dirty, sizeof(dirty));
+    if (out[0] == '\0') {
+        snprintf(out, len, "unknown");
+    } else if (dirty[0] != '\0' && strlen(out) + 7 < len) {
+        strcat(out, "-dirty");
+    }
+}
+
+static void cpu_model(char *out, size_t len) {
+    snprintf(out, len, "unknown");
+    FILE *f = fopen("/proc/cpuinfo", "r");
+    char line[512];
+    while (f && fgets(line, sizeof(line), f)) {
+        char *colon = strchr(line, ':');
+        if (strncmp(line, "model name", 10) == 0 && colon) {
+            snprintf(out, len, "%s", colon + 2);
+            out[strcspn(out, "\n")] = '\0';
+            break;
+        }
+    }
+    if (f) {
+        fclose(f);
+    }
+}
+
+static void json_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(f, "\\%c", *s);
+        } else if ((unsigned char) *s < 0x20) {
+            fprintf(f, "\\u%04x", *s);
+        } else {
+            fputc(*s, f);
+        }
+    }
+    fputc('"', f);
+}
+
+/**
+ * Saves the recorded benchmarks as a baseline.
+ *
+ * @return zero on success, -1 if the file could not be written.
+ */
+static int save_baseline(const char *path, const char *suite) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    struct utsname un;
+    char system[256] = "unknown", cpu[256], revision[64], date[32];
+    if (uname(&un) == 0) {
+        snprintf(system, sizeof(system), "%s %s %s", un.sysname, un.release, un.machine);
+    }
+    cpu_model(cpu, sizeof(cpu));
+    git_revision(revision, sizeof(revision));
+    time_t now = time(NULL);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+    fprintf(f, "{\n  \"suite\": ");
+    json_string(f, suite);
+    fprintf(f, ",\n  \"revision\": ");
+    json_string(f, revision);
+    fprintf(f, ",\n  \"date\": ");
+    json_string(f, date);
+    fprintf(f, ",\n  \"machine\": {\"system\": ");
+    json_string(f, system);
+    fprintf(f, ", \"cpu\": ");
+    json_string(f, cpu);
+    fprintf(f, ", \"cpus\": %ld, \"compiler\": ", sysconf(_SC_NPROCESSORS_ONLN));
+    json_string(f, __VERSION__);
+    fprintf(f, "},\n  \"benchmarks\": [");
+    for (size_t i = 0; i < nrecords; i++) {
+        fprintf(f, "%s\n    {\"name\": ", i ? "," : "");
+        json_string(f, records[i].name);
+        fprintf(f, ", \"unit\": ");
+        json_string(f, records[i].unit);
+        fprintf(f, ", \"samples\": [");
+        for (size_t k = 0; k < records[i].count; k++) {
+            fprintf(f, "%s%.6g", k ? ", " : "", records[i].samples[k]);
+        }
+        fprintf(f, "]}");
+    }
+    fprintf(f, "\n  ]\n}\n");
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+/*
+ * A reader of the JSON written by save_baseline(), skipping whatever it does
+ * not need, so that fields may be added to baselines later on.
+ */
+struct json {
+    const char *p;
+};
+
+static void json_space(struct json *j) {
+    while (*j->p == ' ' || *j->p == '\n' || *j->p == '\t' || *j->p == '\r') {
+        j->p++;
+    }
+}
+
+static int json_expect(struct json *j, char c) {
+    json_space(j);
+    if (*j->p != c) {
+        return -1;
+    }
+    j->p++;
+    return 0;
+}
+
+static int json_read_string(struct json *j, char *out, size_t len) {
+    if (json_expect(j, '"') != 0) {
+        return -1;
+    }
+    size_t n = 0;
+    for (; *j->p && *j->p != '"'; j->p++) {
+        char c = *j->p;
+        if (c == '\\' && j->p[1]) {
+            c = *++j->p;
+            if (c == 'u') {
+                /* only written for control characters, which names never hold */
+                c = '?';
+                for (int k = 0; k < 4 && j->p[1]; k++) {
+                    j->p++;
+                }
+            } else if (c == 'n' || c == 't') {
+                c = c == 'n' ? '\n' : '\t';
+            }
+        }
+        if (n + 1 < len) {
+            out[n++] = c;
+        }
+    }
+    out[n] = '\0';
+    return json_expect(j, '"');
+}
+
+static int json_skip(struct json *j) {
+    json_space(j);
+    if (*j->p == '"') {
+        char tmp[1];
+        return json_read_string(j, tmp, 0);
+    }
+    if (*j->p == '{' || *j->p == '[') {
+        char close = *j->p == '{' ? '}' : ']';
+        j->p++;
+        json_space(j);
+        if (*j->p == close) {
+            j->p++;
+            return 0;
+        }
+        for (;;) {
+            if (close == '}') {
+                char key[1];
+                if (json_read_string(j, key, 0) != 0 || json_expect(j, ':') != 0) {
+                    return -1;
+                }
+            }
+            if (json_skip(j) != 0) {
+                return -1;
+            }
+            json_space(j);
+            if (*j->p == close) {
+                j->p++;
+                return 0;
+            }
+            if (json_expect(j, ',') != 0) {
+                return -1;
+            }
+        }
+    }
+    /* numbers, true, false and null */
+    const char *start = j->p;
+    while (*j->p && !strchr(",]} \n\t\r", *j->p)) {
+        j->p++;
+    }
+    return j->p > start ? 0 : -1;
+}
+
+/**
+ * Parses one benchmark of a baseline.
+ */
+static int json_benchmark(struct json *j, struct record *r) {
+    memset(r, 0, sizeof(*r));
+    size_t cap = 0;
+    if (json_expect(j, '{') != 0) {
+        return -1;
+    }
+    for (;;) {
+        char key[32];
+        if (json_read_string(j, key, sizeof(key)) != 0 || json_expect(j, ':') != 0) {
+            return -1;
+        }
+        if (strcmp(key, "name") == 0) {
+            if (json_read_string(j, r->name, sizeof(r->name)) != 0) {
+                return -1;
+            }
+        } else if (strcmp(key, "samples") == 0) {
+            if (json_expect(j, '[') != 0) {
+                return -1;
+            }
+            json_space(j);
+            while (*j->p != ']') {
+                char *end;
+                double v = strtod(j->p, &end);
+                if (end == j->p) {
+                    return -1;
+                }
+                j->p = end;
+                if (r->count == cap) {
+                    cap = cap ? cap * 2 : 16;
+                    double *grown = realloc(r->samples, cap * sizeof(double));
+                    if (!grown) {
+                        return -1;
+                    }
+                    r->samples = grown;
+                }
+                r->samples[r->count++] = v;
+                json_space(j);
+                if (*j->p == ',') {
+                    j->p++;
+                    json_space(j);
+                }
+            }
+            j->p++;
+        } else if (json_skip(j) != 0) {
+            return -1;
+        }
+        json_space(j);
+        if (*j->p == '}') {
+            j->p++;
+            return 0;
+        }
+        if (json_expect(j, ',') != 0) {
+            return -1;
+        }
+    }
+}
+
+/**
+ * Loads the benchmarks of a baseline, the description of its origin and the
+ * processor it ran on.
+ *
+ * @return the number of benchmarks, -1 if the baseline could not be read.
+ */
+static ssize_t load_baseline(const char *path, struct record **out, char *origin, size_t origin_len,
+                             char *cpu, size_t cpu_len) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    rewind(f);
+    char *text = size >= 0 ? malloc(size + 1) : NULL;
+    if (!text || fread(text, 1, size, f) != (size_t) size) {
+        free(text);
+        fclose(f);
+        return -1;
+    }
+    text[size] = '\0';
+    fclose(f);
+
+    struct json j = { text };
+    struct record *list = NULL;
+    size_t count = 0, cap = 0;
+    char revision[64] = "", date[32] = "";
+    int ok = json_expect(&j, '{') == 0;
+    while (ok) {
+        char key[32];
+        ok = json_read_string(&j, key, sizeof(key)) == 0 && json_expect(&j, ':') == 0;
+        if (!ok) {
+            break;
+        }
+        if (strcmp(key, "revision") == 0) {
+            ok = json_read_string(&j, revision, sizeof(revision)) == 0;
+        } else if (strcmp(key, "date") == 0) {
+            ok = json_read_string(&j, date, sizeof(date)) == 0;
+        } else if (strcmp(key, "machine") == 0) {
+            ok = json_expect(&j, '{') == 0;
+            while (ok) {
+                char field[32];
+                ok = json_read_string(&j, field, sizeof(field)) == 0 && json_expect(&j, ':') == 0;
+                if (ok && strcmp(field, "cpu") == 0) {
+                    ok = json_read_string(&j, cpu, cpu_len) == 0;
+                } else if (ok) {
+                    ok = json_skip(&j) == 0;
+                }
+                json_space(&j);
+                if (*j.p == '}') {
+                    j.p++;
+                    break;
+                }
+                ok = ok && json_expect(&j, ',') == 0;
+            }
+        } else if (strcmp(key, "benchmarks") == 0) {
+            ok = json_expect(&j, '[') == 0;
+            json_space(&j);
+            while (ok && *j.p != ']') {
+                if (count == cap) {
+                    cap = cap ? cap * 2 : 64;
+                    struct record *grown = realloc(list, cap * sizeof(*grown));
+                    if (!grown) {
+                        ok = 0;
+                        break;
+                    }
+                    list = grown;
+                }
+                ok = json_benchmark(&j, &list[count]) == 0;
+                if (!ok) {
+                    /* the samples read before the error */
+                    free(list[count].samples);
+                    break;
+                }
+                count++;
+                json_space(&j);
+                if (*j.p == ',') {
+                    j.p++;
+                    json_space(&j);
+                }
+            }
+            j.p += ok;
+        } else {
+            ok = json_skip(&j) == 0;
+        }
+        if (!ok) {
+            break;
+        }
+        json_space(&j);
+        if (*j.p == '}') {
+            break;
+        }
+        ok = ok && json_expect(&j, ',') == 0;
+    }
+    free(text);
+
+    if (!ok) {
+        fprintf(stderr, "%s: not a tar_bench baseline\n", path);
+        for (size_t i = 0; i < count; i++) {
+            free(list[i].samples);
+        }
+        free(list);
+        return -1;
+    }
+    snprintf(origin, origin_len, "revision %s, %s", revision, date);
+    *out = list;
+    return count;
+}
+
+/**
+ * Two-sided 95% critical value of Student's t distribution.
+ */
+static double t_critical(double df) {
+    static const double table[] = {
+        12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+        2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+    };
+    if (df < 1) {
+        return INFINITY;
+    }
+    return df <= 30 ? table[(int) df - 1] : 1.96;
+}
+
+static void mean_var(const struct record *r, double *mean, double *var) {
+    double sum = 0, sq = 0;
+    for (size_t i = 0; i < r->count; i++) {
+        sum += r->samples[i];
+    }
+    *mean = sum / r->count;
+    for (size_t i = 0; i < r->count; i++) {
+        sq += (r->samples[i] - *mean) * (r->samples[i] - *mean);
+    }
+    *var = r->count > 1 ? sq / (r->count - 1) : 0;
+}
+
+/**
+ * Compares the recorded benchmarks with a baseline.
+ *
+ * @return zero if no benchmark is significantly slower than the threshold allows,
+ *         EXIT_REGRESSION if some is, 1 if the baseline could not be read.
+ */
+static int compare_baseline(const char *path, double threshold) {
+    struct record *base;
+    char origin[128], cpu[256] = "", current[256];
+    ssize_t nbase = load_baseline(path, &base, origin, sizeof(origin), cpu, sizeof(cpu));
+    if (nbase < 0) {
+        return 1;
+    }
+    cpu_model(current, sizeof(current));
+    if (strcmp(cpu, current) != 0) {
+        fprintf(stderr, "warning: the baseline ran on another processor (%s)\n", cpu);
+    }
+
+    printf("\nbaseline %s (%s), slowdown threshold %.1f%%\n", path, origin, threshold);
+    printf("%-46s %11s %11s %8s %19s\n", "benchmark", "baseline", "current", "change", "95% interval");
+    size_t regressions = 0, compared = 0;
+    for (size_t i = 0; i < nrecords; i++) {
+        const struct record *cur = &records[i];
+        const struct record *old = NULL;
+        for (ssize_t k = 0; k < nbase && !old; k++) {
+            old = strcmp(base[k].name, cur->name) == 0 && base[k].count > 0 ? &base[k] : NULL;
+        }
+        if (!old) {
+            printf("%-46s %11s\n", cur->name, "new");
+            continue;
+        }
+
+        double m1, v1, m2, v2;
+        mean_var(old, &m1, &v1);
+        mean_var(cur, &m2, &v2);
+        double a = v1 / old->count, b = v2 / cur->count;
+        double se = sqrt(a + b);
+        double df = a + b > 0 ? (a + b) * (a + b) /
+                                    ((old->count > 1 ? a * a / (old->count - 1) : 0) +
+                                     (cur->count > 1 ? b * b / (cur->count - 1) : 0))
+                              : 0;
+        double half = se > 0 ? t_critical(df) * se : 0;
+        double change = 100 * (m2 - m1) / m1;
+        double lo = 100 * (m2 - m1 - half) / m1, hi = 100 * (m2 - m1 + half) / m1;
+        int significant = isfinite(half) && (lo > 0 || hi < 0);
+        int regression = significant && lo > 0 && change > threshold;
+
+        char interval[32] = "n/a";
+        if (isfinite(half)) {
+            snprintf(interval, sizeof(interval), "[%+.1f%%, %+.1f%%]", lo, hi);
+        }
+        printf("%-46s %11.3f %11.3f %+7.1f%% %19s%s\n", cur->name, m1, m2, change, interval,
+               regression ? "  REGRESSION" : significant ? (change < 0 ? "  faster" : "  slower") : "");
+        regressions += regression;
+        compared++;
+    }
+    printf("%zu benchmarks compared, %zu regressions\n", compared, regressions);
+
+    for (ssize_t k = 0; k < nbase; k++) {
+        free(base[k].samples);
+    }
+    free(base);
+    return regressions ? EXIT_REGRESSION : 0;
+}
+
+static int run_suite(int argc, char **argv) {
+    if (argc >= 1 && strcmp(argv[0], "kernels") == 0) {
+        return run_kernels(argc - 1, argv + 1);
+    }
+    if (argc >= 1 && strcmp(argv[0], "compare") == 0) {
+        return run_compare(argc - 1, argv + 1);
+    }
+    if (argc >= 1 && strcmp(argv[0], "threads") == 0) {
+        return run_threads(argc - 1, argv + 1);
+    }
+    return -1;
+}
+
+int main(int argc, char **argv) {
+    if (argc >= 2 && strcmp(argv[1], "exec") == 0) {
+        return exec_workload(argc - 2, argv + 2);
+    }
+
+    const char *save = NULL, *baseline = NULL;
+    double threshold = DEFAULT_THRESHOLD;
+    int i = 1;
+    for (; i + 1 < argc && strncmp(argv[i], "--", 2) == 0; i += 2) {
+        if (strcmp(argv[i], "--save") == 0) {
+            save = argv[i + 1];
+        } else if (strcmp(argv[i], "--baseline") == 0) {
+            baseline = argv[i + 1];
+        } else if (strcmp(argv[i], "--threshold") == 0) {
+            threshold = atof(argv[i + 1]);
+        } else {
+            break;
+        }
+    }
+
+    int ret = run_suite(argc - i, argv + i);
+    if (ret < 0) {
+        fprintf(stderr, "Usage: %s [options] kernels [archive.tar...]\n", argv[0]);
+        fprintf(stderr, "       %s [options] compare [archive.tar...]\n", argv[0]);
+        fprintf(stderr, "       %s [options] threads [-t max_threads] [archive.tar]\n", argv[0]);
+        fprintf(stderr, "Options: --save file.json, --baseline file.json, --threshold percent\n");
+        return 2;
+    }
+
+    if (ret == 0 && save) {
+        char suite[256] = "";
+        for (int k = i; k < argc; k++) {
+            size_t len = strlen(suite);
+            snprintf(suite + len, sizeof(suite) - len, "%s%s", k > i ? " " : "", argv[k]);
+        }
+        if (save_baseline(save, suite) != 0) {
+            ret = 1;
+        }
+    }
+    if (ret == 0 && baseline) {
+        ret = compare_baseline(baseline, threshold);
+    }
+
+    for (size_t k = 0; k < nrecords; k++) {
+        free(records[k].samples);
+    }
+    free(records);
+    return ret;
+}
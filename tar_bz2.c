@@ -0,0 +1,493 @@
+#include "lib_tar.h"
+#include "tar_internal.h"
+#include <bzlib.h>
+#include <string.h>
+
+/*
+ * Random access into bzip2 data.  A bzip2 stream is a sequence of blocks
+ * compressed independently, each starting with a 48-bit magic number at any
+ * bit offset, and the stream ends with another magic number and the combined
+ * CRC of its blocks.  Blocks are found by scanning for the magic numbers,
+ * then each block is decoded on its own by wrapping it into a stream of one
+ * block, whose combined CRC is the CRC of the block.  Blocks are decoded in
+ * parallel a window at a time, and handed to the sink in order.
+ *
+ * The block table records where each block starts in the compressed data and
+ * in the decompressed data, so that reading any range only decodes the
+ * blocks holding it.  It is saved in a sidecar:
+ *
+ *   "TARBZ202" archive identity (see put_identity()) count  (64-bit little-endian)
+ *   count times: bit_start bit_end out_offset out_len
+ */
+#define BZ_BLOCK_MAGIC 0x314159265359ULL
+#define BZ_EOS_MAGIC 0x177245385090ULL
+#define BZ_MAGIC_MASK ((1ULL << 48) - 1)
+
+/* Compressed bytes read at a time while looking for blocks */
+#define BZ_SCAN_CHUNK (1024 * 1024)
+
+/* Blocks decoded in parallel per worker before the output is handed over */
+#define BZ_WINDOW_PER_THREAD 4
+
+#define BZ_TABLE_MAGIC "TARBZ202"
+#define BZ_TABLE_MAGLEN 8
+
+struct bz_block {
+    uint64_t bit_start;           /* bit offset of the block magic in the compressed data */
+    uint64_t bit_end;             /* bit offset of the next magic number */
+    off_t out_offset;             /* offset of the block data in the decompressed data */
+    size_t out_len;
+};
+
+struct bz_index {
+    struct bz_block *blocks;
+    size_t count;
+    size_t capacity;
+    off_t size;                   /* size of the decompressed data */
+
+    pthread_mutex_t lock;         /* protects the last decoded block */
+    size_t cached;                /* number of the cached block, `count` if none */
+    uint8_t *cache;
+};
+
+/**
+ * Bit writer appending to a buffer large enough for the whole stream.
+ */
+struct bitbuf {
+    uint8_t *data;
+    size_t len;                   /* complete bytes */
+    uint32_t acc;
+    int nacc;                     /* bits pending in `acc` */
+};
+
+static void put_bits(struct bitbuf *b, uint32_t value, int n) {
+    for (int i = n - 1; i >= 0; i--) {
+        b->acc = b->acc << 1 | ((value >> i) & 1);
+        if (++b->nacc == 8) {
+            b->data[b->len++] = b->acc;
+            b->acc = 0;
+            b->nacc = 0;
+        }
+    }
+}
+
+static void flush_bits(struct bitbuf *b) {
+    if (b->nacc > 0) {
+        b->data[b->len++] = b->acc << (8 - b->nacc);
+        b->acc = 0;
+        b->nacc = 0;
+    }
+}
+
+/**
+ * Decodes one block into a newly allocated buffer.
+ *
+ * @return the decompressed data, NULL if the block is not valid.
+ */
+static uint8_t *decode_block(int fd, uint64_t bit_start, uint64_t bit_end, size_t *out_len) {
+    uint64_t nbits = bit_end - bit_start;
+    off_t first = bit_start / 8;
+    size_t span = (bit_end + 7) / 8 - first + 1;
+    int shift = bit_start % 8;
+
+    uint8_t *raw = calloc(span, 1);
+    uint8_t *stream = malloc(nbits / 8 + 32);
+    if (!raw || !stream || pread(fd, raw, span, first) < (ssize_t) span - 1) {
+        free(raw);
+        free(stream);
+        return NULL;
+    }
+
+    /* "BZh9", the block realigned on a byte boundary, then the end of the stream */
+    struct bitbuf b = { stream, 4, 0, 0 };
+    memcpy(stream, "BZh9", 4);
+    for (uint64_t i = 0; i < nbits / 8; i++) {
+        stream[b.len++] = shift ? (raw[i] << shift | raw[i + 1] >> (8 - shift)) : raw[i];
+    }
+    uint32_t tail = shift ? (raw[nbits / 8] << shift | raw[nbits / 8 + 1] >> (8 - shift)) : raw[nbits / 8];
+    put_bits(&b, (tail & 0xff) >> (8 - nbits % 8), nbits % 8);
+
+    /* the combined CRC of a single block stream is the CRC of the block, after its magic */
+    uint32_t crc = 0;
+    for (int i = 0; i < 4; i++) {
+        crc = crc << 8 | stream[4 + 6 + i];
+    }
+    put_bits(&b, BZ_EOS_MAGIC >> 24, 24);
+    put_bits(&b, BZ_EOS_MAGIC & 0xffffff, 24);
+    put_bits(&b, crc, 32);
+    flush_bits(&b);
+    free(raw);
+
+    bz_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (BZ2_bzDecompressInit(&strm, 0, 0) != BZ_OK) {
+        free(stream);
+        return NULL;
+    }
+
+    size_t cap = 1024 * 1024;
+    uint8_t *out = malloc(cap);
+    strm.next_in = (char *) stream;
+    strm.avail_in = b.len;
+    size_t len = 0;
+    int ret = BZ_OK;
+    while (out && ret == BZ_OK) {
+        if (len == cap) {
+            cap *= 2;
+            uint8_t *grown = realloc(out, cap);
+            if (!grown) {
+                free(out);
+                out = NULL;
+                break;
+            }
+            out = grown;
+        }
+        strm.next_out = (char *) out + len;
+        strm.avail_out = cap - len;
+        ret = BZ2_bzDecompress(&strm);
+        len = cap - strm.avail_out;
+    }
+    BZ2_bzDecompressEnd(&strm);
+    free(stream);
+
+    if (ret != BZ_STREAM_END) {
+        free(out);
+        return NULL;
+    }
+    *out_len = len;
+    return out;
+}
+
+static int add_block(bz_index_t *bz, uint64_t bit_start) {
+    if (bz->count == bz->capacity) {
+        size_t capacity = bz->capacity ? bz->capacity * 2 : 64;
+        struct bz_block *blocks = realloc(bz->blocks, capacity * sizeof(*blocks));
+        if (!blocks) {
+            return -1;
+        }
+        bz->blocks = blocks;
+        bz->capacity = capacity;
+    }
+    bz->blocks[bz->count++] = (struct bz_block) { bit_start, 0, 0, 0 };
+    return 0;
+}
+
+/**
+ * Finds every block of the compressed data, its end being the next magic
+ * number of either kind.
+ */
+static int scan_blocks(bz_index_t *bz, int fd, off_t length) {
+    uint8_t *buf = malloc(BZ_SCAN_CHUNK);
+    if (!buf) {
+        return -1;
+    }
+
+    uint64_t window = 0;
+    int open_block = 0;
+    for (off_t off = 0; off < length;) {
+        ssize_t r = pread(fd, buf, length - off < BZ_SCAN_CHUNK ? length - off : BZ_SCAN_CHUNK, off);
+        if (r <= 0) {
+            free(buf);
+            return -1;
+        }
+        for (ssize_t i = 0; i < r; i++) {
+            window = window << 8 | buf[i];
+            uint64_t end = (uint64_t) (off + i + 1) * 8;
+            /* a magic number may end at any of the 8 bits of the byte, earliest first */
+            for (int k = 7; k >= 0; k--) {
+                if (end - k < 48) {
+                    continue;
+                }
+                uint64_t bits = (window >> k) & BZ_MAGIC_MASK;
+                if (bits != BZ_BLOCK_MAGIC && bits != BZ_EOS_MAGIC) {
+                    continue;
+                }
+                uint64_t at = end - k - 48;
+                if (open_block) {
+                    bz->blocks[bz->count - 1].bit_end = at;
+                    open_block = 0;
+                }
+                if (bits == BZ_BLOCK_MAGIC) {
+                    if (add_block(bz, at) != 0) {
+                        free(buf);
+                        return -1;
+                    }
+                    open_block = 1;
+                }
+            }
+        }
+        off += r;
+    }
+    free(buf);
+    /* a block without an end of stream after it is truncated */
+    return open_block ? -1 : 0;
+}
+
+/**
+ * Drops block `i + 1`, whose magic number turned out to be part of the data
+ * of block `i`.
+ */
+static int merge_next(bz_index_t *bz, size_t i) {
+    if (i + 1 >= bz->count) {
+        return -1;
+    }
+    bz->blocks[i].bit_end = bz->blocks[i + 1].bit_end;
+    memmove(&bz->blocks[i + 1], &bz->blocks[i + 2], (bz->count - i - 2) * sizeof(struct bz_block));
+    bz->count--;
+    return 0;
+}
+
+/**
+ * State shared by the workers decoding a window of blocks.
+ */
+struct bz_window {
+    bz_index_t *bz;
+    int fd;
+    size_t first;                 /* first block of the window */
+    size_t count;
+    size_t next;                  /* next block to hand out */
+    uint8_t **out;
+    size_t *out_len;
+    pthread_mutex_t lock;         /* protects next */
+};
+
+static void *window_worker(void *p) {
+    struct bz_window *w = p;
+    for (;;) {
+        pthread_mutex_lock(&w->lock);
+        size_t i = w->next++;
+        pthread_mutex_unlock(&w->lock);
+        if (i >= w->count) {
+            break;
+        }
+        const struct bz_block *block = &w->bz->blocks[w->first + i];
+        w->out[i] = decode_block(w->fd, block->bit_start, block->bit_end, &w->out_len[i]);
+    }
+    return NULL;
+}
+
+/**
+ * Decodes a window of blocks, with `threads` workers.
+ */
+static void decode_window(struct bz_window *w, int threads) {
+    pthread_t tids[threads];
+    int started = 0;
+    for (; started < threads - 1 && (size_t) started + 1 < w->count; started++) {
+        if (pthread_create(&tids[started], NULL, window_worker, w) != 0) {
+            break;
+        }
+    }
+    /* the calling thread works too */
+    window_worker(w);
+    for (int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+}
+
+/**
+ * Decompresses bzip2 data once, in parallel, recording its blocks.
+ *
+ * @param fd A file descriptor of the bzip2 data, which may hold several concatenated streams.
+ * @param length The length of the compressed data.
+ * @param sink A function receiving the decompressed data, in order, may be NULL.
+ * @param arg An opaque pointer passed to `sink`.
+ *
+ * @return the block table, released with bz_index_free(),
+ *         NULL if the data is not valid bzip2 data or the sink failed.
+ */
+bz_index_t *bz_index_build(int fd, off_t length, gz_sink sink, void *arg) {
+    bz_index_t *bz = calloc(1, sizeof(*bz));
+    if (!bz) {
+        return NULL;
+    }
+    pthread_mutex_init(&bz->lock, NULL);
+    if (scan_blocks(bz, fd, length) != 0 || bz->count == 0) {
+        bz_index_free(bz);
+        return NULL;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus > 0 ? (int) cpus : 1;
+    size_t window = (size_t) threads * BZ_WINDOW_PER_THREAD;
+    uint8_t **out = calloc(window, sizeof(uint8_t *));
+    size_t *out_len = calloc(window, sizeof(size_t));
+    int ok = out && out_len;
+
+    off_t offset = 0;
+    for (size_t first = 0; ok && first < bz->count;) {
+        struct bz_window w = { bz, fd, first, bz->count - first < window ? bz->count - first : window, 0,
+                               out, out_len };
+        pthread_mutex_init(&w.lock, NULL);
+        decode_window(&w, threads);
+        pthread_mutex_destroy(&w.lock);
+
+        size_t done = 0;
+        for (size_t i = 0; ok && i < w.count; i++, done++) {
+            struct bz_block *block = &bz->blocks[first + done];
+            while (!out[i] && merge_next(bz, first + done) == 0) {
+                /* a magic number inside compressed data split the block, the rest
+                   of the window moved and is decoded again with the next one */
+                out[i] = decode_block(fd, block->bit_start, block->bit_end, &out_len[i]);
+                w.count = i + 1;
+            }
+            if (!out[i]) {
+                ok = 0;
+                break;
+            }
+            block->out_offset = offset;
+            block->out_len = out_len[i];
+            if (sink && sink(offset, out[i], out_len[i], arg) != 0) {
+                ok = 0;
+            }
+            offset += out_len[i];
+        }
+        for (size_t i = 0; i < window; i++) {
+            free(out[i]);
+            out[i] = NULL;
+        }
+        first += done;
+    }
+    free(out);
+    free(out_len);
+
+    if (!ok) {
+        bz_index_free(bz);
+        return NULL;
+    }
+    bz->size = offset;
+    bz->cached = bz->count;
+    return bz;
+}
+
+void bz_index_free(bz_index_t *bz) {
+    if (!bz) {
+        return;
+    }
+    pthread_mutex_destroy(&bz->lock);
+    free(bz->cache);
+    free(bz->blocks);
+    free(bz);
+}
+
+off_t bz_index_size(const bz_index_t *bz) {
+    return bz->size;
+}
+
+/**
+ * Reads decompressed data, decoding only the blocks holding it.  The last
+ * decoded block is kept, so that reads of consecutive ranges decode each
+ * block once.
+ *
+ * @return the number of bytes read, short at the end of the data, -1 on error.
+ */
+ssize_t bz_index_read(bz_index_t *bz, int fd, uint8_t *dest, size_t len, off_t offset) {
+    /* last block starting at or before the offset */
+    size_t lo = 0, hi = bz->count;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (bz->blocks[mid].out_offset <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    size_t total = 0;
+    for (size_t i = lo; i < bz->count && total < len; i++) {
+        const struct bz_block *block = &bz->blocks[i];
+        if (offset >= block->out_offset + (off_t) block->out_len) {
+            continue;
+        }
+        size_t from = offset - block->out_offset;
+        size_t n = block->out_len - from < len - total ? block->out_len - from : len - total;
+
+        pthread_mutex_lock(&bz->lock);
+        int hit = bz->cached == i;
+        if (hit) {
+            memcpy(dest + total, bz->cache + from, n);
+        }
+        pthread_mutex_unlock(&bz->lock);
+
+        if (!hit) {
+            size_t out_len;
+            uint8_t *out = decode_block(fd, block->bit_start, block->bit_end, &out_len);
+            if (!out || out_len != block->out_len) {
+                free(out);
+                return -1;
+            }
+            memcpy(dest + total, out + from, n);
+
+            pthread_mutex_lock(&bz->lock);
+            free(bz->cache);
+            bz->cache = out;
+            bz->cached = i;
+            pthread_mutex_unlock(&bz->lock);
+        }
+        total += n;
+        offset += n;
+    }
+    return total;
+}
+
+/**
+ * Saves the block table, for the archive of the given identity.
+ *
+ * @return zero on success, -1 if the table could not be written.
+ */
+int bz_index_save(const bz_index_t *bz, int fd, const uint8_t *identity) {
+    size_t len = BZ_TABLE_MAGLEN + IDENTITY_LEN + 8 + bz->count * 4 * 8;
+    uint8_t *buf = malloc(len);
+    if (!buf) {
+        return -1;
+    }
+    memcpy(buf, BZ_TABLE_MAGIC, BZ_TABLE_MAGLEN);
+    uint8_t *p = buf + BZ_TABLE_MAGLEN;
+    memcpy(p, identity, IDENTITY_LEN);
+    put_u64(p + IDENTITY_LEN, bz->count);
+    p += IDENTITY_LEN + 8;
+    for (size_t i = 0; i < bz->count; i++, p += 32) {
+        put_u64(p, bz->blocks[i].bit_start);
+        put_u64(p + 8, bz->blocks[i].bit_end);
+        put_u64(p + 16, bz->blocks[i].out_offset);
+        put_u64(p + 24, bz->blocks[i].out_len);
+    }
+    int ret = write_all(fd, buf, len);
+    free(buf);
+    return ret;
+}
+
+/**
+ * Loads a block table saved with bz_index_save().
+ *
+ * @return the block table, NULL if it could not be read or belongs to another version of the archive.
+ */
+bz_index_t *bz_index_load(int fd, const uint8_t *identity) {
+    uint8_t head[BZ_TABLE_MAGLEN + IDENTITY_LEN + 8];
+    if (read_exact(fd, head, sizeof(head)) != 0 || memcmp(head, BZ_TABLE_MAGIC, BZ_TABLE_MAGLEN) != 0 ||
+        memcmp(head + BZ_TABLE_MAGLEN, identity, IDENTITY_LEN) != 0) {
+        return NULL;
+    }
+
+    /* a block holds at least one compressed bit, the identity starting with the archive size */
+    uint64_t count = get_u64(head + BZ_TABLE_MAGLEN + IDENTITY_LEN);
+    if (count == 0 || count > get_u64(identity) * 8) {
+        return NULL;
+    }
+    bz_index_t *bz = calloc(1, sizeof(*bz));
+    if (!bz) {
+        return NULL;
+    }
+    pthread_mutex_init(&bz->lock, NULL);
+    bz->blocks = malloc(count * sizeof(struct bz_block));
+    bz->count = bz->capacity = bz->cached = count;
+    for (uint64_t i = 0; i < count; i++) {
+        uint8_t rec[32];
+        if (!bz->blocks || read_exact(fd, rec, sizeof(rec)) != 0) {
+            bz_index_free(bz);
+            return NULL;
+        }
+        bz->blocks[i] = (struct bz_block) { get_u64(rec), get_u64(rec + 8), get_u64(rec + 16), get_u64(rec + 24) };
+        bz->size = bz->blocks[i].out_offset + bz->blocks[i].out_len;
+    }
+    return bz;
+}
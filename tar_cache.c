@@ -0,0 +1,154 @@
+#include "lib_tar.h"
+#include "tar_internal.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/*
+ * Decompressed members are cached as "<key>.member" files in a directory
+ * shared between processes.  Files are written under a temporary name and
+ * renamed into place, so readers only ever see complete members.  The
+ * modification time of a file is its last use, refreshed on every hit, and
+ * the least recently used files are removed when the directory exceeds its
+ * byte budget.
+ *
+ * Listing the directory costs a stat() per member, so each handle keeps a
+ * running total of the bytes the directory holds: the directory is scanned on
+ * the first store, and again only once the members stored since push the
+ * total over the budget.  Members stored by other processes are accounted
+ * for at the next scan.
+ */
+#define CACHE_SUFFIX ".member"
+
+struct cache_file {
+    char name[256];
+    off_t size;
+    struct timespec used;
+};
+
+static int cmp_used(const void *a, const void *b) {
+    const struct cache_file *x = a, *y = b;
+    if (x->used.tv_sec != y->used.tv_sec) {
+        return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+    }
+    return x->used.tv_nsec < y->used.tv_nsec ? -1 : x->used.tv_nsec > y->used.tv_nsec;
+}
+
+/**
+ * Removes the least recently used members until the cache fits its budget.
+ *
+ * @return the bytes of members left in the directory, CACHE_USAGE_UNKNOWN if it could not be listed.
+ */
+static size_t cache_evict(const char *dir, size_t budget) {
+    int dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+    DIR *d = dir_fd == -1 ? NULL : fdopendir(dir_fd);
+    if (!d) {
+        if (dir_fd != -1) {
+            close(dir_fd);
+        }
+        return CACHE_USAGE_UNKNOWN;
+    }
+
+    struct cache_file *files = NULL;
+    size_t count = 0, capacity = 0;
+    off_t total = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        size_t len = strlen(de->d_name);
+        struct stat st;
+        if (len <= strlen(CACHE_SUFFIX) || len >= sizeof(files->name) ||
+            strcmp(de->d_name + len - strlen(CACHE_SUFFIX), CACHE_SUFFIX) != 0 ||
+            fstatat(dir_fd, de->d_name, &st, 0) == -1) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            struct cache_file *grown = realloc(files, capacity * sizeof(*files));
+            if (!grown) {
+                break;
+            }
+            files = grown;
+        }
+        strcpy(files[count].name, de->d_name);
+        files[count].size = st.st_size;
+        files[count].used = st.st_mtim;
+        total += st.st_size;
+        count++;
+    }
+
+    if ((size_t) total > budget) {
+        qsort(files, count, sizeof(*files), cmp_used);
+        for (size_t i = 0; i < count && (size_t) total > budget; i++) {
+            if (unlinkat(dir_fd, files[i].name, 0) == 0) {
+                total -= files[i].size;
+            }
+        }
+    }
+
+    free(files);
+    closedir(d);
+    return total;
+}
+
+/**
+ * Opens a cached member and marks it as used.
+ *
+ * @return a read-only file descriptor on the decompressed member, -1 if it is not cached.
+ */
+int cache_open(const char *dir, const char *key) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s" CACHE_SUFFIX, dir, key);
+
+    int fd = open(path, O_RDONLY);
+    if (fd != -1) {
+        futimens(fd, NULL);
+    }
+    return fd;
+}
+
+/**
+ * Adds a member to the cache.  `fill` writes the decompressed member to the
+ * descriptor it is given, the result only becomes visible once complete.
+ *
+ * @param used The running total of the bytes held by the directory, CACHE_USAGE_UNKNOWN before the first store,
+ *             updated atomically so that it may be shared between threads.
+ *
+ * @return zero on success, -1 if the member could not be cached.
+ */
+int cache_store(const char *dir, const char *key, size_t budget, size_t *used,
+                int (*fill)(int fd, void *arg), void *arg) {
+    char path[4096], tmp[4096];
+    snprintf(path, sizeof(path), "%s/%s" CACHE_SUFFIX, dir, key);
+    snprintf(tmp, sizeof(tmp), "%s/.%s.XXXXXX", dir, key);
+
+    int fd = mkstemp(tmp);
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct stat st;
+    int ret = fill(fd, arg);
+    if (ret == 0) {
+        ret = fchmod(fd, 0644);
+    }
+    if (ret == 0) {
+        ret = fstat(fd, &st);
+    }
+    close(fd);
+    if (ret == 0) {
+        ret = rename(tmp, path);
+    }
+    if (ret != 0) {
+        unlink(tmp);
+        return -1;
+    }
+
+    size_t total = __atomic_load_n(used, __ATOMIC_RELAXED);
+    if (total == CACHE_USAGE_UNKNOWN ||
+        __atomic_add_fetch(used, st.st_size, __ATOMIC_RELAXED) > budget) {
+        __atomic_store_n(used, cache_evict(dir, budget), __ATOMIC_RELAXED);
+    }
+    return 0;
+}
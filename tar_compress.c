@@ -0,0 +1,349 @@
+#include "lib_tar.h"
+#include "tar_internal.h"
+#include <pthread.h>
+#include <string.h>
+#include <zlib.h>
+
+/*
+ * Parallel gzip compression.  The archive is cut into chunks, at entry
+ * boundaries unless an entry is larger than a chunk, and every chunk is
+ * compressed as an independent gzip member by a pool of workers.  The
+ * concatenated members are a valid gzip file, and the members are written in
+ * order as they complete, the producer recycling a fixed ring of frames so
+ * that memory use does not depend on the archive size.
+ *
+ * The optional frame table follows the last member, in empty gzip members
+ * that any gzip decoder skips, each carrying up to GZ_FRAMES_PER_MEMBER
+ * frames in an extra field:
+ *
+ *   1f 8b 08 04 00000000 00 ff          gzip header with FEXTRA
+ *   xlen                                 16-bit little-endian
+ *   'T' 'F' len                          extra subfield, 16-bit little-endian length
+ *   count times: compressed_size decompressed_size
+ *   count "TARFRAME"
+ *   03 00                                empty deflate data
+ *   00000000 00000000                    CRC and size of the empty data
+ *
+ * numbers being 64-bit little-endian.  Readers find the table from the end
+ * of the file, where the count and the magic number of the last table member
+ * start 26 bytes before the end.
+ */
+
+/* Size of the chunks when none is given */
+#define DEFAULT_CHUNK_SIZE (4 * 1024 * 1024)
+
+/* Frames in flight per worker, compressing or waiting to be written */
+#define FRAMES_PER_THREAD 2
+
+enum frame_state { FRAME_FREE, FRAME_FILLED, FRAME_DONE, FRAME_FAILED };
+
+struct frame {
+    uint8_t *in;
+    size_t in_len;
+    uint8_t *out;
+    size_t out_len;
+    size_t out_cap;
+    enum frame_state state;
+};
+
+struct compressor {
+    struct frame *frames;         /* ring of frames, frame n using slot n % nframes */
+    size_t nframes;
+    size_t chunk_size;
+    int level;
+
+    int out_fd;
+    int with_table;               /* the frame table is recorded, TAR_COMPRESS_FRAME_TABLE */
+    uint8_t *table;               /* frame table, two numbers per written frame */
+    size_t table_len;
+    size_t table_cap;
+    int failed;                   /* a frame could not be compressed or written */
+
+    pthread_mutex_t lock;         /* protects the frame states and the counters below */
+    pthread_cond_t work;          /* a frame was filled, or the input ended */
+    pthread_cond_t done;          /* a frame was compressed */
+    size_t filled;                /* frames handed to the workers so far */
+    size_t taken;                 /* frames taken by the workers so far */
+    size_t written;               /* frames written so far */
+    int finished;                 /* no frame will be filled anymore */
+};
+
+static int compress_frame(struct frame *f, int level) {
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (deflateInit2(&strm, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+
+    size_t bound = deflateBound(&strm, f->in_len);
+    if (f->out_cap < bound) {
+        uint8_t *out = realloc(f->out, bound);
+        if (!out) {
+            deflateEnd(&strm);
+            return -1;
+        }
+        f->out = out;
+        f->out_cap = bound;
+    }
+
+    strm.next_in = f->in;
+    strm.avail_in = f->in_len;
+    strm.next_out = f->out;
+    strm.avail_out = f->out_cap;
+    int ret = deflate(&strm, Z_FINISH);
+    f->out_len = strm.total_out;
+    deflateEnd(&strm);
+    return ret == Z_STREAM_END ? 0 : -1;
+}
+
+static void *compress_worker(void *arg) {
+    struct compressor *c = arg;
+    pthread_mutex_lock(&c->lock);
+    for (;;) {
+        while (c->taken == c->filled && !c->finished) {
+            pthread_cond_wait(&c->work, &c->lock);
+        }
+        if (c->taken == c->filled) {
+            break;
+        }
+        struct frame *f = &c->frames[c->taken++ % c->nframes];
+        pthread_mutex_unlock(&c->lock);
+
+        int ret = compress_frame(f, c->level);
+
+        pthread_mutex_lock(&c->lock);
+        f->state = ret == 0 ? FRAME_DONE : FRAME_FAILED;
+        pthread_cond_broadcast(&c->done);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+/**
+ * Waits for the oldest frame not written yet and writes it, along with its
+ * entry of the frame table when there is one.
+ */
+static void write_next(struct compressor *c) {
+    struct frame *f = &c->frames[c->written % c->nframes];
+    pthread_mutex_lock(&c->lock);
+    while (f->state == FRAME_FILLED) {
+        pthread_cond_wait(&c->done, &c->lock);
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    if (c->with_table && c->table_len + 16 > c->table_cap) {
+        size_t cap = c->table_cap ? c->table_cap * 2 : 1024;
+        uint8_t *table = realloc(c->table, cap);
+        if (table) {
+            c->table = table;
+            c->table_cap = cap;
+        }
+    }
+    if (f->state == FRAME_FAILED || (c->with_table && c->table_len + 16 > c->table_cap) ||
+        write_all(c->out_fd, f->out, f->out_len) != 0) {
+        c->failed = 1;
+    } else if (c->with_table) {
+        put_u64(c->table + c->table_len, f->out_len);
+        put_u64(c->table + c->table_len + 8, f->in_len);
+        c->table_len += 16;
+    }
+    f->state = FRAME_FREE;
+    f->in_len = 0;
+    c->written++;
+}
+
+/**
+ * Gives the frame to fill next, writing the frame that used its slot before.
+ */
+static struct frame *next_frame(struct compressor *c) {
+    if (c->filled - c->written == c->nframes) {
+        write_next(c);
+    }
+    return &c->frames[c->filled % c->nframes];
+}
+
+/**
+ * Hands a filled frame to the workers.
+ */
+static void submit_frame(struct compressor *c, struct frame *f) {
+    pthread_mutex_lock(&c->lock);
+    f->state = FRAME_FILLED;
+    c->filled++;
+    pthread_cond_signal(&c->work);
+    pthread_mutex_unlock(&c->lock);
+}
+
+/**
+ * Appends input to the current frame, submitting the frames filled on the
+ * way.
+ *
+ * @param data The data to append, NULL to read it from `in_fd`.
+ *
+ * @return zero on success, -1 if the input could not be read.
+ */
+static int append(struct compressor *c, struct frame **f, int in_fd, const void *data, size_t len) {
+    while (len > 0) {
+        if ((*f)->in_len == c->chunk_size) {
+            submit_frame(c, *f);
+            *f = next_frame(c);
+        }
+        size_t room = c->chunk_size - (*f)->in_len;
+        size_t n = len < room ? len : room;
+        if (data) {
+            memcpy((*f)->in + (*f)->in_len, data, n);
+            data = (const uint8_t *) data + n;
+        } else if (read_exact(in_fd, (*f)->in + (*f)->in_len, n) != 0) {
+            return -1;
+        }
+        (*f)->in_len += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Writes the frame table, in empty gzip members.
+ */
+static int write_table(const struct compressor *c) {
+    size_t count = c->table_len / 16;
+    uint8_t *member = malloc(42 + 16 * (count < GZ_FRAMES_PER_MEMBER ? count : GZ_FRAMES_PER_MEMBER));
+    if (!member) {
+        return -1;
+    }
+
+    int ret = 0;
+    for (size_t first = 0; first < count && ret == 0; first += GZ_FRAMES_PER_MEMBER) {
+        size_t n = count - first < GZ_FRAMES_PER_MEMBER ? count - first : GZ_FRAMES_PER_MEMBER;
+        size_t sub = 16 * n + 16;
+        static const uint8_t head[10] = { 0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff };
+        memcpy(member, head, sizeof(head));
+        member[10] = (sub + 4) & 0xff;
+        member[11] = (sub + 4) >> 8;
+        member[12] = 'T';
+        member[13] = 'F';
+        member[14] = sub & 0xff;
+        member[15] = sub >> 8;
+        memcpy(member + 16, c->table + 16 * first, 16 * n);
+        uint8_t *p = member + 16 + 16 * n;
+        put_u64(p, n);
+        memcpy(p + 8, GZ_FRAMES_MAGIC, 8);
+        static const uint8_t tail[10] = { 3, 0 };
+        memcpy(p + 16, tail, sizeof(tail));
+        ret = write_all(c->out_fd, member, 42 + 16 * n);
+    }
+    free(member);
+    return ret;
+}
+
+/**
+ * Compresses an archive into gzip members compressed in parallel.
+ *
+ * @param in_fd A file descriptor pointing to the start of a valid tar archive, it may be a pipe or a socket.
+ * @param out_fd A file descriptor the compressed archive is written to, at its current offset.
+ * @param opts Options of the compression, NULL selects the defaults.
+ *
+ * @return a zero or positive value on success, representing the number of entries written,
+ *         -1 if the input could not be read, ends before its end-of-archive marker, or the output could not be
+ *         written.
+ */
+ssize_t tar_compress(int in_fd, int out_fd, const tar_compress_opts_t *opts) {
+    int threads = opts && opts->threads > 0 ? opts->threads : 0;
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int) cpus : 1;
+    }
+    size_t chunk_size = opts && opts->chunk_size ? TAR_PADDED(opts->chunk_size) : DEFAULT_CHUNK_SIZE;
+    if (chunk_size > UINT32_MAX) {
+        chunk_size = DEFAULT_CHUNK_SIZE;
+    }
+
+    struct compressor c = {
+        .nframes = (size_t) threads * FRAMES_PER_THREAD,
+        .chunk_size = chunk_size,
+        .level = opts && opts->level ? opts->level : Z_DEFAULT_COMPRESSION,
+        .out_fd = out_fd,
+        .with_table = opts && (opts->flags & TAR_COMPRESS_FRAME_TABLE),
+    };
+    c.frames = calloc(c.nframes, sizeof(struct frame));
+    if (!c.frames) {
+        return -1;
+    }
+    for (size_t i = 0; i < c.nframes; i++) {
+        c.frames[i].in = malloc(chunk_size);
+        if (!c.frames[i].in) {
+            c.failed = 1;
+        }
+    }
+    pthread_mutex_init(&c.lock, NULL);
+    pthread_cond_init(&c.work, NULL);
+    pthread_cond_init(&c.done, NULL);
+
+    pthread_t tids[threads];
+    int started = 0;
+    for (; !c.failed && started < threads; started++) {
+        if (pthread_create(&tids[started], NULL, compress_worker, &c) != 0) {
+            break;
+        }
+    }
+
+    ssize_t entries = 0;
+    int ret = started > 0 && !c.failed ? 0 : -1;
+    struct frame *f = ret == 0 ? next_frame(&c) : NULL;
+    tar_header_t hdr;
+    int ended = 0;
+    while (ret == 0 && !c.failed && read_exact(in_fd, &hdr, sizeof(hdr)) == 0) {
+        if (is_empty_block(&hdr)) {
+            ended = 1;
+            break;
+        }
+        size_t padded = TAR_PADDED((size_t) TAR_INT(hdr.size));
+
+        /* start a new frame rather than split an entry that fits in one */
+        if (f->in_len > 0 && f->in_len + sizeof(hdr) + padded > chunk_size) {
+            submit_frame(&c, f);
+            f = next_frame(&c);
+        }
+        if (append(&c, &f, in_fd, &hdr, sizeof(hdr)) != 0 || append(&c, &f, in_fd, NULL, padded) != 0) {
+            ret = -1;
+        }
+        entries++;
+    }
+    /* a truncated input must not come out as a complete archive */
+    if (ret == 0 && !ended) {
+        ret = -1;
+    }
+    if (ret == 0) {
+        static const uint8_t end[1024];
+        ret = append(&c, &f, in_fd, end, sizeof(end));
+        submit_frame(&c, f);
+    }
+
+    pthread_mutex_lock(&c.lock);
+    c.finished = 1;
+    pthread_cond_broadcast(&c.work);
+    pthread_mutex_unlock(&c.lock);
+    while (ret == 0 && c.written < c.filled) {
+        write_next(&c);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    if (ret == 0 && !c.failed && c.with_table) {
+        ret = write_table(&c);
+    }
+    if (c.failed) {
+        ret = -1;
+    }
+
+    pthread_cond_destroy(&c.done);
+    pthread_cond_destroy(&c.work);
+    pthread_mutex_destroy(&c.lock);
+    for (size_t i = 0; i < c.nframes; i++) {
+        free(c.frames[i].in);
+        free(c.frames[i].out);
+    }
+    free(c.frames);
+    free(c.table);
+    return ret == 0 ? entries : -1;
+}
@@ -0,0 +1,356 @@
+#include "lib_tar.h"
+#include "tar_internal.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+/*
+ * CRC32C (Castagnoli) checksums of member data, one for every CRC_CHUNK
+ * bytes of each regular file, computed when the archive is first opened with
+ * TAR_OPEN_VERIFY and saved in the "<archive>.crc" sidecar with
+ * TAR_OPEN_SAVE_INDEX:
+ *
+ *   "TARCRC02" archive identity (see put_identity()) chunk_size count  (64-bit little-endian)
+ *   count times: checksum                                            (32-bit little-endian)
+ *
+ * the checksums of the chunks of the regular files following each other in
+ * entry order.  Reads then verify every chunk they touch, reading whole
+ * chunks even when only part of one is wanted.
+ *
+ * The checksums only catch corruption of an archive whose identity is
+ * unchanged, such as failing media: an archive whose size, modification
+ * time or inode differs from the sidecar's is taken to have been rewritten
+ * on purpose, and its checksums are computed again from its current bytes.
+ *
+ * With SSE4.2, the crc32 instruction checksums three interleaved streams of
+ * CRC_LANE bytes, hiding its latency, and the three checksums are combined
+ * by appending CRC_LANE zero bytes to a checksum with a table lookup per
+ * byte, which needs no carry-less multiplication.  Processors without SSE4.2
+ * use slicing-by-8 tables.
+ */
+#define CRC_MAGIC "TARCRC02"
+#define CRC_MAGLEN 8
+
+/* Bytes of member data covered by each checksum */
+#define CRC_CHUNK (64 * 1024)
+
+/* Bytes of each of the three streams checksummed together */
+#define CRC_LANE 4096
+
+/* CRC32C polynomial, bit-reflected */
+#define CRC_POLY 0x82f63b78
+
+struct crc_table {
+    size_t *first;                /* first checksum of each entry, count + 1 items */
+    uint32_t *crcs;
+    uint8_t *spare;               /* chunk buffer of the handle, NULL while some read holds it */
+};
+
+static uint32_t slice_table[8][256];
+static uint32_t lane_table[4][256];   /* appends CRC_LANE zero bytes to a checksum */
+#if defined(__x86_64__)
+static int have_sse42;
+#endif
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+    for (uint32_t b = 0; b < 256; b++) {
+        uint32_t c = b;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? (c >> 1) ^ CRC_POLY : c >> 1;
+        }
+        slice_table[0][b] = c;
+    }
+    for (int t = 1; t < 8; t++) {
+        for (uint32_t b = 0; b < 256; b++) {
+            uint32_t c = slice_table[t - 1][b];
+            slice_table[t][b] = (c >> 8) ^ slice_table[0][c & 0xff];
+        }
+    }
+
+    /* appending zeros is linear, so the images of the 32 bits give every image */
+    uint32_t basis[32];
+    for (int bit = 0; bit < 32; bit++) {
+        uint32_t c = 1u << bit;
+        for (size_t n = 0; n < CRC_LANE; n++) {
+            c = (c >> 8) ^ slice_table[0][c & 0xff];
+        }
+        basis[bit] = c;
+    }
+    for (int k = 0; k < 4; k++) {
+        for (uint32_t b = 0; b < 256; b++) {
+            uint32_t c = 0;
+            for (int bit = 0; bit < 8; bit++) {
+                if (b & (1u << bit)) {
+                    c ^= basis[8 * k + bit];
+                }
+            }
+            lane_table[k][b] = c;
+        }
+    }
+
+#if defined(__x86_64__)
+    have_sse42 = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static uint32_t load_le32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+/* The checksum functions work on the register, without the initial and final inversions */
+
+static uint32_t crc_slice(uint32_t crc, const uint8_t *p, size_t len) {
+    for (; len >= 8; p += 8, len -= 8) {
+        uint32_t lo = crc ^ load_le32(p), hi = load_le32(p + 4);
+        crc = slice_table[7][lo & 0xff] ^ slice_table[6][(lo >> 8) & 0xff] ^
+              slice_table[5][(lo >> 16) & 0xff] ^ slice_table[4][lo >> 24] ^
+              slice_table[3][hi & 0xff] ^ slice_table[2][(hi >> 8) & 0xff] ^
+              slice_table[1][(hi >> 16) & 0xff] ^ slice_table[0][hi >> 24];
+    }
+    for (; len > 0; p++, len--) {
+        crc = (crc >> 8) ^ slice_table[0][(crc ^ *p) & 0xff];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+static uint32_t shift_lane(uint32_t crc) {
+    return lane_table[0][crc & 0xff] ^ lane_table[1][(crc >> 8) & 0xff] ^
+           lane_table[2][(crc >> 16) & 0xff] ^ lane_table[3][crc >> 24];
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc_sse42(uint32_t crc, const uint8_t *p, size_t len) {
+    for (; len >= 3 * CRC_LANE; p += 3 * CRC_LANE, len -= 3 * CRC_LANE) {
+        uint64_t c0 = crc, c1 = 0, c2 = 0;
+        for (size_t i = 0; i < CRC_LANE; i += 8) {
+            uint64_t w0, w1, w2;
+            memcpy(&w0, p + i, 8);
+            memcpy(&w1, p + CRC_LANE + i, 8);
+            memcpy(&w2, p + 2 * CRC_LANE + i, 8);
+            c0 = _mm_crc32_u64(c0, w0);
+            c1 = _mm_crc32_u64(c1, w1);
+            c2 = _mm_crc32_u64(c2, w2);
+        }
+        crc = shift_lane(shift_lane(c0) ^ c1) ^ c2;
+    }
+    uint64_t c = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        c = _mm_crc32_u64(c, w);
+    }
+    crc = c;
+    for (; len > 0; p++, len--) {
+        crc = _mm_crc32_u8(crc, *p);
+    }
+    return crc;
+}
+#endif
+
+/**
+ * Computes the CRC32C of a buffer, continuing the checksum `crc` of the
+ * preceding data, zero for the first piece.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    pthread_once(&crc_once, crc_init);
+#if defined(__x86_64__)
+    if (have_sse42) {
+        return ~crc_sse42(~crc, buf, len);
+    }
+#endif
+    return ~crc_slice(~crc, buf, len);
+}
+
+static int is_member_file(const tar_entry_t *entry) {
+    return entry->typeflag == REGTYPE || entry->typeflag == AREGTYPE;
+}
+
+void crc_table_free(struct crc_table *t) {
+    if (t) {
+        free(t->first);
+        free(t->crcs);
+        free(t->spare);
+        free(t);
+    }
+}
+
+static int save_crcs(const tar_archive_t *ar, int fd) {
+    size_t count = ar->crcs->first[ar->index.count];
+    uint8_t hdr[CRC_MAGLEN + IDENTITY_LEN + 16];
+    memcpy(hdr, CRC_MAGIC, CRC_MAGLEN);
+    put_identity(hdr + CRC_MAGLEN, &ar->index);
+    put_u64(hdr + CRC_MAGLEN + IDENTITY_LEN, CRC_CHUNK);
+    put_u64(hdr + CRC_MAGLEN + IDENTITY_LEN + 8, count);
+    if (write_all(fd, hdr, sizeof(hdr)) != 0) {
+        return -1;
+    }
+
+    uint8_t buf[4096];
+    for (size_t i = 0; i < count;) {
+        size_t n = 0;
+        for (; n < sizeof(buf) && i < count; n += 4, i++) {
+            uint32_t c = ar->crcs->crcs[i];
+            buf[n] = c;
+            buf[n + 1] = c >> 8;
+            buf[n + 2] = c >> 16;
+            buf[n + 3] = c >> 24;
+        }
+        if (write_all(fd, buf, n) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Loads the checksums of the sidecar, if it is still current.
+ */
+static int load_crcs(tar_archive_t *ar, struct crc_table *t, size_t count) {
+    char path[4096];
+    sidecar_path(path, sizeof(path), ar, "crc");
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+
+    uint8_t hdr[CRC_MAGLEN + IDENTITY_LEN + 16];
+    int ret = -1;
+    if (read_exact(fd, hdr, sizeof(hdr)) == 0 && memcmp(hdr, CRC_MAGIC, CRC_MAGLEN) == 0 &&
+        identity_matches(hdr + CRC_MAGLEN, &ar->index) &&
+        get_u64(hdr + CRC_MAGLEN + IDENTITY_LEN) == CRC_CHUNK &&
+        get_u64(hdr + CRC_MAGLEN + IDENTITY_LEN + 8) == count &&
+        read_exact(fd, t->crcs, count * 4) == 0) {
+        /* stored little-endian, converted in place */
+        for (size_t i = 0; i < count; i++) {
+            t->crcs[i] = load_le32((const uint8_t *) &t->crcs[i]);
+        }
+        ret = 0;
+    }
+    close(fd);
+    return ret;
+}
+
+/**
+ * Checksums every chunk of every regular file of the archive.
+ */
+static int build_crcs(tar_archive_t *ar, struct crc_table *t) {
+    uint8_t *buf = t->spare;
+    int ret = 0;
+    for (size_t i = 0; i < ar->index.count && ret == 0; i++) {
+        const tar_entry_t *entry = &ar->index.entries[i];
+        for (size_t k = t->first[i]; k < t->first[i + 1] && ret == 0; k++) {
+            size_t off = (k - t->first[i]) * CRC_CHUNK;
+            size_t n = entry->size - off < CRC_CHUNK ? entry->size - off : CRC_CHUNK;
+            if (read_entry_stored(ar, entry, buf, n, off) != (ssize_t) n) {
+                ret = -1;
+            }
+            t->crcs[k] = crc32c(0, buf, n);
+        }
+    }
+    return ret;
+}
+
+/**
+ * Sets up the checksums of the member data of an archive, loaded from the
+ * sidecar when it is still current, computed otherwise and then saved if the
+ * handle saves its indexes.
+ *
+ * @return zero on success, -1 if the member data could not be read.
+ */
+int crc_open(tar_archive_t *ar) {
+    struct crc_table *t = calloc(1, sizeof(*t));
+    if (!t || !(t->first = malloc((ar->index.count + 1) * sizeof(size_t)))) {
+        crc_table_free(t);
+        return -1;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < ar->index.count; i++) {
+        const tar_entry_t *entry = &ar->index.entries[i];
+        t->first[i] = count;
+        count += is_member_file(entry) ? (entry->size + CRC_CHUNK - 1) / CRC_CHUNK : 0;
+    }
+    t->first[ar->index.count] = count;
+    t->crcs = malloc(count ? count * sizeof(uint32_t) : 1);
+    t->spare = malloc(CRC_CHUNK);
+    if (!t->crcs || !t->spare) {
+        crc_table_free(t);
+        return -1;
+    }
+
+    int loaded = load_crcs(ar, t, count) == 0;
+    if (!loaded && build_crcs(ar, t) != 0) {
+        crc_table_free(t);
+        return -1;
+    }
+    ar->crcs = t;
+    if (!loaded && ar->save_index) {
+        /* best effort, the archive may live in a read-only directory */
+        sidecar_save(ar, "crc", save_crcs);
+    }
+    return 0;
+}
+
+/**
+ * Reads member data like read_entry_stored(), verifying every chunk the
+ * range touches against its checksum.
+ *
+ * @return the number of bytes read, -1 on error, READ_CORRUPT if some chunk does not match its checksum.
+ */
+ssize_t crc_read(tar_archive_t *ar, const tar_entry_t *entry, uint8_t *dest, size_t len, size_t offset) {
+    if (!is_member_file(entry)) {
+        return read_entry_stored(ar, entry, dest, len, offset);
+    }
+    if (offset >= entry->size) {
+        return 0;
+    }
+    if (len > entry->size - offset) {
+        len = entry->size - offset;
+    }
+
+    struct crc_table *t = ar->crcs;
+    const size_t *first = &t->first[entry - ar->index.entries];
+    uint8_t *tmp = NULL;
+    ssize_t ret = 0;
+    for (size_t done = 0; done < len;) {
+        size_t pos = offset + done;
+        size_t chunk = pos / CRC_CHUNK;
+        size_t start = chunk * CRC_CHUNK;
+        size_t n = entry->size - start < CRC_CHUNK ? entry->size - start : CRC_CHUNK;
+        size_t want = start + n - pos < len - done ? start + n - pos : len - done;
+
+        /* whole chunks are read in place, the chunks at the ends of the range aside */
+        uint8_t *buf = dest + done;
+        if (pos != start || want != n) {
+            /* the buffer of the handle, unless a concurrent read holds it */
+            if (!tmp && !(tmp = __atomic_exchange_n(&t->spare, NULL, __ATOMIC_ACQUIRE)) &&
+                !(tmp = malloc(CRC_CHUNK))) {
+                ret = -1;
+                break;
+            }
+            buf = tmp;
+        }
+        if (read_entry_stored(ar, entry, buf, n, start) != (ssize_t) n) {
+            ret = -1;
+            break;
+        }
+        if (crc32c(0, buf, n) != t->crcs[*first + chunk]) {
+            ret = READ_CORRUPT;
+            break;
+        }
+        if (buf == tmp) {
+            memcpy(dest + done, tmp + (pos - start), want);
+        }
+        done += want;
+        ret = done;
+    }
+    uint8_t *none = NULL;
+    if (tmp && !__atomic_compare_exchange_n(&t->spare, &none, tmp, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        free(tmp);
+    }
+    return ret;
+}
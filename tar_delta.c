@@ -0,0 +1,203 @@
+#include "lib_tar.h"
+#include "tar_internal.h"
+#include <string.h>
+#include <sys/stat.h>
+
+/*
+ * A delta is a sequence of records which, replayed in order, rebuild the new
+ * archive byte for byte:
+ *
+ *   "TARDELTA"                   magic
+ *   'C' <old offset> <length>    copy a byte range of the old archive
+ *   'L' <length> <bytes>         literal bytes carried by the delta
+ *   'E'                          end of the delta
+ *
+ * Numbers are 64-bit little-endian.  Members of the new archive whose header
+ * and data are identical to the member at the same path in the old archive
+ * become copy records, everything else is carried as literals.
+ */
+
+#define DELTA_MAGIC "TARDELTA"
+#define DELTA_MAGLEN 8
+
+#define DELTA_COPY    'C'
+#define DELTA_LITERAL 'L'
+#define DELTA_END     'E'
+
+#define DELTA_CMP_SIZE (64 * 1024)
+
+/**
+ * Compares `len` bytes of two files at the given offsets.
+ *
+ * @return 1 if they are identical, zero otherwise.
+ */
+static int same_bytes(int a_fd, off_t a_off, int b_fd, off_t b_off, size_t len) {
+    uint8_t a[DELTA_CMP_SIZE], b[DELTA_CMP_SIZE];
+    while (len > 0) {
+        size_t chunk = len < DELTA_CMP_SIZE ? len : DELTA_CMP_SIZE;
+        if (pread(a_fd, a, chunk, a_off) != (ssize_t) chunk ||
+            pread(b_fd, b, chunk, b_off) != (ssize_t) chunk ||
+            memcmp(a, b, chunk) != 0) {
+            return 0;
+        }
+        a_off += chunk;
+        b_off += chunk;
+        len -= chunk;
+    }
+    return 1;
+}
+
+/**
+ * Accumulates contiguous copy records so that runs of unchanged members
+ * become a single record.
+ */
+struct pending_copy {
+    off_t off;
+    size_t len;
+};
+
+static int flush_copy(int delta_fd, struct pending_copy *copy) {
+    if (copy->len == 0) {
+        return 0;
+    }
+    uint8_t rec[17];
+    rec[0] = DELTA_COPY;
+    put_u64(rec + 1, copy->off);
+    put_u64(rec + 9, copy->len);
+    copy->len = 0;
+    return write_all(delta_fd, rec, sizeof(rec));
+}
+
+static int emit_literal(int delta_fd, int new_fd, off_t off, size_t len) {
+    uint8_t rec[9];
+    rec[0] = DELTA_LITERAL;
+    put_u64(rec + 1, len);
+    if (write_all(delta_fd, rec, sizeof(rec)) != 0) {
+        return -1;
+    }
+    return copy_range(new_fd, &off, delta_fd, len);
+}
+
+/**
+ * Creates a member-level delta between two versions of an archive.
+ *
+ * @param old_fd A file descriptor pointing to the old version of a valid tar archive file.
+ * @param new_fd A file descriptor pointing to the new version of a valid tar archive file.
+ * @param delta_fd A file descriptor the delta is written to, at its current offset.
+ *
+ * @return a zero or positive value on success, representing the number of members carried in the delta,
+ *         -1 if the archives could not be read or the delta could not be written.
+ */
+ssize_t tar_delta_create(int old_fd, int new_fd, int delta_fd) {
+    tar_index_t old_index, new_index;
+    struct stat st;
+    if (fstat(new_fd, &st) == -1) {
+        return -1;
+    }
+    if (tar_index_build(old_fd, &old_index) < 0) {
+        return -1;
+    }
+    if (tar_index_build(new_fd, &new_index) < 0) {
+        tar_index_free(&old_index);
+        return -1;
+    }
+
+    ssize_t carried = 0;
+    struct pending_copy copy = { 0, 0 };
+    if (write_all(delta_fd, DELTA_MAGIC, DELTA_MAGLEN) != 0) {
+        carried = -1;
+        goto out;
+    }
+
+    for (size_t i = 0; i < new_index.count; i++) {
+        const tar_entry_t *entry = &new_index.entries[i];
+        size_t span = 512 + TAR_PADDED(entry->size);
+        const tar_entry_t *old = tar_index_find(&old_index, entry->path);
+
+        if (old && old->size == entry->size &&
+            same_bytes(old_fd, old->header_offset, new_fd, entry->header_offset, span)) {
+            if (copy.len > 0 && copy.off + (off_t) copy.len == old->header_offset) {
+                copy.len += span;
+                continue;
+            }
+            if (flush_copy(delta_fd, &copy) != 0) {
+                carried = -1;
+                goto out;
+            }
+            copy.off = old->header_offset;
+            copy.len = span;
+            continue;
+        }
+
+        if (flush_copy(delta_fd, &copy) != 0 ||
+            emit_literal(delta_fd, new_fd, entry->header_offset, span) != 0) {
+            carried = -1;
+            goto out;
+        }
+        carried++;
+    }
+
+    /* end-of-archive blocks and any trailing bytes */
+    uint8_t end = DELTA_END;
+    if (flush_copy(delta_fd, &copy) != 0 ||
+        (st.st_size > new_index.end_offset &&
+         emit_literal(delta_fd, new_fd, new_index.end_offset, st.st_size - new_index.end_offset) != 0) ||
+        write_all(delta_fd, &end, 1) != 0) {
+        carried = -1;
+    }
+
+out:
+    tar_index_free(&old_index);
+    tar_index_free(&new_index);
+    return carried;
+}
+
+/**
+ * Rebuilds the new version of an archive from the old version and a delta
+ * created by tar_delta_create().  Unchanged members are copied from the old
+ * archive inside the kernel when possible.  The result is then validated with
+ * check_archive().
+ *
+ * @param old_fd A file descriptor pointing to the old version of the archive.
+ * @param delta_fd A file descriptor pointing to the start of the delta.
+ * @param out_fd A file descriptor opened for reading and writing the new archive is written to.
+ *
+ * @return a zero or positive value on success, representing the number of non-null headers of the new archive,
+ *         -1 if the delta is malformed or an I/O error occurred,
+ *         -2 if the rebuilt archive does not pass check_archive().
+ */
+ssize_t tar_delta_apply(int old_fd, int delta_fd, int out_fd) {
+    char magic[DELTA_MAGLEN];
+    if (read_exact(delta_fd, magic, DELTA_MAGLEN) != 0 || memcmp(magic, DELTA_MAGIC, DELTA_MAGLEN) != 0) {
+        return -1;
+    }
+
+    for (;;) {
+        uint8_t rec[17];
+        if (read_exact(delta_fd, rec, 1) != 0) {
+            return -1;
+        }
+
+        if (rec[0] == DELTA_END) {
+            break;
+        } else if (rec[0] == DELTA_COPY) {
+            if (read_exact(delta_fd, rec + 1, 16) != 0) {
+                return -1;
+            }
+            off_t off = get_u64(rec + 1);
+            if (copy_range(old_fd, &off, out_fd, get_u64(rec + 9)) != 0) {
+                return -1;
+            }
+        } else if (rec[0] == DELTA_LITERAL) {
+            if (read_exact(delta_fd, rec + 1, 8) != 0 ||
+                copy_range(delta_fd, NULL, out_fd, get_u64(rec + 1)) != 0) {
+                return -1;
+            }
+        } else {
+            return -1;
+        }
+    }
+
+    int ret = check_archive(out_fd);
+    return ret < 0 ? -2 : ret;
+}
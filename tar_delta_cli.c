@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include "lib_tar.h"
+
+/**
+ * Command line front-end of tar_delta_create() and tar_delta_apply().
+ *
+ * Usage: tar_delta create old.tar new.tar delta
+ *        tar_delta apply old.tar delta new.tar
+ */
+int main(int argc, char **argv) {
+    if (argc != 5 || (strcmp(argv[1], "create") != 0 && strcmp(argv[1], "apply") != 0)) {
+        fprintf(stderr, "Usage: %s create old.tar new.tar delta\n", argv[0]);
+        fprintf(stderr, "       %s apply old.tar delta new.tar\n", argv[0]);
+        return 2;
+    }
+
+    int create = strcmp(argv[1], "create") == 0;
+    int old_fd = open(argv[2], O_RDONLY);
+    int in_fd = open(argv[3], O_RDONLY);
+    int out_fd = open(argv[4], O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (old_fd == -1 || in_fd == -1 || out_fd == -1) {
+        perror("open");
+        return 1;
+    }
+
+    if (create) {
+        ssize_t carried = tar_delta_create(old_fd, in_fd, out_fd);
+        if (carried < 0) {
+            fprintf(stderr, "%s: cannot create delta from %s\n", argv[4], argv[2]);
+            return 1;
+        }
+        printf("%zd members carried in the delta\n", carried);
+    } else {
+        ssize_t ret = tar_delta_apply(old_fd, in_fd, out_fd);
+        if (ret == -2) {
+            fprintf(stderr, "%s: rebuilt archive is not valid\n", argv[4]);
+            return 1;
+        }
+        if (ret < 0) {
+            fprintf(stderr, "%s: cannot apply delta\n", argv[3]);
+            return 1;
+        }
+        printf("rebuilt %zd entries\n", ret);
+    }
+
+    close(old_fd);
+    close(in_fd);
+    close(out_fd);
+    return 0;
+}
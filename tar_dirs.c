@@ -0,0 +1,347 @@
+#include "lib_tar.h"
+#include "tar_internal.h"
+#include <string.h>
+
+/*
+ * Directory statistics are accumulated in one pass over the entries: each
+ * entry is added to its parent directory and to every ancestor of it, found
+ * by following parent links from a single path lookup.  Directories with no
+ * entry of their own are created on the way.  Each path is counted once, for
+ * its last occurrence, the one the index resolves it to.
+ */
+
+static ssize_t dirs_lookup(const struct tar_dirs *dirs, const char *path, size_t len) {
+    if (dirs->nslots == 0) {
+        return -1;
+    }
+    size_t s = tar_hash(0, path, len) & (dirs->nslots - 1);
+    while (dirs->slots[s] != 0) {
+        const tar_dir_stats_t *stats = &dirs->stats[dirs->slots[s] - 1];
+        if (strncmp(stats->path, path, len) == 0 && stats->path[len] == '\0') {
+            return dirs->slots[s] - 1;
+        }
+        s = (s + 1) & (dirs->nslots - 1);
+    }
+    return -1;
+}
+
+static int dirs_grow_slots(struct tar_dirs *dirs) {
+    size_t nslots = dirs->nslots ? dirs->nslots * 2 : 64;
+    uint32_t *slots = calloc(nslots, sizeof(uint32_t));
+    if (!slots) {
+        return -1;
+    }
+    for (size_t d = 0; d < dirs->count; d++) {
+        const char *path = dirs->stats[d].path;
+        size_t s = tar_hash(0, path, strlen(path)) & (nslots - 1);
+        while (slots[s] != 0) {
+            s = (s + 1) & (nslots - 1);
+        }
+        slots[s] = d + 1;
+    }
+    free(dirs->slots);
+    dirs->slots = slots;
+    dirs->nslots = nslots;
+    return 0;
+}
+
+/**
+ * Adds a directory with empty statistics, its path ending with a slash or
+ * being empty for the root.
+ *
+ * @return the number of the new directory, -1 if the table could not grow.
+ */
+ssize_t dirs_insert(struct tar_dirs *dirs, const char *path, size_t len) {
+    if (len >= sizeof(dirs->stats->path)) {
+        return -1;
+    }
+    if (dirs->count == dirs->capacity) {
+        size_t capacity = dirs->capacity ? dirs->capacity * 2 : 64;
+        tar_dir_stats_t *stats = realloc(dirs->stats, capacity * sizeof(*stats));
+        if (!stats) {
+            return -1;
+        }
+        dirs->stats = stats;
+        dirs->capacity = capacity;
+    }
+    if ((dirs->count + 1) * 2 > dirs->nslots && dirs_grow_slots(dirs) != 0) {
+        return -1;
+    }
+
+    size_t d = dirs->count++;
+    tar_dir_stats_t *stats = &dirs->stats[d];
+    memset(stats, 0, sizeof(*stats));
+    memcpy(stats->path, path, len);
+    stats->path[len] = '\0';
+
+    size_t s = tar_hash(0, path, len) & (dirs->nslots - 1);
+    while (dirs->slots[s] != 0) {
+        s = (s + 1) & (dirs->nslots - 1);
+    }
+    dirs->slots[s] = d + 1;
+    return d;
+}
+
+/* Parent links of the directories, only needed while building */
+struct dirs_build {
+    struct tar_dirs *dirs;
+    uint32_t *parent;
+    size_t parent_cap;
+};
+
+/**
+ * Finds a directory, creating it and its missing ancestors, each of which
+ * counts the new directory.
+ */
+static ssize_t dirs_get(struct dirs_build *b, const char *path, size_t len) {
+    ssize_t d = dirs_lookup(b->dirs, path, len);
+    if (d >= 0) {
+        return d;
+    }
+
+    ssize_t parent = -1;
+    if (len > 0) {
+        size_t plen = len - 1;
+        while (plen > 0 && path[plen - 1] != '/') {
+            plen--;
+        }
+        parent = dirs_get(b, path, plen);
+        if (parent < 0) {
+            return -1;
+        }
+    }
+
+    d = dirs_insert(b->dirs, path, len);
+    if (d < 0) {
+        return -1;
+    }
+    if ((size_t) d >= b->parent_cap) {
+        b->parent_cap = b->dirs->capacity;
+        uint32_t *links = realloc(b->parent, b->parent_cap * sizeof(uint32_t));
+        if (!links) {
+            return -1;
+        }
+        b->parent = links;
+    }
+    b->parent[d] = parent;
+    for (ssize_t a = parent; a >= 0; a = a ? (ssize_t) b->parent[a] : -1) {
+        b->dirs->stats[a].dirs++;
+    }
+    return d;
+}
+
+/**
+ * Computes the statistics of every directory of an index.
+ *
+ * @return the statistics, NULL if they could not be allocated.
+ */
+struct tar_dirs *dirs_build(const tar_index_t *index) {
+    struct tar_dirs *dirs = calloc(1, sizeof(*dirs));
+    struct dirs_build b = { dirs, NULL, 0 };
+    int ok = dirs && dirs_get(&b, "", 0) == 0;
+
+    for (size_t i = 0; i < index->count && ok; i++) {
+        const tar_entry_t *entry = &index->entries[i];
+        if (!index_is_latest(index, i)) {
+            continue;
+        }
+
+        size_t len = strlen(entry->path);
+        ssize_t d;
+        if (entry->typeflag == DIRTYPE) {
+            char path[sizeof(entry->path) + 1];
+            memcpy(path, entry->path, len + 1);
+            if (len > 0 && path[len - 1] != '/') {
+                path[len++] = '/';
+            }
+            d = dirs_get(&b, path, len);
+            ok = d >= 0;
+            if (ok && entry->mtime > dirs->stats[d].max_mtime) {
+                dirs->stats[d].max_mtime = entry->mtime;
+            }
+            d = d > 0 ? (ssize_t) b.parent[d] : -1;
+        } else {
+            while (len > 0 && entry->path[len - 1] != '/') {
+                len--;
+            }
+            d = dirs_get(&b, entry->path, len);
+            ok = d >= 0;
+        }
+
+        for (; ok && d >= 0; d = d ? (ssize_t) b.parent[d] : -1) {
+            tar_dir_stats_t *stats = &dirs->stats[d];
+            stats->size += entry->size;
+            stats->files += entry->typeflag == REGTYPE || entry->typeflag == AREGTYPE ||
+                            entry->typeflag == LNKTYPE;
+            stats->symlinks += entry->typeflag == SYMTYPE;
+            if (entry->mtime > stats->max_mtime) {
+                stats->max_mtime = entry->mtime;
+            }
+        }
+    }
+
+    free(b.parent);
+    if (!ok) {
+        dirs_free(dirs);
+        return NULL;
+    }
+    return dirs;
+}
+
+void dirs_free(struct tar_dirs *dirs) {
+    if (!dirs) {
+        return;
+    }
+    free(dirs->stats);
+    free(dirs->slots);
+    free(dirs);
+}
+
+/**
+ * Gives the aggregate statistics of a directory of an index.
+ *
+ * @param index An index built with tar_index_build().
+ * @param path A path to a directory, with or without its trailing slash, NULL or empty for the whole archive.
+ *
+ * @return the statistics of the directory, NULL if no directory exists at the given path.
+ */
+const tar_dir_stats_t *tar_index_du(const tar_index_t *index, const char *path) {
+    const struct tar_dirs *dirs = index->dirs;
+    char key[sizeof(dirs->stats->path) + 1];
+    size_t len = path ? strlen(path) : 0;
+    if (len >= sizeof(key) - 1) {
+        return NULL;
+    }
+    if (len > 0) {
+        memcpy(key, path, len);
+    }
+    if (len > 0 && key[len - 1] != '/') {
+        key[len++] = '/';
+    }
+
+    ssize_t d = dirs_lookup(dirs, key, len);
+    return d >= 0 ? &dirs->stats[d] : NULL;
+}
+
+/* Selection of the n largest items with a min-heap of the best ones so far */
+struct top {
+    uint64_t key;
+    uint32_t id;
+};
+
+static void top_push(struct top *heap, size_t *len, size_t n, uint64_t key, uint32_t id) {
+    size_t i;
+    if (*len < n) {
+        /* sift up */
+        i = (*len)++;
+        while (i > 0 && heap[(i - 1) / 2].key > key) {
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+    } else if (key > heap[0].key) {
+        /* replace the smallest and sift down */
+        i = 0;
+        for (;;) {
+            size_t c = 2 * i + 1;
+            if (c >= *len) {
+                break;
+            }
+            if (c + 1 < *len && heap[c + 1].key < heap[c].key) {
+                c++;
+            }
+            if (heap[c].key >= key) {
+                break;
+            }
+            heap[i] = heap[c];
+            i = c;
+        }
+    } else {
+        return;
+    }
+    heap[i] = (struct top) { key, id };
+}
+
+/**
+ * Empties the heap into `out`, largest item first, `out` may be the heap itself.
+ */
+static void top_drain(struct top *heap, size_t len, struct top *out) {
+    while (len > 0) {
+        struct top min = heap[0];
+        struct top last = heap[--len];
+        size_t i = 0;
+        for (;;) {
+            size_t c = 2 * i + 1;
+            if (c >= len) {
+                break;
+            }
+            if (c + 1 < len && heap[c + 1].key < heap[c].key) {
+                c++;
+            }
+            if (heap[c].key >= last.key) {
+                break;
+            }
+            heap[i] = heap[c];
+            i = c;
+        }
+        heap[i] = last;
+        out[len] = min;
+    }
+}
+
+/**
+ * Finds the largest directories of an index, the root excepted.
+ *
+ * @param index An index built with tar_index_build().
+ * @param n The number of directories wanted.
+ * @param out A destination array of `n` items receiving the directories, largest first.
+ *
+ * @return the number of directories written to `out`.
+ */
+size_t tar_index_top_dirs(const tar_index_t *index, size_t n, const tar_dir_stats_t **out) {
+    const struct tar_dirs *dirs = index->dirs;
+    struct top *heap = n ? malloc(n * sizeof(*heap)) : NULL;
+    if (!heap) {
+        return 0;
+    }
+
+    size_t len = 0;
+    for (size_t d = 1; d < dirs->count; d++) {
+        top_push(heap, &len, n, dirs->stats[d].size, d);
+    }
+    top_drain(heap, len, heap);
+    for (size_t k = 0; k < len; k++) {
+        out[k] = &dirs->stats[heap[k].id];
+    }
+    free(heap);
+    return len;
+}
+
+/**
+ * Finds the largest files of an index.
+ *
+ * @param index An index built with tar_index_build().
+ * @param n The number of files wanted.
+ * @param ids A destination array of `n` items receiving the entry numbers of the files, largest first.
+ *
+ * @return the number of entry numbers written to `ids`.
+ */
+size_t tar_index_top_files(const tar_index_t *index, size_t n, uint32_t *ids) {
+    const struct tar_columns *columns = index->columns;
+    struct top *heap = n ? malloc(n * sizeof(*heap)) : NULL;
+    if (!heap) {
+        return 0;
+    }
+
+    size_t len = 0;
+    for (size_t i = 0; i < index->count; i++) {
+        if ((columns->type[i] == REGTYPE || columns->type[i] == AREGTYPE) && index_is_latest(index, i)) {
+            top_push(heap, &len, n, columns->size[i], i);
+        }
+    }
+    top_drain(heap, len, heap);
+    for (size_t k = 0; k < len; k++) {
+        ids[k] = heap[k].id;
+    }
+    free(heap);
+    return len;
+}
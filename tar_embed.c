@@ -0,0 +1,272 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "lib_tar.h"
+#include "tar_internal.h"
+
+/**
+ * Generates a C source file embedding a tar archive and a perfect-hash index
+ * of its entries as constant data, to be used with embedded_find() and
+ * embedded_view().
+ *
+ * Usage: tar_embed [-i] symbol archive.tar > archive.c
+ *
+ * With -i the archive bytes are pulled in with the assembler .incbin
+ * directive instead of being spelled out as a C array, which keeps compile
+ * times low for large archives.
+ */
+
+/* Give up on a table size after this many seeds for a single bucket */
+#define MAX_DISPLACEMENT (1u << 20)
+
+/* Give up on the archive after growing the table this many times, by a quarter each */
+#define MAX_GROWTHS 16
+
+/**
+ * Builds a perfect hash over the keys `keys[0..n)`: every key is placed in
+ * its own slot of `slots`, the slot being chosen by the seed stored for its
+ * bucket in `disp`.  Buckets are placed largest first (hash and displace).
+ *
+ * @return zero on success, -1 if memory ran out, -2 if some bucket could not be placed.
+ */
+static int build_phash(const tar_index_t *index, const size_t *keys, size_t n,
+                       uint32_t *disp, size_t nbuckets, uint32_t *slots, size_t nslots) {
+    size_t *bucket_of = malloc((n ? n : 1) * sizeof(size_t));
+    size_t *order = malloc((n ? n : 1) * sizeof(size_t));
+    size_t *sizes = calloc(nbuckets, sizeof(size_t));
+    size_t *first = malloc(nbuckets * sizeof(size_t));
+    size_t *tmp = malloc((n ? n : 1) * sizeof(size_t));
+    size_t *with_size = NULL;
+    int ret = -1;
+    if (!bucket_of || !order || !sizes || !first || !tmp) {
+        goto out;
+    }
+
+    size_t max_size = 0;
+    for (size_t i = 0; i < n; i++) {
+        const char *path = index->entries[keys[i]].path;
+        bucket_of[i] = tar_hash(0, path, path_key_len(path)) % nbuckets;
+        if (++sizes[bucket_of[i]] > max_size) {
+            max_size = sizes[bucket_of[i]];
+        }
+    }
+
+    /*
+     * order keys by decreasing bucket size, keeping each bucket together: a
+     * counting sort of the buckets by size gives the first position of each
+     */
+    if (!(with_size = calloc(max_size + 1, sizeof(size_t)))) {
+        goto out;
+    }
+    for (size_t b = 0; b < nbuckets; b++) {
+        with_size[sizes[b]]++;
+    }
+    size_t pos = 0;
+    for (size_t size = max_size; size > 0; size--) {
+        size_t keys_of_size = with_size[size] * size;
+        with_size[size] = pos;
+        pos += keys_of_size;
+    }
+    for (size_t b = 0; b < nbuckets; b++) {
+        if (sizes[b] > 0) {
+            first[b] = with_size[sizes[b]];
+            with_size[sizes[b]] += sizes[b];
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        order[first[bucket_of[i]]++] = i;
+    }
+
+    memset(disp, 0, nbuckets * sizeof(uint32_t));
+    memset(slots, 0, nslots * sizeof(uint32_t));
+
+    for (size_t start = 0; start < n;) {
+        size_t b = bucket_of[order[start]];
+        size_t count = sizes[b];
+        uint32_t d;
+        for (d = 1; d < MAX_DISPLACEMENT; d++) {
+            size_t placed = 0;
+            for (; placed < count; placed++) {
+                const char *path = index->entries[keys[order[start + placed]]].path;
+                size_t s = tar_hash(d, path, path_key_len(path)) % nslots;
+                int taken = slots[s] != 0;
+                for (size_t k = 0; k < placed && !taken; k++) {
+                    taken = tmp[k] == s;
+                }
+                if (taken) {
+                    break;
+                }
+                tmp[placed] = s;
+            }
+            if (placed == count) {
+                break;
+            }
+        }
+        if (d == MAX_DISPLACEMENT) {
+            ret = -2;
+            goto out;
+        }
+
+        disp[b] = d;
+        for (size_t k = 0; k < count; k++) {
+            slots[tmp[k]] = keys[order[start + k]] + 1;
+        }
+        start += count;
+    }
+    ret = 0;
+
+out:
+    free(bucket_of);
+    free(order);
+    free(sizes);
+    free(first);
+    free(tmp);
+    free(with_size);
+    return ret;
+}
+
+/**
+ * Prints `s` as a C string literal.
+ */
+static void print_string(const char *s) {
+    putchar('"');
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\' || c == '?' || c < 0x20 || c >= 0x7f) {
+            printf("\\%03o", c);
+        } else {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+
+static void print_table(const char *symbol, const char *name, const uint32_t *values, size_t count) {
+    printf("static const uint32_t %s_%s[] = {", symbol, name);
+    for (size_t i = 0; i < count; i++) {
+        printf("%s%u,", i % 16 == 0 ? "\n    " : " ", values[i]);
+    }
+    printf("\n};\n\n");
+}
+
+int main(int argc, char **argv) {
+    int incbin = argc > 1 && strcmp(argv[1], "-i") == 0;
+    if (argc != 3 + incbin) {
+        fprintf(stderr, "Usage: %s [-i] symbol archive.tar > archive.c\n", argv[0]);
+        return 2;
+    }
+    const char *symbol = argv[1 + incbin];
+    const char *archive = argv[2 + incbin];
+
+    int fd = open(archive, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror("open(tar_file)");
+        return 1;
+    }
+    if (check_archive(fd) < 0) {
+        fprintf(stderr, "%s: not a valid archive\n", archive);
+        return 1;
+    }
+
+    tar_index_t index;
+    if (tar_index_build(fd, &index) < 0) {
+        perror("tar_index_build");
+        return 1;
+    }
+
+    /* only the last occurrence of a path is reachable, like find_header() */
+    size_t *keys = malloc((index.count + 1) * sizeof(size_t));
+    if (!keys) {
+        perror("malloc");
+        return 1;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < index.count; i++) {
+        if (tar_index_find(&index, index.entries[i].path) == &index.entries[i]) {
+            keys[n++] = i;
+        }
+    }
+
+    size_t nbuckets = n / 2 + 1;
+    size_t nslots = n + n / 4 + 1;
+    uint32_t *disp = malloc(nbuckets * sizeof(uint32_t));
+    uint32_t *slots = NULL;
+    int ret = disp ? -2 : -1;
+    for (int growths = 0; ret == -2 && growths <= MAX_GROWTHS; growths++) {
+        uint32_t *grown = realloc(slots, nslots * sizeof(uint32_t));
+        if (!grown) {
+            ret = -1;
+            break;
+        }
+        slots = grown;
+        ret = build_phash(&index, keys, n, disp, nbuckets, slots, nslots);
+        nslots += ret == -2 ? nslots / 4 + 1 : 0;
+    }
+    if (ret != 0) {
+        fprintf(stderr, "%s: %s\n", archive, ret == -2 ? "could not build a perfect hash of the entries" : "out of memory");
+        return 1;
+    }
+
+    printf("/* Generated by tar_embed from %s, do not edit. */\n", archive);
+    printf("#include \"lib_tar.h\"\n\n");
+
+    if (incbin) {
+        char real[4096];
+        if (!realpath(archive, real)) {
+            perror("realpath");
+            return 1;
+        }
+        printf("__asm__(\".section .rodata\\n\"\n");
+        printf("        \".balign 512\\n\"\n");
+        printf("        \"%s_data:\\n\"\n", symbol);
+        printf("        \".incbin \\\"");
+        for (const char *p = real; *p; p++) {
+            printf(*p == '"' || *p == '\\' ? "\\\\\\%c" : "%c", *p);
+        }
+        printf("\\\"\\n\"\n");
+        printf("        \".previous\\n\");\n");
+        printf("extern const uint8_t %s_data[];\n\n", symbol);
+    } else {
+        printf("static const uint8_t %s_data[] __attribute__((aligned(512))) = {", symbol);
+        uint8_t buf[4096];
+        size_t total = 0;
+        ssize_t r;
+        while ((r = pread(fd, buf, sizeof(buf), total)) > 0) {
+            for (ssize_t i = 0; i < r; i++, total++) {
+                printf("%s0x%02x,", total % 16 == 0 ? "\n    " : " ", buf[i]);
+            }
+        }
+        printf("\n};\n\n");
+    }
+
+    printf("static const tar_embedded_entry_t %s_entries[] = {\n", symbol);
+    for (size_t i = 0; i < index.count; i++) {
+        const tar_entry_t *entry = &index.entries[i];
+        printf("    { ");
+        print_string(entry->path);
+        printf(", ");
+        print_string(entry->linkname);
+        printf(", %d, %zu, %lld },\n", entry->typeflag, entry->size, (long long) entry->data_offset);
+    }
+    printf("};\n\n");
+
+    print_table(symbol, "disp", disp, nbuckets);
+    print_table(symbol, "slots", slots, nslots);
+
+    printf("const tar_embedded_t %s = {\n", symbol);
+    printf("    %s_data, %lld,\n", symbol, (long long) st.st_size);
+    printf("    %s_entries, %zu,\n", symbol, index.count);
+    printf("    %s_disp, %zu,\n", symbol, nbuckets);
+    printf("    %s_slots, %zu,\n", symbol, nslots);
+    printf("};\n");
+
+    free(keys);
+    free(disp);
+    free(slots);
+    tar_index_free(&index);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,57 @@
+#include "lib_tar.h"
+#include "tar_internal.h"
+#include <string.h>
+
+/**
+ * Looks up an entry of an embedded archive through its precomputed perfect
+ * hash: a single probe, no scan and no allocation.
+ *
+ * @param emb An embedded archive emitted by tar_embed.
+ * @param path A path to an entry in the archive, directories may be given with or without their trailing slash.
+ *
+ * @return the entry at the given path, NULL if no such entry exists.
+ */
+const tar_embedded_entry_t *embedded_find(const tar_embedded_t *emb, const char *path) {
+    if (emb->count == 0) {
+        return NULL;
+    }
+
+    size_t klen = path_key_len(path);
+    uint32_t disp = emb->disp[tar_hash(0, path, klen) % emb->nbuckets];
+    uint32_t slot = emb->slots[tar_hash(disp, path, klen) % emb->nslots];
+    if (slot == 0) {
+        return NULL;
+    }
+
+    const tar_embedded_entry_t *entry = &emb->entries[slot - 1];
+    if (path_key_len(entry->path) != klen || strncmp(entry->path, path, klen) != 0) {
+        return NULL;
+    }
+    return entry;
+}
+
+/**
+ * Gives a zero-copy view of a file of an embedded archive.
+ *
+ * @param emb An embedded archive emitted by tar_embed.
+ * @param path A path to an entry in the archive.  If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param data Set to the first byte of the file contents, which live in the read-only data of the program.
+ * @param size Set to the size of the file in bytes.
+ *
+ * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         zero otherwise.
+ */
+int embedded_view(const tar_embedded_t *emb, const char *path, const uint8_t **data, size_t *size) {
+    const tar_embedded_entry_t *entry = embedded_find(emb, path);
+    for (int depth = 0; entry && entry->typeflag == SYMTYPE && depth < 16; depth++) {
+        entry = embedded_find(emb, entry->linkname);
+    }
+
+    if (!entry || !(entry->typeflag == REGTYPE || entry->typeflag == AREGTYPE)) {
+        return -1;
+    }
+
+    *data = emb->data + entry->data_offset;
+    *size = entry->size;
+    return 0;
+}
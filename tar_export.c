@@ -0,0 +1,458 @@
+#include "lib_tar.h"
+#include "tar_internal.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+/*
+ * Manifest export.  The header chain is walked once through a large input
+ * buffer, the data of the entries being skipped with lseek() when it is not
+ * buffered already, or read only to be digested.  Records are formatted by
+ * hand straight into a large output buffer, which is written whenever it
+ * could not hold the longest record anymore, so that exporting an entry costs
+ * no allocation and no system call of its own.
+ *
+ * The binary format starts with "TARMAN01" and a 32-bit flags field, the
+ * TAR_EXPORT_* flags of the export, followed by one record per entry:
+ *
+ *   header_offset size mtime            64-bit
+ *   mode uid gid crc32                  32-bit, crc32 being zero without TAR_EXPORT_DIGEST
+ *   typeflag                            8-bit
+ *   path_len link_len                   16-bit
+ *   path link                           path_len and link_len bytes, without NUL
+ *
+ * numbers being little-endian.
+ */
+#define MANIFEST_MAGIC "TARMAN01"
+
+/* Size of the input and output buffers */
+#define INPUT_SIZE (1024 * 1024)
+#define OUTPUT_SIZE (4 * 1024 * 1024)
+
+/* Longest record of any format: every byte of the path and linkname escaped as \u00XX */
+#define MAX_RECORD (6 * (256 + 100) + 512)
+
+struct input {
+    int fd;
+    uint8_t *buf;
+    size_t pos;
+    size_t len;
+    off_t offset;                 /* archive offset of buf[pos] */
+    off_t end;                    /* archive offset of the end of a regular file, -1 for other inputs */
+};
+
+struct output {
+    int fd;
+    uint8_t *buf;
+    size_t len;
+};
+
+/**
+ * Makes at least `need` bytes available at the input position.
+ *
+ * @return zero on success, -1 if the input ended or could not be read.
+ */
+static int input_fill(struct input *in, size_t need) {
+    if (in->len - in->pos >= need) {
+        return 0;
+    }
+    memmove(in->buf, in->buf + in->pos, in->len - in->pos);
+    in->len -= in->pos;
+    in->pos = 0;
+    while (in->len < need) {
+        ssize_t r = read(in->fd, in->buf + in->len, INPUT_SIZE - in->len);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return -1;
+        }
+        in->len += r;
+    }
+    return 0;
+}
+
+/**
+ * Skips input bytes, passing them to crc32() first when `crc` is not NULL.
+ */
+static int input_skip(struct input *in, size_t len, uLong *crc) {
+    in->offset += len;
+    for (;;) {
+        size_t n = in->len - in->pos < len ? in->len - in->pos : len;
+        if (crc && n > 0) {
+            *crc = crc32(*crc, in->buf + in->pos, n);
+        }
+        in->pos += n;
+        len -= n;
+        if (len == 0) {
+            return 0;
+        }
+        in->pos = in->len = 0;
+        if (!crc) {
+            /* seeking past the end of a file succeeds, the data is missing all the same */
+            return skip_input(in->fd, len) != 0 || (in->end >= 0 && in->offset > in->end) ? -1 : 0;
+        }
+        if (input_fill(in, len < INPUT_SIZE ? len : INPUT_SIZE) != 0) {
+            return -1;
+        }
+    }
+}
+
+static int output_flush(struct output *out) {
+    int ret = write_all(out->fd, out->buf, out->len);
+    out->len = 0;
+    return ret;
+}
+
+/* Formatting into a buffer known to be large enough, each function returning the end of its output */
+
+static uint8_t *fmt_bytes(uint8_t *p, const void *s, size_t len) {
+    memcpy(p, s, len);
+    return p + len;
+}
+
+static uint8_t *fmt_dec(uint8_t *p, uint64_t v) {
+    uint8_t tmp[20];
+    size_t n = 0;
+    do {
+        tmp[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v > 0);
+    while (n > 0) {
+        *p++ = tmp[--n];
+    }
+    return p;
+}
+
+static uint8_t *fmt_signed(uint8_t *p, int64_t v) {
+    if (v < 0) {
+        *p++ = '-';
+        return fmt_dec(p, -(uint64_t) v);
+    }
+    return fmt_dec(p, v);
+}
+
+/* Four octal digits at least, like ls and stat print modes */
+static uint8_t *fmt_mode(uint8_t *p, uint32_t mode) {
+    uint8_t tmp[11];
+    size_t n = 0;
+    do {
+        tmp[n++] = '0' + (mode & 7);
+        mode >>= 3;
+    } while (mode > 0 || n < 4);
+    while (n > 0) {
+        *p++ = tmp[--n];
+    }
+    return p;
+}
+
+static uint8_t *fmt_hex32(uint8_t *p, uint32_t v) {
+    static const char digits[] = "0123456789abcdef";
+    for (int shift = 28; shift >= 0; shift -= 4) {
+        *p++ = digits[(v >> shift) & 0xf];
+    }
+    return p;
+}
+
+static uint8_t *fmt_json_string(uint8_t *p, const char *s, size_t len) {
+    static const char digits[] = "0123456789abcdef";
+    *p++ = '"';
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            *p++ = '\\';
+            *p++ = c;
+        } else if (c < 0x20) {
+            p = fmt_bytes(p, "\\u00", 4);
+            *p++ = digits[c >> 4];
+            *p++ = digits[c & 0xf];
+        } else {
+            *p++ = c;
+        }
+    }
+    *p++ = '"';
+    return p;
+}
+
+/* Quoted as RFC 4180 requires only when holding a comma, a quote or a line break */
+static uint8_t *fmt_csv_string(uint8_t *p, const char *s, size_t len) {
+    size_t plain = 0;
+    while (plain < len && s[plain] != ',' && s[plain] != '"' && s[plain] != '\r' && s[plain] != '\n') {
+        plain++;
+    }
+    if (plain == len) {
+        return fmt_bytes(p, s, len);
+    }
+    *p++ = '"';
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] == '"') {
+            *p++ = '"';
+        }
+        *p++ = s[i];
+    }
+    *p++ = '"';
+    return p;
+}
+
+static uint8_t *fmt_u32le(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        *p++ = v >> (8 * i);
+    }
+    return p;
+}
+
+/**
+ * Parses a numeric header field, octal or GNU base-256.
+ */
+static uint64_t field_value(const char *field, size_t len) {
+    const unsigned char *f = (const unsigned char *) field;
+    uint64_t v = 0;
+    if (f[0] & 0x80) {
+        v = f[0] & 0x3f;
+        for (size_t i = 1; i < len; i++) {
+            v = (v << 8) | f[i];
+        }
+        return v;
+    }
+    size_t i = 0;
+    while (i < len && f[i] == ' ') {
+        i++;
+    }
+    for (; i < len && f[i] >= '0' && f[i] <= '7'; i++) {
+        v = (v << 3) | (f[i] - '0');
+    }
+    return v;
+}
+
+#define FIELD(hdr, name) field_value((hdr)->name, sizeof((hdr)->name))
+
+/**
+ * Checks the checksum of a header like header_checksum_ok(), summing the
+ * header in place.
+ */
+static int checksum_ok(const tar_header_t *hdr) {
+    const uint8_t *bytes = (const uint8_t *) hdr;
+    uint32_t sum = 0;
+    for (size_t i = 0; i < sizeof(*hdr); i++) {
+        sum += bytes[i];
+    }
+    for (size_t i = 0; i < sizeof(hdr->chksum); i++) {
+        sum += ' ' - (uint8_t) hdr->chksum[i];
+    }
+    return sum == FIELD(hdr, chksum);
+}
+
+static const char *type_name(char typeflag) {
+    switch (typeflag) {
+    case REGTYPE:
+    case AREGTYPE:
+        return "file";
+    case LNKTYPE:
+        return "hardlink";
+    case SYMTYPE:
+        return "symlink";
+    case '3':
+        return "char";
+    case '4':
+        return "block";
+    case DIRTYPE:
+        return "dir";
+    case '6':
+        return "fifo";
+    case GNU_DUMPDIR:
+        return "dumpdir";
+    default:
+        return NULL;
+    }
+}
+
+/* The fields of an entry as they are formatted */
+struct record {
+    const tar_header_t *hdr;
+    char path[256];
+    size_t path_len;
+    const char *link;
+    size_t link_len;
+    off_t offset;
+    uint64_t size;
+    int has_crc;
+    uint32_t crc;
+};
+
+static uint8_t *fmt_jsonl(uint8_t *p, const struct record *r, int flags) {
+    const char *type = type_name(r->hdr->typeflag);
+    p = fmt_bytes(p, "{\"path\":", 8);
+    p = fmt_json_string(p, r->path, r->path_len);
+    p = fmt_bytes(p, ",\"type\":", 8);
+    p = type ? fmt_json_string(p, type, strlen(type)) : fmt_json_string(p, &r->hdr->typeflag, 1);
+    p = fmt_bytes(p, ",\"size\":", 8);
+    p = fmt_dec(p, r->size);
+    p = fmt_bytes(p, ",\"mode\":\"", 9);
+    p = fmt_mode(p, FIELD(r->hdr, mode) & 07777);
+    p = fmt_bytes(p, "\",\"uid\":", 8);
+    p = fmt_dec(p, FIELD(r->hdr, uid));
+    p = fmt_bytes(p, ",\"gid\":", 7);
+    p = fmt_dec(p, FIELD(r->hdr, gid));
+    p = fmt_bytes(p, ",\"mtime\":", 9);
+    p = fmt_signed(p, FIELD(r->hdr, mtime));
+    p = fmt_bytes(p, ",\"linkname\":", 12);
+    p = fmt_json_string(p, r->link, r->link_len);
+    p = fmt_bytes(p, ",\"offset\":", 10);
+    p = fmt_dec(p, r->offset);
+    if (flags & TAR_EXPORT_DIGEST) {
+        if (r->has_crc) {
+            p = fmt_bytes(p, ",\"crc32\":\"", 10);
+            p = fmt_hex32(p, r->crc);
+            *p++ = '"';
+        } else {
+            p = fmt_bytes(p, ",\"crc32\":null", 13);
+        }
+    }
+    return fmt_bytes(p, "}\n", 2);
+}
+
+static uint8_t *fmt_csv(uint8_t *p, const struct record *r, int flags) {
+    const char *type = type_name(r->hdr->typeflag);
+    p = fmt_csv_string(p, r->path, r->path_len);
+    *p++ = ',';
+    p = type ? fmt_bytes(p, type, strlen(type)) : fmt_csv_string(p, &r->hdr->typeflag, 1);
+    *p++ = ',';
+    p = fmt_dec(p, r->size);
+    *p++ = ',';
+    p = fmt_mode(p, FIELD(r->hdr, mode) & 07777);
+    *p++ = ',';
+    p = fmt_dec(p, FIELD(r->hdr, uid));
+    *p++ = ',';
+    p = fmt_dec(p, FIELD(r->hdr, gid));
+    *p++ = ',';
+    p = fmt_signed(p, FIELD(r->hdr, mtime));
+    *p++ = ',';
+    p = fmt_csv_string(p, r->link, r->link_len);
+    *p++ = ',';
+    p = fmt_dec(p, r->offset);
+    if (flags & TAR_EXPORT_DIGEST) {
+        *p++ = ',';
+        if (r->has_crc) {
+            p = fmt_hex32(p, r->crc);
+        }
+    }
+    *p++ = '\n';
+    return p;
+}
+
+static uint8_t *fmt_binary(uint8_t *p, const struct record *r, int flags) {
+    put_u64(p, r->offset);
+    put_u64(p + 8, r->size);
+    put_u64(p + 16, FIELD(r->hdr, mtime));
+    p = fmt_u32le(p + 24, FIELD(r->hdr, mode));
+    p = fmt_u32le(p, FIELD(r->hdr, uid));
+    p = fmt_u32le(p, FIELD(r->hdr, gid));
+    p = fmt_u32le(p, r->has_crc ? r->crc : 0);
+    *p++ = r->hdr->typeflag;
+    *p++ = r->path_len & 0xff;
+    *p++ = r->path_len >> 8;
+    *p++ = r->link_len & 0xff;
+    *p++ = r->link_len >> 8;
+    p = fmt_bytes(p, r->path, r->path_len);
+    return fmt_bytes(p, r->link, r->link_len);
+}
+
+/**
+ * Builds the full path of an entry, like header_path() does.
+ */
+static size_t record_path(char *out, const tar_header_t *hdr) {
+    size_t len = 0;
+    if (hdr->prefix[0] != '\0' && memcmp(hdr->magic, TMAGIC, TMAGLEN) == 0) {
+        len = strnlen(hdr->prefix, sizeof(hdr->prefix));
+        memcpy(out, hdr->prefix, len);
+        out[len++] = '/';
+    }
+    size_t name = strnlen(hdr->name, sizeof(hdr->name));
+    memcpy(out + len, hdr->name, name);
+    return len + name;
+}
+
+/**
+ * Writes a manifest of every entry of an archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a tar archive, it may be a pipe or a socket.
+ * @param out_fd A file descriptor the manifest is written to, at its current offset.
+ * @param format The format of the manifest.
+ * @param flags TAR_EXPORT_* flags.
+ *
+ * @return a zero or positive value on success, representing the number of entries exported,
+ *         -1 if the input could not be read or ends before its end-of-archive marker,
+ *            or if the output could not be written,
+ *         -2 if the archive contains a header with an invalid checksum value.
+ */
+ssize_t tar_export(int tar_fd, int out_fd, tar_export_format_t format, int flags) {
+    struct input in = { tar_fd, malloc(INPUT_SIZE), 0, 0, 0, -1 };
+    struct stat st;
+    off_t start = lseek(tar_fd, 0, SEEK_CUR);
+    if (start != -1 && fstat(tar_fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        in.end = st.st_size - start;
+    }
+    struct output out = { out_fd, malloc(OUTPUT_SIZE), 0 };
+    uint8_t *(*fmt)(uint8_t *, const struct record *, int) =
+        format == TAR_EXPORT_CSV ? fmt_csv : format == TAR_EXPORT_BINARY ? fmt_binary : fmt_jsonl;
+    ssize_t ret = in.buf && out.buf ? 0 : -1;
+
+    if (ret == 0 && format == TAR_EXPORT_CSV) {
+        static const char head[] = "path,type,size,mode,uid,gid,mtime,linkname,offset";
+        uint8_t *p = fmt_bytes(out.buf, head, sizeof(head) - 1);
+        p = flags & TAR_EXPORT_DIGEST ? fmt_bytes(p, ",crc32\n", 7) : fmt_bytes(p, "\n", 1);
+        out.len = p - out.buf;
+    } else if (ret == 0 && format == TAR_EXPORT_BINARY) {
+        uint8_t *p = fmt_bytes(out.buf, MANIFEST_MAGIC, 8);
+        out.len = fmt_u32le(p, flags) - out.buf;
+    }
+
+    ssize_t count = 0;
+    while (ret == 0) {
+        /* an input ending before the end-of-archive marker was cut short */
+        if (input_fill(&in, sizeof(tar_header_t)) != 0) {
+            ret = -1;
+            break;
+        }
+        /* copied, the input buffer moving when the data is digested */
+        tar_header_t hdr;
+        memcpy(&hdr, in.buf + in.pos, sizeof(hdr));
+        if (!checksum_ok(&hdr)) {
+            /* the end-of-archive marker is the only header without a valid checksum */
+            ret = is_empty_block(&hdr) ? 0 : -2;
+            break;
+        }
+        in.pos += sizeof(hdr);
+        in.offset += sizeof(hdr);
+
+        struct record r = { &hdr };
+        r.path_len = record_path(r.path, &hdr);
+        r.link = hdr.linkname;
+        r.link_len = strnlen(hdr.linkname, sizeof(hdr.linkname));
+        r.offset = in.offset - sizeof(hdr);
+        r.size = FIELD(&hdr, size);
+        r.has_crc = (flags & TAR_EXPORT_DIGEST) && (hdr.typeflag == REGTYPE || hdr.typeflag == AREGTYPE);
+        uLong crc = crc32(0, NULL, 0);
+        if (input_skip(&in, r.size, r.has_crc ? &crc : NULL) != 0 ||
+            input_skip(&in, TAR_PADDED(r.size) - r.size, NULL) != 0) {
+            ret = -1;
+            break;
+        }
+        r.crc = crc;
+
+        if (out.len + MAX_RECORD > OUTPUT_SIZE && output_flush(&out) != 0) {
+            ret = -1;
+            break;
+        }
+        uint8_t *end = fmt(out.buf + out.len, &r, flags);
+        out.len = end - out.buf;
+        count++;
+    }
+    if (ret == 0 && output_flush(&out) != 0) {
+        ret = -1;
+    }
+    free(in.buf);
+    free(out.buf);
+    return ret == 0 ? count : ret;
+}
@@ -0,0 +1,222 @@
+#include "lib_tar.h"
+#include "tar_internal.h"
+#include <limits.h>
+#include <string.h>
+
+/*
+ * Filters run over blocks of FILTER_BLOCK entries: each predicate narrows a
+ * byte mask of the block with a tight loop over one column, which the
+ * compiler turns into vector compares, and the survivors are collected once
+ * every predicate was applied.
+ */
+#define FILTER_BLOCK 1024
+
+/**
+ * Copies the metadata of the entries of an index into columns.  The path ids
+ * are adopted by the columns, and released on failure.
+ *
+ * @return the columns, NULL if they could not be allocated.
+ */
+struct tar_columns *columns_build(const tar_index_t *index, uint32_t *path_ids) {
+    struct tar_columns *columns = calloc(1, sizeof(*columns));
+    if (!columns) {
+        free(path_ids);
+        return NULL;
+    }
+    columns->path = path_ids;
+
+    size_t n = index->count ? index->count : 1;
+    columns->type = malloc(n * sizeof(uint8_t));
+    columns->size = malloc(n * sizeof(uint64_t));
+    columns->mtime = malloc(n * sizeof(int64_t));
+    columns->uid = malloc(n * sizeof(uint32_t));
+    columns->gid = malloc(n * sizeof(uint32_t));
+    columns->mode = malloc(n * sizeof(uint32_t));
+    if (!columns->type || !columns->size || !columns->mtime || !columns->uid || !columns->gid || !columns->mode) {
+        columns_free(columns);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < index->count; i++) {
+        const tar_entry_t *entry = &index->entries[i];
+        columns->type[i] = entry->typeflag;
+        columns->size[i] = entry->size;
+        columns->mtime[i] = entry->mtime;
+        columns->uid[i] = entry->uid;
+        columns->gid[i] = entry->gid;
+        columns->mode[i] = entry->mode;
+    }
+    return columns;
+}
+
+void columns_free(struct tar_columns *columns) {
+    if (!columns) {
+        return;
+    }
+    free(columns->type);
+    free(columns->size);
+    free(columns->mtime);
+    free(columns->uid);
+    free(columns->gid);
+    free(columns->mode);
+    free(columns->path);
+    free(columns);
+}
+
+/* Narrows `match` to the `n` items of `col` satisfying `col op v` */
+#define DEFINE_NARROW(name, type)                                                   \
+    static void name(const type *col, size_t n, tar_op_t op, type v, uint8_t *match) { \
+        switch (op) {                                                               \
+        case TAR_EQ:                                                                \
+            for (size_t i = 0; i < n; i++) match[i] &= col[i] == v;                 \
+            break;                                                                  \
+        case TAR_NE:                                                                \
+            for (size_t i = 0; i < n; i++) match[i] &= col[i] != v;                 \
+            break;                                                                  \
+        case TAR_LT:                                                                \
+            for (size_t i = 0; i < n; i++) match[i] &= col[i] < v;                  \
+            break;                                                                  \
+        case TAR_LE:                                                                \
+            for (size_t i = 0; i < n; i++) match[i] &= col[i] <= v;                 \
+            break;                                                                  \
+        case TAR_GT:                                                                \
+            for (size_t i = 0; i < n; i++) match[i] &= col[i] > v;                  \
+            break;                                                                  \
+        case TAR_GE:                                                                \
+            for (size_t i = 0; i < n; i++) match[i] &= col[i] >= v;                 \
+            break;                                                                  \
+        case TAR_BITS:                                                              \
+            for (size_t i = 0; i < n; i++) match[i] &= (col[i] & v) == v;           \
+            break;                                                                  \
+        }                                                                           \
+    }
+
+DEFINE_NARROW(narrow_u8, uint8_t)
+DEFINE_NARROW(narrow_u32, uint32_t)
+DEFINE_NARROW(narrow_u64, uint64_t)
+DEFINE_NARROW(narrow_i64, int64_t)
+
+/**
+ * Tells how a predicate whose value lies outside the range of its column
+ * evaluates, which is the same for every entry.
+ */
+static int out_of_range(tar_op_t op, int below) {
+    switch (op) {
+    case TAR_NE:
+        return 1;
+    case TAR_LT:
+    case TAR_LE:
+        return !below;
+    case TAR_GT:
+    case TAR_GE:
+        return below;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Finds the entries of an index matching every predicate of a list.
+ *
+ * @param index An index built with tar_index_build().
+ * @param preds The predicates, all of which must hold.
+ * @param npreds The number of predicates, zero matching every entry.
+ * @param ids A destination array receiving the numbers of the matching entries, in archive order.
+ * @param max_ids The number of entries of `ids`.
+ *
+ * @return the number of matching entries, which may exceed `max_ids`,
+ *         -1 if a predicate is invalid.
+ */
+ssize_t tar_index_filter(const tar_index_t *index, const tar_predicate_t *preds, size_t npreds,
+                         uint32_t *ids, size_t max_ids) {
+    /* predicates left once those holding for every entry are dropped */
+    tar_predicate_t active[npreds ? npreds : 1];
+    size_t nactive = 0;
+    for (size_t p = 0; p < npreds; p++) {
+        const tar_predicate_t *pred = &preds[p];
+        if (pred->op < TAR_EQ || pred->op > TAR_BITS) {
+            return -1;
+        }
+
+        unsigned long max;
+        switch (pred->column) {
+        case TAR_COL_TYPE:
+            max = UINT8_MAX;
+            break;
+        case TAR_COL_UID:
+        case TAR_COL_GID:
+        case TAR_COL_MODE:
+        case TAR_COL_PATH:
+            max = UINT32_MAX;
+            break;
+        case TAR_COL_SIZE:
+            max = ULONG_MAX;
+            break;
+        case TAR_COL_MTIME:
+            active[nactive++] = *pred;
+            continue;
+        default:
+            return -1;
+        }
+
+        if (pred->value < 0 || (unsigned long) pred->value > max) {
+            if (!out_of_range(pred->op, pred->value < 0)) {
+                return 0;
+            }
+            continue;
+        }
+        active[nactive++] = *pred;
+    }
+
+    const struct tar_columns *columns = index->columns;
+    uint8_t match[FILTER_BLOCK];
+    size_t found = 0;
+    for (size_t start = 0; start < index->count; start += FILTER_BLOCK) {
+        size_t n = index->count - start < FILTER_BLOCK ? index->count - start : FILTER_BLOCK;
+        memset(match, 1, n);
+
+        for (size_t p = 0; p < nactive; p++) {
+            tar_op_t op = active[p].op;
+            long v = active[p].value;
+            switch (active[p].column) {
+            case TAR_COL_TYPE:
+                narrow_u8(columns->type + start, n, op, v, match);
+                break;
+            case TAR_COL_SIZE:
+                narrow_u64(columns->size + start, n, op, v, match);
+                break;
+            case TAR_COL_MTIME:
+                narrow_i64(columns->mtime + start, n, op, v, match);
+                break;
+            case TAR_COL_UID:
+                narrow_u32(columns->uid + start, n, op, v, match);
+                break;
+            case TAR_COL_GID:
+                narrow_u32(columns->gid + start, n, op, v, match);
+                break;
+            case TAR_COL_MODE:
+                narrow_u32(columns->mode + start, n, op, v, match);
+                break;
+            case TAR_COL_PATH:
+                narrow_u32(columns->path + start, n, op, v, match);
+                break;
+            }
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            uint64_t word;
+            if (i % 8 == 0 && i + 8 <= n && (memcpy(&word, match + i, 8), word == 0)) {
+                /* selective filters leave most words empty */
+                i += 7;
+                continue;
+            }
+            if (match[i]) {
+                if (found < max_ids) {
+                    ids[found] = start + i;
+                }
+                found++;
+            }
+        }
+    }
+    return found;
+}
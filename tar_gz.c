@@ -0,0 +1,467 @@
+#include "lib_tar.h"
+#include "tar_internal.h"
+#include <string.h>
+#include <zlib.h>
+
+/*
+ * Random access into gzip data, after zlib's examples/zran.c.  While the data
+ * is decompressed once, an access point is recorded every GZ_SPAN bytes of
+ * output: the input position, the bit offset within the input byte, and the
+ * 32 KiB of output preceding it, which is the only state deflate carries
+ * across blocks.  A later read starts inflating at the closest access point
+ * before the requested offset instead of at the start of the data.
+ *
+ * Concatenated gzip members are supported; each member start is an access
+ * point needing no window.
+ *
+ * The access points of an archive are saved in a sidecar, so that it is not
+ * decompressed again on the next open:
+ *
+ *   "TARGZI01" archive identity (see put_identity()) length size count  (64-bit little-endian)
+ *   count times: out in bits (GZ_STREAM_START as 0xff) window (GZ_WINSIZE bytes, absent at member starts)
+ */
+#define GZ_TABLE_MAGIC "TARGZI01"
+#define GZ_TABLE_MAGLEN 8
+
+#define GZ_WINSIZE 32768
+#define GZ_CHUNK   16384
+
+/* Marks an access point at the start of a gzip member */
+#define GZ_STREAM_START -1
+
+struct gz_point {
+    off_t out;                    /* offset in the decompressed data */
+    off_t in;                     /* offset of the first full byte in the compressed data */
+    int bits;                     /* bits of the byte before `in` still to use, or GZ_STREAM_START */
+    uint8_t window[GZ_WINSIZE];   /* decompressed data preceding `out` */
+};
+
+struct gz_index {
+    off_t base;                   /* offset of the compressed data within the file */
+    off_t length;                 /* length of the compressed data */
+    off_t size;                   /* length of the decompressed data */
+    struct gz_point *points;
+    size_t count;
+    size_t capacity;
+};
+
+static int add_point(gz_index_t *gz, int bits, off_t in, off_t out, unsigned left, const uint8_t *window) {
+    if (gz->count == gz->capacity) {
+        size_t capacity = gz->capacity ? gz->capacity * 2 : 8;
+        struct gz_point *points = realloc(gz->points, capacity * sizeof(struct gz_point));
+        if (!points) {
+            return -1;
+        }
+        gz->points = points;
+        gz->capacity = capacity;
+    }
+
+    struct gz_point *p = &gz->points[gz->count++];
+    p->bits = bits;
+    p->in = in;
+    p->out = out;
+    if (bits != GZ_STREAM_START) {
+        /* unroll the circular window so that it ends right before `out` */
+        if (left) {
+            memcpy(p->window, window + GZ_WINSIZE - left, left);
+        }
+        if (left < GZ_WINSIZE) {
+            memcpy(p->window + left, window, GZ_WINSIZE - left);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Decompresses gzip data once, recording access points every `span` bytes of
+ * output and handing every decompressed byte to `sink` in order.
+ *
+ * @param fd A file descriptor containing the gzip data.
+ * @param base The offset of the gzip data within the file.
+ * @param length The length of the gzip data.
+ * @param span The distance between access points, in decompressed bytes.
+ * @param sink A callback receiving the decompressed data, may be NULL.
+ * @param arg An opaque pointer passed to `sink`.
+ *
+ * @return the access point index, released with gz_index_free(),
+ *         NULL if the data is not valid gzip data or memory ran out.
+ */
+gz_index_t *gz_index_build(int fd, off_t base, off_t length, off_t span, gz_sink sink, void *arg) {
+    gz_index_t *gz = calloc(1, sizeof(*gz));
+    uint8_t *window = calloc(1, GZ_WINSIZE);
+    uint8_t input[GZ_CHUNK];
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (!gz || !window || inflateInit2(&strm, 47) != Z_OK) {
+        free(gz);
+        free(window);
+        return NULL;
+    }
+    gz->base = base;
+    gz->length = length;
+
+    off_t totin = 0, totout = 0, last = 0;
+    int ret = Z_OK;
+    int ok = add_point(gz, GZ_STREAM_START, 0, 0, 0, NULL) == 0;
+    strm.avail_out = 0;
+
+    while (ok && totin < length) {
+        size_t want = length - totin < GZ_CHUNK ? length - totin : GZ_CHUNK;
+        ssize_t n = pread(fd, input, want, base + totin);
+        if (n <= 0) {
+            ok = 0;
+            break;
+        }
+        strm.next_in = input;
+        strm.avail_in = n;
+
+        do {
+            if (strm.avail_out == 0) {
+                strm.avail_out = GZ_WINSIZE;
+                strm.next_out = window;
+            }
+
+            uint8_t *produced = strm.next_out;
+            totin += strm.avail_in;
+            totout += strm.avail_out;
+            ret = inflate(&strm, Z_BLOCK);
+            totin -= strm.avail_in;
+            totout -= strm.avail_out;
+            if (ret == Z_NEED_DICT || ret == Z_MEM_ERROR || ret == Z_DATA_ERROR) {
+                /* garbage such as zero padding after the last member ends the data */
+                const struct gz_point *start = &gz->points[gz->count - 1];
+                ok = ret == Z_DATA_ERROR && gz->count > 1 &&
+                     start->bits == GZ_STREAM_START && start->out == totout;
+                if (ok) {
+                    gz->count--;
+                }
+                goto done;
+            }
+
+            size_t got = strm.next_out - produced;
+            if (sink && got > 0 && sink(totout - got, produced, got, arg) != 0) {
+                ok = 0;
+                goto done;
+            }
+
+            if (ret == Z_STREAM_END) {
+                if (strm.avail_in == 0 && totin == length) {
+                    break;
+                }
+                inflateReset(&strm);
+                if (add_point(gz, GZ_STREAM_START, totin, totout, 0, NULL) != 0) {
+                    ok = 0;
+                    goto done;
+                }
+                last = totout;
+                continue;
+            }
+
+            /* at the end of a deflate block, past the span since the last point */
+            if ((strm.data_type & 128) && !(strm.data_type & 64) && totout - last > span) {
+                if (add_point(gz, strm.data_type & 7, totin, totout, strm.avail_out, window) != 0) {
+                    ok = 0;
+                    goto done;
+                }
+                last = totout;
+            }
+        } while (strm.avail_in != 0);
+    }
+
+done:
+    inflateEnd(&strm);
+    free(window);
+    if (!ok) {
+        gz_index_free(gz);
+        return NULL;
+    }
+    gz->size = totout;
+    return gz;
+}
+
+/**
+ * Builds access points from the frame table ending gzip data written by
+ * tar_compress(), one at the start of every frame, without decompressing
+ * anything.
+ *
+ * @param fd A file descriptor containing the gzip data, from its start.
+ * @param length The length of the file.
+ *
+ * @return the access point index, released with gz_index_free(),
+ *         NULL if the data does not end with a valid frame table.
+ */
+gz_index_t *gz_index_load_frames(int fd, off_t length) {
+    uint8_t *table = NULL;
+    size_t count = 0;
+    off_t end = length;
+
+    /* table members, from the last one */
+    for (;;) {
+        uint8_t tail[26];
+        static const uint8_t empty[10] = { 3, 0 };
+        if (end < 42 || pread(fd, tail, sizeof(tail), end - sizeof(tail)) != sizeof(tail) ||
+            memcmp(tail + 8, GZ_FRAMES_MAGIC, 8) != 0 || memcmp(tail + 16, empty, sizeof(empty)) != 0) {
+            break;
+        }
+        uint64_t n = get_u64(tail);
+        if (n == 0 || n > GZ_FRAMES_PER_MEMBER || (off_t) (42 + 16 * n) > end) {
+            break;
+        }
+        off_t start = end - (42 + 16 * n);
+        uint8_t head[16];
+        uint8_t *grown = realloc(table, 16 * (count + n));
+        if (!grown) {
+            break;
+        }
+        table = grown;
+        memmove(table + 16 * n, table, 16 * count);
+        if (pread(fd, head, sizeof(head), start) != sizeof(head) || head[0] != 0x1f || head[1] != 0x8b ||
+            head[3] != 4 || head[12] != 'T' || head[13] != 'F' ||
+            pread(fd, table, 16 * n, start + sizeof(head)) != (ssize_t) (16 * n)) {
+            memmove(table, table + 16 * n, 16 * count);
+            break;
+        }
+        count += n;
+        end = start;
+    }
+
+    gz_index_t *gz = count ? calloc(1, sizeof(*gz)) : NULL;
+    if (!gz) {
+        free(table);
+        return NULL;
+    }
+    gz->length = end;
+    off_t in = 0, out = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (add_point(gz, GZ_STREAM_START, in, out, 0, NULL) != 0) {
+            in = -1;
+            break;
+        }
+        in += get_u64(table + 16 * i);
+        out += get_u64(table + 16 * i + 8);
+    }
+    free(table);
+
+    /* the frames must cover the data up to the table */
+    if (in != end) {
+        gz_index_free(gz);
+        return NULL;
+    }
+    gz->size = out;
+    return gz;
+}
+
+/**
+ * Releases an index built with gz_index_build().
+ */
+void gz_index_free(gz_index_t *gz) {
+    if (gz) {
+        free(gz->points);
+        free(gz);
+    }
+}
+
+/**
+ * Saves the access points, for the archive of the given identity.
+ *
+ * @return zero on success, -1 if the access points could not be written.
+ */
+int gz_index_save(const gz_index_t *gz, int fd, const uint8_t *identity) {
+    uint8_t head[GZ_TABLE_MAGLEN + IDENTITY_LEN + 24];
+    memcpy(head, GZ_TABLE_MAGIC, GZ_TABLE_MAGLEN);
+    memcpy(head + GZ_TABLE_MAGLEN, identity, IDENTITY_LEN);
+    uint8_t *p = head + GZ_TABLE_MAGLEN + IDENTITY_LEN;
+    put_u64(p, gz->length);
+    put_u64(p + 8, gz->size);
+    put_u64(p + 16, gz->count);
+    if (write_all(fd, head, sizeof(head)) != 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < gz->count; i++) {
+        const struct gz_point *point = &gz->points[i];
+        uint8_t rec[17];
+        put_u64(rec, point->out);
+        put_u64(rec + 8, point->in);
+        rec[16] = point->bits == GZ_STREAM_START ? 0xff : point->bits;
+        if (write_all(fd, rec, sizeof(rec)) != 0 ||
+            (point->bits != GZ_STREAM_START && write_all(fd, point->window, GZ_WINSIZE) != 0)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Loads access points saved with gz_index_save().
+ *
+ * @return the access point index, released with gz_index_free(),
+ *         NULL if it could not be read or belongs to another version of the archive.
+ */
+gz_index_t *gz_index_load(int fd, const uint8_t *identity) {
+    uint8_t head[GZ_TABLE_MAGLEN + IDENTITY_LEN + 24];
+    if (read_exact(fd, head, sizeof(head)) != 0 || memcmp(head, GZ_TABLE_MAGIC, GZ_TABLE_MAGLEN) != 0 ||
+        memcmp(head + GZ_TABLE_MAGLEN, identity, IDENTITY_LEN) != 0) {
+        return NULL;
+    }
+
+    const uint8_t *p = head + GZ_TABLE_MAGLEN + IDENTITY_LEN;
+    gz_index_t *gz = calloc(1, sizeof(*gz));
+    if (!gz) {
+        return NULL;
+    }
+    gz->length = get_u64(p);
+    gz->size = get_u64(p + 8);
+    uint64_t count = get_u64(p + 16);
+    if (gz->length <= 0 || gz->size < 0 || count == 0 || count > (uint64_t) gz->length) {
+        gz_index_free(gz);
+        return NULL;
+    }
+
+    /* points must start at the beginning and move forward */
+    off_t last_in = -1, last_out = -1;
+    for (uint64_t i = 0; i < count; i++) {
+        uint8_t rec[17];
+        if (read_exact(fd, rec, sizeof(rec)) != 0) {
+            gz_index_free(gz);
+            return NULL;
+        }
+        off_t out = get_u64(rec), in = get_u64(rec + 8);
+        int bits = rec[16] == 0xff ? GZ_STREAM_START : rec[16];
+        if (bits > 7 || in < last_in || out < last_out || in > gz->length || out > gz->size ||
+            (i == 0 && (in != 0 || out != 0 || bits != GZ_STREAM_START)) ||
+            add_point(gz, GZ_STREAM_START, in, out, 0, NULL) != 0) {
+            gz_index_free(gz);
+            return NULL;
+        }
+        struct gz_point *point = &gz->points[gz->count - 1];
+        point->bits = bits;
+        if (bits != GZ_STREAM_START && read_exact(fd, point->window, GZ_WINSIZE) != 0) {
+            gz_index_free(gz);
+            return NULL;
+        }
+        last_in = in;
+        last_out = out;
+    }
+    return gz;
+}
+
+/**
+ * Returns the length of the decompressed data.
+ */
+off_t gz_index_size(const gz_index_t *gz) {
+    return gz->size;
+}
+
+/**
+ * Reads decompressed data, starting from the closest access point.  Every
+ * call uses its own inflate state, so concurrent reads are safe.
+ *
+ * @return the number of bytes read, `len` unless the data ends first, -1 on
+ *         error, including compressed data that is invalid or ends early.
+ */
+ssize_t gz_index_read(const gz_index_t *gz, int fd, uint8_t *dest, size_t len, off_t offset) {
+    if (offset >= gz->size || len == 0) {
+        return 0;
+    }
+    if (len > (size_t) (gz->size - offset)) {
+        len = gz->size - offset;
+    }
+
+    /* last access point at or before offset */
+    size_t lo = 0, hi = gz->count;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (gz->points[mid].out <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    const struct gz_point *p = &gz->points[lo];
+
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    off_t in = p->in;
+    int raw = p->bits != GZ_STREAM_START;
+    if (!raw) {
+        if (inflateInit2(&strm, 47) != Z_OK) {
+            return -1;
+        }
+    } else {
+        if (inflateInit2(&strm, -15) != Z_OK) {
+            return -1;
+        }
+        if (p->bits) {
+            uint8_t byte;
+            if (pread(fd, &byte, 1, gz->base + p->in - 1) != 1) {
+                inflateEnd(&strm);
+                return -1;
+            }
+            inflatePrime(&strm, p->bits, byte >> (8 - p->bits));
+        }
+        inflateSetDictionary(&strm, p->window, GZ_WINSIZE);
+    }
+
+    uint8_t input[GZ_CHUNK];
+    uint8_t discard[GZ_WINSIZE];
+    off_t skip = offset - p->out;
+    size_t done = 0;
+    int ret = Z_OK;
+
+    strm.avail_in = 0;
+    while (done < len) {
+        if (skip > 0) {
+            strm.next_out = discard;
+            strm.avail_out = skip < (off_t) sizeof(discard) ? skip : sizeof(discard);
+        } else {
+            strm.next_out = dest + done;
+            strm.avail_out = len - done;
+        }
+
+        if (strm.avail_in == 0) {
+            if (in >= gz->length) {
+                break;
+            }
+            size_t want = gz->length - in < GZ_CHUNK ? gz->length - in : GZ_CHUNK;
+            ssize_t n = pread(fd, input, want, gz->base + in);
+            if (n <= 0) {
+                break;
+            }
+            in += n;
+            strm.next_in = input;
+            strm.avail_in = n;
+        }
+
+        unsigned before = strm.avail_out;
+        ret = inflate(&strm, Z_NO_FLUSH);
+        if (ret == Z_NEED_DICT || ret == Z_MEM_ERROR || ret == Z_DATA_ERROR) {
+            break;
+        }
+        unsigned got = before - strm.avail_out;
+        if (skip > 0) {
+            skip -= got;
+        } else {
+            done += got;
+        }
+
+        if (ret == Z_STREAM_END) {
+            if (raw) {
+                /* a raw stream stops before the trailer of its gzip member */
+                size_t n = strm.avail_in < 8 ? strm.avail_in : 8;
+                strm.next_in += n;
+                strm.avail_in -= n;
+                in += 8 - n;
+                raw = 0;
+            }
+            /* the next gzip member, if any, starts a new stream */
+            if (inflateReset2(&strm, 47) != Z_OK) {
+                break;
+            }
+        }
+    }
+
+    inflateEnd(&strm);
+    /* the access points promise `size` bytes, fewer means damaged or missing input */
+    return done < len ? -1 : (ssize_t) done;
+}
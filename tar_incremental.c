@@ -0,0 +1,213 @@
+#include "lib_tar.h"
+#include "tar_internal.h"
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * GNU incremental dumps record every directory, changed or not, as a dumpdir
+ * entry listing its contents at dump time, one NUL-terminated record per
+ * name, the list ending with an empty record.  The first character of each
+ * record tells what the dump holds for the name:
+ *
+ *   'Y'  the file changed and is a member of this archive
+ *   'N'  the file did not change since the previous level
+ *   'D'  a directory, with its own dumpdir entry in this archive
+ *
+ * Names missing from the most recent dumpdir of their directory were deleted.
+ * Rename records ('R', 'T') and others are not followed.
+ */
+#define PATH_MAX_LEN 256
+
+struct plan {
+    const tar_index_t *const *chain;
+    size_t n;
+    tar_restore_t *out;
+    size_t max;
+    size_t count;
+};
+
+static void plan_add(struct plan *p, size_t archive, const tar_entry_t *entry) {
+    if (p->count < p->max) {
+        p->out[p->count] = (tar_restore_t) { archive, entry };
+    }
+    p->count++;
+}
+
+/**
+ * Gives the dumpdir of an entry, NULL if it is not a dumpdir entry.
+ */
+static const char *dumpdir_of(const tar_index_t *index, const tar_entry_t *entry) {
+    if (!entry || entry->typeflag != GNU_DUMPDIR || !index->dumpdirs) {
+        return NULL;
+    }
+    return index->dumpdirs[entry - index->entries];
+}
+
+/**
+ * Finds the record of a name in a dumpdir.
+ *
+ * @return the control character of the record, zero if the name is not listed.
+ */
+static char dumpdir_find(const char *data, size_t size, const char *name, size_t name_len) {
+    size_t pos = 0;
+    while (pos < size && data[pos] != '\0') {
+        const char *record = data + pos;
+        size_t len = strnlen(record, size - pos);
+        if (len - 1 == name_len && memcmp(record + 1, name, name_len) == 0) {
+            return record[0];
+        }
+        pos += len + 1;
+    }
+    return 0;
+}
+
+/**
+ * Finds the latest archive before `below` holding a member at `path`, the
+ * copy of a file recorded as unchanged.
+ */
+static void plan_unchanged(struct plan *p, size_t below, const char *path) {
+    for (size_t k = below; k-- > 0;) {
+        const tar_entry_t *entry = tar_index_find(p->chain[k], path);
+        if (entry && entry->typeflag != GNU_DUMPDIR) {
+            plan_add(p, k, entry);
+            return;
+        }
+    }
+}
+
+/**
+ * Plans a directory and its whole subtree as recorded by the dumpdir of
+ * archive `k`.
+ */
+static void plan_dir(struct plan *p, size_t k, const tar_entry_t *dir) {
+    plan_add(p, k, dir);
+
+    const tar_index_t *index = p->chain[k];
+    const char *data = dumpdir_of(index, dir);
+    if (!data) {
+        /* not an incremental dump, the directory holds what the archive holds */
+        size_t len = strlen(dir->path);
+        for (size_t i = 0; i < index->count; i++) {
+            const tar_entry_t *entry = &index->entries[i];
+            if (entry != dir && strncmp(entry->path, dir->path, len) == 0 && entry->path[len] != '\0' &&
+                index_is_latest(index, i)) {
+                plan_add(p, k, entry);
+            }
+        }
+        return;
+    }
+
+    size_t size = dir->size;
+    size_t pos = 0;
+    while (pos < size && data[pos] != '\0') {
+        const char *record = data + pos;
+        size_t len = strnlen(record, size - pos);
+        pos += len + 1;
+
+        char path[PATH_MAX_LEN + 1];
+        int n = snprintf(path, sizeof(path), "%s%s%s", dir->path,
+                         dir->path[strlen(dir->path) - 1] == '/' ? "" : "/", record + 1);
+        if (n < 0 || n >= PATH_MAX_LEN) {
+            continue;
+        }
+
+        const tar_entry_t *entry;
+        switch (record[0]) {
+        case 'Y':
+            entry = tar_index_find(index, path);
+            if (entry) {
+                plan_add(p, k, entry);
+            }
+            break;
+        case 'N':
+            plan_unchanged(p, k, path);
+            break;
+        case 'D':
+            entry = tar_index_find(index, path);
+            if (entry) {
+                plan_dir(p, k, entry);
+            }
+            break;
+        }
+    }
+}
+
+/**
+ * Plans the restore of a path from a chain of GNU incremental archives.
+ *
+ * @param chain The indexes of the archives of the chain, the level 0 dump first.
+ * @param n The number of archives of the chain.
+ * @param path A path to a file or a directory, a directory being restored with its whole subtree.
+ * @param plan A destination array receiving a member for each path to restore, directories before their contents.
+ * @param max The number of items of `plan`.
+ *
+ * @return the number of members to restore, which may exceed `max`,
+ *         zero if the path does not exist once the whole chain is restored.
+ */
+size_t tar_plan_restore(const tar_index_t *const *chain, size_t n, const char *path,
+                        tar_restore_t *plan, size_t max) {
+    struct plan p = { chain, n, plan, max, 0 };
+
+    size_t len = strlen(path);
+    while (len > 0 && path[len - 1] == '/') {
+        len--;
+    }
+    if (len == 0 || len >= PATH_MAX_LEN) {
+        return 0;
+    }
+    char target[PATH_MAX_LEN + 1];
+    memcpy(target, path, len);
+    target[len] = '\0';
+
+    size_t name = len;
+    while (name > 0 && target[name - 1] != '/') {
+        name--;
+    }
+    char parent[PATH_MAX_LEN + 1];
+    memcpy(parent, target, name);
+    parent[name] = '\0';
+
+    /* the latest dumpdir of the parent directory decides whether the path is live */
+    for (size_t k = n; name > 0 && k-- > 0;) {
+        const tar_entry_t *dir = tar_index_find(chain[k], parent);
+        const char *data = dumpdir_of(chain[k], dir);
+        if (!data) {
+            continue;
+        }
+
+        const tar_entry_t *entry;
+        switch (dumpdir_find(data, dir->size, target + name, len - name)) {
+        case 'Y':
+            entry = tar_index_find(chain[k], target);
+            if (entry) {
+                plan_add(&p, k, entry);
+            }
+            break;
+        case 'N':
+            plan_unchanged(&p, k, target);
+            break;
+        case 'D':
+            entry = tar_index_find(chain[k], target);
+            if (entry) {
+                plan_dir(&p, k, entry);
+            }
+            break;
+        }
+        return p.count;
+    }
+
+    /* top-level paths, and archives that are not incremental dumps */
+    for (size_t k = n; k-- > 0;) {
+        const tar_entry_t *entry = tar_index_find(chain[k], target);
+        if (!entry) {
+            continue;
+        }
+        if (entry->typeflag == GNU_DUMPDIR || entry->typeflag == DIRTYPE) {
+            plan_dir(&p, k, entry);
+        } else {
+            plan_add(&p, k, entry);
+        }
+        break;
+    }
+    return p.count;
+}
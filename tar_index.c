@@ -0,0 +1,883 @@
+#include "lib_tar.h"
+#include "tar_internal.h"
+#include <string.h>
+#include <sys/stat.h>
+
+/**
+ * Hashes `len` bytes of `s` with a seeded FNV-1a followed by a final
+ * avalanche step, so that different seeds give independent hash functions.
+ */
+uint32_t tar_hash(uint32_t seed, const char *s, size_t len) {
+    uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) s[i];
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+/**
+ * Returns the length of `path` ignoring a single trailing slash, which lets
+ * directories be looked up with or without it like find_header() does.
+ */
+size_t path_key_len(const char *path) {
+    size_t len = strlen(path);
+    if (len > 0 && path[len - 1] == '/') {
+        len--;
+    }
+    return len;
+}
+
+/**
+ * Appends an entry to the index, growing the entry array when needed, and
+ * the dumpdirs with it once they exist.
+ */
+static tar_entry_t *index_append(tar_index_t *index) {
+    if (index->count == index->capacity) {
+        size_t capacity = index->capacity ? index->capacity * 2 : 64;
+        if (index->dumpdirs) {
+            char **dumpdirs = realloc(index->dumpdirs, capacity * sizeof(char *));
+            if (!dumpdirs) {
+                return NULL;
+            }
+            memset(dumpdirs + index->capacity, 0, (capacity - index->capacity) * sizeof(char *));
+            index->dumpdirs = dumpdirs;
+        }
+        tar_entry_t *entries = realloc(index->entries, capacity * sizeof(tar_entry_t));
+        if (!entries) {
+            return NULL;
+        }
+        index->entries = entries;
+        index->capacity = capacity;
+    }
+    tar_entry_t *entry = &index->entries[index->count++];
+    memset(entry, 0, sizeof(*entry));
+    return entry;
+}
+
+/**
+ * Fills `entry` from the header found at offset `off` of the archive.
+ */
+void entry_from_header(tar_entry_t *entry, const tar_header_t *hdr, off_t off) {
+    memset(entry, 0, sizeof(*entry));
+    header_path(entry->path, hdr);
+    memcpy(entry->linkname, hdr->linkname, sizeof(hdr->linkname));
+    entry->linkname[sizeof(hdr->linkname)] = '\0';
+    entry->typeflag = hdr->typeflag;
+    entry->size = TAR_INT(hdr->size);
+    entry->mode = TAR_INT(hdr->mode);
+    entry->uid = TAR_INT(hdr->uid);
+    entry->gid = TAR_INT(hdr->gid);
+    entry->mtime = TAR_INT(hdr->mtime);
+    entry->header_offset = off;
+    entry->data_offset = off + 512;
+}
+
+/**
+ * Appends the entry described by the header found at offset `off` of the
+ * archive to the index.  The path table is only updated by index_finish().
+ *
+ * @return the new entry, NULL if the index could not grow.
+ */
+tar_entry_t *index_add_header(tar_index_t *index, const tar_header_t *hdr, off_t off) {
+    tar_entry_t *entry = index_append(index);
+    if (!entry) {
+        return NULL;
+    }
+    entry_from_header(entry, hdr, off);
+    return entry;
+}
+
+/**
+ * Groups the occurrences of each path, in archive order.
+ */
+static struct tar_history *history_build(const struct tar_columns *columns, size_t count) {
+    struct tar_history *history = malloc(sizeof(*history));
+    if (!history) {
+        return NULL;
+    }
+    size_t n = count ? count : 1;
+    history->entries = malloc(n * sizeof(uint32_t));
+    history->start = malloc(n * sizeof(uint32_t));
+    history->count = calloc(n, sizeof(uint32_t));
+    if (!history->entries || !history->start || !history->count) {
+        history_free(history);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        history->count[columns->path[i]]++;
+    }
+    uint32_t next = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (columns->path[i] == i) {
+            history->start[i] = next;
+            next += history->count[i];
+        }
+    }
+    /* count is rebuilt while the entries are placed */
+    memset(history->count, 0, n * sizeof(uint32_t));
+    for (size_t i = 0; i < count; i++) {
+        uint32_t p = columns->path[i];
+        history->entries[history->start[p] + history->count[p]++] = i;
+    }
+    return history;
+}
+
+void history_free(struct tar_history *history) {
+    if (!history) {
+        return;
+    }
+    free(history->entries);
+    free(history->start);
+    free(history->count);
+    free(history);
+}
+
+/**
+ * Tells whether an entry is the last occurrence of its path, the one
+ * tar_index_find() returns.
+ */
+int index_is_latest(const tar_index_t *index, size_t i) {
+    const struct tar_history *history = index->history;
+    uint32_t p = index->columns->path[i];
+    return history->entries[history->start[p] + history->count[p] - 1] == i;
+}
+
+/**
+ * (Re)builds the path hash table and the metadata columns of the index, and
+ * computes its directory statistics unless they were loaded with it.  When a
+ * path occurs several times the last occurrence is found, matching
+ * find_header(), and every occurrence is kept in the history of the path.
+ */
+int index_finish(tar_index_t *index) {
+    size_t nslots = 16;
+    while (nslots < index->count * 2) {
+        nslots *= 2;
+    }
+
+    uint32_t *slots = calloc(nslots, sizeof(uint32_t));
+    uint32_t *path_ids = malloc((index->count ? index->count : 1) * sizeof(uint32_t));
+    if (!slots || !path_ids) {
+        free(slots);
+        free(path_ids);
+        return -1;
+    }
+
+    for (size_t i = 0; i < index->count; i++) {
+        const tar_entry_t *entry = &index->entries[i];
+        size_t klen = path_key_len(entry->path);
+        size_t s = tar_hash(0, entry->path, klen) & (nslots - 1);
+        int duplicate = 0;
+        while (slots[s] != 0) {
+            const tar_entry_t *other = &index->entries[slots[s] - 1];
+            if (path_key_len(other->path) == klen && strncmp(other->path, entry->path, klen) == 0) {
+                duplicate = 1;
+                break;
+            }
+            s = (s + 1) & (nslots - 1);
+        }
+        path_ids[i] = duplicate ? path_ids[slots[s] - 1] : i;
+        slots[s] = i + 1;
+    }
+
+    struct tar_columns *columns = columns_build(index, path_ids);
+    struct tar_history *history = columns ? history_build(columns, index->count) : NULL;
+    if (!history) {
+        columns_free(columns);
+        free(slots);
+        return -1;
+    }
+
+    free(index->slots);
+    columns_free(index->columns);
+    history_free(index->history);
+    index->slots = slots;
+    index->nslots = nslots;
+    index->columns = columns;
+    index->history = history;
+
+    if (!index->dirs) {
+        index->dirs = dirs_build(index);
+        if (!index->dirs) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Records the size and modification time of the archive in the index, so
+ * that a saved index can later be matched against the archive.
+ */
+int index_set_identity(tar_index_t *index, int tar_fd) {
+    struct stat st;
+    if (fstat(tar_fd, &st) == -1) {
+        return -1;
+    }
+    index->archive_size = st.st_size;
+    index->archive_mtime = st.st_mtim.tv_sec;
+    index->archive_mtime_nsec = st.st_mtim.tv_nsec;
+    index->archive_ino = st.st_ino;
+    return 0;
+}
+
+/**
+ * Writes the identity of the archive an index describes, IDENTITY_LEN bytes,
+ * for sidecar files to tell whether they still describe the archive.
+ */
+void put_identity(uint8_t *p, const tar_index_t *index) {
+    put_u64(p, index->archive_size);
+    put_u64(p + 8, index->archive_mtime);
+    put_u64(p + 16, index->archive_mtime_nsec);
+    put_u64(p + 24, index->archive_ino);
+}
+
+/**
+ * Tells whether an identity written by put_identity() is that of the archive
+ * an index describes.
+ */
+int identity_matches(const uint8_t *p, const tar_index_t *index) {
+    uint8_t id[IDENTITY_LEN];
+    put_identity(id, index);
+    return memcmp(p, id, IDENTITY_LEN) == 0;
+}
+
+/**
+ * Makes room for the dumpdirs of the entries, as many as the entry array
+ * holds so that index_append() keeps them the same size.
+ *
+ * @return the dumpdirs of the index, NULL if they could not be allocated.
+ */
+static char **index_dumpdirs(tar_index_t *index) {
+    if (!index->dumpdirs) {
+        index->dumpdirs = calloc(index->capacity ? index->capacity : 1, sizeof(char *));
+    }
+    return index->dumpdirs;
+}
+
+/**
+ * Indexes the archive stored in the `length` bytes of `tar_fd` starting at
+ * `base`.  Offsets in the index are relative to `base`, and the identity
+ * fields of the index are left for the caller to fill.
+ *
+ * @return the number of entries indexed, -1 if the index could not be allocated.
+ */
+ssize_t index_build_range(int tar_fd, off_t base, off_t length, tar_index_t *index) {
+    tar_header_t hdr;
+    off_t off = 0;
+    while (off + (off_t) sizeof(hdr) <= length &&
+           pread(tar_fd, &hdr, sizeof(hdr), base + off) == sizeof(hdr)) {
+        if (is_empty_block(&hdr)) {
+            break;
+        }
+
+        tar_entry_t *entry = index_add_header(index, &hdr, off);
+        if (!entry) {
+            tar_index_free(index);
+            return -1;
+        }
+
+        off += 512 + TAR_PADDED(entry->size);
+    }
+    index->end_offset = off;
+
+    /* dumpdirs are small, read them once the headers are known */
+    for (size_t i = 0; i < index->count; i++) {
+        const tar_entry_t *entry = &index->entries[i];
+        if (entry->typeflag != GNU_DUMPDIR || entry->size == 0) {
+            continue;
+        }
+        char *data = malloc(entry->size);
+        if (!data || !index_dumpdirs(index) ||
+            pread(tar_fd, data, entry->size, base + entry->data_offset) != (ssize_t) entry->size) {
+            free(data);
+            continue;
+        }
+        index->dumpdirs[i] = data;
+    }
+
+    if (index_finish(index) != 0) {
+        tar_index_free(index);
+        return -1;
+    }
+    return index->count;
+}
+
+/**
+ * Attaches the index of the archive stored in entry `i`, which the index then
+ * owns, replacing any previous one.
+ */
+int index_set_nested(tar_index_t *index, size_t i, tar_index_t *child) {
+    if (!index->nested) {
+        index->nested = calloc(index->count, sizeof(tar_index_t *));
+        if (!index->nested) {
+            return -1;
+        }
+    }
+    if (index->nested[i]) {
+        tar_index_free(index->nested[i]);
+        free(index->nested[i]);
+    }
+    index->nested[i] = child;
+    return 0;
+}
+
+/**
+ * Copies an index, with the indexes nested in it at any depth.
+ */
+int index_copy(tar_index_t *dst, const tar_index_t *src) {
+    *dst = *src;
+    dst->nested = NULL;
+    dst->slots = NULL;
+    dst->columns = NULL;
+    dst->history = NULL;
+    dst->dirs = NULL;
+    dst->dumpdirs = NULL;
+    dst->capacity = src->count ? src->count : 1;
+    dst->entries = malloc(dst->capacity * sizeof(tar_entry_t));
+    if (!dst->entries) {
+        memset(dst, 0, sizeof(*dst));
+        return -1;
+    }
+    memcpy(dst->entries, src->entries, src->count * sizeof(tar_entry_t));
+
+    int ok = 1;
+    for (size_t i = 0; src->dumpdirs && i < src->count && ok; i++) {
+        if (src->dumpdirs[i]) {
+            ok = index_dumpdirs(dst) && (dst->dumpdirs[i] = malloc(src->entries[i].size));
+            if (ok) {
+                memcpy(dst->dumpdirs[i], src->dumpdirs[i], src->entries[i].size);
+            }
+        }
+    }
+    for (size_t i = 0; src->nested && i < src->count && ok; i++) {
+        if (src->nested[i]) {
+            tar_index_t *child = malloc(sizeof(*child));
+            if (!child || index_copy(child, src->nested[i]) != 0) {
+                free(child);
+                ok = 0;
+            } else if (index_set_nested(dst, i, child) != 0) {
+                tar_index_free(child);
+                free(child);
+                ok = 0;
+            }
+        }
+    }
+    if (!ok || index_finish(dst) != 0) {
+        tar_index_free(dst);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Builds an in-memory index of every entry of an archive in a single pass.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file, its offset is not used nor modified.
+ * @param index The index to fill, released with tar_index_free().
+ *
+ * @return the number of entries indexed,
+ *         -1 if the index could not be allocated.
+ */
+ssize_t tar_index_build(int tar_fd, tar_index_t *index) {
+    memset(index, 0, sizeof(*index));
+    if (index_set_identity(index, tar_fd) != 0) {
+        return -1;
+    }
+    return index_build_range(tar_fd, 0, index->archive_size, index);
+}
+
+/**
+ * Copies the part of the dumpdir being captured found in the archive bytes
+ * [offset, offset + len).
+ */
+static void scan_capture(struct index_scan *scan, off_t offset, const uint8_t *buf, size_t len) {
+    if (!scan->capturing) {
+        return;
+    }
+    const tar_entry_t *entry = &scan->index->entries[scan->capture_entry];
+    off_t from = entry->data_offset > offset ? entry->data_offset : offset;
+    off_t to = entry->data_offset + (off_t) entry->size;
+    if (to > offset + (off_t) len) {
+        to = offset + len;
+    }
+    if (from < to) {
+        memcpy(scan->index->dumpdirs[scan->capture_entry] + (from - entry->data_offset), buf + (from - offset),
+               to - from);
+    }
+    scan->capturing = to < entry->data_offset + (off_t) entry->size;
+}
+
+/**
+ * Starts capturing the dumpdir of the entry just added.
+ */
+static int scan_start_capture(struct index_scan *scan, const tar_entry_t *entry) {
+    tar_index_t *index = scan->index;
+    size_t i = entry - index->entries;
+    if (!index_dumpdirs(index)) {
+        return -1;
+    }
+    index->dumpdirs[i] = malloc(entry->size);
+    if (!index->dumpdirs[i]) {
+        return -1;
+    }
+    scan->capture_entry = i;
+    scan->capturing = 1;
+    return 0;
+}
+
+/**
+ * Indexes the archive bytes [offset, offset + len), which must directly follow
+ * the bytes of the previous call.  Suitable as a gz_sink, so that compressed
+ * archives are indexed while they are decompressed.
+ *
+ * @return zero on success, -1 if the index could not grow.
+ */
+int index_scan_feed(off_t offset, const uint8_t *buf, size_t len, void *arg) {
+    struct index_scan *scan = arg;
+    off_t end = offset + len;
+    scan_capture(scan, offset, buf, len);
+
+    while (!scan->done && scan->next + (off_t) scan->have < end) {
+        off_t pos = scan->next + scan->have;
+        if (pos < offset) {
+            /* the header started before this chunk and was lost */
+            return -1;
+        }
+
+        size_t avail = end - pos;
+        size_t need = sizeof(scan->hdr) - scan->have;
+        size_t n = avail < need ? avail : need;
+        memcpy((uint8_t *) &scan->hdr + scan->have, buf + (pos - offset), n);
+        scan->have += n;
+        if (scan->have < sizeof(scan->hdr)) {
+            break;
+        }
+
+        scan->have = 0;
+        if (is_empty_block(&scan->hdr)) {
+            scan->done = 1;
+            break;
+        }
+        tar_entry_t *entry = index_add_header(scan->index, &scan->hdr, scan->next);
+        if (!entry) {
+            return -1;
+        }
+        if (entry->typeflag == GNU_DUMPDIR && entry->size > 0) {
+            if (scan_start_capture(scan, entry) != 0) {
+                return -1;
+            }
+            scan_capture(scan, offset, buf, len);
+        }
+        scan->next += 512 + TAR_PADDED(entry->size);
+    }
+    return 0;
+}
+
+/**
+ * Completes an index built with index_scan_feed().
+ */
+int index_scan_finish(struct index_scan *scan) {
+    if (scan->capturing) {
+        /* the archive ended within a dumpdir */
+        free(scan->index->dumpdirs[scan->capture_entry]);
+        scan->index->dumpdirs[scan->capture_entry] = NULL;
+    }
+    scan->index->end_offset = scan->next;
+    return index_finish(scan->index);
+}
+
+/**
+ * Releases the memory held by an index built with tar_index_build().
+ */
+void tar_index_free(tar_index_t *index) {
+    for (size_t i = 0; index->nested && i < index->count; i++) {
+        if (index->nested[i]) {
+            tar_index_free(index->nested[i]);
+            free(index->nested[i]);
+        }
+    }
+    free(index->nested);
+    for (size_t i = 0; index->dumpdirs && i < index->count; i++) {
+        free(index->dumpdirs[i]);
+    }
+    free(index->dumpdirs);
+    free(index->entries);
+    free(index->slots);
+    columns_free(index->columns);
+    history_free(index->history);
+    dirs_free(index->dirs);
+    memset(index, 0, sizeof(*index));
+}
+
+/**
+ * Looks up an entry of the index by path.
+ *
+ * @param index An index built with tar_index_build().
+ * @param path A path to an entry in the archive, directories may be given with or without their trailing slash.
+ *
+ * @return the entry at the given path, its last occurrence if the path occurs several times,
+ *         NULL if no such entry exists.
+ */
+const tar_entry_t *tar_index_find(const tar_index_t *index, const char *path) {
+    if (index->nslots == 0) {
+        return NULL;
+    }
+
+    size_t klen = path_key_len(path);
+    size_t s = tar_hash(0, path, klen) & (index->nslots - 1);
+    while (index->slots[s] != 0) {
+        const tar_entry_t *entry = &index->entries[index->slots[s] - 1];
+        if (path_key_len(entry->path) == klen && strncmp(entry->path, path, klen) == 0) {
+            return entry;
+        }
+        s = (s + 1) & (index->nslots - 1);
+    }
+    return NULL;
+}
+
+/**
+ * Gives every occurrence of a path in an index, in archive order.
+ *
+ * @param index An index built with tar_index_build().
+ * @param path A path to an entry in the archive, directories may be given with or without their trailing slash.
+ * @param versions Set to the numbers of the entries at the given path, the oldest first and the one
+ *                 tar_index_find() returns last.  The array belongs to the index.
+ *
+ * @return the number of occurrences of the path, zero if no entry exists at the given path.
+ */
+size_t tar_index_history(const tar_index_t *index, const char *path, const uint32_t **versions) {
+    const tar_entry_t *entry = tar_index_find(index, path);
+    if (!entry) {
+        *versions = NULL;
+        return 0;
+    }
+    const struct tar_history *history = index->history;
+    uint32_t p = index->columns->path[entry - index->entries];
+    *versions = history->entries + history->start[p];
+    return history->count[p];
+}
+
+/**
+ * Tells whether an index, typically loaded from a sidecar file, still
+ * describes an archive.
+ *
+ * @return zero if the archive changed since the index was built,
+ *         any other value otherwise.
+ */
+int tar_index_is_current(const tar_index_t *index, int tar_fd) {
+    struct stat st;
+    if (fstat(tar_fd, &st) == -1) {
+        return 0;
+    }
+    return st.st_size == index->archive_size && st.st_ino == index->archive_ino &&
+           st.st_mtim.tv_sec == index->archive_mtime && st.st_mtim.tv_nsec == index->archive_mtime_nsec;
+}
+
+/*
+ * Saved index layout, numbers being 64-bit little-endian unless noted:
+ *
+ *   "TARIDX06" archive_size archive_mtime archive_mtime_nsec archive_ino end_offset count
+ *   count times: header_offset size mode uid gid mtime typeflag (8 bits)
+ *                path length (16 bits) path linkname length (16 bits) linkname
+ *   nested
+ *   nested times: entry number, saved index of the archive stored in that entry
+ *   dirs
+ *   dirs times: path length (16 bits) path size files subdirs symlinks max_mtime
+ *   dumpdirs
+ *   dumpdirs times: entry number, dumpdir (entry size bytes)
+ */
+#define INDEX_MAGIC "TARIDX06"
+#define INDEX_MAGLEN 8
+
+/**
+ * A growable output buffer, so that an index is written with a few large
+ * write() calls.
+ */
+struct wbuf {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+    int failed;
+};
+
+static void wbuf_put(struct wbuf *b, const void *p, size_t len) {
+    if (b->failed) {
+        return;
+    }
+    if (b->len + len > b->cap) {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap < b->len + len) {
+            cap *= 2;
+        }
+        uint8_t *data = realloc(b->data, cap);
+        if (!data) {
+            b->failed = 1;
+            return;
+        }
+        b->data = data;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, p, len);
+    b->len += len;
+}
+
+static void wbuf_u64(struct wbuf *b, uint64_t v) {
+    uint8_t tmp[8];
+    put_u64(tmp, v);
+    wbuf_put(b, tmp, sizeof(tmp));
+}
+
+static void wbuf_str(struct wbuf *b, const char *s) {
+    size_t len = strlen(s);
+    uint8_t tmp[2] = { len & 0xff, len >> 8 };
+    wbuf_put(b, tmp, sizeof(tmp));
+    wbuf_put(b, s, len);
+}
+
+/**
+ * Reader over a loaded index, every accessor fails once the data runs out.
+ */
+struct rbuf {
+    const uint8_t *data;
+    size_t len;
+    size_t pos;
+    int failed;
+};
+
+static const uint8_t *rbuf_get(struct rbuf *b, size_t len) {
+    if (b->failed || b->len - b->pos < len) {
+        b->failed = 1;
+        return NULL;
+    }
+    const uint8_t *p = b->data + b->pos;
+    b->pos += len;
+    return p;
+}
+
+static uint64_t rbuf_u64(struct rbuf *b) {
+    const uint8_t *p = rbuf_get(b, 8);
+    return p ? get_u64(p) : 0;
+}
+
+static void rbuf_str(struct rbuf *b, char *out, size_t out_len) {
+    const uint8_t *p = rbuf_get(b, 2);
+    size_t len = p ? p[0] | (p[1] << 8) : 0;
+    if (len >= out_len) {
+        b->failed = 1;
+        return;
+    }
+    p = rbuf_get(b, len);
+    if (p) {
+        memcpy(out, p, len);
+        out[len] = '\0';
+    }
+}
+
+/**
+ * Appends the serialized form of an index and of its nested indexes.
+ */
+static void index_encode(struct wbuf *b, const tar_index_t *index) {
+    wbuf_put(b, INDEX_MAGIC, INDEX_MAGLEN);
+    uint8_t id[IDENTITY_LEN];
+    put_identity(id, index);
+    wbuf_put(b, id, sizeof(id));
+    wbuf_u64(b, index->end_offset);
+    wbuf_u64(b, index->count);
+    for (size_t i = 0; i < index->count; i++) {
+        const tar_entry_t *entry = &index->entries[i];
+        wbuf_u64(b, entry->header_offset);
+        wbuf_u64(b, entry->size);
+        wbuf_u64(b, entry->mode);
+        wbuf_u64(b, entry->uid);
+        wbuf_u64(b, entry->gid);
+        wbuf_u64(b, entry->mtime);
+        wbuf_put(b, &entry->typeflag, 1);
+        wbuf_str(b, entry->path);
+        wbuf_str(b, entry->linkname);
+    }
+
+    size_t nested = 0;
+    for (size_t i = 0; index->nested && i < index->count; i++) {
+        nested += index->nested[i] != NULL;
+    }
+    wbuf_u64(b, nested);
+    for (size_t i = 0; nested > 0 && i < index->count; i++) {
+        if (index->nested[i]) {
+            wbuf_u64(b, i);
+            index_encode(b, index->nested[i]);
+        }
+    }
+
+    const struct tar_dirs *dirs = index->dirs;
+    wbuf_u64(b, dirs->count);
+    for (size_t d = 0; d < dirs->count; d++) {
+        const tar_dir_stats_t *stats = &dirs->stats[d];
+        wbuf_str(b, stats->path);
+        wbuf_u64(b, stats->size);
+        wbuf_u64(b, stats->files);
+        wbuf_u64(b, stats->dirs);
+        wbuf_u64(b, stats->symlinks);
+        wbuf_u64(b, stats->max_mtime);
+    }
+
+    size_t dumpdirs = 0;
+    for (size_t i = 0; index->dumpdirs && i < index->count; i++) {
+        dumpdirs += index->dumpdirs[i] != NULL;
+    }
+    wbuf_u64(b, dumpdirs);
+    for (size_t i = 0; dumpdirs > 0 && i < index->count; i++) {
+        if (index->dumpdirs[i]) {
+            wbuf_u64(b, i);
+            wbuf_put(b, index->dumpdirs[i], index->entries[i].size);
+        }
+    }
+}
+
+/**
+ * Parses an index serialized by index_encode().
+ */
+static int index_decode(struct rbuf *b, tar_index_t *index) {
+    memset(index, 0, sizeof(*index));
+
+    const uint8_t *magic = rbuf_get(b, INDEX_MAGLEN);
+    if (!magic || memcmp(magic, INDEX_MAGIC, INDEX_MAGLEN) != 0) {
+        return -1;
+    }
+
+    index->archive_size = rbuf_u64(b);
+    index->archive_mtime = rbuf_u64(b);
+    index->archive_mtime_nsec = rbuf_u64(b);
+    index->archive_ino = rbuf_u64(b);
+    index->end_offset = rbuf_u64(b);
+    uint64_t count = rbuf_u64(b);
+    for (uint64_t i = 0; i < count && !b->failed; i++) {
+        tar_entry_t *entry = index_append(index);
+        if (!entry) {
+            b->failed = 1;
+            break;
+        }
+        entry->header_offset = rbuf_u64(b);
+        entry->data_offset = entry->header_offset + 512;
+        entry->size = rbuf_u64(b);
+        entry->mode = rbuf_u64(b);
+        entry->uid = rbuf_u64(b);
+        entry->gid = rbuf_u64(b);
+        entry->mtime = rbuf_u64(b);
+        const uint8_t *typeflag = rbuf_get(b, 1);
+        entry->typeflag = typeflag ? (char) *typeflag : 0;
+        rbuf_str(b, entry->path, sizeof(entry->path));
+        rbuf_str(b, entry->linkname, sizeof(entry->linkname));
+    }
+
+    uint64_t nested = rbuf_u64(b);
+    for (uint64_t n = 0; n < nested && !b->failed; n++) {
+        uint64_t i = rbuf_u64(b);
+        tar_index_t *child = malloc(sizeof(*child));
+        if (!child || i >= index->count || index_set_nested(index, i, child) != 0) {
+            free(child);
+            b->failed = 1;
+            break;
+        }
+        if (index_decode(b, child) != 0) {
+            b->failed = 1;
+        }
+    }
+
+    uint64_t ndirs = rbuf_u64(b);
+    index->dirs = calloc(1, sizeof(struct tar_dirs));
+    if (!index->dirs) {
+        b->failed = 1;
+    }
+    for (uint64_t d = 0; d < ndirs && !b->failed; d++) {
+        char path[sizeof(index->dirs->stats->path)];
+        rbuf_str(b, path, sizeof(path));
+        ssize_t n = b->failed ? -1 : dirs_insert(index->dirs, path, strlen(path));
+        if (n < 0) {
+            b->failed = 1;
+            break;
+        }
+        tar_dir_stats_t *stats = &index->dirs->stats[n];
+        stats->size = rbuf_u64(b);
+        stats->files = rbuf_u64(b);
+        stats->dirs = rbuf_u64(b);
+        stats->symlinks = rbuf_u64(b);
+        stats->max_mtime = rbuf_u64(b);
+    }
+    if (ndirs == 0) {
+        /* every index has at least its root */
+        b->failed = 1;
+    }
+
+    uint64_t dumpdirs = rbuf_u64(b);
+    for (uint64_t n = 0; n < dumpdirs && !b->failed; n++) {
+        uint64_t i = rbuf_u64(b);
+        const uint8_t *data = i < index->count ? rbuf_get(b, index->entries[i].size) : NULL;
+        if (!data || !index_dumpdirs(index) || index->dumpdirs[i] ||
+            !(index->dumpdirs[i] = malloc(index->entries[i].size))) {
+            b->failed = 1;
+            break;
+        }
+        memcpy(index->dumpdirs[i], data, index->entries[i].size);
+    }
+
+    if (b->failed || index_finish(index) != 0) {
+        tar_index_free(index);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Serializes an index, typically into a sidecar file next to the archive.
+ * The indexes of nested archives recorded with the index are saved with it.
+ *
+ * @param index An index built with tar_index_build() or loaded with tar_index_load().
+ * @param fd A file descriptor the index is written to, at its current offset.
+ *
+ * @return zero on success,
+ *         -1 if the index could not be written.
+ */
+int tar_index_save(const tar_index_t *index, int fd) {
+    struct wbuf b = { NULL, 0, 0, 0 };
+    index_encode(&b, index);
+
+    int ret = b.failed ? -1 : write_all(fd, b.data, b.len);
+    free(b.data);
+    return ret;
+}
+
+/**
+ * Loads an index saved with tar_index_save().
+ *
+ * @param fd A file descriptor positioned at the start of a saved index, which is read until its end.
+ * @param index The index to fill, released with tar_index_free().
+ *
+ * @return the number of entries loaded,
+ *         -1 if the index could not be read or is malformed.
+ */
+ssize_t tar_index_load(int fd, tar_index_t *index) {
+    memset(index, 0, sizeof(*index));
+
+    struct wbuf raw = { NULL, 0, 0, 0 };
+    uint8_t chunk[64 * 1024];
+    ssize_t r;
+    while ((r = read(fd, chunk, sizeof(chunk))) > 0) {
+        wbuf_put(&raw, chunk, r);
+    }
+    if (r < 0 || raw.failed) {
+        free(raw.data);
+        return -1;
+    }
+
+    struct rbuf b = { raw.data, raw.len, 0, 0 };
+    int ret = index_decode(&b, index);
+    free(raw.data);
+    return ret == 0 ? (ssize_t) index->count : -1;
+}
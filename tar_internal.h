@@ -0,0 +1,215 @@
+#ifndef TAR_INTERNAL_H
+#define TAR_INTERNAL_H
+
+#include "lib_tar.h"
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * Helpers shared between the lib_tar translation units.  Nothing in this
+ * header is part of the public API.
+ */
+
+/* Size of a member's data rounded up to the 512-byte block boundary */
+#define TAR_PADDED(size) ((((size) + 511) / 512) * 512)
+
+/* GNU incremental directory entry, its data listing the directory contents */
+#define GNU_DUMPDIR 'D'
+
+int is_empty_block(const tar_header_t *hdr);
+void header_path(char *out, const tar_header_t *hdr);
+int header_matches(const tar_header_t *hdr, const char *path);
+int header_checksum_ok(const tar_header_t *hdr);
+int check_header(const tar_header_t *hdr);
+int header_set_octal(char *field, size_t field_len, unsigned long value);
+void header_update_checksum(tar_header_t *hdr);
+
+uint32_t tar_hash(uint32_t seed, const char *s, size_t len);
+size_t path_key_len(const char *path);
+void entry_from_header(tar_entry_t *entry, const tar_header_t *hdr, off_t off);
+tar_entry_t *index_add_header(tar_index_t *index, const tar_header_t *hdr, off_t off);
+int index_finish(tar_index_t *index);
+int index_set_identity(tar_index_t *index, int tar_fd);
+
+/* Archive identity recorded in sidecar files: size, mtime, mtime nanoseconds and inode */
+#define IDENTITY_LEN 32
+
+void put_identity(uint8_t *p, const tar_index_t *index);
+int identity_matches(const uint8_t *p, const tar_index_t *index);
+ssize_t index_build_range(int tar_fd, off_t base, off_t length, tar_index_t *index);
+int index_set_nested(tar_index_t *index, size_t i, tar_index_t *child);
+int index_copy(tar_index_t *dst, const tar_index_t *src);
+
+/* Entry metadata of an index, one array per field */
+struct tar_columns {
+    uint8_t *type;
+    uint64_t *size;
+    int64_t *mtime;
+    uint32_t *uid;
+    uint32_t *gid;
+    uint32_t *mode;
+    uint32_t *path;
+};
+
+struct tar_columns *columns_build(const tar_index_t *index, uint32_t *path_ids);
+void columns_free(struct tar_columns *columns);
+
+/* Statistics of every directory of an index, the root first */
+struct tar_dirs {
+    tar_dir_stats_t *stats;
+    size_t count;
+    size_t capacity;
+    uint32_t *slots;              /* open-addressing path table, directory number + 1 or zero */
+    size_t nslots;
+};
+
+/* Every occurrence of each path, in archive order */
+struct tar_history {
+    uint32_t *entries;            /* entry numbers grouped by path */
+    uint32_t *start;              /* by path id, first item of the path in `entries` */
+    uint32_t *count;              /* by path id, number of occurrences of the path */
+};
+
+void history_free(struct tar_history *history);
+int index_is_latest(const tar_index_t *index, size_t i);
+
+ssize_t dirs_insert(struct tar_dirs *dirs, const char *path, size_t len);
+struct tar_dirs *dirs_build(const tar_index_t *index);
+void dirs_free(struct tar_dirs *dirs);
+
+/* Incremental indexing of an archive whose bytes arrive in order */
+struct index_scan {
+    tar_index_t *index;
+    off_t next;                   /* offset of the next header */
+    tar_header_t hdr;             /* header being assembled */
+    size_t have;                  /* bytes of `hdr` received so far */
+    int done;                     /* the end-of-archive marker was seen */
+    size_t capture_entry;         /* entry whose dumpdir is being copied */
+    int capturing;
+};
+
+int index_scan_feed(off_t offset, const uint8_t *buf, size_t len, void *arg);
+int index_scan_finish(struct index_scan *scan);
+
+/* Random access into gzip data through access points, see tar_gz.c */
+typedef struct gz_index gz_index_t;
+typedef int (*gz_sink)(off_t offset, const uint8_t *buf, size_t len, void *arg);
+
+gz_index_t *gz_index_build(int fd, off_t base, off_t length, off_t span, gz_sink sink, void *arg);
+void gz_index_free(gz_index_t *gz);
+off_t gz_index_size(const gz_index_t *gz);
+int gz_index_save(const gz_index_t *gz, int fd, const uint8_t *identity);
+gz_index_t *gz_index_load(int fd, const uint8_t *identity);
+ssize_t gz_index_read(const gz_index_t *gz, int fd, uint8_t *dest, size_t len, off_t offset);
+
+/* Frame table ending the archives written by tar_compress(), see tar_compress.c */
+#define GZ_FRAMES_MAGIC "TARFRAME"
+#define GZ_FRAMES_PER_MEMBER 4000
+
+gz_index_t *gz_index_load_frames(int fd, off_t length);
+
+/* Random access into bzip2 data through its blocks, see tar_bz2.c */
+typedef struct bz_index bz_index_t;
+
+bz_index_t *bz_index_build(int fd, off_t length, gz_sink sink, void *arg);
+void bz_index_free(bz_index_t *bz);
+off_t bz_index_size(const bz_index_t *bz);
+ssize_t bz_index_read(bz_index_t *bz, int fd, uint8_t *dest, size_t len, off_t offset);
+int bz_index_save(const bz_index_t *bz, int fd, const uint8_t *identity);
+bz_index_t *bz_index_load(int fd, const uint8_t *identity);
+
+/* On-disk cache of decompressed members, see tar_cache.c */
+#define CACHE_USAGE_UNKNOWN ((size_t) -1)
+
+int cache_open(const char *dir, const char *key);
+int cache_store(const char *dir, const char *key, size_t budget, size_t *used,
+                int (*fill)(int fd, void *arg), void *arg);
+
+int read_exact(int fd, void *buf, size_t len);
+int write_all(int fd, const void *buf, size_t len);
+int copy_range(int in_fd, off_t *in_off, int out_fd, size_t len);
+int skip_input(int fd, size_t len);
+void put_u64(uint8_t *p, uint64_t v);
+uint64_t get_u64(const uint8_t *p);
+
+/**
+ * A byte range of the archive read while profiling.
+ */
+struct hot_range {
+    off_t off;
+    size_t len;
+};
+
+/* An archive opened with tar_open() */
+struct tar_archive {
+    int fd;
+    char *path;                   /* NULL for nested archives */
+    off_t base;                   /* offset of the archive within the file, non-zero for nested archives */
+    tar_archive_t *outer;         /* archive a nested archive was opened from, which it keeps open, NULL otherwise */
+    size_t outer_entry;           /* entry of `outer` holding the nested archive */
+    int refs;                     /* the handle itself and each nested archive opened from it */
+    tar_index_t index;
+    int index_dirty;              /* the sidecar index must be saved again */
+    int save_index;               /* indexes built are saved in sidecars, TAR_OPEN_SAVE_INDEX */
+
+    int profiling;                /* accesses are being recorded, read and written atomically */
+    struct timespec opened;
+    unsigned profile_seconds;
+    struct hot_range *ranges;
+    size_t nranges;
+    size_t ranges_cap;
+    pthread_mutex_t lock;         /* protects the profile */
+
+    gz_index_t *gz;               /* access points of a gzip-compressed archive, NULL otherwise */
+    bz_index_t *bz;               /* blocks of a bzip2-compressed archive, NULL otherwise */
+    char *cache_dir;              /* decompressed member cache, NULL when disabled */
+    size_t cache_budget;
+    size_t cache_used;            /* bytes the cache directory is known to hold, see cache_store() */
+    uint64_t identity;            /* hash of the archive device and identity, see put_identity() */
+    uint32_t *reads;              /* reads of each entry, to find the members worth caching */
+    uint8_t *cache_checked;       /* whether the cache file of each entry was checksummed, set atomically */
+
+    struct line_index **lines;    /* line index of each entry, built on demand, NULL until first used */
+    int lines_dirty;              /* some line index must be saved */
+
+    int decompress;               /* tar_read() decompresses ".gz" members */
+    gz_index_t **members_gz;      /* access points of each compressed member, built on demand */
+    uint8_t *members_tried;       /* whether each member was already probed for compression */
+
+    int *volumes;                 /* descriptors of a multi-volume set, `fd` being the first, NULL otherwise */
+    size_t nvolumes;
+    struct tar_extent *extents;   /* data extents of every entry of a multi-volume set, in entry order */
+    size_t *entry_extents;        /* first extent of each entry, count + 1 items */
+
+    struct crc_table *crcs;       /* checksums of the member data, NULL unless reads are verified */
+};
+
+/* A piece of member data stored contiguously in one volume */
+struct tar_extent {
+    size_t volume;
+    off_t offset;
+    off_t length;
+};
+
+void sidecar_path(char *out, size_t out_len, const tar_archive_t *ar, const char *suffix);
+int sidecar_save(const tar_archive_t *ar, const char *suffix,
+                 int (*save)(const tar_archive_t *ar, int fd));
+const tar_entry_t *resolve_entry(const tar_archive_t *ar, const char *path);
+ssize_t read_entry_data(tar_archive_t *ar, const tar_entry_t *entry, uint8_t *dest, size_t len, size_t offset);
+ssize_t read_entry_stored(tar_archive_t *ar, const tar_entry_t *entry, uint8_t *dest, size_t len, size_t offset);
+void close_lines(tar_archive_t *ar);
+ssize_t volume_read(const tar_archive_t *ar, const tar_entry_t *entry, uint8_t *dest, size_t len, size_t offset);
+void close_volumes(tar_archive_t *ar);
+
+/* CRC32C checksums of member data, see tar_crc.c */
+struct crc_table;
+
+/* read_entry_data() result for data not matching its checksum */
+#define READ_CORRUPT (-3)
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+int crc_open(tar_archive_t *ar);
+void crc_table_free(struct crc_table *t);
+ssize_t crc_read(tar_archive_t *ar, const tar_entry_t *entry, uint8_t *dest, size_t len, size_t offset);
+
+#endif
@@ -0,0 +1,148 @@
+#define _GNU_SOURCE
+#include "lib_tar.h"
+#include "tar_internal.h"
+#include <errno.h>
+#include <fcntl.h>
+
+/* Size of the bounce buffer used when the kernel cannot copy for us */
+#define COPY_BUF_SIZE (64 * 1024)
+
+/**
+ * Copies `len` bytes using read() and write(), used when copy_file_range()
+ * is not supported between the two descriptors.
+ */
+static int copy_range_slow(int in_fd, off_t *in_off, int out_fd, size_t len) {
+    uint8_t buf[COPY_BUF_SIZE];
+    while (len > 0) {
+        size_t chunk = len < sizeof(buf) ? len : sizeof(buf);
+        ssize_t r = in_off ? pread(in_fd, buf, chunk, *in_off) : read(in_fd, buf, chunk);
+        if (r <= 0) {
+            return -1;
+        }
+        if (write_all(out_fd, buf, r) != 0) {
+            return -1;
+        }
+        if (in_off) {
+            *in_off += r;
+        }
+        len -= r;
+    }
+    return 0;
+}
+
+/**
+ * Copies `len` bytes with splice(), which moves pages without copying them
+ * through user space when one of the descriptors is a pipe.  Falls back to
+ * read() and write() when neither is.
+ */
+static int copy_range_splice(int in_fd, off_t *in_off, int out_fd, size_t len) {
+    while (len > 0) {
+        ssize_t r = splice(in_fd, (loff_t *) in_off, out_fd, NULL, len, SPLICE_F_MOVE);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EINVAL) {
+                return copy_range_slow(in_fd, in_off, out_fd, len);
+            }
+            return -1;
+        }
+        if (r == 0) {
+            return -1;
+        }
+        len -= r;
+    }
+    return 0;
+}
+
+/**
+ * Writes the whole buffer, retrying on short writes.
+ *
+ * @return zero on success, -1 on error.
+ */
+int write_all(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t w = write(fd, p, len);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += w;
+        len -= w;
+    }
+    return 0;
+}
+
+/**
+ * Reads exactly `len` bytes from the current offset of `fd`.
+ *
+ * @return zero on success, -1 on error or end of file.
+ */
+int read_exact(int fd, void *buf, size_t len) {
+    uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t r = read(fd, p, len);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return -1;
+        }
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+/**
+ * Copies `len` bytes from `in_fd` to the current offset of `out_fd`, inside
+ * the kernel with copy_file_range() between files or splice() when a pipe is
+ * involved, and through a user space buffer otherwise.  The bytes are read at
+ * `*in_off`, which is advanced, or at the current offset of `in_fd` when
+ * `in_off` is NULL.
+ *
+ * @return zero on success, -1 on error or if the input ends early.
+ */
+int copy_range(int in_fd, off_t *in_off, int out_fd, size_t len) {
+    while (len > 0) {
+        ssize_t r = copy_file_range(in_fd, in_off, out_fd, NULL, len, 0);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) {
+                return copy_range_splice(in_fd, in_off, out_fd, len);
+            }
+            return -1;
+        }
+        if (r == 0) {
+            return -1;
+        }
+        len -= r;
+    }
+    return 0;
+}
+
+/**
+ * Stores a 64-bit value in little-endian byte order, the byte order of every
+ * file format written by the library.
+ */
+void put_u64(uint8_t *p, uint64_t v) {
+    for (int i = 0; i < 8; i++) {
+        p[i] = v >> (8 * i);
+    }
+}
+
+/**
+ * Loads a 64-bit value stored by put_u64().
+ */
+uint64_t get_u64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) {
+        v |= (uint64_t) p[i] << (8 * i);
+    }
+    return v;
+}
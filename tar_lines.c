@@ -0,0 +1,367 @@
+#include "lib_tar.h"
+#include "tar_internal.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/*
+ * Line indexes record the offset of every LINE_STEP-th line of a member, so
+ * that reaching any line costs one lookup and a scan of at most LINE_STEP
+ * lines.  They are built on the first line query of a member and saved in
+ * the "<archive>.lines" sidecar when the archive is closed:
+ *
+ *   "TARLIN02" identity step count                       (64-bit little-endian)
+ *   count times: entry number, lines, marks, marks offsets
+ *
+ * A member of n lines has 1 + n / LINE_STEP marks, one less when its last
+ * line ends the LINE_STEP-th group without a newline.  Loaded records are
+ * checked against that and against the member, the sidecar is not trusted.
+ */
+#define LINE_STEP 1024
+#define LINE_CHUNK (1024 * 1024)
+
+#define LINES_MAGIC "TARLIN02"
+#define LINES_MAGLEN 8
+
+struct line_index {
+    size_t lines;                 /* number of lines of the member */
+    size_t nmarks;
+    off_t *marks;                 /* offset of line k * LINE_STEP */
+};
+
+static int add_mark(struct line_index *li, size_t *capacity, off_t off) {
+    if (li->nmarks == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 16;
+        off_t *marks = realloc(li->marks, *capacity * sizeof(off_t));
+        if (!marks) {
+            return -1;
+        }
+        li->marks = marks;
+    }
+    li->marks[li->nmarks++] = off;
+    return 0;
+}
+
+/**
+ * Builds the line index of a member with a single pass over its data.
+ *
+ * @param corrupt Set to 1 if the index could not be built because the data does not match its checksum.
+ */
+static struct line_index *build_lines(tar_archive_t *ar, const tar_entry_t *entry, int *corrupt) {
+    struct line_index *li = calloc(1, sizeof(*li));
+    uint8_t *buf = malloc(LINE_CHUNK);
+    size_t capacity = 0;
+    if (!li || !buf || add_mark(li, &capacity, 0) != 0) {
+        goto fail;
+    }
+
+    size_t newlines = 0;
+    for (size_t off = 0; off < entry->size;) {
+        size_t want = entry->size - off < LINE_CHUNK ? entry->size - off : LINE_CHUNK;
+        ssize_t r = read_entry_data(ar, entry, buf, want, off);
+        if (r <= 0) {
+            *corrupt = r == READ_CORRUPT;
+            goto fail;
+        }
+        /* memchr() is vectorized by the C library */
+        for (const uint8_t *p = buf, *end = buf + r; (p = memchr(p, '\n', end - p)) != NULL; p++) {
+            newlines++;
+            if (newlines % LINE_STEP == 0 && add_mark(li, &capacity, off + (p - buf) + 1) != 0) {
+                goto fail;
+            }
+        }
+        off += r;
+    }
+
+    uint8_t last = '\n';
+    ssize_t r = entry->size > 0 ? read_entry_data(ar, entry, &last, 1, entry->size - 1) : 1;
+    if (r != 1) {
+        *corrupt = r == READ_CORRUPT;
+        goto fail;
+    }
+    li->lines = newlines + (last != '\n');
+    free(buf);
+    return li;
+
+fail:
+    if (li) {
+        free(li->marks);
+    }
+    free(li);
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Returns the offset of the start of line `line` (from zero) of a member,
+ * the member size for the line after the last one, -1 on error, READ_CORRUPT
+ * if the data does not match its checksum.
+ */
+static off_t line_offset(tar_archive_t *ar, const tar_entry_t *entry, const struct line_index *li, size_t line) {
+    if (line >= li->lines) {
+        return line == li->lines ? (off_t) entry->size : -1;
+    }
+
+    off_t off = li->marks[line / LINE_STEP];
+    size_t skip = line % LINE_STEP;
+    uint8_t buf[64 * 1024];
+    while (skip > 0) {
+        ssize_t r = read_entry_data(ar, entry, buf, sizeof(buf), off);
+        if (r <= 0) {
+            return r == READ_CORRUPT ? READ_CORRUPT : -1;
+        }
+        const uint8_t *p = buf, *end = buf + r;
+        while (skip > 0 && (p = memchr(p, '\n', end - p)) != NULL) {
+            p++;
+            skip--;
+        }
+        off += skip > 0 ? r : p - buf;
+    }
+    return off;
+}
+
+static void free_lines(struct line_index *li) {
+    if (li) {
+        free(li->marks);
+        free(li);
+    }
+}
+
+static int save_lines(const tar_archive_t *ar, int fd) {
+    size_t count = 0;
+    for (size_t i = 0; i < ar->index.count; i++) {
+        count += ar->lines[i] != NULL;
+    }
+
+    uint8_t hdr[LINES_MAGLEN + IDENTITY_LEN + 16];
+    memcpy(hdr, LINES_MAGIC, LINES_MAGLEN);
+    put_identity(hdr + LINES_MAGLEN, &ar->index);
+    put_u64(hdr + LINES_MAGLEN + IDENTITY_LEN, LINE_STEP);
+    put_u64(hdr + LINES_MAGLEN + IDENTITY_LEN + 8, count);
+    if (write_all(fd, hdr, sizeof(hdr)) != 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < ar->index.count; i++) {
+        const struct line_index *li = ar->lines[i];
+        if (!li) {
+            continue;
+        }
+        size_t len = (3 + li->nmarks) * 8;
+        uint8_t *rec = malloc(len);
+        if (!rec) {
+            return -1;
+        }
+        put_u64(rec, i);
+        put_u64(rec + 8, li->lines);
+        put_u64(rec + 16, li->nmarks);
+        for (size_t k = 0; k < li->nmarks; k++) {
+            put_u64(rec + 24 + 8 * k, li->marks[k]);
+        }
+        int ret = write_all(fd, rec, len);
+        free(rec);
+        if (ret != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Tells whether a loaded line index can describe a member: its marks are as
+ * many as its lines call for, increasing, and within the member.
+ */
+static int lines_valid(const struct line_index *li, const tar_entry_t *entry) {
+    if (li->lines > entry->size || (li->lines == 0) != (entry->size == 0) ||
+        li->nmarks < 1 + (li->lines ? li->lines - 1 : 0) / LINE_STEP || li->nmarks > 1 + li->lines / LINE_STEP ||
+        li->marks[0] != 0) {
+        return 0;
+    }
+    for (size_t k = 1; k < li->nmarks; k++) {
+        if (li->marks[k] <= li->marks[k - 1] || (uint64_t) li->marks[k] > entry->size) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Loads the line indexes saved by a previous handle, if they still describe
+ * the archive.  Loading stops at the first record that is truncated or does
+ * not fit its member.
+ */
+static void load_lines(tar_archive_t *ar) {
+    char path[4096];
+    if (!ar->path) {
+        return;
+    }
+    sidecar_path(path, sizeof(path), ar, "lines");
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return;
+    }
+
+    struct stat st;
+    uint8_t hdr[LINES_MAGLEN + IDENTITY_LEN + 16];
+    if (fstat(fd, &st) != 0 || read_exact(fd, hdr, sizeof(hdr)) != 0 ||
+        memcmp(hdr, LINES_MAGIC, LINES_MAGLEN) != 0 || !identity_matches(hdr + LINES_MAGLEN, &ar->index) ||
+        get_u64(hdr + LINES_MAGLEN + IDENTITY_LEN) != LINE_STEP) {
+        close(fd);
+        return;
+    }
+
+    uint64_t count = get_u64(hdr + LINES_MAGLEN + IDENTITY_LEN + 8);
+    uint64_t left = st.st_size - sizeof(hdr);
+    for (uint64_t n = 0; n < count; n++) {
+        uint8_t rec[24];
+        if (left < sizeof(rec) || read_exact(fd, rec, sizeof(rec)) != 0) {
+            break;
+        }
+        left -= sizeof(rec);
+        uint64_t i = get_u64(rec);
+        uint64_t lines = get_u64(rec + 8);
+        uint64_t nmarks = get_u64(rec + 16);
+        /* the marks must be in the file, which also bounds the allocation */
+        if (i >= ar->index.count || nmarks == 0 || nmarks > left / 8) {
+            break;
+        }
+        left -= nmarks * 8;
+
+        struct line_index *li = calloc(1, sizeof(*li));
+        uint8_t *raw = malloc(nmarks * 8);
+        if (li) {
+            li->lines = lines;
+            li->nmarks = nmarks;
+            li->marks = malloc(nmarks * sizeof(off_t));
+        }
+        if (!li || !li->marks || !raw || read_exact(fd, raw, nmarks * 8) != 0) {
+            free_lines(li);
+            free(raw);
+            break;
+        }
+        for (size_t k = 0; k < nmarks; k++) {
+            li->marks[k] = get_u64(raw + 8 * k);
+        }
+        free(raw);
+        if (!lines_valid(li, &ar->index.entries[i])) {
+            free_lines(li);
+            break;
+        }
+        free_lines(ar->lines[i]);
+        ar->lines[i] = li;
+    }
+    close(fd);
+}
+
+/**
+ * Returns the line index of a member, loading or building it on first use.
+ * The member is scanned without holding the archive lock, so that reads of
+ * other members go on meanwhile, and the first index built is kept when two
+ * threads race to build the same one.
+ *
+ * @param corrupt Set to 1 if the index could not be built because the data does not match its checksum.
+ */
+static const struct line_index *get_lines(tar_archive_t *ar, const tar_entry_t *entry, int *corrupt) {
+    size_t i = entry - ar->index.entries;
+    pthread_mutex_lock(&ar->lock);
+    if (!ar->lines) {
+        ar->lines = calloc(ar->index.count ? ar->index.count : 1, sizeof(struct line_index *));
+        if (ar->lines) {
+            load_lines(ar);
+        }
+    }
+    struct line_index *li = ar->lines ? ar->lines[i] : NULL;
+    int have_lines = ar->lines != NULL;
+    pthread_mutex_unlock(&ar->lock);
+    if (li || !have_lines) {
+        return li;
+    }
+
+    struct line_index *built = build_lines(ar, entry, corrupt);
+    if (!built) {
+        return NULL;
+    }
+    pthread_mutex_lock(&ar->lock);
+    if (!ar->lines[i]) {
+        ar->lines[i] = built;
+        ar->lines_dirty = 1;
+        built = NULL;
+    }
+    li = ar->lines[i];
+    pthread_mutex_unlock(&ar->lock);
+    free_lines(built);
+    return li;
+}
+
+/**
+ * Saves the line indexes built by the handle, with TAR_OPEN_SAVE_INDEX, and
+ * releases them.
+ */
+void close_lines(tar_archive_t *ar) {
+    if (!ar->lines) {
+        return;
+    }
+    if (ar->lines_dirty && ar->save_index) {
+        sidecar_save(ar, "lines", save_lines);
+    }
+    for (size_t i = 0; i < ar->index.count; i++) {
+        free_lines(ar->lines[i]);
+    }
+    free(ar->lines);
+    ar->lines = NULL;
+}
+
+/**
+ * Reads a range of lines of a text file in an archive opened with tar_open().
+ *
+ * @param ar An archive opened with tar_open().
+ * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param first_line The number of the first line to read, the first line of the file being line 1.
+ * @param count The number of lines to read.
+ * @param dest A destination buffer to read the lines into, newlines included.
+ * @param len An in-out argument.
+ *            The caller set it to the size of dest.
+ *            The callee set it to the number of bytes written to dest.
+ *
+ * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the first line is outside the file,
+ *         zero if the requested lines were read in their entirety into the destination buffer,
+ *         -3 if the lines read do not match their checksum, with TAR_OPEN_VERIFY,
+ *         a positive value if the lines were partially read, representing the remaining bytes left to be read to
+ *         reach the end of the last requested line.
+ */
+ssize_t tar_read_lines(tar_archive_t *ar, const char *path, size_t first_line, size_t count,
+                       uint8_t *dest, size_t *len) {
+    const tar_entry_t *entry = resolve_entry(ar, path);
+    if (!entry || !(entry->typeflag == REGTYPE || entry->typeflag == AREGTYPE)) {
+        return -1;
+    }
+
+    int corrupt = 0;
+    const struct line_index *li = get_lines(ar, entry, &corrupt);
+    if (!li) {
+        return corrupt ? -3 : -1;
+    }
+    if (first_line == 0 || first_line > li->lines) {
+        return -2;
+    }
+
+    /* lines past the end of the member stop at its end, without wrapping around */
+    size_t last = count < li->lines - (first_line - 1) ? first_line - 1 + count : li->lines;
+    off_t start = line_offset(ar, entry, li, first_line - 1);
+    off_t end = last >= li->lines ? (off_t) entry->size : line_offset(ar, entry, li, last);
+    if (start < 0 || end < 0) {
+        return start == READ_CORRUPT || end == READ_CORRUPT ? -3 : -1;
+    }
+
+    size_t to_read = end - start;
+    if (to_read > *len) {
+        to_read = *len;
+    }
+    ssize_t r = read_entry_data(ar, entry, dest, to_read, start);
+    if (r < 0) {
+        return r == READ_CORRUPT ? -3 : -1;
+    }
+    *len = r;
+    return (end - start) - r;
+}
@@ -0,0 +1,405 @@
+#define _GNU_SOURCE
+#include "lib_tar.h"
+#include "tar_internal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/*
+ * Long operations periodically persist their progress in a checkpoint file,
+ * numbers being 64-bit little-endian:
+ *
+ *   "TARCKPT2" operation next_offset processed outputs
+ *   archive_size archive_mtime archive_mtime_nsec archive_inode
+ *   recent: the header offsets of the last CKPT_VERIFY_ENTRIES entries, oldest first
+ *
+ * The record has a fixed size whatever the archive, so a checkpoint costs the
+ * same at the end of an archive as at its start.  It is written next to its
+ * final name, synced and renamed over it, then its directory is synced so
+ * that the rename itself is durable: a crash leaves either the previous or
+ * the new checkpoint.  When extracting, the outputs written since
+ * the previous checkpoint are synced with a single syncfs() before the
+ * checkpoint records them as completed.
+ */
+#define CKPT_MAGIC "TARCKPT2"
+#define CKPT_MAGLEN 8
+
+#define OP_CHECK   1
+#define OP_EXTRACT 2
+
+/* A checkpoint is written after this many entries or archive bytes */
+#define CKPT_INTERVAL_ENTRIES 4096
+#define CKPT_INTERVAL_BYTES (256 * 1024 * 1024)
+
+/* Entries whose headers are re-read before trusting a checkpoint */
+#define CKPT_VERIFY_ENTRIES 4
+
+#define CKPT_LEN (CKPT_MAGLEN + (8 + CKPT_VERIFY_ENTRIES) * 8)
+
+/**
+ * Progress of a resumable operation.
+ */
+struct progress {
+    off_t next_offset;            /* offset of the next header to process */
+    int processed;                /* non-null headers processed */
+    ssize_t outputs;              /* outputs completed, when extracting */
+    struct stat archive;          /* identity of the archive */
+    off_t recent[CKPT_VERIFY_ENTRIES]; /* header offsets of the last entries, by processed number modulo */
+};
+
+/**
+ * Writes a checkpoint atomically.
+ *
+ * @return zero on success, -1 if the checkpoint could not be written.
+ */
+static int checkpoint_save(const char *path, int op, const struct progress *p) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+
+    uint8_t rec[CKPT_LEN];
+    memcpy(rec, CKPT_MAGIC, CKPT_MAGLEN);
+    uint8_t *q = rec + CKPT_MAGLEN;
+    put_u64(q, op);
+    put_u64(q + 8, p->next_offset);
+    put_u64(q + 16, p->processed);
+    put_u64(q + 24, p->outputs);
+    put_u64(q + 32, p->archive.st_size);
+    put_u64(q + 40, p->archive.st_mtim.tv_sec);
+    put_u64(q + 48, p->archive.st_mtim.tv_nsec);
+    put_u64(q + 56, p->archive.st_ino);
+    for (int i = 0; i < CKPT_VERIFY_ENTRIES; i++) {
+        put_u64(q + 64 + 8 * i, p->recent[(p->processed + i) % CKPT_VERIFY_ENTRIES]);
+    }
+
+    int ret = -1;
+    if (write_all(fd, rec, sizeof(rec)) == 0 && fsync(fd) == 0) {
+        ret = rename(tmp, path);
+    }
+    close(fd);
+    if (ret != 0) {
+        unlink(tmp);
+        return ret;
+    }
+
+    /* the rename is only recorded once the directory holding the checkpoint is synced */
+    char dir[4096];
+    const char *slash = strrchr(path, '/');
+    if (!slash) {
+        strcpy(dir, ".");
+    } else {
+        snprintf(dir, sizeof(dir), "%.*s", slash == path ? 1 : (int) (slash - path), path);
+    }
+    int dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (dir_fd == -1) {
+        return -1;
+    }
+    ret = fsync(dir_fd);
+    close(dir_fd);
+    return ret == 0 ? 0 : -1;
+}
+
+/**
+ * Tells whether the progress loaded from a checkpoint is trustworthy: the
+ * archive is unchanged and the headers of the last processed entries are
+ * still found where the checkpoint says, each one leading to the next.
+ */
+static int checkpoint_verify(int tar_fd, const struct progress *p) {
+    struct stat st;
+    if (fstat(tar_fd, &st) == -1 || st.st_size != p->archive.st_size || st.st_ino != p->archive.st_ino ||
+        st.st_mtim.tv_sec != p->archive.st_mtim.tv_sec || st.st_mtim.tv_nsec != p->archive.st_mtim.tv_nsec) {
+        return 0;
+    }
+
+    int n = p->processed < CKPT_VERIFY_ENTRIES ? p->processed : CKPT_VERIFY_ENTRIES;
+    off_t expected = n < CKPT_VERIFY_ENTRIES ? 0 : -1;
+    for (int i = p->processed - n; i < p->processed; i++) {
+        off_t off = p->recent[i % CKPT_VERIFY_ENTRIES];
+        tar_header_t hdr;
+        if ((expected != -1 && off != expected) ||
+            pread(tar_fd, &hdr, sizeof(hdr), off) != sizeof(hdr) || check_header(&hdr) != 0) {
+            return 0;
+        }
+        expected = off + 512 + (off_t) TAR_PADDED((size_t) TAR_INT(hdr.size));
+    }
+    return p->next_offset == expected;
+}
+
+/**
+ * Restores the progress of an interrupted operation, or starts afresh when
+ * there is no usable checkpoint.
+ */
+static int checkpoint_load(const char *path, int op, int tar_fd, struct progress *p) {
+    memset(p, 0, sizeof(*p));
+
+    int fd = path ? open(path, O_RDONLY) : -1;
+    if (fd != -1) {
+        uint8_t rec[CKPT_LEN];
+        const uint8_t *q = rec + CKPT_MAGLEN;
+        if (read_exact(fd, rec, sizeof(rec)) == 0 &&
+            memcmp(rec, CKPT_MAGIC, CKPT_MAGLEN) == 0 && get_u64(q) == (uint64_t) op) {
+            p->next_offset = get_u64(q + 8);
+            p->processed = get_u64(q + 16);
+            p->outputs = get_u64(q + 24);
+            p->archive.st_size = get_u64(q + 32);
+            p->archive.st_mtim.tv_sec = get_u64(q + 40);
+            p->archive.st_mtim.tv_nsec = get_u64(q + 48);
+            p->archive.st_ino = get_u64(q + 56);
+            for (int i = 0; i < CKPT_VERIFY_ENTRIES; i++) {
+                p->recent[(p->processed + i) % CKPT_VERIFY_ENTRIES] = get_u64(q + 64 + 8 * i);
+            }
+            if (p->processed >= 0 && checkpoint_verify(tar_fd, p)) {
+                close(fd);
+                return 0;
+            }
+        }
+        close(fd);
+        memset(p, 0, sizeof(*p));
+    }
+
+    return fstat(tar_fd, &p->archive) == 0 ? 0 : -1;
+}
+
+/**
+ * Tells whether extracting to `path` stays inside the destination directory.
+ */
+static int is_safe_path(const char *path) {
+    if (path[0] == '/' || path[0] == '\0') {
+        return 0;
+    }
+    for (const char *c = path; c; c = strchr(c, '/')) {
+        if (*c == '/') {
+            c++;
+        }
+        if (c[0] == '.' && c[1] == '.' && (c[2] == '/' || c[2] == '\0')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Opens the directory holding `path` under `dir_fd`, one component at a
+ * time and without following symbolic links, so that no entry reaches
+ * outside of the destination through a link extracted before it.
+ *
+ * @param create Nonzero creates the missing directories.
+ * @param name Set to the last component of `path`, "." for the destination itself.
+ *
+ * @return a descriptor of the directory, to be closed by the caller,
+ *         -2 if a directory could not be created or opened,
+ *         -3 if a directory is a symbolic link or "..".
+ */
+static int open_parent(int dir_fd, const char *path, int create, char name[256]) {
+    char buf[256];
+    strncpy(buf, path, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+
+    int fd = dup(dir_fd);
+    if (fd == -1) {
+        return -2;
+    }
+    strcpy(name, ".");
+
+    char *save = NULL;
+    for (char *comp = strtok_r(buf, "/", &save); comp; comp = strtok_r(NULL, "/", &save)) {
+        if (strcmp(comp, ".") == 0) {
+            continue;
+        }
+        if (strcmp(comp, "..") == 0) {
+            close(fd);
+            return -3;
+        }
+        if (strcmp(name, ".") != 0) {
+            /* the previous component is a directory to descend into */
+            if (create && mkdirat(fd, name, 0755) == -1 && errno != EEXIST) {
+                close(fd);
+                return -2;
+            }
+            int next = openat(fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            if (next == -1) {
+                struct stat st;
+                int link = fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISLNK(st.st_mode);
+                close(fd);
+                return link ? -3 : -2;
+            }
+            close(fd);
+            fd = next;
+        }
+        strcpy(name, comp);
+    }
+    return fd;
+}
+
+/**
+ * Writes one entry of the archive under `dir_fd`.  Entry types other than
+ * files, directories and links are skipped.
+ *
+ * @return zero on success,
+ *         -2 if the entry could not be written,
+ *         -3 if the entry or the target of a hard link lies outside of `dir_fd`.
+ */
+static int extract_entry(int tar_fd, int dir_fd, const tar_entry_t *entry) {
+    char name[256];
+    int parent = open_parent(dir_fd, entry->path, 1, name);
+    if (parent < 0) {
+        return parent;
+    }
+
+    int ret = 0;
+    mode_t mode = entry->mode & 07777;
+    switch (entry->typeflag) {
+    case DIRTYPE:
+        if (mkdirat(parent, name, mode | 0700) == -1 && errno != EEXIST) {
+            ret = -2;
+        }
+        break;
+    case REGTYPE:
+    case AREGTYPE: {
+        /* a link left at this path by an earlier entry is replaced, not followed */
+        int fd = openat(parent, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, mode);
+        if (fd == -1 && errno == ELOOP && unlinkat(parent, name, 0) == 0) {
+            fd = openat(parent, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, mode);
+        }
+        if (fd == -1) {
+            ret = -2;
+            break;
+        }
+        off_t off = entry->data_offset;
+        ret = copy_range(tar_fd, &off, fd, entry->size) == 0 ? 0 : -2;
+        close(fd);
+        break;
+    }
+    case SYMTYPE:
+        unlinkat(parent, name, 0);
+        ret = symlinkat(entry->linkname, parent, name) == 0 ? 0 : -2;
+        break;
+    case LNKTYPE: {
+        /* the target is an earlier member, looked up the same way as the entry */
+        char target[256];
+        int from = is_safe_path(entry->linkname) ? open_parent(dir_fd, entry->linkname, 0, target) : -3;
+        if (from < 0) {
+            ret = from;
+            break;
+        }
+        unlinkat(parent, name, 0);
+        ret = linkat(from, target, parent, name, 0) == 0 ? 0 : -2;
+        close(from);
+        break;
+    }
+    default:
+        break;
+    }
+    close(parent);
+    return ret;
+}
+
+/**
+ * Walks the archive from the checkpointed position, validating every header
+ * and extracting the entries when `dir_fd` is not -1.
+ *
+ * @return the number of non-null headers processed, or a negative error code.
+ */
+static ssize_t run_resumable(int tar_fd, int op, int dir_fd, const char *checkpoint) {
+    struct progress p;
+    if (checkpoint_load(checkpoint, op, tar_fd, &p) != 0) {
+        return op == OP_CHECK ? -3 : -2;
+    }
+
+    ssize_t ret;
+    size_t since_entries = 0;
+    off_t since_offset = p.next_offset;
+    tar_header_t hdr;
+    for (;;) {
+        if (pread(tar_fd, &hdr, sizeof(hdr), p.next_offset) != sizeof(hdr) || is_empty_block(&hdr)) {
+            ret = op == OP_CHECK ? p.processed : p.outputs;
+            break;
+        }
+
+        int err = check_header(&hdr);
+        if (err != 0) {
+            return op == OP_CHECK ? err : -1;
+        }
+
+        tar_entry_t entry;
+        entry_from_header(&entry, &hdr, p.next_offset);
+
+        if (op == OP_EXTRACT) {
+            if (!is_safe_path(entry.path)) {
+                return -3;
+            }
+            err = extract_entry(tar_fd, dir_fd, &entry);
+            if (err != 0) {
+                return err;
+            }
+            p.outputs++;
+        }
+
+        p.recent[p.processed % CKPT_VERIFY_ENTRIES] = p.next_offset;
+        p.next_offset += 512 + TAR_PADDED(entry.size);
+        p.processed++;
+        since_entries++;
+
+        if (checkpoint && (since_entries >= CKPT_INTERVAL_ENTRIES ||
+                           p.next_offset - since_offset >= CKPT_INTERVAL_BYTES)) {
+            /* outputs must be durable before the checkpoint claims them */
+            if (op == OP_EXTRACT && syncfs(dir_fd) != 0) {
+                return -2;
+            }
+            if (checkpoint_save(checkpoint, op, &p) != 0) {
+                return -4;
+            }
+            since_entries = 0;
+            since_offset = p.next_offset;
+        }
+    }
+
+    /* the operation completed, there is nothing left to resume */
+    if (checkpoint) {
+        unlink(checkpoint);
+    }
+    return ret;
+}
+
+/**
+ * Checks whether the archive is valid, like check_archive(), persisting its
+ * progress so that an interrupted check resumes where it stopped.
+ *
+ * @param tar_fd A file descriptor pointing to a file supposed to contain a tar archive.
+ * @param checkpoint The path of the checkpoint file, removed once the check completes.
+ *
+ * @return the check_archive() return value,
+ *         -4 if the checkpoint could not be written.
+ */
+int check_archive_resumable(int tar_fd, const char *checkpoint) {
+    return run_resumable(tar_fd, OP_CHECK, -1, checkpoint);
+}
+
+/**
+ * Extracts every entry of an archive into a directory.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file.
+ * @param dest_dir The directory the entries are extracted into, it must exist.
+ * @param checkpoint The path of a checkpoint file, removed once the extraction completes, NULL disables checkpoints.
+ *
+ * @return a zero or positive value on success, representing the number of entries extracted,
+ *         -1 if the archive contains an invalid header,
+ *         -2 if an entry could not be written,
+ *         -3 if an entry or the target of a hard link lies outside of `dest_dir`,
+ *         -4 if the checkpoint could not be written.
+ */
+ssize_t tar_extract(int tar_fd, const char *dest_dir, const char *checkpoint) {
+    int dir_fd = open(dest_dir, O_RDONLY | O_DIRECTORY);
+    if (dir_fd == -1) {
+        return -2;
+    }
+    ssize_t ret = run_resumable(tar_fd, OP_EXTRACT, dir_fd, checkpoint);
+    close(dir_fd);
+    return ret;
+}
@@ -0,0 +1,271 @@
+#include "lib_tar.h"
+#include "tar_internal.h"
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * Skips `len` bytes of input, seeking when the input allows it and reading
+ * them away otherwise.
+ */
+int skip_input(int fd, size_t len) {
+    if (lseek(fd, len, SEEK_CUR) != (off_t) -1) {
+        return 0;
+    }
+    if (errno != ESPIPE) {
+        return -1;
+    }
+
+    uint8_t buf[64 * 1024];
+    while (len > 0) {
+        size_t chunk = len < sizeof(buf) ? len : sizeof(buf);
+        if (read_exact(fd, buf, chunk) != 0) {
+            return -1;
+        }
+        len -= chunk;
+    }
+    return 0;
+}
+
+/**
+ * Replaces the leading `from` of `path` by `to` into `out`.
+ *
+ * @return 1 if the path was renamed, zero if it does not start with `from`.
+ */
+static int rename_prefix(char *out, size_t out_len, const char *path, const char *from, const char *to) {
+    size_t from_len = strlen(from);
+    if (strncmp(path, from, from_len) != 0) {
+        return 0;
+    }
+    snprintf(out, out_len, "%s%s", to, path + from_len);
+    return 1;
+}
+
+/**
+ * A transform callback applying a tar_rules_t, passed as `arg`.
+ *
+ * @return TAR_DROP if the entry matches one of the dropped prefixes,
+ *         TAR_KEEP if the entry is kept, possibly rewritten,
+ *         -1 if the renamed path or a new numeric value does not fit in the header.
+ */
+int tar_rules_apply(tar_header_t *hdr, void *arg) {
+    const tar_rules_t *rules = arg;
+    char path[256];
+    header_path(path, hdr);
+
+    for (const char *const *drop = rules->drop; drop && *drop; drop++) {
+        if (strncmp(path, *drop, strlen(*drop)) == 0) {
+            return TAR_DROP;
+        }
+    }
+
+    if (rules->rename_from) {
+        char renamed[512];
+        if (rename_prefix(renamed, sizeof(renamed), path, rules->rename_from, rules->rename_to) &&
+            (strlen(renamed) > 255 || tar_header_set_path(hdr, renamed) != 0)) {
+            return -1;
+        }
+        /* hard links name another archive member, keep them pointing at it */
+        if (hdr->typeflag == LNKTYPE) {
+            char link[sizeof(hdr->linkname) + 1];
+            memcpy(link, hdr->linkname, sizeof(hdr->linkname));
+            link[sizeof(hdr->linkname)] = '\0';
+            if (rename_prefix(renamed, sizeof(renamed), link, rules->rename_from, rules->rename_to)) {
+                if (strlen(renamed) > sizeof(hdr->linkname)) {
+                    return -1;
+                }
+                memset(hdr->linkname, 0, sizeof(hdr->linkname));
+                memcpy(hdr->linkname, renamed, strlen(renamed));
+            }
+        }
+    }
+
+    if ((rules->uid >= 0 && header_set_octal(hdr->uid, sizeof(hdr->uid), rules->uid) != 0) ||
+        (rules->gid >= 0 && header_set_octal(hdr->gid, sizeof(hdr->gid), rules->gid) != 0) ||
+        (rules->mode >= 0 && header_set_octal(hdr->mode, sizeof(hdr->mode), rules->mode) != 0)) {
+        return -1;
+    }
+    if (rules->uname) {
+        strncpy(hdr->uname, rules->uname, sizeof(hdr->uname) - 1);
+    }
+    if (rules->gname) {
+        strncpy(hdr->gname, rules->gname, sizeof(hdr->gname) - 1);
+    }
+    return TAR_KEEP;
+}
+
+/**
+ * Copies an archive while rewriting its entries.
+ *
+ * @param in_fd A file descriptor pointing to the start of a valid tar archive, it may be a pipe or a socket.
+ * @param out_fd A file descriptor the transformed archive is written to, at its current offset.
+ * @param cb A callback deciding the fate of each entry, NULL copies every entry unchanged.
+ * @param arg An opaque pointer passed to `cb`.
+ *
+ * @return a zero or positive value on success, representing the number of entries written,
+ *         -1 if the input could not be read, is not a valid archive or ends without its
+ *            end-of-archive marker, or if the output could not be written,
+ *         -2 if the callback returned an error for some entry.
+ */
+ssize_t tar_transform(int in_fd, int out_fd, transform_cb cb, void *arg) {
+    tar_header_t hdr;
+    ssize_t written = 0;
+    int ended = 0;
+
+    while (read_exact(in_fd, &hdr, sizeof(hdr)) == 0) {
+        if (is_empty_block(&hdr)) {
+            ended = 1;
+            break;
+        }
+        /* a corrupt header must not leave with a checksum made valid */
+        if (check_header(&hdr) != 0) {
+            return -1;
+        }
+
+        size_t padded = TAR_PADDED((size_t) TAR_INT(hdr.size));
+        tar_header_t orig = hdr;
+        int action = cb ? cb(&hdr, arg) : TAR_KEEP;
+        if (action < 0) {
+            return -2;
+        }
+
+        if (action == TAR_DROP) {
+            if (skip_input(in_fd, padded) != 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        /* the data is never altered, so its size must not be either */
+        memcpy(hdr.size, orig.size, sizeof(hdr.size));
+        if (memcmp(&hdr, &orig, sizeof(hdr)) != 0) {
+            header_update_checksum(&hdr);
+        }
+
+        if (write_all(out_fd, &hdr, sizeof(hdr)) != 0 ||
+            copy_range(in_fd, NULL, out_fd, padded) != 0) {
+            return -1;
+        }
+        written++;
+    }
+
+    /* an input ending without its end-of-archive marker was cut short */
+    if (!ended) {
+        return -1;
+    }
+    static const uint8_t end[1024];
+    if (write_all(out_fd, end, sizeof(end)) != 0) {
+        return -1;
+    }
+    return written;
+}
+
+/**
+ * Tells whether a path is selected by a route pattern: a glob when the
+ * pattern contains a wildcard, a path prefix otherwise.
+ */
+static int route_matches(const char *pattern, const char *path) {
+    if (!pattern) {
+        return 1;
+    }
+    if (strpbrk(pattern, "*?[")) {
+        return fnmatch(pattern, path, 0) == 0;
+    }
+    return strncmp(path, pattern, strlen(pattern)) == 0;
+}
+
+/**
+ * Splits an archive into several outputs in a single pass.
+ *
+ * @param in_fd A file descriptor pointing to the start of a valid tar archive, it may be a pipe or a socket.
+ * @param routes The routes, tried in order for each entry.
+ * @param count The number of entries in `routes`.
+ *
+ * @return a zero or positive value on success, representing the number of entries routed,
+ *         -1 if the input could not be read or ends without its end-of-archive marker,
+ *            or if an output could not be written,
+ *         -2 if a raw route selected more than one file.
+ */
+ssize_t tar_route(int in_fd, const tar_route_t *routes, size_t count) {
+    tar_header_t hdr;
+    ssize_t routed = 0;
+    int ended = 0;
+
+    /* files written by each raw route, which takes a single one */
+    uint8_t *raw_files = calloc(count ? count : 1, 1);
+    if (!raw_files) {
+        return -1;
+    }
+
+    while (read_exact(in_fd, &hdr, sizeof(hdr)) == 0) {
+        if (is_empty_block(&hdr)) {
+            ended = 1;
+            break;
+        }
+
+        char path[256];
+        header_path(path, &hdr);
+        size_t size = TAR_INT(hdr.size);
+
+        const tar_route_t *route = NULL;
+        for (size_t i = 0; i < count && !route; i++) {
+            if (route_matches(routes[i].pattern, path)) {
+                route = &routes[i];
+            }
+        }
+
+        if (!route) {
+            if (skip_input(in_fd, TAR_PADDED(size)) != 0) {
+                goto fail;
+            }
+            continue;
+        }
+
+        if (route->raw) {
+            /* only file contents make sense outside of an archive */
+            int is_reg = hdr.typeflag == REGTYPE || hdr.typeflag == AREGTYPE;
+            if (is_reg && raw_files[route - routes]++) {
+                /* a second file would run into the first with nothing to tell them apart */
+                free(raw_files);
+                return -2;
+            }
+            size_t data = is_reg ? size : 0;
+            if ((data > 0 && copy_range(in_fd, NULL, route->fd, data) != 0) ||
+                skip_input(in_fd, TAR_PADDED(size) - data) != 0) {
+                goto fail;
+            }
+            routed += is_reg;
+            continue;
+        }
+
+        if (write_all(route->fd, &hdr, sizeof(hdr)) != 0 ||
+            copy_range(in_fd, NULL, route->fd, TAR_PADDED(size)) != 0) {
+            goto fail;
+        }
+        routed++;
+    }
+    free(raw_files);
+
+    /* the routes are left unterminated when the input was cut short */
+    if (!ended) {
+        return -1;
+    }
+
+    /* terminate every sub-archive once, even when several routes share it */
+    static const uint8_t end[1024];
+    for (size_t i = 0; i < count; i++) {
+        int seen = routes[i].raw;
+        for (size_t j = 0; j < i && !seen; j++) {
+            seen = !routes[j].raw && routes[j].fd == routes[i].fd;
+        }
+        if (!seen && write_all(routes[i].fd, end, sizeof(end)) != 0) {
+            return -1;
+        }
+    }
+    return routed;
+
+fail:
+    free(raw_files);
+    return -1;
+}
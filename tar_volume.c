@@ -0,0 +1,246 @@
+#include "lib_tar.h"
+#include "tar_internal.h"
+#include <string.h>
+#include <sys/stat.h>
+
+/*
+ * GNU multi-volume sets split an archive into volumes of a fixed size.  A
+ * member that does not fit in the rest of a volume is cut at its end and
+ * continued at the start of the next volume, after an optional volume label
+ * ('V' header), by a continuation header ('M') holding the member name, the
+ * size of the rest of the data and the offset within the member where it
+ * resumes.  The set is indexed as one archive whose members are lists of
+ * extents, each stored contiguously in one volume.
+ */
+#define GNU_VOLHDR   'V'
+#define GNU_MULTIVOL 'M'
+
+/* Offset of the continuation offset field, within the prefix of old GNU headers */
+#define GNU_OFFSET_FIELD 24
+#define GNU_OFFSET_LEN 12
+
+struct volume_scan {
+    tar_archive_t *ar;
+    size_t extents_cap;
+    size_t starts_cap;
+    ssize_t pending;              /* entry continued in the next volume, -1 if none */
+    off_t done;                   /* bytes of the pending entry already seen */
+};
+
+static int add_extent(struct volume_scan *scan, size_t volume, off_t offset, off_t length) {
+    tar_archive_t *ar = scan->ar;
+    size_t n = ar->entry_extents[ar->index.count];
+    if (n == scan->extents_cap) {
+        scan->extents_cap = scan->extents_cap ? scan->extents_cap * 2 : 64;
+        struct tar_extent *extents = realloc(ar->extents, scan->extents_cap * sizeof(*extents));
+        if (!extents) {
+            return -1;
+        }
+        ar->extents = extents;
+    }
+    ar->extents[n] = (struct tar_extent) { volume, offset, length };
+    ar->entry_extents[ar->index.count] = n + 1;
+    return 0;
+}
+
+/**
+ * Records a new entry, whose extents start after those of the previous one.
+ */
+static tar_entry_t *add_entry(struct volume_scan *scan, const tar_header_t *hdr, off_t off) {
+    tar_archive_t *ar = scan->ar;
+    if (ar->index.count + 2 > scan->starts_cap) {
+        scan->starts_cap = scan->starts_cap ? scan->starts_cap * 2 : 64;
+        size_t *starts = realloc(ar->entry_extents, scan->starts_cap * sizeof(*starts));
+        if (!starts) {
+            return NULL;
+        }
+        ar->entry_extents = starts;
+    }
+
+    size_t start = ar->index.count ? ar->entry_extents[ar->index.count] : 0;
+    tar_entry_t *entry = index_add_header(&ar->index, hdr, off);
+    if (entry) {
+        ar->entry_extents[ar->index.count - 1] = start;
+        ar->entry_extents[ar->index.count] = start;
+    }
+    return entry;
+}
+
+/**
+ * Indexes one volume, continuing the member cut at the end of the previous
+ * volume if any.
+ *
+ * @return 1 if the end-of-archive marker was found, zero if the archive
+ *         continues in the next volume, -1 if the volume is invalid.
+ */
+static int scan_volume(struct volume_scan *scan, size_t v, off_t size) {
+    tar_archive_t *ar = scan->ar;
+    tar_header_t hdr;
+    off_t off = 0;
+    while (off + (off_t) sizeof(hdr) <= size) {
+        if (pread(ar->volumes[v], &hdr, sizeof(hdr), off) != sizeof(hdr)) {
+            return -1;
+        }
+        if (is_empty_block(&hdr)) {
+            ar->index.end_offset = off;
+            return scan->pending < 0 ? 1 : -1;
+        }
+        if (!header_checksum_ok(&hdr)) {
+            return -1;
+        }
+        if (hdr.typeflag == GNU_VOLHDR) {
+            off += sizeof(hdr);
+            continue;
+        }
+
+        if (hdr.typeflag == GNU_MULTIVOL) {
+            char field[GNU_OFFSET_LEN + 1] = { 0 };
+            memcpy(field, hdr.prefix + GNU_OFFSET_FIELD, GNU_OFFSET_LEN);
+            if (scan->pending < 0 || TAR_INT(field) != scan->done ||
+                strncmp(hdr.name, ar->index.entries[scan->pending].path, sizeof(hdr.name)) != 0) {
+                return -1;
+            }
+        } else {
+            if (scan->pending >= 0 || !add_entry(scan, &hdr, off)) {
+                return -1;
+            }
+            scan->pending = ar->index.count - 1;
+            scan->done = 0;
+        }
+
+        const tar_entry_t *entry = &ar->index.entries[scan->pending];
+        off_t data = off + sizeof(hdr);
+        off_t length = entry->size - scan->done;
+        if (length > size - data) {
+            length = size - data;
+        }
+        if (length > 0 && add_extent(scan, v, data, length) != 0) {
+            return -1;
+        }
+        scan->done += length;
+        if (scan->done == (off_t) entry->size) {
+            scan->pending = -1;
+        }
+        off = data + TAR_PADDED(length);
+    }
+    return 0;
+}
+
+/**
+ * Opens a GNU multi-volume archive as a single archive.
+ *
+ * @param fds The file descriptors of the volumes, in order.  They are duplicated and left open.
+ * @param count The number of volumes.
+ *
+ * @return a handle on the archive, released with tar_close(),
+ *         NULL if the volumes do not form a complete multi-volume archive.
+ */
+tar_archive_t *tar_open_volumes(const int *fds, size_t count) {
+    tar_archive_t *ar = calloc(1, sizeof(*ar));
+    if (!ar || count == 0) {
+        free(ar);
+        return NULL;
+    }
+    ar->refs = 1;
+    ar->volumes = calloc(count, sizeof(int));
+    if (!ar->volumes) {
+        free(ar);
+        return NULL;
+    }
+    for (size_t v = 0; v < count; v++) {
+        ar->volumes[v] = -1;
+    }
+
+    int ok = 1;
+    for (size_t v = 0; v < count && ok; v++) {
+        ar->volumes[v] = dup(fds[v]);
+        ok = ar->volumes[v] != -1;
+    }
+    ar->nvolumes = count;
+    ar->fd = ar->volumes[0];
+
+    struct volume_scan scan = { ar, 0, 0, -1, 0 };
+    int end = 0;
+    for (size_t v = 0; v < count && ok && !end; v++) {
+        struct stat st;
+        if (fstat(ar->volumes[v], &st) == -1) {
+            ok = 0;
+            break;
+        }
+        if (v == 0) {
+            ar->index.archive_mtime = st.st_mtime;
+        }
+        ar->index.archive_size += st.st_size;
+
+        end = scan_volume(&scan, v, st.st_size);
+        ok = end >= 0;
+    }
+    if (ok && end && !ar->entry_extents) {
+        ar->entry_extents = calloc(1, sizeof(size_t));
+    }
+    ok = ok && end && ar->entry_extents && index_finish(&ar->index) == 0;
+
+    if (!ok) {
+        int fd = ar->fd;
+        close_volumes(ar);
+        if (fd != -1) {
+            close(fd);
+        }
+        tar_index_free(&ar->index);
+        free(ar);
+        return NULL;
+    }
+    pthread_mutex_init(&ar->lock, NULL);
+    return ar;
+}
+
+/**
+ * Reads the data of an entry of a multi-volume set, gathering the pieces
+ * stored in each volume.
+ *
+ * @return the number of bytes read, -1 on error.
+ */
+ssize_t volume_read(const tar_archive_t *ar, const tar_entry_t *entry, uint8_t *dest, size_t len, size_t offset) {
+    size_t i = entry - ar->index.entries;
+    size_t total = 0;
+    for (size_t e = ar->entry_extents[i]; e < ar->entry_extents[i + 1] && total < len; e++) {
+        const struct tar_extent *ext = &ar->extents[e];
+        if (offset >= (size_t) ext->length) {
+            offset -= ext->length;
+            continue;
+        }
+        size_t chunk = ext->length - offset;
+        if (chunk > len - total) {
+            chunk = len - total;
+        }
+        ssize_t r = pread(ar->volumes[ext->volume], dest + total, chunk, ext->offset + offset);
+        if (r < 0) {
+            return -1;
+        }
+        total += r;
+        if ((size_t) r < chunk) {
+            break;
+        }
+        offset = 0;
+    }
+    return total;
+}
+
+/**
+ * Releases the volumes of a multi-volume set, except the first one which is
+ * the descriptor of the handle.
+ */
+void close_volumes(tar_archive_t *ar) {
+    if (!ar->volumes) {
+        return;
+    }
+    for (size_t v = 1; v < ar->nvolumes; v++) {
+        if (ar->volumes[v] != -1) {
+            close(ar->volumes[v]);
+        }
+    }
+    free(ar->volumes);
+    free(ar->extents);
+    free(ar->entry_extents);
+    ar->volumes = NULL;
+}
@@ -1,43 +1,1123 @@
+#define _GNU_SOURCE
 #include <stdio.h>
-#include <sys/types.h>
-#include <sys/stat.h>
+#include <string.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <zlib.h>
 
 #include "lib_tar.h"
+#include "tar_internal.h"
 
 /**
- * You are free to use this file to write tests for your implementation
+ * Command line tool inspecting archives through lib_tar.
+ *
+ * Usage: tests [-b backend] [-j threads] [-s] [-v] command archive [arguments]
+ *
+ * Commands:
+ *   verify archive...                  validate archives, several of them in parallel
+ *   ls [-R] archive [dir]              list a directory, or everything below it with -R
+ *   stat archive path...               print the metadata of entries, symlinks not followed
+ *   cat archive path...                write files to the standard output
+ *   extract archive dir [path...]      extract the archive, or the given subtrees, into dir
+ *   find archive [dir] [tests]         list the entries matching -name, -path, -type, -size and -mtime
+ *   du archive [dir] [-n count]        aggregate sizes, with the largest directories and files
+ *   hash archive [path...]             CRC-32 of every file, or of the files below the paths
+ *   index build archive...             rebuild the sidecar index of archives
+ *   export [-f format] [-d] archive    write a manifest of every entry, -d adding file digests
+ *   bench archive                      time opening, listing and reading with every backend
+ *
+ * "tests archive..." is short for "tests verify archive...".
+ *
+ * The backends are:
+ *   mmap   the index of tar_open(), file data read straight from a mapping of the archive
+ *   index  the index of tar_open(), file data read with tar_read(), compressed archives included
+ *   scan   no index: list() and read_file() scan the archive, other commands index it in memory
+ *   auto   mmap for uncompressed archives and index otherwise, the default
+ *
+ * The indexed backends read files with -j threads, one per processor by
+ * default, where a command reads several of them.  With -s, the wall and CPU
+ * time of the command, its read and write system calls and its page faults
+ * are printed to the standard error once it completes.  With -v, archives
+ * are opened with TAR_OPEN_VERIFY and the data read is verified against its
+ * checksums, which the mmap backend does not read through.
+ *
+ * The exit status is 0 on success, 1 if some archive or entry could not be
+ * processed, and 2 on usage errors.
  */
 
-void debug_dump(const uint8_t *bytes, size_t len) {
-    for (int i = 0; i < len;) {
-        printf("%04x:  ", (int) i);
+/* Size of the buffers files are read through */
+#define BUF_SIZE (1024 * 1024)
+
+/* Room for an entry path and the directory it is extracted into */
+#define PATH_LEN 1024
+
+/* Files read with the scan backend by the bench command, whose reads take quadratic time */
+#define BENCH_SCAN_FILES 1000
+
+enum backend { BACKEND_AUTO, BACKEND_MMAP, BACKEND_INDEX, BACKEND_SCAN };
+
+static const char *const backend_names[] = { "auto", "mmap", "index", "scan" };
+
+/* An archive opened with some backend */
+struct cli {
+    const char *path;
+    enum backend backend;
+    int threads;
+    int fd;
+    tar_archive_t *ar;            /* mmap and index backends */
+    const uint8_t *map;           /* mmap backend */
+    size_t map_len;
+    tar_index_t scan_index;       /* scan backend, built on first use */
+    int scan_indexed;
+};
+
+static enum backend opt_backend = BACKEND_AUTO;
+static int opt_threads;
+static int opt_verify;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Opens an archive with a backend, resolving BACKEND_AUTO.
+ *
+ * @return zero on success, -1 if the archive could not be opened with the backend.
+ */
+static int cli_open(struct cli *c, const char *path, enum backend backend) {
+    memset(c, 0, sizeof(*c));
+    c->path = path;
+    c->backend = backend;
+    c->threads = opt_threads;
+    c->fd = open(path, O_RDONLY);
+    if (c->fd == -1) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (backend == BACKEND_SCAN) {
+        /* list() and read_file() move the descriptor offset */
+        c->threads = 1;
+        return 0;
+    }
 
-        for (int j = 0; j < 16 && i + j < len; j++) {
-            printf("%02x ", bytes[i + j]);
+    tar_open_opts_t opts = { .flags = TAR_OPEN_SAVE_INDEX | (opt_verify ? TAR_OPEN_VERIFY : 0) };
+    c->ar = tar_open(path, &opts);
+    if (!c->ar) {
+        fprintf(stderr, "%s: cannot open the archive\n", path);
+        close(c->fd);
+        return -1;
+    }
+    if (backend == BACKEND_INDEX || (backend == BACKEND_AUTO && opt_verify)) {
+        c->backend = BACKEND_INDEX;
+        return 0;
+    }
+
+    struct stat st;
+    if (c->ar->gz || c->ar->bz || fstat(c->fd, &st) != 0 || st.st_size == 0) {
+        if (backend == BACKEND_AUTO) {
+            c->backend = BACKEND_INDEX;
+            return 0;
         }
-        printf("\t");
-        for (int j = 0; j < 16 && i < len; j++, i++) {
-            printf("%c ", bytes[i]);
+        fprintf(stderr, "%s: the mmap backend needs an uncompressed archive\n", path);
+        tar_close(c->ar);
+        close(c->fd);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, c->fd, 0);
+    if (map == MAP_FAILED) {
+        if (backend == BACKEND_AUTO) {
+            c->backend = BACKEND_INDEX;
+            return 0;
         }
-        printf("\n");
+        fprintf(stderr, "%s: mmap: %s\n", path, strerror(errno));
+        tar_close(c->ar);
+        close(c->fd);
+        return -1;
     }
+    c->map = map;
+    c->map_len = st.st_size;
+    c->backend = BACKEND_MMAP;
+    return 0;
 }
 
-int main(int argc, char **argv) {
-    if (argc < 2) {
-        printf("Usage: %s tar_file\n", argv[0]);
+static void cli_close(struct cli *c) {
+    if (c->map) {
+        munmap((void *) c->map, c->map_len);
+    }
+    if (c->ar) {
+        tar_close(c->ar);
+    }
+    if (c->scan_indexed) {
+        tar_index_free(&c->scan_index);
+    }
+    close(c->fd);
+}
+
+/**
+ * Gives the index of an archive, building it in memory for the scan backend.
+ */
+static const tar_index_t *cli_index(struct cli *c) {
+    if (c->ar) {
+        return tar_archive_index(c->ar);
+    }
+    if (!c->scan_indexed) {
+        if (tar_index_build(c->fd, &c->scan_index) < 0) {
+            fprintf(stderr, "%s: cannot index the archive\n", c->path);
+            return NULL;
+        }
+        c->scan_indexed = 1;
+    }
+    return &c->scan_index;
+}
+
+/**
+ * Looks up a file by path, following symlinks.
+ */
+static const tar_entry_t *cli_resolve(struct cli *c, const char *path) {
+    if (c->ar) {
+        return resolve_entry(c->ar, path);
+    }
+    const tar_index_t *index = cli_index(c);
+    const tar_entry_t *entry = index ? tar_index_find(index, path) : NULL;
+    for (int depth = 0; entry && entry->typeflag == SYMTYPE && depth < 16; depth++) {
+        entry = tar_index_find(index, entry->linkname);
+    }
+    return entry;
+}
+
+static int is_regular(const tar_entry_t *entry) {
+    return entry && (entry->typeflag == REGTYPE || entry->typeflag == AREGTYPE);
+}
+
+typedef int (*data_sink)(const uint8_t *data, size_t len, void *arg);
+
+/**
+ * Passes the data of a regular file to a sink, piece by piece.
+ *
+ * @param buf A buffer of BUF_SIZE bytes, unused by the mmap backend.
+ *
+ * @return zero on success, -1 if the file could not be read or the sink failed,
+ *         -3 if the data does not match its checksum.
+ */
+static int cli_stream(struct cli *c, const tar_entry_t *entry, uint8_t *buf, data_sink sink, void *arg) {
+    if (c->backend == BACKEND_MMAP) {
+        if ((size_t) entry->data_offset > c->map_len || entry->size > c->map_len - entry->data_offset) {
+            return -1;
+        }
+        return entry->size > 0 ? sink(c->map + entry->data_offset, entry->size, arg) : 0;
+    }
+
+    size_t offset = 0;
+    for (;;) {
+        size_t len = BUF_SIZE;
+        ssize_t left = c->ar ? tar_read(c->ar, entry->path, offset, buf, &len)
+                             : read_file(c->fd, (char *) entry->path, offset, buf, &len);
+        if (left < 0) {
+            return left == -3 ? -3 : -1;
+        }
+        if (len > 0 && sink(buf, len, arg) != 0) {
+            return -1;
+        }
+        offset += len;
+        if (left == 0 || len == 0) {
+            return 0;
+        }
+    }
+}
+
+static int sink_fd(const uint8_t *data, size_t len, void *arg) {
+    return write_all(*(int *) arg, data, len);
+}
+
+static int sink_crc(const uint8_t *data, size_t len, void *arg) {
+    uLong *crc = arg;
+    /* crc32() takes 32-bit lengths */
+    while (len > 0) {
+        uInt n = len > (1u << 30) ? 1u << 30 : (uInt) len;
+        *crc = crc32(*crc, data, n);
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* A set of files processed in parallel, each result stored by position */
+struct job {
+    struct cli *c;
+    const uint32_t *ids;
+    size_t count;
+    size_t next;                  /* next position to take, updated atomically */
+    int (*fn)(struct cli *c, const tar_entry_t *entry, uint8_t *buf, void *arg, size_t i);
+    void *arg;
+};
+
+static void *job_worker(void *arg) {
+    struct job *job = arg;
+    uint8_t *buf = NULL;
+    if (job->c->backend != BACKEND_MMAP && !(buf = malloc(BUF_SIZE))) {
+        return (void *) 1;
+    }
+    intptr_t failed = 0;
+    const tar_index_t *index = cli_index(job->c);
+    for (;;) {
+        size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (i >= job->count) {
+            break;
+        }
+        if (job->fn(job->c, &index->entries[job->ids[i]], buf, job->arg, i) != 0) {
+            failed = 1;
+        }
+    }
+    free(buf);
+    return (void *) failed;
+}
+
+/**
+ * Runs a function on every file of a list with the threads of the archive.
+ *
+ * @return zero on success, -1 if the function failed on some file.
+ */
+static int run_job(struct cli *c, const uint32_t *ids, size_t count,
+                   int (*fn)(struct cli *, const tar_entry_t *, uint8_t *, void *, size_t), void *arg) {
+    struct job job = { c, ids, count, 0, fn, arg };
+    int threads = c->threads > 0 ? c->threads : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) {
+        threads = 1;
+    }
+    if ((size_t) threads > count) {
+        threads = count > 0 ? (int) count : 1;
+    }
+
+    pthread_t tids[threads];
+    int started = 0;
+    for (int t = 1; t < threads; t++, started++) {
+        if (pthread_create(&tids[started], NULL, job_worker, &job) != 0) {
+            break;
+        }
+    }
+    int failed = job_worker(&job) != NULL;
+    for (int t = 0; t < started; t++) {
+        void *ret;
+        pthread_join(tids[t], &ret);
+        failed |= ret != NULL;
+    }
+    return failed ? -1 : 0;
+}
+
+/**
+ * Normalizes a directory argument into a path prefix, empty for the root.
+ */
+static void dir_prefix(char *out, size_t len, const char *dir) {
+    if (!dir || dir[0] == '\0') {
+        out[0] = '\0';
+        return;
+    }
+    snprintf(out, len, "%s%s", dir, dir[strlen(dir) - 1] == '/' ? "" : "/");
+}
+
+/**
+ * Tells whether a path is one of a list of paths, or below one of them.
+ */
+static int path_selected(const char *path, char **paths, int npaths) {
+    for (int p = 0; p < npaths; p++) {
+        char prefix[PATH_LEN];
+        dir_prefix(prefix, sizeof(prefix), paths[p]);
+        size_t len = strlen(prefix);
+        if (strncmp(path, prefix, len) == 0 || (len > 0 && strncmp(path, prefix, len - 1) == 0 && path[len - 1] == '\0')) {
+            return 1;
+        }
+    }
+    return npaths == 0;
+}
+
+/**
+ * Selects the current entries at, or below, any of a list of paths.
+ *
+ * @param paths The paths, none selecting every entry.
+ * @param files_only Only select regular files.
+ * @param ids Set to an array of the selected entry numbers, in archive order, to be freed.
+ *
+ * @return the number of selected entries, -1 on allocation failure.
+ */
+static ssize_t select_entries(const tar_index_t *index, char **paths, int npaths, int files_only, uint32_t **ids) {
+    *ids = malloc((index->count + 1) * sizeof(uint32_t));
+    if (!*ids) {
         return -1;
     }
+    size_t n = 0;
+    for (size_t i = 0; i < index->count; i++) {
+        const tar_entry_t *entry = &index->entries[i];
+        if ((!files_only || is_regular(entry)) && index_is_latest(index, i) &&
+            path_selected(entry->path, paths, npaths)) {
+            (*ids)[n++] = i;
+        }
+    }
+    return n;
+}
+
+/* --- Statistics ------------------------------------------------------------- */
+
+struct usage {
+    double wall;
+    struct rusage ru;
+    unsigned long long syscr, syscw, rchar, wchar;
+};
+
+static void usage_take(struct usage *u) {
+    memset(u, 0, sizeof(*u));
+    getrusage(RUSAGE_SELF, &u->ru);
+    FILE *f = fopen("/proc/self/io", "r");
+    char line[128];
+    while (f && fgets(line, sizeof(line), f)) {
+        sscanf(line, "syscr: %llu", &u->syscr);
+        sscanf(line, "syscw: %llu", &u->syscw);
+        sscanf(line, "rchar: %llu", &u->rchar);
+        sscanf(line, "wchar: %llu", &u->wchar);
+    }
+    if (f) {
+        fclose(f);
+    }
+    u->wall = now();
+}
+
+static double tv_ms(struct timeval a, struct timeval b) {
+    return (b.tv_sec - a.tv_sec) * 1e3 + (b.tv_usec - a.tv_usec) / 1e3;
+}
+
+/**
+ * Prints the resources used between two snapshots, the reads of /proc
+ * itself excepted.
+ */
+static void usage_print(const char *command, const struct usage *a, const struct usage *b) {
+    fprintf(stderr, "%s: wall %.3f ms, user %.3f ms, sys %.3f ms\n", command, (b->wall - a->wall) * 1e3,
+            tv_ms(a->ru.ru_utime, b->ru.ru_utime), tv_ms(a->ru.ru_stime, b->ru.ru_stime));
+    fprintf(stderr, "%s: %llu reads (%llu bytes), %llu writes (%llu bytes), "
+            "%ld page faults (%ld major), %ld context switches (%ld involuntary)\n",
+            command, b->syscr - a->syscr, b->rchar - a->rchar, b->syscw - a->syscw, b->wchar - a->wchar,
+            b->ru.ru_minflt - a->ru.ru_minflt + b->ru.ru_majflt - a->ru.ru_majflt, b->ru.ru_majflt - a->ru.ru_majflt,
+            b->ru.ru_nvcsw - a->ru.ru_nvcsw + b->ru.ru_nivcsw - a->ru.ru_nivcsw, b->ru.ru_nivcsw - a->ru.ru_nivcsw);
+}
+
+/* --- Commands --------------------------------------------------------------- */
+
+static void print_check_result(const check_result_t *res, void *arg) {
+    if (res->ret == -4) {
+        printf("%s: cannot open: %s\n", res->path, strerror(res->err));
+    } else {
+        printf("%s: check_archive returned %d\n", res->path, res->ret);
+    }
+}
+
+static int cmd_verify(int argc, char **argv) {
+    if (argc < 1) {
+        return 2;
+    }
+    int failed = check_archives(argv, argc, opt_threads, print_check_result, NULL);
+    return failed == 0 ? 0 : 1;
+}
+
+static int cmd_ls(int argc, char **argv) {
+    int recursive = argc > 0 && strcmp(argv[0], "-R") == 0;
+    argc -= recursive;
+    argv += recursive;
+    if (argc < 1 || argc > 2) {
+        return 2;
+    }
+
+    struct cli c;
+    if (cli_open(&c, argv[0], opt_backend) != 0) {
+        return 1;
+    }
+    char prefix[PATH_LEN];
+    dir_prefix(prefix, sizeof(prefix), argc > 1 ? argv[1] : NULL);
+    int ret = 0;
+
+    if (recursive) {
+        uint32_t *ids;
+        const tar_index_t *index = cli_index(&c);
+        char *paths[] = { prefix };
+        ssize_t n = index ? select_entries(index, paths, prefix[0] != '\0', 0, &ids) : -1;
+        for (ssize_t i = 0; i < n; i++) {
+            puts(index->entries[ids[i]].path);
+        }
+        ret = n < 0;
+        if (n >= 0) {
+            free(ids);
+        }
+    } else {
+        /* list() reports at most the entries it is given room for */
+        size_t cap = 256;
+        for (;;) {
+            char *names = malloc(cap * PATH_LEN);
+            char **entries = malloc(cap * sizeof(char *));
+            if (!names || !entries) {
+                free(names);
+                free(entries);
+                ret = 1;
+                break;
+            }
+            for (size_t i = 0; i < cap; i++) {
+                entries[i] = names + i * PATH_LEN;
+            }
+            size_t count = cap;
+            int found = c.ar ? tar_list(c.ar, prefix, entries, &count) : list(c.fd, prefix, entries, &count);
+            if (found && count == cap) {
+                free(names);
+                free(entries);
+                cap *= 4;
+                continue;
+            }
+            for (size_t i = 0; found && i < count; i++) {
+                puts(entries[i]);
+            }
+            if (!found) {
+                fprintf(stderr, "%s: no directory %s\n", argv[0], prefix);
+                ret = 1;
+            }
+            free(names);
+            free(entries);
+            break;
+        }
+    }
+    cli_close(&c);
+    return ret;
+}
+
+static const char *type_name(char typeflag) {
+    switch (typeflag) {
+    case REGTYPE:
+    case AREGTYPE:
+        return "regular file";
+    case LNKTYPE:
+        return "hard link";
+    case SYMTYPE:
+        return "symbolic link";
+    case DIRTYPE:
+        return "directory";
+    case GNU_DUMPDIR:
+        return "incremental directory";
+    default:
+        return "other";
+    }
+}
+
+static int cmd_stat(int argc, char **argv) {
+    if (argc < 2) {
+        return 2;
+    }
+    struct cli c;
+    if (cli_open(&c, argv[0], opt_backend) != 0) {
+        return 1;
+    }
+    const tar_index_t *index = cli_index(&c);
+    int ret = index ? 0 : 1;
+    for (int i = 1; index && i < argc; i++) {
+        const tar_entry_t *entry = tar_index_find(index, argv[i]);
+        if (!entry) {
+            fprintf(stderr, "%s: no entry %s\n", argv[0], argv[i]);
+            ret = 1;
+            continue;
+        }
+        const uint32_t *versions;
+        char mtime[32];
+        strftime(mtime, sizeof(mtime), "%Y-%m-%d %H:%M:%S", gmtime(&entry->mtime));
+        printf("  Path: %s\n", entry->path);
+        printf("  Type: %s", type_name(entry->typeflag));
+        if (entry->typeflag == SYMTYPE || entry->typeflag == LNKTYPE) {
+            printf(" -> %s", entry->linkname);
+        }
+        printf("\n  Size: %zu\n", entry->size);
+        printf("  Mode: %04o  Uid: %u  Gid: %u\n", (unsigned) entry->mode & 07777, (unsigned) entry->uid,
+               (unsigned) entry->gid);
+        printf("Modify: %s UTC\n", mtime);
+        printf("Header: %lld  Data: %lld\n", (long long) entry->header_offset, (long long) entry->data_offset);
+        printf("Copies: %zu\n", tar_index_history(index, entry->path, &versions));
+    }
+    cli_close(&c);
+    return ret;
+}
+
+static int cmd_cat(int argc, char **argv) {
+    if (argc < 2) {
+        return 2;
+    }
+    struct cli c;
+    if (cli_open(&c, argv[0], opt_backend) != 0) {
+        return 1;
+    }
+    uint8_t *buf = malloc(BUF_SIZE);
+    int out = STDOUT_FILENO;
+    int ret = buf ? 0 : 1;
+    for (int i = 1; buf && i < argc; i++) {
+        const tar_entry_t *entry = cli_resolve(&c, argv[i]);
+        int r;
+        if (!is_regular(entry)) {
+            fprintf(stderr, "%s: no file %s\n", argv[0], argv[i]);
+            ret = 1;
+        } else if ((r = cli_stream(&c, entry, buf, sink_fd, &out)) != 0) {
+            fprintf(stderr, "%s: %s %s\n", argv[0], r == -3 ? "checksum mismatch in" : "cannot read", argv[i]);
+            ret = 1;
+        }
+    }
+    free(buf);
+    cli_close(&c);
+    return ret;
+}
+
+/* Checksum of a file of the hash command, valid once `hashed` is set */
+struct file_hash {
+    uint32_t crc;
+    int hashed;
+};
 
-    int fd = open(argv[1] , O_RDONLY);
+static int hash_file(struct cli *c, const tar_entry_t *entry, uint8_t *buf, void *arg, size_t i) {
+    uLong crc = crc32(0, NULL, 0);
+    int ret = cli_stream(c, entry, buf, sink_crc, &crc);
+    struct file_hash *h = &((struct file_hash *) arg)[i];
+    h->crc = crc;
+    h->hashed = ret == 0;
+    if (ret == -3) {
+        fprintf(stderr, "%s: checksum mismatch in %s\n", c->path, entry->path);
+    }
+    return ret;
+}
+
+static int cmd_hash(int argc, char **argv) {
+    if (argc < 1) {
+        return 2;
+    }
+    struct cli c;
+    if (cli_open(&c, argv[0], opt_backend) != 0) {
+        return 1;
+    }
+    const tar_index_t *index = cli_index(&c);
+    uint32_t *ids = NULL;
+    struct file_hash *hashes = NULL;
+    ssize_t n = index ? select_entries(index, argv + 1, argc - 1, 1, &ids) : -1;
+    int ret = 1;
+    if (n >= 0 && (hashes = calloc(n + 1, sizeof(*hashes)))) {
+        ret = run_job(&c, ids, n, hash_file, hashes) == 0 ? 0 : 1;
+        for (ssize_t i = 0; i < n; i++) {
+            /* the files that could not be read are marked instead of given a checksum */
+            if (hashes[i].hashed) {
+                printf("%08x  %s\n", hashes[i].crc, index->entries[ids[i]].path);
+            } else {
+                printf("FAILED    %s\n", index->entries[ids[i]].path);
+            }
+        }
+    }
+    if (ret != 0) {
+        fprintf(stderr, "%s: some files could not be read\n", argv[0]);
+    }
+    free(ids);
+    free(hashes);
+    cli_close(&c);
+    return ret;
+}
+
+/* Paths given to the extract command, none selecting every entry */
+struct selection {
+    char **paths;
+    int npaths;
+};
+
+/**
+ * A transform callback keeping the entries at, or below, the paths of a
+ * struct selection.
+ */
+static int keep_selected(tar_header_t *hdr, void *arg) {
+    const struct selection *sel = arg;
+    char path[PATH_LEN];
+    header_path(path, hdr);
+    return path_selected(path, sel->paths, sel->npaths) ? TAR_KEEP : TAR_DROP;
+}
+
+/**
+ * Decompresses a gzip-compressed archive into a temporary file.
+ *
+ * @return a descriptor of the file, -1 on error.
+ */
+static int gunzip_tmp(int fd) {
+    FILE *tmp = tmpfile();
+    gzFile gz = gzdopen(dup(fd), "rb");
+    int out = tmp ? dup(fileno(tmp)) : -1;
+    uint8_t buf[64 * 1024];
+    int n = 0;
+    while (gz && out != -1 && (n = gzread(gz, buf, sizeof(buf))) > 0 && write_all(out, buf, n) == 0) {
+    }
+    if (gz) {
+        gzclose(gz);
+    }
+    if (tmp) {
+        fclose(tmp);
+    }
+    if (out != -1 && (n != 0 || lseek(out, 0, SEEK_SET) != 0)) {
+        close(out);
+        out = -1;
+    }
+    return out;
+}
+
+static int cmd_extract(int argc, char **argv) {
+    if (argc < 2) {
+        return 2;
+    }
+    int fd = open(argv[0], O_RDONLY);
     if (fd == -1) {
-        perror("open(tar_file)");
-        return -1;
+        fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+        return 1;
+    }
+
+    /* tar_extract() reads an uncompressed archive file, decompress or select into a temporary one */
+    uint8_t magic[3] = { 0 };
+    if (pread(fd, magic, sizeof(magic), 0) == sizeof(magic) && memcmp(magic, "BZh", 3) == 0) {
+        fprintf(stderr, "%s: extract does not read bzip2-compressed archives\n", argv[0]);
+        close(fd);
+        return 1;
+    }
+    int tar_fd = fd;
+    if (magic[0] == 0x1f && magic[1] == 0x8b) {
+        tar_fd = gunzip_tmp(fd);
+    }
+    if (tar_fd != -1 && argc > 2) {
+        struct selection sel = { argv + 2, argc - 2 };
+        FILE *tmp = tmpfile();
+        int selected = tmp ? dup(fileno(tmp)) : -1;
+        if (tmp) {
+            fclose(tmp);
+        }
+        if (selected != -1 && tar_transform(tar_fd, selected, keep_selected, &sel) < 0) {
+            close(selected);
+            selected = -1;
+        }
+        if (tar_fd != fd) {
+            close(tar_fd);
+        }
+        tar_fd = selected;
+    }
+    if (tar_fd == -1) {
+        fprintf(stderr, "%s: cannot read the archive\n", argv[0]);
+        close(fd);
+        return 1;
+    }
+
+    ssize_t n = tar_extract(tar_fd, argv[1], NULL);
+    if (n == -3) {
+        fprintf(stderr, "%s: some entry would be written outside of %s\n", argv[0], argv[1]);
+    } else if (n < 0) {
+        fprintf(stderr, "%s: extraction failed with %zd\n", argv[0], n);
+    } else {
+        printf("%zd entries extracted\n", n);
+    }
+    if (tar_fd != fd) {
+        close(tar_fd);
+    }
+    close(fd);
+    return n < 0;
+}
+
+/**
+ * Gives the last component of a path, without the trailing slash of directories.
+ */
+static void base_name(char *out, size_t len, const char *path) {
+    size_t end = strlen(path);
+    if (end > 1 && path[end - 1] == '/') {
+        end--;
+    }
+    size_t start = end;
+    while (start > 0 && path[start - 1] != '/') {
+        start--;
+    }
+    snprintf(out, len, "%.*s", (int) (end - start), path + start);
+}
+
+/**
+ * Parses a size with an optional k, M or G suffix.
+ */
+static long parse_size(const char *s) {
+    char *end;
+    long v = strtol(s, &end, 10);
+    switch (*end) {
+    case 'k':
+        return v << 10;
+    case 'M':
+        return v << 20;
+    case 'G':
+        return v << 30;
+    default:
+        return v;
+    }
+}
+
+static int cmd_find(int argc, char **argv) {
+    if (argc < 1) {
+        return 2;
+    }
+    const char *dir = argc > 1 && argv[1][0] != '-' ? argv[1] : NULL;
+    const char *name = NULL, *path = NULL;
+    char type = 0;
+    tar_predicate_t preds[4];
+    size_t npreds = 0;
+    for (int i = dir ? 2 : 1; i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            return 2;
+        }
+        if (npreds > 2) {
+            return 2;
+        }
+        const char *v = argv[i + 1];
+        /* -size and -mtime take find(1) forms: +N for more, -N for less, N for exactly */
+        tar_op_t op = v[0] == '+' ? TAR_GT : v[0] == '-' ? TAR_LT : TAR_EQ;
+        if (strcmp(argv[i], "-name") == 0) {
+            name = v;
+        } else if (strcmp(argv[i], "-path") == 0) {
+            path = v;
+        } else if (strcmp(argv[i], "-type") == 0 && strchr("fdl", v[0])) {
+            type = v[0];
+        } else if (strcmp(argv[i], "-size") == 0) {
+            preds[npreds++] = (tar_predicate_t) { TAR_COL_SIZE, op, parse_size(v + (op != TAR_EQ)) };
+        } else if (strcmp(argv[i], "-mtime") == 0) {
+            /* days ago, more days ago being an earlier time */
+            long days = atol(v + (op != TAR_EQ));
+            long t = time(NULL) - days * 86400;
+            if (op == TAR_EQ) {
+                preds[npreds++] = (tar_predicate_t) { TAR_COL_MTIME, TAR_LE, t };
+                preds[npreds++] = (tar_predicate_t) { TAR_COL_MTIME, TAR_GT, t - 86400 };
+            } else {
+                preds[npreds++] = (tar_predicate_t) { TAR_COL_MTIME, op == TAR_GT ? TAR_LT : TAR_GT, t };
+            }
+        } else {
+            return 2;
+        }
+    }
+
+    struct cli c;
+    if (cli_open(&c, argv[0], opt_backend) != 0) {
+        return 1;
+    }
+    const tar_index_t *index = cli_index(&c);
+    uint32_t *ids = index ? malloc((index->count + 1) * sizeof(uint32_t)) : NULL;
+    ssize_t n = ids ? tar_index_filter(index, preds, npreds, ids, index->count) : -1;
+    char prefix[PATH_LEN];
+    dir_prefix(prefix, sizeof(prefix), dir);
+    size_t len = strlen(prefix);
+    for (ssize_t i = 0; i < n; i++) {
+        const tar_entry_t *entry = &index->entries[ids[i]];
+        char bname[PATH_LEN];
+        base_name(bname, sizeof(bname), entry->path);
+        if (strncmp(entry->path, prefix, len) != 0 || !index_is_latest(index, ids[i]) ||
+            (type == 'f' && !is_regular(entry)) || (type == 'd' && entry->typeflag != DIRTYPE) ||
+            (type == 'l' && entry->typeflag != SYMTYPE) || (name && fnmatch(name, bname, 0) != 0) ||
+            (path && fnmatch(path, entry->path, 0) != 0)) {
+            continue;
+        }
+        puts(entry->path);
+    }
+    free(ids);
+    cli_close(&c);
+    return n < 0;
+}
+
+static int cmd_du(int argc, char **argv) {
+    if (argc < 1) {
+        return 2;
+    }
+    const char *dir = NULL;
+    size_t top = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            top = strtoul(argv[++i], NULL, 10);
+        } else if (!dir) {
+            dir = argv[i];
+        } else {
+            return 2;
+        }
     }
 
-    int ret = check_archive(fd);
-    printf("check_archive returned %d\n", ret);
+    struct cli c;
+    if (cli_open(&c, argv[0], opt_backend) != 0) {
+        return 1;
+    }
+    const tar_index_t *index = cli_index(&c);
+    const tar_dir_stats_t *stats = index ? tar_index_du(index, dir) : NULL;
+    if (!stats) {
+        fprintf(stderr, "%s: no directory %s\n", argv[0], dir ? dir : "");
+        cli_close(&c);
+        return 1;
+    }
+    printf("%12llu  %s  (%llu files, %llu directories, %llu symlinks)\n", (unsigned long long) stats->size,
+           stats->path[0] ? stats->path : ".", (unsigned long long) stats->files,
+           (unsigned long long) stats->dirs, (unsigned long long) stats->symlinks);
 
+    const tar_dir_stats_t **dirs = top ? malloc(top * sizeof(*dirs)) : NULL;
+    uint32_t *files = top ? malloc(top * sizeof(*files)) : NULL;
+    if (dirs && files) {
+        size_t n = tar_index_top_dirs(index, top, dirs);
+        printf("largest directories:\n");
+        for (size_t i = 0; i < n; i++) {
+            printf("%12llu  %s\n", (unsigned long long) dirs[i]->size, dirs[i]->path);
+        }
+        n = tar_index_top_files(index, top, files);
+        printf("largest files:\n");
+        for (size_t i = 0; i < n; i++) {
+            printf("%12zu  %s\n", index->entries[files[i]].size, index->entries[files[i]].path);
+        }
+    }
+    free(dirs);
+    free(files);
+    cli_close(&c);
     return 0;
-}
\ No newline at end of file
+}
+
+static int cmd_index(int argc, char **argv) {
+    if (argc < 2 || strcmp(argv[0], "build") != 0) {
+        return 2;
+    }
+    int ret = 0;
+    for (int i = 1; i < argc; i++) {
+        char sidecar[PATH_LEN + 8];
+        snprintf(sidecar, sizeof(sidecar), "%s.idx", argv[i]);
+        unlink(sidecar);
+        snprintf(sidecar, sizeof(sidecar), "%s.bzi", argv[i]);
+        unlink(sidecar);
+
+        double start = now();
+        tar_open_opts_t opts = { .flags = TAR_OPEN_SAVE_INDEX };
+        tar_archive_t *ar = tar_open(argv[i], &opts);
+        if (!ar) {
+            fprintf(stderr, "%s: cannot index the archive\n", argv[i]);
+            ret = 1;
+            continue;
+        }
+        size_t count = tar_archive_index(ar)->count;
+        tar_close(ar);
+        printf("%s: %zu entries indexed in %.3f ms\n", argv[i], count, (now() - start) * 1e3);
+    }
+    return ret;
+}
+
+static int cmd_export(int argc, char **argv) {
+    static const char *const formats[] = { "jsonl", "csv", "binary" };
+    tar_export_format_t format = TAR_EXPORT_JSONL;
+    int flags = 0;
+    int i = 0;
+    for (; i < argc - 1; i++) {
+        if (strcmp(argv[i], "-d") == 0) {
+            flags |= TAR_EXPORT_DIGEST;
+        } else if (strcmp(argv[i], "-f") == 0 && i + 2 < argc) {
+            i++;
+            size_t f = 0;
+            while (f < 3 && strcmp(argv[i], formats[f]) != 0) {
+                f++;
+            }
+            if (f == 3) {
+                return 2;
+            }
+            format = f;
+        } else {
+            return 2;
+        }
+    }
+    if (i != argc - 1) {
+        return 2;
+    }
+
+    /* the export walks the header chain itself, whatever the backend */
+    int fd = open(argv[i], O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+        return 1;
+    }
+    ssize_t n = tar_export(fd, STDOUT_FILENO, format, flags);
+    close(fd);
+    if (n < 0) {
+        fprintf(stderr, "%s: export failed with %zd\n", argv[i], n);
+        return 1;
+    }
+    return 0;
+}
+
+static int cmd_compress(int argc, char **argv) {
+    tar_compress_opts_t opts = { .threads = opt_threads };
+    int i = 0;
+    if (argc > 0 && strcmp(argv[0], "-t") == 0) {
+        opts.flags |= TAR_COMPRESS_FRAME_TABLE;
+        i++;
+    }
+    if (argc - i != 2) {
+        return 2;
+    }
+
+    int in_fd = open(argv[i], O_RDONLY);
+    if (in_fd == -1) {
+        fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+        return 1;
+    }
+    int out_fd = open(argv[i + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd == -1) {
+        fprintf(stderr, "%s: %s\n", argv[i + 1], strerror(errno));
+        close(in_fd);
+        return 1;
+    }
+    double start = now();
+    ssize_t n = tar_compress(in_fd, out_fd, &opts);
+    close(in_fd);
+    if (close(out_fd) != 0 || n < 0) {
+        fprintf(stderr, "%s: compression failed\n", argv[i]);
+        unlink(argv[i + 1]);
+        return 1;
+    }
+    printf("%s: %zd entries compressed in %.3f ms\n", argv[i + 1], n, (now() - start) * 1e3);
+    return 0;
+}
+
+static int read_nothing(const uint8_t *data, size_t len, void *arg) {
+    /* touch every page, so that the mmap backend reads the data too */
+    volatile uint8_t sum = 0;
+    for (size_t i = 0; i < len; i += 4096) {
+        sum += data[i];
+    }
+    (void) sum;
+    return 0;
+}
+
+static int bench_file(struct cli *c, const tar_entry_t *entry, uint8_t *buf, void *arg, size_t i) {
+    return cli_stream(c, entry, buf, read_nothing, NULL);
+}
+
+static int cmd_bench(int argc, char **argv) {
+    if (argc != 1) {
+        return 2;
+    }
+    static const enum backend backends[] = { BACKEND_SCAN, BACKEND_INDEX, BACKEND_MMAP };
+    printf("%-8s %12s %12s %12s %10s\n", "backend", "open ms", "ls -R ms", "read ms", "MB/s");
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+        double t0 = now();
+        struct cli c;
+        if (cli_open(&c, argv[0], backends[b]) != 0) {
+            continue;
+        }
+        const tar_index_t *index = cli_index(&c);
+        double t1 = now();
+
+        uint32_t *ids;
+        ssize_t n = index ? select_entries(index, NULL, 0, 0, &ids) : -1;
+        if (n >= 0) {
+            free(ids);
+        }
+        double t2 = now();
+
+        n = index ? select_entries(index, NULL, 0, 1, &ids) : -1;
+        if (n < 0) {
+            cli_close(&c);
+            continue;
+        }
+        uint64_t bytes = 0;
+        for (ssize_t i = 0; i < n; i++) {
+            bytes += index->entries[ids[i]].size;
+        }
+        char read_ms[16] = "skipped", rate[16] = "-";
+        if (backends[b] != BACKEND_SCAN || n <= BENCH_SCAN_FILES) {
+            double t3 = now();
+            run_job(&c, ids, n, bench_file, NULL);
+            double t4 = now();
+            snprintf(read_ms, sizeof(read_ms), "%.3f", (t4 - t3) * 1e3);
+            snprintf(rate, sizeof(rate), "%.1f", t4 > t3 ? bytes / (t4 - t3) / 1e6 : 0);
+        }
+        free(ids);
+        printf("%-8s %12.3f %12.3f %12s %10s\n", backend_names[backends[b]], (t1 - t0) * 1e3, (t2 - t1) * 1e3,
+               read_ms, rate);
+        cli_close(&c);
+    }
+    return 0;
+}
+
+static const struct command {
+    const char *name;
+    int (*run)(int argc, char **argv);
+    const char *usage;
+} commands[] = {
+    { "verify", cmd_verify, "verify archive..." },
+    { "ls", cmd_ls, "ls [-R] archive [dir]" },
+    { "stat", cmd_stat, "stat archive path..." },
+    { "cat", cmd_cat, "cat archive path..." },
+    { "extract", cmd_extract, "extract archive dir [path...]" },
+    { "find", cmd_find, "find archive [dir] [-name glob] [-path glob] [-type f|d|l] [-size [+-]N[kMG]] [-mtime [+-]days]" },
+    { "du", cmd_du, "du archive [dir] [-n count]" },
+    { "hash", cmd_hash, "hash archive [path...]" },
+    { "index", cmd_index, "index build archive..." },
+    { "export", cmd_export, "export [-f jsonl|csv|binary] [-d] archive" },
+    { "compress", cmd_compress, "compress [-t] archive output.gz" },
+    { "bench", cmd_bench, "bench archive" },
+};
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "Usage: %s [-b auto|mmap|index|scan] [-j threads] [-s] [-v] command [arguments]\n", argv0);
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        fprintf(stderr, "       %s %s\n", argv0, commands[i].usage);
+    }
+}
+
+int main(int argc, char **argv) {
+    int stats = 0;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-s") == 0) {
+            stats = 1;
+        } else if (strcmp(argv[i], "-v") == 0) {
+            opt_verify = 1;
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            opt_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            i++;
+            size_t b = 0;
+            while (b < 4 && strcmp(argv[i], backend_names[b]) != 0) {
+                b++;
+            }
+            if (b == 4) {
+                usage(argv[0]);
+                return 2;
+            }
+            opt_backend = b;
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (i >= argc) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    const struct command *cmd = NULL;
+    for (size_t k = 0; k < sizeof(commands) / sizeof(commands[0]); k++) {
+        if (strcmp(argv[i], commands[k].name) == 0) {
+            cmd = &commands[k];
+        }
+    }
+    if (cmd) {
+        i++;
+    } else {
+        cmd = &commands[0];
+    }
+
+    struct usage before, after;
+    usage_take(&before);
+    int ret = cmd->run(argc - i, argv + i);
+    fflush(stdout);
+    usage_take(&after);
+    if (ret == 2) {
+        fprintf(stderr, "Usage: %s %s\n", argv[0], cmd->usage);
+    } else if (stats) {
+        usage_print(cmd->name, &before, &after);
+    }
+    return ret;
+}
@@ -0,0 +1,1598 @@
+#define _GNU_SOURCE
+#include <bzlib.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "lib_tar.h"
+#include "tar_internal.h"
+
+/*
+ * Regression tests of the library, run with `make check`.  Each test works
+ * in a fresh directory under /tmp and builds the archives it needs.
+ */
+
+static int failures;
+
+#define CHECK(cond) do {                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                     \
+        }                                                                   \
+    } while (0)
+
+/* Working directory of the running test */
+static char workdir[64];
+
+/**
+ * Builds the path of a file of the working directory into a static buffer,
+ * valid until the next call.
+ */
+static const char *work_path(const char *name) {
+    static char buf[2][256];
+    static int turn;
+    turn = !turn;
+    snprintf(buf[turn], sizeof(buf[turn]), "%s/%s", workdir, name);
+    return buf[turn];
+}
+
+/**
+ * A member of an archive written by write_archive().
+ */
+struct member {
+    const char *path;
+    char typeflag;
+    const char *linkname;         /* NULL for none */
+    const char *data;             /* contents, NULL for none */
+    size_t size;                  /* length of the contents, zero for a NUL-terminated string */
+};
+
+/**
+ * Writes a ustar archive holding `members` to `fd`, ending it with the
+ * end-of-archive marker.
+ */
+static void write_members(int fd, const struct member *members, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        const struct member *m = &members[i];
+        size_t size = m->size ? m->size : m->data ? strlen(m->data) : 0;
+
+        tar_header_t hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        tar_header_set_path(&hdr, m->path);
+        header_set_octal(hdr.mode, sizeof(hdr.mode), m->typeflag == DIRTYPE ? 0755 : 0644);
+        header_set_octal(hdr.uid, sizeof(hdr.uid), 0);
+        header_set_octal(hdr.gid, sizeof(hdr.gid), 0);
+        header_set_octal(hdr.size, sizeof(hdr.size), size);
+        header_set_octal(hdr.mtime, sizeof(hdr.mtime), 1700000000);
+        hdr.typeflag = m->typeflag;
+        if (m->linkname) {
+            strncpy(hdr.linkname, m->linkname, sizeof(hdr.linkname));
+        }
+        memcpy(hdr.magic, TMAGIC, TMAGLEN);
+        memcpy(hdr.version, TVERSION, TVERSLEN);
+        header_update_checksum(&hdr);
+
+        static const uint8_t zeros[512];
+        write_all(fd, &hdr, sizeof(hdr));
+        write_all(fd, m->data ? m->data : "", size);
+        write_all(fd, zeros, TAR_PADDED(size) - size);
+    }
+    static const uint8_t end[1024];
+    write_all(fd, end, sizeof(end));
+}
+
+/**
+ * Writes an archive of `members` to a file of the working directory.
+ *
+ * @return a read-only descriptor of the archive.
+ */
+static int write_archive(const char *name, const struct member *members, size_t count) {
+    int fd = open(work_path(name), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    write_members(fd, members, count);
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+/**
+ * Fills a buffer with bytes that do not compress.
+ */
+static void fill_random(uint8_t *buf, size_t len, uint32_t seed) {
+    for (size_t i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        buf[i] = seed >> 16;
+    }
+}
+
+/**
+ * Reads a whole file of the working directory.
+ *
+ * @return the contents, to free, or NULL.
+ */
+static uint8_t *read_work_file(const char *name, size_t *len) {
+    int fd = open(work_path(name), O_RDONLY);
+    struct stat st;
+    uint8_t *buf = NULL;
+    if (fd != -1 && fstat(fd, &st) == 0 && (buf = malloc(st.st_size ? st.st_size : 1))) {
+        *len = st.st_size;
+        if (read_exact(fd, buf, *len) != 0) {
+            free(buf);
+            buf = NULL;
+        }
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    return buf;
+}
+
+/**
+ * Appends `len` bytes to `fd` as one gzip member.
+ */
+static void write_gzip_member(int fd, const uint8_t *data, size_t len) {
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    deflateInit2(&strm, 6, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY);
+    size_t cap = deflateBound(&strm, len);
+    uint8_t *out = malloc(cap);
+    strm.next_in = (uint8_t *) data;
+    strm.avail_in = len;
+    strm.next_out = out;
+    strm.avail_out = cap;
+    deflate(&strm, Z_FINISH);
+    write_all(fd, out, cap - strm.avail_out);
+    deflateEnd(&strm);
+    free(out);
+}
+
+/**
+ * Tells whether a file of the working directory exists, links included.
+ */
+static int work_exists(const char *name) {
+    struct stat st;
+    return lstat(work_path(name), &st) == 0;
+}
+
+static void test_extract(void) {
+    const struct member members[] = {
+        { "d/", DIRTYPE, NULL, NULL },
+        { "d/file", REGTYPE, NULL, "contents\n" },
+        { "d/sym", SYMTYPE, "file", NULL },
+        { "d/hard", LNKTYPE, "d/file", NULL },
+    };
+    int fd = write_archive("a.tar", members, 4);
+    mkdir(work_path("out"), 0755);
+    CHECK(tar_extract(fd, work_path("out"), NULL) == 4);
+    close(fd);
+
+    struct stat file, hard;
+    CHECK(stat(work_path("out/d/file"), &file) == 0 && file.st_size == 9);
+    CHECK(stat(work_path("out/d/hard"), &hard) == 0 && hard.st_ino == file.st_ino);
+    char link[16] = "";
+    CHECK(readlink(work_path("out/d/sym"), link, sizeof(link)) == 4 && memcmp(link, "file", 4) == 0);
+}
+
+static void test_extract_through_symlink(void) {
+    mkdir(work_path("victim"), 0755);
+    char target[256];
+    snprintf(target, sizeof(target), "%s", work_path("victim"));
+
+    /* a member below a symlink extracted just before */
+    const struct member members[] = {
+        { "a", SYMTYPE, target, NULL },
+        { "a/written", REGTYPE, NULL, "escaped\n" },
+    };
+    int fd = write_archive("a.tar", members, 2);
+    mkdir(work_path("out"), 0755);
+    CHECK(tar_extract(fd, work_path("out"), NULL) == -3);
+    close(fd);
+    CHECK(!work_exists("victim/written"));
+
+    /* the same through a directory named like the link */
+    const struct member nested[] = {
+        { "b", SYMTYPE, target, NULL },
+        { "b/c/written", REGTYPE, NULL, "escaped\n" },
+    };
+    fd = write_archive("b.tar", nested, 2);
+    CHECK(tar_extract(fd, work_path("out"), NULL) == -3);
+    close(fd);
+    CHECK(!work_exists("victim/c"));
+
+    /* a file member replacing a link does not write through it */
+    int keep = open(work_path("victim/keep"), O_WRONLY | O_CREAT, 0644);
+    write_all(keep, "kept\n", 5);
+    close(keep);
+    snprintf(target, sizeof(target), "%s", work_path("victim/keep"));
+    const struct member replace[] = {
+        { "f", SYMTYPE, target, NULL },
+        { "f", REGTYPE, NULL, "replaced\n" },
+    };
+    fd = write_archive("c.tar", replace, 2);
+    CHECK(tar_extract(fd, work_path("out"), NULL) == 2);
+    close(fd);
+    struct stat st;
+    CHECK(stat(work_path("victim/keep"), &st) == 0 && st.st_size == 5);
+    CHECK(lstat(work_path("out/f"), &st) == 0 && S_ISREG(st.st_mode) && st.st_size == 9);
+}
+
+static void test_extract_hard_link_outside(void) {
+    mkdir(work_path("victim"), 0755);
+    int keep = open(work_path("victim/keep"), O_WRONLY | O_CREAT, 0644);
+    close(keep);
+    char target[256];
+    snprintf(target, sizeof(target), "%s", work_path("victim/keep"));
+
+    /* an absolute link target */
+    const struct member absolute[] = {
+        { "x", LNKTYPE, target, NULL },
+    };
+    int fd = write_archive("a.tar", absolute, 1);
+    mkdir(work_path("out"), 0755);
+    CHECK(tar_extract(fd, work_path("out"), NULL) == -3);
+    close(fd);
+    CHECK(!work_exists("out/x"));
+
+    /* a relative target going up or through an extracted symlink */
+    snprintf(target, sizeof(target), "%s", work_path("victim"));
+    const struct member relative[] = {
+        { "up", LNKTYPE, "../victim/keep", NULL },
+    };
+    fd = write_archive("b.tar", relative, 1);
+    CHECK(tar_extract(fd, work_path("out"), NULL) == -3);
+    close(fd);
+    const struct member through[] = {
+        { "s", SYMTYPE, target, NULL },
+        { "y", LNKTYPE, "s/keep", NULL },
+    };
+    fd = write_archive("c.tar", through, 2);
+    CHECK(tar_extract(fd, work_path("out"), NULL) == -3);
+    close(fd);
+    CHECK(!work_exists("out/up") && !work_exists("out/y"));
+
+    struct stat st;
+    CHECK(stat(work_path("victim/keep"), &st) == 0 && st.st_nlink == 1);
+}
+
+static void test_extract_resume(void) {
+    /* enough entries for a checkpoint, then one that cannot be written */
+    size_t count = 5000;
+    struct member *members = calloc(count, sizeof(*members));
+    char (*paths)[16] = calloc(count, sizeof(*paths));
+    members[0] = (struct member) { "blocker", REGTYPE, NULL, "x" };
+    for (size_t i = 1; i < count; i++) {
+        snprintf(paths[i], sizeof(paths[i]), i == 4500 ? "blocker/%zu" : "f%zu", i);
+        members[i] = (struct member) { paths[i], REGTYPE, NULL, "data" };
+    }
+    int fd = write_archive("a.tar", members, count);
+    free(members);
+    free(paths);
+
+    mkdir(work_path("out"), 0755);
+    char checkpoint[256];
+    snprintf(checkpoint, sizeof(checkpoint), "%s", work_path("ckpt"));
+    CHECK(tar_extract(fd, work_path("out"), checkpoint) == -2);
+
+    /* the checkpoint is a small record, not the entries seen so far */
+    struct stat st;
+    CHECK(stat(checkpoint, &st) == 0 && st.st_size < 512);
+
+    /* the resumed extraction skips what was checkpointed but counts it */
+    unlink(work_path("out/blocker"));
+    mkdir(work_path("out/blocker"), 0755);
+    unlink(work_path("out/f1"));
+    CHECK(tar_extract(fd, work_path("out"), checkpoint) == (ssize_t) count);
+    CHECK(!work_exists("out/f1") && work_exists("out/blocker/4500") && work_exists("out/f4999"));
+    CHECK(stat(checkpoint, &st) == -1);
+
+    /* a checkpoint that cannot be written fails the call */
+    CHECK(check_archive_resumable(fd, work_path("missing/ckpt")) == -4);
+    CHECK(check_archive_resumable(fd, checkpoint) == (int) count);
+    close(fd);
+}
+
+static void test_open_sidecar_identity(void) {
+    const struct member before[] = { { "old", REGTYPE, NULL, "data" } };
+    int fd = write_archive("a.tar", before, 1);
+    struct stat st;
+    fstat(fd, &st);
+    close(fd);
+
+    /* read-only use leaves no file behind */
+    tar_archive_t *ar = tar_open(work_path("a.tar"), NULL);
+    CHECK(ar != NULL);
+    tar_close(ar);
+    CHECK(!work_exists("a.tar.idx"));
+
+    tar_open_opts_t opts = { .flags = TAR_OPEN_SAVE_INDEX };
+    ar = tar_open(work_path("a.tar"), &opts);
+    tar_close(ar);
+    CHECK(work_exists("a.tar.idx"));
+
+    /* a rewrite of the same size within the same second is noticed */
+    const struct member after[] = { { "new", REGTYPE, NULL, "data" } };
+    fd = write_archive("a.tar", after, 1);
+    struct timespec times[2] = { st.st_atim, st.st_mtim };
+    times[1].tv_nsec = (times[1].tv_nsec + 1) % 1000000000;
+    futimens(fd, times);
+    close(fd);
+
+    ar = tar_open(work_path("a.tar"), &opts);
+    CHECK(ar && tar_index_find(tar_archive_index(ar), "new") && !tar_index_find(tar_archive_index(ar), "old"));
+    tar_close(ar);
+}
+
+static void test_gzip_members(void) {
+    /* a member far larger than the access point span, split across two gzip members */
+    size_t size = 3 * 1024 * 1024;
+    uint8_t *data = malloc(size);
+    fill_random(data, size, 1);
+    const struct member members[] = {
+        { "small", REGTYPE, NULL, "small\n" },
+        { "big", REGTYPE, NULL, (const char *) data, size },
+    };
+    close(write_archive("a.tar", members, 2));
+    size_t len;
+    uint8_t *tar = read_work_file("a.tar", &len);
+    int fd = open(work_path("a.tar.gz"), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    size_t split = 2 * 1024 * 1024 + 512 * 1024;
+    write_gzip_member(fd, tar, split);
+    write_gzip_member(fd, tar + split, len - split);
+    close(fd);
+    free(tar);
+
+    tar_open_opts_t opts = { .flags = TAR_OPEN_SAVE_INDEX };
+    for (int pass = 0; pass < 2; pass++) {
+        /* the first pass decompresses the archive, the second loads the saved access points */
+        tar_archive_t *ar = tar_open(work_path("a.tar.gz"), &opts);
+        CHECK(ar != NULL);
+        if (!ar) {
+            break;
+        }
+        CHECK(work_exists("a.tar.gz.gzi"));
+
+        /* from a point inside the first gzip member into the second one */
+        size_t offset = 2 * 1024 * 1024 + 100000, want = 600000;
+        uint8_t *buf = malloc(want);
+        size_t got = want;
+        CHECK(tar_read(ar, "big", offset, buf, &got) >= 0 && got == want && memcmp(buf, data + offset, want) == 0);
+        got = want;
+        CHECK(tar_read(ar, "big", size - want, buf, &got) == 0 && got == want &&
+              memcmp(buf, data + size - want, want) == 0);
+        free(buf);
+        tar_close(ar);
+    }
+    free(data);
+}
+
+static void test_gzip_cache_budget(void) {
+    size_t size = 100 * 1024;
+    uint8_t *data = malloc(size);
+    fill_random(data, size, 2);
+    const struct member members[] = {
+        { "a", REGTYPE, NULL, (const char *) data, size },
+        { "b", REGTYPE, NULL, (const char *) data, size },
+        { "c", REGTYPE, NULL, (const char *) data, size },
+    };
+    close(write_archive("a.tar", members, 3));
+    size_t len;
+    uint8_t *tar = read_work_file("a.tar", &len);
+    int fd = open(work_path("a.tar.gz"), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    write_gzip_member(fd, tar, len);
+    close(fd);
+    free(tar);
+
+    mkdir(work_path("cache"), 0755);
+    char cache[256];
+    snprintf(cache, sizeof(cache), "%s", work_path("cache"));
+    tar_open_opts_t opts = { .cache_dir = cache, .cache_budget = 250 * 1024 };
+    tar_archive_t *ar = tar_open(work_path("a.tar.gz"), &opts);
+    CHECK(ar != NULL);
+    uint8_t *buf = malloc(size);
+    for (int round = 0; ar && round < 3; round++) {
+        for (const char *const *path = (const char *const[]) { "a", "b", "c", NULL }; *path; path++) {
+            size_t got = size;
+            CHECK(tar_read(ar, *path, 0, buf, &got) == 0 && got == size && memcmp(buf, data, size) == 0);
+        }
+    }
+    tar_close(ar);
+    free(buf);
+    free(data);
+
+    /* two members fit the budget, the third evicts one of them */
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "test $(ls %s | wc -l) -eq 2", cache);
+    CHECK(system(cmd) == 0);
+}
+
+/**
+ * Reads lines `first` to `first + count - 1` of "text" into `buf` and
+ * compares them with the lines of `text`.
+ */
+static int lines_match(tar_archive_t *ar, const char *text, size_t first, size_t count) {
+    const char *start = text, *end;
+    for (size_t n = 1; n < first; n++) {
+        start = strchr(start, '\n') + 1;
+    }
+    end = start;
+    for (size_t n = 0; n < count && *end; n++) {
+        end = strchr(end, '\n') + 1;
+    }
+    uint8_t buf[64 * 1024];
+    size_t len = sizeof(buf);
+    return tar_read_lines(ar, "text", first, count, buf, &len) == 0 &&
+           len == (size_t) (end - start) && memcmp(buf, start, len) == 0;
+}
+
+static void test_read_lines_sidecar(void) {
+    char *text = malloc(3000 * 16);
+    size_t size = 0;
+    for (int n = 1; n <= 3000; n++) {
+        size += sprintf(text + size, "line %d\n", n);
+    }
+    const struct member members[] = { { "text", REGTYPE, NULL, text } };
+    close(write_archive("a.tar", members, 1));
+
+    /* a count running past the end of the member stops there, without wrapping */
+    tar_open_opts_t opts = { .flags = TAR_OPEN_SAVE_INDEX };
+    tar_archive_t *ar = tar_open(work_path("a.tar"), &opts);
+    CHECK(ar && lines_match(ar, text, 2500, SIZE_MAX));
+    tar_close(ar);
+    CHECK(work_exists("a.tar.lines"));
+
+    /* the first record: entry number, lines and marks after the magic, identity, step and count */
+    off_t record = 8 + IDENTITY_LEN + 16;
+    const uint64_t bad[][2] = {
+        { record + 16, (uint64_t) 1 << 61 },  /* marks whose size wraps around */
+        { record + 8, 1000000 },              /* more lines than the marks cover */
+        { record + 16, 1 },                   /* fewer marks than the record holds */
+    };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        int fd = open(work_path("a.tar.lines"), O_RDWR);
+        uint8_t value[8];
+        put_u64(value, bad[i][1]);
+        CHECK(pwrite(fd, value, sizeof(value), bad[i][0]) == sizeof(value));
+        close(fd);
+
+        /* the record is rejected and the index built again */
+        ar = tar_open(work_path("a.tar"), &opts);
+        CHECK(ar && lines_match(ar, text, 2049, 3) && lines_match(ar, text, 3000, 1));
+        tar_close(ar);
+    }
+    free(text);
+}
+
+static void test_nested_index_saved(void) {
+    const struct member leaf[] = { { "leaf", REGTYPE, NULL, "leaf\n" } };
+    close(write_archive("inner.tar", leaf, 1));
+    size_t inner_len, middle_len;
+    uint8_t *inner = read_work_file("inner.tar", &inner_len);
+    const struct member middle[] = { { "inner.tar", REGTYPE, NULL, (const char *) inner, inner_len } };
+    close(write_archive("middle.tar", middle, 1));
+    uint8_t *mid = read_work_file("middle.tar", &middle_len);
+    const struct member outer[] = {
+        { "other", REGTYPE, NULL, "other\n" },
+        { "middle.tar", REGTYPE, NULL, (const char *) mid, middle_len },
+    };
+    close(write_archive("outer.tar", outer, 2));
+    free(inner);
+    free(mid);
+
+    /* the outer archive is closed first, it is released with the last nested one */
+    tar_open_opts_t opts = { .flags = TAR_OPEN_SAVE_INDEX };
+    tar_archive_t *ar = tar_open(work_path("outer.tar"), &opts);
+    tar_archive_t *m = ar ? tar_open_member(ar, "middle.tar") : NULL;
+    tar_archive_t *in = m ? tar_open_member(m, "inner.tar") : NULL;
+    CHECK(in != NULL);
+    tar_close(ar);
+    uint8_t buf[16];
+    size_t len = sizeof(buf);
+    CHECK(in && tar_read(in, "leaf", 0, buf, &len) == 0 && len == 5 && memcmp(buf, "leaf\n", 5) == 0);
+    tar_close(in);
+    tar_close(m);
+
+    /* the grandchild index is loaded from the sidecar, and handed down to the nested handle */
+    ar = tar_open(work_path("outer.tar"), &opts);
+    const tar_index_t *index = ar ? tar_archive_index(ar) : NULL;
+    CHECK(index && index->nested && index->nested[1] && index->nested[1]->nested &&
+          index->nested[1]->nested[0] && index->nested[1]->nested[0]->count == 1);
+    m = ar ? tar_open_member(ar, "middle.tar") : NULL;
+    index = m ? tar_archive_index(m) : NULL;
+    CHECK(index && index->nested && index->nested[0] && index->nested[0]->count == 1);
+    tar_close(m);
+    tar_close(ar);
+}
+
+static void test_list_repeated_paths(void) {
+    /* every path twice, the second round in reverse order */
+    struct member members[1 + 2 * 300];
+    char names[300][16];
+    members[0] = (struct member) { "d/", DIRTYPE, NULL, NULL };
+    for (int i = 0; i < 300; i++) {
+        snprintf(names[i], sizeof(names[i]), "d/f%d", i);
+        members[1 + i] = (struct member) { names[i], REGTYPE, NULL, "old" };
+        members[600 - i] = (struct member) { names[i], REGTYPE, NULL, "new" };
+    }
+    int fd = write_archive("a.tar", members, 601);
+
+    char storage[400][256];
+    char *entries[400];
+    for (int i = 0; i < 400; i++) {
+        entries[i] = storage[i];
+    }
+    size_t n = 400;
+    CHECK(list(fd, "d/", entries, &n) && n == 300);
+    for (size_t i = 0; i < n; i++) {
+        CHECK(strcmp(entries[i], names[i]) == 0);
+    }
+
+    /* a short array keeps the first paths */
+    n = 10;
+    CHECK(list(fd, "d/", entries, &n) && n == 10 && strcmp(entries[9], names[9]) == 0);
+    close(fd);
+}
+
+/**
+ * Tells whether a restore plan holds `path`, from archive `archive` of the chain.
+ */
+static int plan_has(const tar_restore_t *plan, size_t n, const char *path, size_t archive) {
+    for (size_t i = 0; i < n; i++) {
+        if (strcmp(plan[i].entry->path, path) == 0) {
+            return plan[i].archive == archive;
+        }
+    }
+    return 0;
+}
+
+static void test_incremental_restore(void) {
+    /* b is deleted by the level 1 dump, c is created and a left unchanged */
+    static const char dump0[] = "Ya\0Yb\0";
+    static const char dump1[] = "Na\0Yc\0";
+    const struct member level0[] = {
+        { "src/", GNU_DUMPDIR, NULL, dump0, sizeof(dump0) },
+        { "src/a", REGTYPE, NULL, "a\n" },
+        { "src/b", REGTYPE, NULL, "b\n" },
+    };
+    const struct member level1[] = {
+        { "src/", GNU_DUMPDIR, NULL, dump1, sizeof(dump1) },
+        { "src/c", REGTYPE, NULL, "c\n" },
+    };
+    close(write_archive("l0.tar", level0, 3));
+    close(write_archive("l1.tar", level1, 2));
+
+    tar_archive_t *ar0 = tar_open(work_path("l0.tar"), NULL);
+    tar_archive_t *ar1 = tar_open(work_path("l1.tar"), NULL);
+    CHECK(ar0 && ar1);
+    if (!ar0 || !ar1) {
+        tar_close(ar0);
+        tar_close(ar1);
+        return;
+    }
+    const tar_index_t *chain[] = { tar_archive_index(ar0), tar_archive_index(ar1) };
+    tar_restore_t plan[8];
+    size_t n = tar_plan_restore(chain, 2, "src", plan, 8);
+    CHECK(n == 3 && plan_has(plan, n, "src/", 1) && plan_has(plan, n, "src/a", 0) && plan_has(plan, n, "src/c", 1));
+    CHECK(!plan_has(plan, n, "src/b", 0));
+    CHECK(tar_plan_restore(chain, 2, "src/b", plan, 8) == 0);
+    CHECK(tar_plan_restore(chain, 1, "src/b", plan, 8) == 1);
+    tar_close(ar0);
+    tar_close(ar1);
+}
+
+static void test_incremental_gzip_entries(void) {
+    /* a dumpdir first, then more files than the entry array first holds */
+    char dump[300 * 8];
+    struct member members[1 + 300];
+    char names[300][16];
+    size_t len = 0;
+    for (int i = 0; i < 300; i++) {
+        snprintf(names[i], sizeof(names[i]), "d/f%d", i);
+        len += sprintf(dump + len, "Yf%d", i) + 1;
+        members[1 + i] = (struct member) { names[i], REGTYPE, NULL, "data\n" };
+    }
+    dump[len++] = '\0';
+    members[0] = (struct member) { "d/", GNU_DUMPDIR, NULL, dump, len };
+    close(write_archive("a.tar", members, 301));
+    size_t tar_len;
+    uint8_t *tar = read_work_file("a.tar", &tar_len);
+    int fd = open(work_path("a.tar.gz"), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    write_gzip_member(fd, tar, tar_len);
+    close(fd);
+    free(tar);
+
+    /* the first open indexes while decompressing, the second decodes the saved index */
+    tar_open_opts_t opts = { .flags = TAR_OPEN_SAVE_INDEX };
+    for (int pass = 0; pass < 2; pass++) {
+        tar_archive_t *ar = tar_open(work_path("a.tar.gz"), &opts);
+        const tar_index_t *index = ar ? tar_archive_index(ar) : NULL;
+        CHECK(index && index->count == 301 && index->dumpdirs && index->dumpdirs[0] &&
+              memcmp(index->dumpdirs[0], dump, len) == 0);
+        size_t dumpdirs = 0;
+        for (size_t i = 0; index && i < index->count; i++) {
+            dumpdirs += index->dumpdirs[i] != NULL;
+        }
+        CHECK(dumpdirs == 1);
+        tar_restore_t plan[301];
+        CHECK(index && tar_plan_restore(&index, 1, "d", plan, 301) == 301);
+        tar_close(ar);
+    }
+}
+
+/**
+ * Decompresses a gzip file of the working directory, all its members.
+ */
+static uint8_t *gunzip_work_file(const char *name, size_t *len) {
+    gzFile gz = gzopen(work_path(name), "rb");
+    size_t cap = 1024 * 1024;
+    uint8_t *buf = malloc(cap);
+    *len = 0;
+    int n;
+    while (gz && (n = gzread(gz, buf + *len, cap - *len)) > 0) {
+        *len += n;
+        if (*len == cap) {
+            buf = realloc(buf, cap *= 2);
+        }
+    }
+    if (gz) {
+        gzclose(gz);
+    }
+    return buf;
+}
+
+static void test_compress(void) {
+    /* entries larger than a chunk, and many small ones */
+    size_t size = 300 * 1024;
+    uint8_t *data = malloc(size);
+    fill_random(data, size, 2);
+    struct member members[2 + 100];
+    char names[100][16];
+    members[0] = (struct member) { "big1", REGTYPE, NULL, (const char *) data, size };
+    members[1] = (struct member) { "big2", REGTYPE, NULL, (const char *) data + 1, size - 1 };
+    for (int i = 0; i < 100; i++) {
+        snprintf(names[i], sizeof(names[i]), "small%d", i);
+        members[2 + i] = (struct member) { names[i], REGTYPE, NULL, names[i] };
+    }
+    int in_fd = write_archive("a.tar", members, 102);
+    size_t tar_len;
+    uint8_t *tar = read_work_file("a.tar", &tar_len);
+
+    for (int table = 0; table < 2; table++) {
+        tar_compress_opts_t opts = {
+            .flags = table ? TAR_COMPRESS_FRAME_TABLE : 0, .threads = 2, .chunk_size = 64 * 1024,
+        };
+        lseek(in_fd, 0, SEEK_SET);
+        int out_fd = open(work_path("a.tar.gz"), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        CHECK(tar_compress(in_fd, out_fd, &opts) == 102);
+        close(out_fd);
+
+        /* any gzip reader gets the archive back, frame table included */
+        size_t len;
+        uint8_t *out = gunzip_work_file("a.tar.gz", &len);
+        CHECK(len == tar_len && memcmp(out, tar, len) == 0);
+        free(out);
+
+        /* the frame table ends the file only when asked for */
+        size_t gz_len;
+        uint8_t *gz = read_work_file("a.tar.gz", &gz_len);
+        CHECK(gz_len > 26 && (memcmp(gz + gz_len - 26 + 8, GZ_FRAMES_MAGIC, 8) == 0) == table);
+        free(gz);
+
+        tar_archive_t *ar = tar_open(work_path("a.tar.gz"), NULL);
+        CHECK(ar != NULL);
+        uint8_t buf[1024];
+        size_t got = sizeof(buf);
+        CHECK(ar && tar_read(ar, "big2", size - 1 - sizeof(buf), buf, &got) == 0 && got == sizeof(buf) &&
+              memcmp(buf, data + size - sizeof(buf), sizeof(buf)) == 0);
+        got = sizeof(buf);
+        CHECK(ar && tar_read(ar, "small99", 0, buf, &got) == 0 && got == 7 && memcmp(buf, "small99", 7) == 0);
+        tar_close(ar);
+    }
+    close(in_fd);
+
+    /* an input cut within an entry or before its end-of-archive marker is not a valid archive */
+    for (size_t cut = 1024; cut <= 1024 + 512; cut += 512) {
+        int cut_fd = open(work_path("cut.tar"), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        write_all(cut_fd, tar, tar_len - cut);
+        lseek(cut_fd, 0, SEEK_SET);
+        int out_fd = open(work_path("cut.tar.gz"), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        CHECK(tar_compress(cut_fd, out_fd, NULL) == -1);
+        close(out_fd);
+        close(cut_fd);
+    }
+    free(tar);
+    free(data);
+}
+
+static void test_verify_reads(void) {
+    size_t size = 200 * 1024;
+    uint8_t *data = malloc(size);
+    fill_random(data, size, 3);
+    const struct member members[] = { { "big", REGTYPE, NULL, (const char *) data, size } };
+    int fd = write_archive("a.tar", members, 1);
+    struct stat st;
+    fstat(fd, &st);
+    close(fd);
+
+    /* a read-only open computes the checksums without saving them */
+    tar_open_opts_t opts = { .flags = TAR_OPEN_VERIFY };
+    tar_archive_t *ar = tar_open(work_path("a.tar"), &opts);
+    CHECK(ar != NULL);
+    tar_close(ar);
+    CHECK(!work_exists("a.tar.crc"));
+
+    /* reads within chunks and across them, each verified against the checksums */
+    opts.flags |= TAR_OPEN_SAVE_INDEX;
+    ar = tar_open(work_path("a.tar"), &opts);
+    CHECK(ar != NULL);
+    CHECK(work_exists("a.tar.crc"));
+    uint8_t buf[100 * 1024];
+    for (size_t off = 0; off < size; off += 30000) {
+        size_t got = sizeof(buf);
+        CHECK(ar && tar_read(ar, "big", off, buf, &got) >= 0 &&
+              got == (size - off < sizeof(buf) ? size - off : sizeof(buf)) && memcmp(buf, data + off, got) == 0);
+    }
+    tar_close(ar);
+
+    /* a byte changed behind an unchanged identity fails the chunk holding it */
+    fd = open(work_path("a.tar"), O_RDWR);
+    uint8_t flipped = data[100000] ^ 1;
+    CHECK(pwrite(fd, &flipped, 1, 512 + 100000) == 1);
+    struct timespec times[2] = { st.st_atim, st.st_mtim };
+    futimens(fd, times);
+    ar = tar_open(work_path("a.tar"), &opts);
+    size_t got = 10;
+    CHECK(ar && tar_read(ar, "big", 99995, buf, &got) == -3);
+    got = 10;
+    CHECK(ar && tar_read(ar, "big", 0, buf, &got) >= 0 && got == 10);
+    /* as is the line index, built over the whole member */
+    got = sizeof(buf);
+    CHECK(ar && tar_read_lines(ar, "big", 1, 1, buf, &got) == -3);
+    tar_close(ar);
+
+    /* a changed identity is taken for a rewrite, the checksums being computed again */
+    times[1].tv_nsec = (times[1].tv_nsec + 1) % 1000000000;
+    futimens(fd, times);
+    close(fd);
+    ar = tar_open(work_path("a.tar"), &opts);
+    got = 10;
+    CHECK(ar && tar_read(ar, "big", 99995, buf, &got) >= 0 && buf[5] == flipped);
+    tar_close(ar);
+    free(data);
+}
+
+static int drop_all(tar_header_t *hdr, void *arg) {
+    (void) hdr;
+    (void) arg;
+    return TAR_DROP;
+}
+
+static void test_transform_truncated(void) {
+    const struct member members[] = {
+        { "a", REGTYPE, NULL, "a\n" },
+        { "b", REGTYPE, NULL, "b\n" },
+    };
+    close(write_archive("a.tar", members, 2));
+    size_t tar_len;
+    uint8_t *tar = read_work_file("a.tar", &tar_len);
+
+    int out_fd = open(work_path("out.tar"), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    int in_fd = open(work_path("a.tar"), O_RDONLY);
+    CHECK(tar_transform(in_fd, out_fd, NULL, NULL) == 2);
+    lseek(in_fd, 0, SEEK_SET);
+    const tar_route_t all = { .pattern = NULL, .fd = out_fd };
+    CHECK(tar_route(in_fd, &all, 1) == 2);
+    close(in_fd);
+
+    /* cut after an entry, within a header, within dropped data and before the marker */
+    const size_t cuts[] = { 1024, 1024 + 104, 1024 + 512 + 100, tar_len - 1024 };
+    for (size_t i = 0; i < sizeof(cuts) / sizeof(cuts[0]); i++) {
+        for (int drop = 0; drop < 2; drop++) {
+            in_fd = open(work_path("cut.tar"), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            write_all(in_fd, tar, cuts[i]);
+            lseek(in_fd, 0, SEEK_SET);
+            CHECK(tar_transform(in_fd, out_fd, drop ? drop_all : NULL, NULL) == -1);
+            close(in_fd);
+        }
+
+        /* entries routed, raw or skipped */
+        const tar_route_t routes[] = {
+            { .pattern = "a", .fd = out_fd, .raw = 1 },
+            { .pattern = "x", .fd = out_fd },
+        };
+        for (size_t r = 0; r < 2; r++) {
+            in_fd = open(work_path("cut.tar"), O_RDONLY);
+            CHECK(tar_route(in_fd, routes + r, 1) == -1);
+            close(in_fd);
+        }
+    }
+
+    /* a corrupt header is not passed on with a checksum made valid */
+    tar[1024] ^= 1;
+    in_fd = open(work_path("cut.tar"), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    write_all(in_fd, tar, tar_len);
+    lseek(in_fd, 0, SEEK_SET);
+    tar_rules_t rules = { .uid = 1, .gid = -1, .mode = -1 };
+    CHECK(tar_transform(in_fd, out_fd, tar_rules_apply, &rules) == -1);
+    close(in_fd);
+    close(out_fd);
+    free(tar);
+}
+
+static void test_export_truncated(void) {
+    /* a member larger than the input buffer, skipped by seeking unless digested */
+    size_t size = 3 * 1024 * 1024;
+    uint8_t *data = malloc(size);
+    fill_random(data, size, 4);
+    const struct member members[] = {
+        { "small", REGTYPE, NULL, "small\n" },
+        { "big", REGTYPE, NULL, (const char *) data, size },
+    };
+    close(write_archive("a.tar", members, 2));
+    size_t tar_len;
+    uint8_t *tar = read_work_file("a.tar", &tar_len);
+    int out_fd = open(work_path("out.jsonl"), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    for (int digest = 0; digest < 2; digest++) {
+        int in_fd = open(work_path("a.tar"), O_RDONLY);
+        CHECK(tar_export(in_fd, out_fd, TAR_EXPORT_JSONL, digest ? TAR_EXPORT_DIGEST : 0) == 2);
+        close(in_fd);
+
+        /* cut within the data of the last member and before the end-of-archive marker */
+        const size_t cuts[] = { tar_len - 1024 - 1000, tar_len - 1024 };
+        for (size_t i = 0; i < sizeof(cuts) / sizeof(cuts[0]); i++) {
+            in_fd = open(work_path("cut.tar"), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            write_all(in_fd, tar, cuts[i]);
+            lseek(in_fd, 0, SEEK_SET);
+            CHECK(tar_export(in_fd, out_fd, TAR_EXPORT_JSONL, digest ? TAR_EXPORT_DIGEST : 0) == -1);
+            close(in_fd);
+        }
+    }
+    close(out_fd);
+    free(tar);
+    free(data);
+}
+
+/**
+ * Writes an archive of `members` to "a.tar.gz" as a single gzip member,
+ * setting its modification time to `mtime` unless NULL.
+ */
+static void write_gzip_archive(const struct member *members, size_t count, const struct timespec *mtime) {
+    close(write_archive("a.tar", members, count));
+    size_t len;
+    uint8_t *tar = read_work_file("a.tar", &len);
+    int fd = open(work_path("a.tar.gz"), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    write_gzip_member(fd, tar, len);
+    if (mtime) {
+        struct timespec times[2] = { *mtime, *mtime };
+        futimens(fd, times);
+    }
+    close(fd);
+    free(tar);
+}
+
+/**
+ * Reads "m" through a cached handle and compares it with `data`.
+ */
+static int cached_read_matches(const char *cache, const uint8_t *data, size_t size) {
+    tar_open_opts_t opts = { .cache_dir = cache };
+    tar_archive_t *ar = tar_open(work_path("a.tar.gz"), &opts);
+    uint8_t *buf = malloc(size);
+    int ok = ar != NULL;
+    for (int i = 0; ok && i < 3; i++) {
+        size_t got = size;
+        ok = tar_read(ar, "m", 0, buf, &got) == 0 && got == size && memcmp(buf, data, size) == 0;
+    }
+    tar_close(ar);
+    free(buf);
+    return ok;
+}
+
+static void test_gzip_cache_stale(void) {
+    size_t size = 100 * 1024;
+    uint8_t *data = malloc(2 * size);
+    fill_random(data, 2 * size, 5);
+    mkdir(work_path("cache"), 0755);
+    char cache[256];
+    snprintf(cache, sizeof(cache), "%s", work_path("cache"));
+
+    const struct member before[] = { { "m", REGTYPE, NULL, (const char *) data, size } };
+    write_gzip_archive(before, 1, NULL);
+    CHECK(cached_read_matches(cache, data, size));
+    struct stat st;
+    stat(work_path("a.tar.gz"), &st);
+
+    /* rewritten in place within the same second, with contents of the same size */
+    const struct member after[] = { { "m", REGTYPE, NULL, (const char *) data + size, size } };
+    struct timespec mtime = st.st_mtim;
+    mtime.tv_nsec = (mtime.tv_nsec + 1) % 1000000000;
+    write_gzip_archive(after, 1, &mtime);
+    CHECK(cached_read_matches(cache, data + size, size));
+
+    /* a damaged cache file is not served, and is replaced */
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "for f in %s/*.member; do printf X | dd of=$f bs=1 seek=1000 conv=notrunc 2>/dev/null; done",
+             cache);
+    CHECK(system(cmd) == 0);
+    CHECK(cached_read_matches(cache, data + size, size));
+    CHECK(cached_read_matches(cache, data + size, size));
+    free(data);
+}
+
+struct member_reader {
+    tar_archive_t *ar;
+    const uint8_t *data;
+    size_t size;
+    int ok;
+};
+
+/**
+ * Reads "log.gz" decompressed, from the end backwards, comparing it with
+ * the data it was compressed from.
+ */
+static void *read_log(void *arg) {
+    struct member_reader *r = arg;
+    uint8_t buf[70000];
+    r->ok = 1;
+    for (size_t end = r->size; end > 0 && r->ok;) {
+        size_t offset = end > sizeof(buf) ? end - sizeof(buf) : 0, got = sizeof(buf);
+        r->ok = tar_read(r->ar, "log.gz", offset, buf, &got) >= 0 && got == sizeof(buf) &&
+                memcmp(buf, r->data + offset, got) == 0;
+        end = offset;
+    }
+    return NULL;
+}
+
+static void test_decompress_members(void) {
+    /* a member spanning several access points, and a ".gz" member holding no gzip data */
+    size_t size = 1024 * 1024;
+    uint8_t *data = malloc(size);
+    fill_random(data, size, 6);
+    int fd = open(work_path("log.gz"), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    write_gzip_member(fd, data, size);
+    close(fd);
+    size_t gz_len;
+    uint8_t *gz = read_work_file("log.gz", &gz_len);
+    const struct member members[] = {
+        { "log.gz", REGTYPE, NULL, (const char *) gz, gz_len },
+        { "plain.gz", REGTYPE, NULL, "plain\n" },
+    };
+    close(write_archive("a.tar", members, 2));
+
+    /* without the flag the stored bytes are read */
+    tar_archive_t *ar = tar_open(work_path("a.tar"), NULL);
+    uint8_t buf[16];
+    size_t got = sizeof(buf);
+    CHECK(ar && tar_read(ar, "log.gz", 0, buf, &got) > 0 && got == sizeof(buf) && memcmp(buf, gz, got) == 0);
+    tar_close(ar);
+
+    /* threads reading the member for the first time at once */
+    tar_open_opts_t opts = { .flags = TAR_OPEN_DECOMPRESS };
+    ar = tar_open(work_path("a.tar"), &opts);
+    CHECK(ar != NULL);
+    struct member_reader readers[4];
+    pthread_t tids[4];
+    for (int t = 0; ar && t < 4; t++) {
+        readers[t] = (struct member_reader) { ar, data, size, 0 };
+        pthread_create(&tids[t], NULL, read_log, &readers[t]);
+    }
+    for (int t = 0; ar && t < 4; t++) {
+        pthread_join(tids[t], NULL);
+        CHECK(readers[t].ok);
+    }
+
+    got = sizeof(buf);
+    CHECK(ar && tar_read(ar, "log.gz", size + 1, buf, &got) == -2);
+    got = sizeof(buf);
+    CHECK(ar && tar_read(ar, "plain.gz", 0, buf, &got) == 0 && got == 6 && memcmp(buf, "plain\n", 6) == 0);
+    tar_close(ar);
+    free(gz);
+    free(data);
+}
+
+static void test_gzip_damaged(void) {
+    char *text = malloc(200000 * 16);
+    size_t size = 0;
+    for (int n = 1; n <= 200000; n++) {
+        size += sprintf(text + size, "line %d\n", n);
+    }
+    const struct member members[] = { { "text", REGTYPE, NULL, text, size } };
+    write_gzip_archive(members, 1, NULL);
+    tar_open_opts_t opts = { .flags = TAR_OPEN_SAVE_INDEX };
+    tar_archive_t *ar = tar_open(work_path("a.tar.gz"), &opts);
+    CHECK(ar != NULL);
+    tar_close(ar);
+
+    /*
+     * damaged behind the saved access points, which are still current: the
+     * Huffman codes decode any bits, the block headers met in the junk do not
+     */
+    int fd = open(work_path("a.tar.gz"), O_RDWR);
+    struct stat st;
+    fstat(fd, &st);
+    uint8_t junk[64 * 1024];
+    fill_random(junk, sizeof(junk), 7);
+    CHECK(pwrite(fd, junk, sizeof(junk), st.st_size / 2) == sizeof(junk));
+    struct timespec times[2] = { st.st_atim, st.st_mtim };
+    futimens(fd, times);
+    close(fd);
+
+    /* reading on until the end, like the cat command, stops with an error */
+    ar = tar_open(work_path("a.tar.gz"), &opts);
+    CHECK(ar != NULL);
+    uint8_t buf[64 * 1024];
+    ssize_t r = 1;
+    size_t offset = 0;
+    for (int reads = 0; ar && r > 0 && reads < 1000; reads++) {
+        size_t got = sizeof(buf);
+        r = tar_read(ar, "text", offset, buf, &got);
+        offset += got;
+    }
+    CHECK(r == -1);
+    tar_close(ar);
+    free(text);
+}
+
+/**
+ * Appends `len` bytes to `fd` as one bzip2 stream of 100k blocks.
+ */
+static void write_bzip2_stream(int fd, const uint8_t *data, size_t len) {
+    unsigned cap = len + len / 100 + 600;
+    char *out = malloc(cap);
+    BZ2_bzBuffToBuffCompress(out, &cap, (char *) data, len, 1, 0, 0);
+    write_all(fd, out, cap);
+    free(out);
+}
+
+static void test_bzip2_round_trip(void) {
+    /* members spanning several blocks, the archive split into two streams */
+    size_t size = 60 * 1024;
+    uint8_t *data = malloc(10 * size);
+    fill_random(data, 10 * size, 8);
+    struct member members[11];
+    char names[10][8];
+    for (int i = 0; i < 10; i++) {
+        snprintf(names[i], sizeof(names[i]), "f%d", i);
+        members[i] = (struct member) { names[i], REGTYPE, NULL, (const char *) data + i * size, size };
+    }
+    members[10] = (struct member) { "last", REGTYPE, NULL, "last\n" };
+    close(write_archive("a.tar", members, 11));
+    size_t len;
+    uint8_t *tar = read_work_file("a.tar", &len);
+    int fd = open(work_path("a.tar.bz2"), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    size_t split = 5 * size + 1000;
+    write_bzip2_stream(fd, tar, split);
+    write_bzip2_stream(fd, tar + split, len - split);
+    close(fd);
+    free(tar);
+
+    tar_open_opts_t opts = { .flags = TAR_OPEN_SAVE_INDEX };
+    for (int pass = 0; pass < 2; pass++) {
+        /* the first pass decompresses the archive, the second loads the saved block table */
+        tar_archive_t *ar = tar_open(work_path("a.tar.bz2"), &opts);
+        CHECK(ar != NULL);
+        if (!ar) {
+            break;
+        }
+        CHECK(work_exists("a.tar.bz2.bzi"));
+
+        uint8_t buf[20000];
+        size_t got = 5;
+        CHECK(tar_read(ar, "last", 0, buf, &got) == 0 && got == 5 && memcmp(buf, "last\n", 5) == 0);
+        /* across the end of the first stream, then at random within later members */
+        for (int i = 0; i < 20; i++) {
+            int m = i == 0 ? 4 : 9 - i % 5;
+            size_t offset = i == 0 ? size - 5000 : (size_t) (i * 7919) % (size - sizeof(buf));
+            got = sizeof(buf);
+            CHECK(tar_read(ar, names[m], offset, buf, &got) >= 0 && got == (i == 0 ? 5000 : sizeof(buf)) &&
+                  memcmp(buf, data + m * size + offset, got) == 0);
+        }
+        tar_close(ar);
+    }
+
+    /* the block table belongs to this very archive, a rewrite in the same second aside */
+    tar_archive_t *ar = tar_open(work_path("a.tar.bz2"), NULL);
+    CHECK(ar != NULL);
+    tar_index_t index = ar ? *tar_archive_index(ar) : (tar_index_t) { 0 };
+    uint8_t id[IDENTITY_LEN];
+    for (int nsec = 0; ar && nsec < 2; nsec++) {
+        index.archive_mtime_nsec += nsec;
+        put_identity(id, &index);
+        fd = open(work_path("a.tar.bz2.bzi"), O_RDONLY);
+        bz_index_t *bz = bz_index_load(fd, id);
+        CHECK((bz != NULL) == (nsec == 0));
+        bz_index_free(bz);
+        close(fd);
+    }
+    tar_close(ar);
+    free(data);
+}
+
+static void test_delta(void) {
+    /* unchanged, changed, unchanged and large, then added members */
+    size_t size = 200 * 1024;
+    uint8_t *data = malloc(size);
+    fill_random(data, size, 9);
+    const struct member old_members[] = {
+        { "a", REGTYPE, NULL, "same\n" },
+        { "b", REGTYPE, NULL, "old\n" },
+        { "c", REGTYPE, NULL, (const char *) data, size },
+    };
+    const struct member new_members[] = {
+        { "a", REGTYPE, NULL, "same\n" },
+        { "b", REGTYPE, NULL, "new contents\n" },
+        { "c", REGTYPE, NULL, (const char *) data, size },
+        { "d", REGTYPE, NULL, "added\n" },
+    };
+    int old_fd = write_archive("old.tar", old_members, 3);
+    int new_fd = write_archive("new.tar", new_members, 4);
+    int delta_fd = open(work_path("delta"), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(tar_delta_create(old_fd, new_fd, delta_fd) == 2);
+    close(new_fd);
+
+    /* a copy record then a literal one, and the large member copied rather than carried */
+    size_t delta_len;
+    uint8_t *delta = read_work_file("delta", &delta_len);
+    CHECK(delta && delta_len > 8 + 17 && memcmp(delta, "TARDELTA", 8) == 0 && delta[8] == 'C' &&
+          delta[8 + 17] == 'L');
+    CHECK(delta_len < size / 4);
+    free(delta);
+
+    lseek(delta_fd, 0, SEEK_SET);
+    int out_fd = open(work_path("out.tar"), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(tar_delta_apply(old_fd, delta_fd, out_fd) == 4);
+    close(out_fd);
+    close(delta_fd);
+    close(old_fd);
+
+    size_t new_len, out_len;
+    uint8_t *new_tar = read_work_file("new.tar", &new_len);
+    uint8_t *out = read_work_file("out.tar", &out_len);
+    CHECK(new_tar && out && new_len == out_len && memcmp(new_tar, out, new_len) == 0);
+    free(new_tar);
+    free(out);
+    free(data);
+}
+
+/**
+ * Fills a ustar header for a multi-volume test, with its checksum.
+ */
+static void volume_header(tar_header_t *hdr, const char *path, char typeflag, size_t size, size_t resumed) {
+    memset(hdr, 0, sizeof(*hdr));
+    tar_header_set_path(hdr, path);
+    header_set_octal(hdr->mode, sizeof(hdr->mode), 0644);
+    header_set_octal(hdr->size, sizeof(hdr->size), size);
+    header_set_octal(hdr->mtime, sizeof(hdr->mtime), 1700000000);
+    hdr->typeflag = typeflag;
+    memcpy(hdr->magic, TMAGIC, TMAGLEN);
+    memcpy(hdr->version, TVERSION, TVERSLEN);
+    if (typeflag == 'M') {
+        /* the offset the member resumes at, in the prefix field like GNU tar */
+        header_set_octal(hdr->prefix + 24, 12, resumed);
+    }
+    header_update_checksum(hdr);
+}
+
+static void test_volumes(void) {
+    /* "big" is cut after `cut` bytes and continued in the second volume, after its label */
+    size_t size = 30000, cut = 20480;
+    uint8_t *data = malloc(size);
+    fill_random(data, size, 10);
+    static const uint8_t zeros[1024];
+    tar_header_t hdr;
+
+    for (int broken = 0; broken < 2; broken++) {
+        int v1 = open(work_path("v1.tar"), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        volume_header(&hdr, "small", REGTYPE, 6, 0);
+        write_all(v1, &hdr, sizeof(hdr));
+        write_all(v1, "small\n", 6);
+        write_all(v1, zeros, 512 - 6);
+        volume_header(&hdr, "big", REGTYPE, size, 0);
+        write_all(v1, &hdr, sizeof(hdr));
+        write_all(v1, data, cut);
+
+        int v2 = open(work_path("v2.tar"), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        volume_header(&hdr, "label", 'V', 0, 0);
+        write_all(v2, &hdr, sizeof(hdr));
+        /* a continuation resuming at the wrong offset breaks the set */
+        volume_header(&hdr, "big", 'M', size - cut, broken ? cut - 512 : cut);
+        write_all(v2, &hdr, sizeof(hdr));
+        write_all(v2, data + cut, size - cut);
+        write_all(v2, zeros, TAR_PADDED(size - cut) - (size - cut));
+        volume_header(&hdr, "after", REGTYPE, 6, 0);
+        write_all(v2, &hdr, sizeof(hdr));
+        write_all(v2, "after\n", 6);
+        write_all(v2, zeros, 512 - 6);
+        write_all(v2, zeros, sizeof(zeros));
+
+        int fds[2] = { v1, v2 };
+        tar_archive_t *ar = tar_open_volumes(fds, 2);
+        close(v1);
+        close(v2);
+        if (broken) {
+            CHECK(ar == NULL);
+            tar_close(ar);
+            break;
+        }
+        CHECK(ar != NULL);
+        CHECK(ar && tar_archive_index(ar)->count == 3);
+
+        /* across the volume boundary, then the whole member */
+        uint8_t *buf = malloc(size);
+        size_t got = 1000;
+        CHECK(ar && tar_read(ar, "big", cut - 500, buf, &got) > 0 && got == 1000 &&
+              memcmp(buf, data + cut - 500, 1000) == 0);
+        got = size;
+        CHECK(ar && tar_read(ar, "big", 0, buf, &got) == 0 && got == size && memcmp(buf, data, size) == 0);
+        got = size;
+        CHECK(ar && tar_read(ar, "after", 0, buf, &got) == 0 && got == 6 && memcmp(buf, "after\n", 6) == 0);
+        free(buf);
+        tar_close(ar);
+    }
+    free(data);
+}
+
+/**
+ * Evaluates a predicate on an entry the slow way, for comparison with
+ * tar_index_filter().
+ */
+static int predicate_holds(const tar_entry_t *entry, long path_id, const tar_predicate_t *pred) {
+    long x;
+    switch (pred->column) {
+    case TAR_COL_TYPE:
+        x = (uint8_t) entry->typeflag;
+        break;
+    case TAR_COL_SIZE:
+        x = entry->size;
+        break;
+    case TAR_COL_MTIME:
+        x = entry->mtime;
+        break;
+    case TAR_COL_UID:
+        x = entry->uid;
+        break;
+    case TAR_COL_GID:
+        x = entry->gid;
+        break;
+    case TAR_COL_MODE:
+        x = entry->mode;
+        break;
+    default:
+        x = path_id;
+        break;
+    }
+    long v = pred->value;
+    switch (pred->op) {
+    case TAR_EQ:
+        return x == v;
+    case TAR_NE:
+        return x != v;
+    case TAR_LT:
+        return x < v;
+    case TAR_LE:
+        return x <= v;
+    case TAR_GT:
+        return x > v;
+    case TAR_GE:
+        return x >= v;
+    default:
+        return (x & v) == v;
+    }
+}
+
+/**
+ * Tells whether tar_index_filter() finds the entries of `index` matching
+ * every predicate, and only those.
+ */
+static int filter_matches(const tar_index_t *index, const long *path_ids,
+                          const tar_predicate_t *preds, size_t npreds) {
+    uint32_t *ids = malloc(index->count * sizeof(uint32_t));
+    ssize_t found = tar_index_filter(index, preds, npreds, ids, index->count);
+    size_t expected = 0;
+    int ok = found >= 0;
+    for (size_t i = 0; ok && i < index->count; i++) {
+        int holds = 1;
+        for (size_t p = 0; p < npreds; p++) {
+            holds &= predicate_holds(&index->entries[i], path_ids[i], &preds[p]);
+        }
+        if (holds) {
+            ok = expected < (size_t) found && ids[expected] == i;
+            expected++;
+        }
+    }
+    free(ids);
+    return ok && expected == (size_t) found;
+}
+
+static void test_filter(void) {
+    /* spans three filter blocks, with metadata cycling at different rates */
+    size_t count = 2100;
+    time_t base = 1700000000;
+    static const uint8_t zeros[512];
+    int fd = open(work_path("a.tar"), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    for (size_t i = 0; i < count; i++) {
+        char path[16];
+        int dir = i % 5 == 0;
+        size_t size = dir ? 0 : i % 13;
+        if (i % 100 == 99) {
+            /* repeated paths share the path id of their first occurrence */
+            snprintf(path, sizeof(path), "e%04zu", i % 300 + 2);
+        } else {
+            snprintf(path, sizeof(path), dir ? "d%04zu/" : "e%04zu", i);
+        }
+        static const mode_t modes[] = { 0644, 0755, 0600 };
+
+        tar_header_t hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        tar_header_set_path(&hdr, path);
+        header_set_octal(hdr.mode, sizeof(hdr.mode), modes[i % 3]);
+        header_set_octal(hdr.uid, sizeof(hdr.uid), i % 7);
+        header_set_octal(hdr.gid, sizeof(hdr.gid), i % 3);
+        header_set_octal(hdr.size, sizeof(hdr.size), size);
+        header_set_octal(hdr.mtime, sizeof(hdr.mtime), base + i);
+        hdr.typeflag = dir ? DIRTYPE : REGTYPE;
+        memcpy(hdr.magic, TMAGIC, TMAGLEN);
+        memcpy(hdr.version, TVERSION, TVERSLEN);
+        header_update_checksum(&hdr);
+        write_all(fd, &hdr, sizeof(hdr));
+        write_all(fd, zeros, TAR_PADDED(size));
+    }
+    write_all(fd, zeros, sizeof(zeros));
+    write_all(fd, zeros, sizeof(zeros));
+    lseek(fd, 0, SEEK_SET);
+
+    tar_index_t index;
+    CHECK(tar_index_build(fd, &index) == (ssize_t) count);
+    close(fd);
+    long *path_ids = malloc(count * sizeof(long));
+    for (size_t i = 0; i < count; i++) {
+        path_ids[i] = i;
+        for (size_t j = 0; j < i; j++) {
+            if (strcmp(index.entries[j].path, index.entries[i].path) == 0) {
+                path_ids[i] = j;
+                break;
+            }
+        }
+    }
+
+    /* every operator on every column, with values inside and outside the range of the column */
+    static const struct {
+        tar_column_t column;
+        long values[6];
+    } columns[] = {
+        { TAR_COL_TYPE, { REGTYPE, DIRTYPE, 0, -1, 256, 0x1000 } },
+        { TAR_COL_SIZE, { 0, 6, 12, 1, -1, LONG_MAX } },
+        { TAR_COL_MTIME, { 1700000000, 1700001027, 1700002099, 1700002100, -1, 0 } },
+        { TAR_COL_UID, { 0, 3, 6, 4, -1, (long) UINT32_MAX + 1 } },
+        { TAR_COL_GID, { 1, 2, 3, UINT32_MAX, -1, (long) UINT32_MAX + 2 } },
+        { TAR_COL_MODE, { 0644, 0755, 0100, 0111, -1, 0600 } },
+        { TAR_COL_PATH, { 0, 1, 100, 2099, -1, (long) UINT32_MAX + 1 } },
+    };
+    for (size_t c = 0; c < sizeof(columns) / sizeof(columns[0]); c++) {
+        for (tar_op_t op = TAR_EQ; op <= TAR_BITS; op++) {
+            for (size_t v = 0; v < 6; v++) {
+                tar_predicate_t pred = { columns[c].column, op, columns[c].values[v] };
+                CHECK(filter_matches(&index, path_ids, &pred, 1));
+            }
+        }
+    }
+
+    /* a predicate false for every entry ends the filter, one true for every entry is dropped */
+    tar_predicate_t preds[3] = { { TAR_COL_SIZE, TAR_EQ, -1 } };
+    CHECK(tar_index_filter(&index, preds, 1, NULL, 0) == 0);
+    preds[0] = (tar_predicate_t) { TAR_COL_UID, TAR_LT, (long) UINT32_MAX + 1 };
+    preds[1] = (tar_predicate_t) { TAR_COL_SIZE, TAR_GE, -5 };
+    CHECK(tar_index_filter(&index, preds, 2, NULL, 0) == (ssize_t) count);
+    CHECK(tar_index_filter(&index, NULL, 0, NULL, 0) == (ssize_t) count);
+
+    /* a few entries scattered over the blocks, most words of the mask empty */
+    preds[0] = (tar_predicate_t) { TAR_COL_UID, TAR_EQ, 6 };
+    preds[1] = (tar_predicate_t) { TAR_COL_MODE, TAR_BITS, 0111 };
+    preds[2] = (tar_predicate_t) { TAR_COL_MTIME, TAR_GE, 1700001020 };
+    CHECK(filter_matches(&index, path_ids, preds, 3));
+    preds[0] = (tar_predicate_t) { TAR_COL_MTIME, TAR_EQ, 1700001027 };
+    uint32_t ids[4];
+    CHECK(tar_index_filter(&index, preds, 1, ids, 4) == 1 && ids[0] == 1027);
+
+    /* more matches than room for them: only the first are stored */
+    preds[0] = (tar_predicate_t) { TAR_COL_TYPE, TAR_EQ, DIRTYPE };
+    ids[3] = 0xffffffff;
+    CHECK(tar_index_filter(&index, preds, 1, ids, 3) == (ssize_t) count / 5 &&
+          ids[0] == 0 && ids[1] == 5 && ids[2] == 10 && ids[3] == 0xffffffff);
+
+    /* invalid predicates */
+    preds[0] = (tar_predicate_t) { TAR_COL_SIZE, TAR_BITS + 1, 0 };
+    CHECK(tar_index_filter(&index, preds, 1, ids, 4) == -1);
+    preds[0] = (tar_predicate_t) { TAR_COL_PATH + 1, TAR_EQ, 0 };
+    CHECK(tar_index_filter(&index, preds, 1, ids, 4) == -1);
+
+    free(path_ids);
+    tar_index_free(&index);
+}
+
+/**
+ * Tells whether a directory has the given statistics.
+ */
+static int du_is(const tar_dir_stats_t *stats, const char *path, uint64_t size, uint64_t files,
+                 uint64_t dirs, uint64_t symlinks) {
+    return stats && strcmp(stats->path, path) == 0 && stats->size == size && stats->files == files &&
+           stats->dirs == dirs && stats->symlinks == symlinks && stats->max_mtime == 1700000000;
+}
+
+/**
+ * Checks the directory statistics of the archive of test_du().
+ */
+static void check_du(const tar_index_t *index) {
+    CHECK(du_is(tar_index_du(index, NULL), "", 48, 4, 4, 1));
+    CHECK(tar_index_du(index, "") == tar_index_du(index, NULL));
+    CHECK(du_is(tar_index_du(index, "a"), "a/", 15, 2, 2, 1));
+    CHECK(du_is(tar_index_du(index, "a/b/"), "a/b/", 10, 1, 1, 0));
+    CHECK(du_is(tar_index_du(index, "a/b/c"), "a/b/c/", 10, 1, 0, 0));
+    CHECK(du_is(tar_index_du(index, "e"), "e/", 8, 1, 0, 0));
+    CHECK(tar_index_du(index, "e/") == tar_index_du(index, "e"));
+    CHECK(tar_index_du(index, "top") == NULL && tar_index_du(index, "nope") == NULL);
+
+    const tar_dir_stats_t *dirs[8];
+    CHECK(tar_index_top_dirs(index, 8, dirs) == 4);
+    CHECK(strcmp(dirs[0]->path, "a/") == 0 && dirs[1]->size == 10 && dirs[2]->size == 10 &&
+          strcmp(dirs[3]->path, "e/") == 0);
+    CHECK(tar_index_top_dirs(index, 1, dirs) == 1 && strcmp(dirs[0]->path, "a/") == 0);
+
+    /* the latest "e/f" only, neither directories nor symlinks */
+    uint32_t ids[8];
+    CHECK(tar_index_top_files(index, 8, ids) == 4);
+    CHECK(strcmp(index->entries[ids[0]].path, "top") == 0 && strcmp(index->entries[ids[1]].path, "a/b/c/deep") == 0 &&
+          ids[2] == 8 && strcmp(index->entries[ids[3]].path, "a/x") == 0);
+    CHECK(tar_index_top_files(index, 2, ids) == 2 && strcmp(index->entries[ids[1]].path, "a/b/c/deep") == 0);
+}
+
+static void test_du(void) {
+    const struct member members[] = {
+        { "a/", DIRTYPE, NULL, NULL },
+        { "a/x", REGTYPE, NULL, "12345" },
+        /* "a/b/" and "a/b/c/" have no entry of their own */
+        { "a/b/c/deep", REGTYPE, NULL, "0123456789" },
+        { "a/l", SYMTYPE, "x", NULL },
+        /* a directory entry without its trailing slash, then with it */
+        { "e", DIRTYPE, NULL, NULL },
+        { "e/f", REGTYPE, NULL, "abc" },
+        { "top", REGTYPE, NULL, "0123456789012345678901234" },
+        { "e/", DIRTYPE, NULL, NULL },
+        { "e/f", REGTYPE, NULL, "abcdefgh" },
+    };
+    close(write_archive("a.tar", members, sizeof(members) / sizeof(members[0])));
+
+    /* built, then loaded from the sidecar */
+    tar_open_opts_t opts = { .flags = TAR_OPEN_SAVE_INDEX };
+    for (int loaded = 0; loaded < 2; loaded++) {
+        tar_archive_t *ar = tar_open(work_path("a.tar"), &opts);
+        CHECK(ar != NULL && work_exists("a.tar.idx"));
+        if (ar) {
+            check_du(tar_archive_index(ar));
+        }
+        tar_close(ar);
+    }
+}
+
+static void record_result(const check_result_t *result, void *arg) {
+    ((int *) arg)[result->index] = result->ret;
+}
+
+static void test_check_archives(void) {
+    const struct member members[] = {
+        { "a", REGTYPE, NULL, "first\n" },
+        { "b", REGTYPE, NULL, "second\n" },
+        { "c", REGTYPE, NULL, "third\n" },
+    };
+    close(write_archive("valid.tar", members, 3));
+    size_t len;
+    uint8_t *tar = read_work_file("valid.tar", &len);
+    tar_header_t *second = (tar_header_t *) (tar + 1024);
+
+    /* a bad checksum on the second header */
+    second->name[0] = 'x';
+    int fd = open(work_path("checksum.tar"), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    write_all(fd, tar, len);
+    close(fd);
+
+    /* cut in the data of the second member */
+    second->name[0] = 'b';
+    fd = open(work_path("truncated.tar"), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    write_all(fd, tar, 1024 + 512 + 3);
+    close(fd);
+
+    /* sizes whose padded length is not a valid offset: strtol() saturating, and negative */
+    const char *sizes[] = { "777777777777", "-2000" };
+    char *names[] = { "huge.tar", "negative.tar" };
+    for (int i = 0; i < 2; i++) {
+        memcpy(second->size, sizes[i], strlen(sizes[i]));
+        memset(second->size + strlen(sizes[i]), 0, sizeof(second->size) - strlen(sizes[i]));
+        memcpy(second->mtime, "77777777777", 11);
+        header_update_checksum(second);
+        fd = open(work_path(names[i]), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        write_all(fd, tar, len);
+        close(fd);
+    }
+    free(tar);
+
+    const char *archives[] = { "valid.tar", "checksum.tar", "truncated.tar", "huge.tar", "negative.tar", "missing.tar" };
+    size_t count = sizeof(archives) / sizeof(archives[0]);
+    char paths[6][64];
+    char *list[6];
+    int expected[6];
+    for (size_t i = 0; i < count; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "%s", work_path(archives[i]));
+        list[i] = paths[i];
+        fd = open(paths[i], O_RDONLY);
+        expected[i] = fd == -1 ? -4 : check_archive(fd);
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+    CHECK(expected[0] == 3 && expected[1] == -3 && expected[2] == 2 && expected[3] == -3 && expected[4] == -3);
+
+    /* the same results whichever worker checks an archive */
+    for (int threads = 1; threads <= 4; threads += 3) {
+        int results[6] = { 0 };
+        CHECK(check_archives(list, count, threads, record_result, results) == 4);
+        CHECK(memcmp(results, expected, sizeof(expected)) == 0);
+    }
+}
+
+static const struct {
+    const char *name;
+    void (*run)(void);
+} tests[] = {
+    { "extract", test_extract },
+    { "extract_through_symlink", test_extract_through_symlink },
+    { "extract_hard_link_outside", test_extract_hard_link_outside },
+    { "extract_resume", test_extract_resume },
+    { "open_sidecar_identity", test_open_sidecar_identity },
+    { "gzip_members", test_gzip_members },
+    { "gzip_cache_budget", test_gzip_cache_budget },
+    { "read_lines_sidecar", test_read_lines_sidecar },
+    { "nested_index_saved", test_nested_index_saved },
+    { "list_repeated_paths", test_list_repeated_paths },
+    { "incremental_restore", test_incremental_restore },
+    { "incremental_gzip_entries", test_incremental_gzip_entries },
+    { "compress", test_compress },
+    { "verify_reads", test_verify_reads },
+    { "transform_truncated", test_transform_truncated },
+    { "export_truncated", test_export_truncated },
+    { "gzip_cache_stale", test_gzip_cache_stale },
+    { "decompress_members", test_decompress_members },
+    { "gzip_damaged", test_gzip_damaged },
+    { "bzip2_round_trip", test_bzip2_round_trip },
+    { "delta", test_delta },
+    { "volumes", test_volumes },
+    { "filter", test_filter },
+    { "du", test_du },
+    { "check_archives", test_check_archives },
+};
+
+int main(int argc, char **argv) {
+    size_t count = sizeof(tests) / sizeof(tests[0]);
+    for (size_t i = 0; i < count; i++) {
+        if (argc > 1 && strcmp(argv[1], tests[i].name) != 0) {
+            continue;
+        }
+        snprintf(workdir, sizeof(workdir), "/tmp/lib_tar_test.XXXXXX");
+        if (!mkdtemp(workdir)) {
+            perror("mkdtemp");
+            return 1;
+        }
+
+        int before = failures;
+        tests[i].run();
+        printf("%-40s %s\n", tests[i].name, failures == before ? "ok" : "FAILED");
+
+        char cmd[128];
+        snprintf(cmd, sizeof(cmd), "rm -rf %s", workdir);
+        /* KEEP=1 leaves the working directory behind for inspection */
+        if (!getenv("KEEP") && system(cmd) != 0) {
+            fprintf(stderr, "could not remove %s\n", workdir);
+        }
+    }
+    return failures ? 1 : 0;
+}